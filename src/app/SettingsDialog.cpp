@@ -618,6 +618,7 @@ void SettingsDialog::on_stackedWidget_currentChanged(int /*arg1*/)
 
     } else if (currentPage == ui.pageBlackWhiteMode) {
         ui.disableSmoothingBW->setChecked(m_settings.value(_key_mode_bw_disable_smoothing, _key_mode_bw_disable_smoothing_def).toBool());
+        ui.rotateByShearsBW->setChecked(m_settings.value(_key_mode_bw_rotate_by_shears, _key_mode_bw_rotate_by_shears_def).toBool());
     } else if (currentPage == ui.pageHotKeysManager) {
         ui.lblHotKeyManager->setText(GlobalStaticSettings::m_hotKeyManager.toDisplayableText());
     } else if (currentPage == ui.pageDeskew) {
@@ -781,6 +782,11 @@ void SettingsDialog::on_disableSmoothingBW_clicked(bool checked)
     m_settings.setValue(_key_mode_bw_disable_smoothing, checked);
 }
 
+void SettingsDialog::on_rotateByShearsBW_clicked(bool checked)
+{
+    m_settings.setValue(_key_mode_bw_rotate_by_shears, checked);
+}
+
 void SettingsDialog::on_rectangularAreasSensitivityValue_valueChanged(int arg1)
 {
     m_settings.setValue(_key_picture_zones_layer_sensitivity, arg1);
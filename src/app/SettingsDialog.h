@@ -73,6 +73,8 @@ private slots:
 
     void on_disableSmoothingBW_clicked(bool checked);
 
+    void on_rotateByShearsBW_clicked(bool checked);
+
     void on_rectangularAreasSensitivityValue_valueChanged(int arg1);
 
     void on_originalPageDisplayOnKeyHold_clicked(bool checked);
@@ -40,6 +40,8 @@
 #include "ProjectReader.h"
 #include "OrthogonalRotation.h"
 #include "SelectedPage.h"
+#include "imageproc/CpuFeatures.h"
+#include "foundation/ScratchArena.h"
 
 #include "filters/fix_orientation/Settings.h"
 #include "filters/fix_orientation/Filter.h"
@@ -210,6 +212,15 @@ ConsoleBatch::process()
         endFilterIdx = ef;
     }
 
+    if (cli.isVerbose()) {
+        using imageproc::CpuFeatures;
+        std::cout << "SIMD: " << CpuFeatures::levelName(CpuFeatures::level())
+                  << " (detected: " << CpuFeatures::levelName(CpuFeatures::detectedLevel()) << ")\n";
+        for (auto const& kernel : CpuFeatures::kernelImplementations()) {
+            std::cout << "\t" << kernel.first << ": " << kernel.second << "\n";
+        }
+    }
+
     // run filters
     for (int j = startFilterIdx; j <= endFilterIdx; j++) {
         if (cli.isVerbose()) {
@@ -228,6 +239,17 @@ ConsoleBatch::process()
         }
     }
 
+    // Between pages, MAX_TOTAL_CACHED_BYTES limits what the arenas keep.
+    ScratchArena::trimAll();
+
+    if (cli.isVerbose()) {
+        ScratchArena::Stats const scratch(ScratchArena::stats());
+        std::cout << "Scratch buffers: " << (scratch.bytesReused >> 20) << " MiB in "
+                  << scratch.blocksReused << " blocks reused, "
+                  << (scratch.bytesAllocated >> 20) << " MiB in "
+                  << scratch.blocksAllocated << " blocks allocated\n";
+    }
+
     // setup rest filters with params from cli
     const std::set<PageId> select_all = m_ptrPages->toPageSequence(PAGE_VIEW).asPageIdSet();
     for (int j = endFilterIdx + 1; j <= m_ptrStages->count(); j++) {
@@ -437,7 +459,8 @@ ConsoleBatch::setupOutput(std::set<PageId> allPages)
         }
 
         if (cli.hasWhiteMargins() || cli.hasNormalizeIllumination() ||
-                cli.hasAutoLayer() || cli.hasPictureZonesLayer() || cli.hasForegroundLayer()) {
+                cli.hasAutoLayer() || cli.hasPictureZonesLayer() || cli.hasForegroundLayer() ||
+                cli.hasDenoise() || cli.hasPaletteSize()) {
             output::ColorGrayscaleOptions cgo;
             if (cli.hasWhiteMargins()) {
                 cgo.setWhiteMargins(true);
@@ -454,6 +477,14 @@ ConsoleBatch::setupOutput(std::set<PageId> allPages)
             if (cli.hasForegroundLayer()) {
                 cgo.setForegroundLayerEnabled(true);
             }
+            if (cli.hasDenoise()) {
+                cgo.setDenoiseFilter(cli.getDenoiseFilter());
+                cgo.setDenoiseRadius(cli.getDenoiseRadius());
+                cgo.setDenoiseStrength(cli.getDenoiseStrength());
+            }
+            if (cli.hasPaletteSize()) {
+                cgo.setPaletteSize(cli.getPaletteSize());
+            }
             colorParams.setColorGrayscaleOptions(cgo);
         }
 
@@ -102,6 +102,10 @@ CommandLine::parseCli(QStringList const& argv)
     opts << "color-mode";
     opts << "white-margins";
     opts << "normalize-illumination";
+    opts << "denoise";
+    opts << "denoise-radius";
+    opts << "denoise-strength";
+    opts << "palette-size";
     opts << "threshold";
     opts << "despeckle";
     opts << "dewarping";
@@ -275,6 +279,10 @@ CommandLine::setup()
     m_contentDeviation = fetchContentDeviation();
     m_orientation = fetchOrientation();
     m_threshold = fetchThreshold();
+    m_denoiseFilter = fetchDenoiseFilter();
+    m_denoiseRadius = fetchDenoiseRadius();
+    m_denoiseStrength = fetchDenoiseStrength();
+    m_paletteSize = fetchPaletteSize();
     m_deskewAngle = fetchDeskewAngle();
     m_deskewMode = fetchDeskewMode();
     m_skewDeviation = fetchSkewDeviation();
@@ -389,6 +397,10 @@ CommandLine::printHelp()
     std::cout << "\t--picture-shape=<free|rectangular>\n\t\t\t\t\t\t-- default: free" << std::endl;
     std::cout << "\t--white-margins\t\t\t\t-- default: false" << std::endl;
     std::cout << "\t--normalize-illumination\t\t-- default: false" << std::endl;
+    std::cout << "\t--denoise=<off|knn|wiener>\t\t-- color/grayscale output filter; default: off" << std::endl;
+    std::cout << "\t\t--denoise-radius=<1...>\t\t-- default: 3" << std::endl;
+    std::cout << "\t\t--denoise-strength=<0.0..1.0>\t-- default: 0.2" << std::endl;
+    std::cout << "\t--palette-size=<0|4...16>\t\t-- colors of a palette-reduced color output; default: 0 (off)" << std::endl;
     std::cout << "\t--threshold=<n>\t\t\t\t-- n<0 thinner, n>0 thicker; default: 0" << std::endl;
     std::cout << "\t--despeckle=<off|cautious|normal|aggressive>\n\t\t\t\t\t\t-- default: normal" << std::endl;
     std::cout << "\t--dewarping=<off|auto>\t\t\t-- default: off" << std::endl;
@@ -404,6 +416,9 @@ CommandLine::printHelp()
     std::cout << "\t\t--page-detection-tolerance=<0.0..1.0>\t-- default: 0.1" << std::endl;
     std::cout << "\t--disable-check-output\t\t\t-- don't check if page is valid when switching to step 6";
     std::cout << std::endl;
+    std::cout << std::endl;
+    std::cout << "Environment:" << std::endl;
+    std::cout << "\tSCANTAILOR_SIMD=<baseline|sse4.2|avx2>\t-- default: the best one the CPU supports; limits the instruction set of image processing kernels, --verbose lists them" << std::endl;
 }
 
 page_split::LayoutType
@@ -781,6 +796,47 @@ CommandLine::fetchDespeckleLevel()
     return output::despeckleLevelFromString(m_options.value("despeckle"));
 }
 
+output::DenoiseFilter
+CommandLine::fetchDenoiseFilter()
+{
+    if (!hasDenoise()) {
+        return output::DENOISE_NONE;
+    }
+
+    return output::ColorGrayscaleOptions::parseDenoiseFilter(m_options.value("denoise"));
+}
+
+int
+CommandLine::fetchDenoiseRadius()
+{
+    if (!hasDenoiseRadius()) {
+        return 3;
+    }
+
+    return m_options["denoise-radius"].toInt();
+}
+
+double
+CommandLine::fetchDenoiseStrength()
+{
+    if (!hasDenoiseStrength()) {
+        return 0.2;
+    }
+
+    return m_options["denoise-strength"].toDouble();
+}
+
+int
+CommandLine::fetchPaletteSize()
+{
+    if (!hasPaletteSize()) {
+        return 0;
+    }
+
+    int const size = m_options["palette-size"].toInt();
+    return (size > 0) ? qBound(4, size, 16) : 0;
+}
+
 float
 CommandLine::fetchMatchLayoutTolerance()
 {
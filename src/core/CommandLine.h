@@ -220,6 +220,22 @@ public:
     {
         return contains("normalize-illumination");
     }
+    bool hasDenoise() const
+    {
+        return contains("denoise") && !m_options["denoise"].isEmpty();
+    }
+    bool hasDenoiseRadius() const
+    {
+        return contains("denoise-radius") && !m_options["denoise-radius"].isEmpty();
+    }
+    bool hasDenoiseStrength() const
+    {
+        return contains("denoise-strength") && !m_options["denoise-strength"].isEmpty();
+    }
+    bool hasPaletteSize() const
+    {
+        return contains("palette-size") && !m_options["palette-size"].isEmpty();
+    }
     bool hasThreshold() const
     {
         return contains("threshold") && !m_options["threshold"].isEmpty();
@@ -348,6 +364,22 @@ public:
     {
         return m_threshold;
     }
+    output::DenoiseFilter getDenoiseFilter() const
+    {
+        return m_denoiseFilter;
+    }
+    int getDenoiseRadius() const
+    {
+        return m_denoiseRadius;
+    }
+    double getDenoiseStrength() const
+    {
+        return m_denoiseStrength;
+    }
+    int getPaletteSize() const
+    {
+        return m_paletteSize;
+    }
     double getDeskewAngle() const
     {
         return m_deskewAngle;
@@ -466,6 +498,10 @@ private:
     double m_contentDeviation;
     Orientation m_orientation;
     int m_threshold;
+    output::DenoiseFilter m_denoiseFilter;
+    int m_denoiseRadius;
+    double m_denoiseStrength;
+    int m_paletteSize;
     double m_deskewAngle;
     AutoManualMode m_deskewMode;
     double m_skewDeviation;
@@ -505,6 +541,10 @@ private:
     Orientation fetchOrientation();
     QString fetchOutputProjectFile();
     int fetchThreshold();
+    output::DenoiseFilter fetchDenoiseFilter();
+    int fetchDenoiseRadius();
+    double fetchDenoiseStrength();
+    int fetchPaletteSize();
     double fetchDeskewAngle();
     AutoManualMode fetchDeskewMode();
     double fetchSkewDeviation();
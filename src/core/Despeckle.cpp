@@ -28,7 +28,7 @@
 #include <QImage>
 #include <QDebug>
 #include <vector>
-#include <map>
+#include <utility>
 #include <limits>
 #include <algorithm>
 #include <stddef.h>
@@ -125,91 +125,122 @@ Settings::get(Despeckle::Level const level, Dpi const& dpi)
     return settings;
 }
 
-struct Component {
-    static uint32_t const ANCHORED_TO_BIG = uint32_t(1) << 31;
-    static uint32_t const ANCHORED_TO_SMALL = uint32_t(1) << 30;
-    static uint32_t const TAG_MASK = ANCHORED_TO_BIG | ANCHORED_TO_SMALL;
-
-    /**
-     * Lower 30 bits: the number of pixels in the connected component.
-     * Higher 2 bits: tags.
-     */
-    uint32_t num_pixels;
+/**
+ * \brief Pixel counts and tags of connected components, indexed by label.
+ *
+ * The counts and the tags are kept in separate arrays, as most passes
+ * only need one of them.
+ */
+class Components
+{
+public:
+    explicit Components(size_t size = 0) : m_numPixels(size, 0), m_tags(size, 0) {}
 
-    Component() : num_pixels(0) {}
+    void resize(size_t size)
+    {
+        m_numPixels.resize(size, 0);
+        m_tags.resize(size, 0);
+    }
 
-    uint32_t anchoredToBig() const
+    uint32_t numPixels(uint32_t label) const
     {
-        return num_pixels & ANCHORED_TO_BIG;
+        return m_numPixels[label];
     }
 
-    void setAnchoredToBig()
+    void setNumPixels(uint32_t label, uint32_t num_pixels)
     {
-        num_pixels |= ANCHORED_TO_BIG;
+        m_numPixels[label] = num_pixels;
     }
 
-    uint32_t anchoredToSmall() const
+    void addPixels(uint32_t label, uint32_t num_pixels)
     {
-        return num_pixels & ANCHORED_TO_SMALL;
+        m_numPixels[label] += num_pixels;
     }
 
-    void setAnchoredToSmall()
+    bool anchoredToBig(uint32_t label) const
     {
-        num_pixels |= ANCHORED_TO_SMALL;
+        return m_tags[label] & ANCHORED_TO_BIG;
     }
 
-    bool anchoredToSmallButNotBig() const
+    void setAnchoredToBig(uint32_t label)
     {
-        return (num_pixels & TAG_MASK) == ANCHORED_TO_SMALL;
+        m_tags[label] |= ANCHORED_TO_BIG;
     }
 
-    void clearTags()
+    void setAnchoredToSmall(uint32_t label)
     {
-        num_pixels &= ~TAG_MASK;
+        m_tags[label] |= ANCHORED_TO_SMALL;
     }
-};
 
-uint32_t const Component::ANCHORED_TO_BIG;
-uint32_t const Component::ANCHORED_TO_SMALL;
-uint32_t const Component::TAG_MASK;
+    bool anchoredToSmallButNotBig(uint32_t label) const
+    {
+        return m_tags[label] == ANCHORED_TO_SMALL;
+    }
 
-struct BoundingBox {
-    int top;
-    int left;
-    int bottom;
-    int right;
+    bool haveAnchoredToSmallButNotBig() const
+    {
+        return std::find(m_tags.begin(), m_tags.end(), uint8_t(ANCHORED_TO_SMALL)) != m_tags.end();
+    }
 
-    BoundingBox()
+    void clearTags()
     {
-        top = left = std::numeric_limits<int>::max();
-        bottom = right = std::numeric_limits<int>::min();
+        std::fill(m_tags.begin(), m_tags.end(), 0);
     }
+private:
+    enum { ANCHORED_TO_BIG = 1, ANCHORED_TO_SMALL = 2 };
 
-    int width() const
+    std::vector<uint32_t> m_numPixels;
+    std::vector<uint8_t> m_tags;
+};
+
+/**
+ * \brief Bounding boxes of connected components, indexed by label.
+ */
+class BoundingBoxes
+{
+public:
+    explicit BoundingBoxes(size_t size = 0)
+        : m_left(size, std::numeric_limits<int>::max()),
+          m_top(size, std::numeric_limits<int>::max()),
+          m_right(size, std::numeric_limits<int>::min()),
+          m_bottom(size, std::numeric_limits<int>::min()) {}
+
+    int width(uint32_t label) const
     {
-        return right - left + 1;
+        return m_right[label] - m_left[label] + 1;
     }
 
-    int height() const
+    int height(uint32_t label) const
     {
-        return bottom - top + 1;
+        return m_bottom[label] - m_top[label] + 1;
     }
 
-    void extend(int x, int y)
+    /**
+     * Extends the box by a horizontal run of pixels [x_begin, x_end) at y.
+     */
+    void extendByRun(uint32_t label, int x_begin, int x_end, int y)
     {
-        top = std::min(top, y);
-        left = std::min(left, x);
-        bottom = std::max(bottom, y);
-        right = std::max(right, x);
+        m_left[label] = std::min(m_left[label], x_begin);
+        m_top[label] = std::min(m_top[label], y);
+        m_right[label] = std::max(m_right[label], x_end - 1);
+        m_bottom[label] = std::max(m_bottom[label], y);
     }
 
-    void extend(const BoundingBox& b)
+    void extend(BoundingBoxes const& other)
     {
-        top = std::min(top, b.top);
-        left = std::min(left, b.left);
-        bottom = std::max(bottom, b.bottom);
-        right = std::max(right, b.right);
+        size_t const size = m_left.size();
+        for (size_t i = 0; i < size; ++i) {
+            m_left[i] = std::min(m_left[i], other.m_left[i]);
+            m_top[i] = std::min(m_top[i], other.m_top[i]);
+            m_right[i] = std::max(m_right[i], other.m_right[i]);
+            m_bottom[i] = std::max(m_bottom[i], other.m_bottom[i]);
+        }
     }
+private:
+    std::vector<int> m_left;
+    std::vector<int> m_top;
+    std::vector<int> m_right;
+    std::vector<int> m_bottom;
 };
 
 struct Vector {
@@ -310,22 +341,26 @@ struct TargetSourceConn {
 };
 
 /**
- * \brief If the association didn't exist, create it,
- *        otherwise the minimum distance.
+ * \brief Distances between components, see voronoiDistances().
  */
-void updateDistance(
-    std::map<Connection, uint32_t>& conns,
-    uint32_t label1, uint32_t label2, uint32_t sqdist)
-{
-    typedef std::map<Connection, uint32_t> Connections;
+typedef std::vector<std::pair<Connection, uint32_t> > Connections;
 
-    Connection const conn(label1, label2);
-    Connections::iterator it(conns.lower_bound(conn));
-    if (it == conns.end() || conn < it->first) {
-        conns.insert(Connections::value_type(conn, sqdist));
-    } else if (sqdist < it->second) {
-        it->second = sqdist;
-    }
+/**
+ * \brief Sorts connections and leaves a single one with the minimum
+ *        distance for every pair of components.
+ */
+void mergeConnections(Connections& conns)
+{
+    std::sort(conns.begin(), conns.end());
+    Connections::iterator const end(
+        std::unique(
+            conns.begin(), conns.end(),
+            [](Connections::value_type const& lhs, Connections::value_type const& rhs) {
+                return !(lhs.first < rhs.first) && !(rhs.first < lhs.first);
+            }
+        )
+    );
+    conns.erase(end, conns.end());
 }
 
 /**
@@ -333,22 +368,24 @@ void updateDistance(
  *        or none of the above.
  */
 void tagSourceComponent(
-    Component& source, Component const& target, uint32_t sqdist, Settings const& settings)
+    Components& components, uint32_t source, uint32_t target,
+    uint32_t sqdist, Settings const& settings)
 {
-    if (source.anchoredToBig()) {
+    if (components.anchoredToBig(source)) {
         // No point in setting ANCHORED_TO_SMALL.
         return;
     }
 
-    if (sqdist > source.num_pixels * settings.pixelsToSqDist) {
+    uint32_t const source_pixels = components.numPixels(source);
+    if (sqdist > source_pixels * settings.pixelsToSqDist) {
         // Too far.
         return;
     }
 
-    if (target.num_pixels >= settings.minRelativeParentWeight * source.num_pixels) {
-        source.setAnchoredToBig();
+    if (components.numPixels(target) >= settings.minRelativeParentWeight * source_pixels) {
+        components.setAnchoredToBig(source);
     } else {
-        source.setAnchoredToSmall();
+        components.setAnchoredToSmall(source);
     }
 }
 
@@ -358,321 +395,404 @@ void tagSourceComponent(
  * being attached, provided that the one it's attached to is also preserved.
  */
 bool canBeAttachedTo(
-    Component const& comp, Component const& target, uint32_t sqdist, Settings const& settings)
+    Components const& components, uint32_t comp, uint32_t target,
+    uint32_t sqdist, Settings const& settings)
 {
-    if (sqdist <= comp.num_pixels * settings.pixelsToSqDist) {
-        if (target.num_pixels >= comp.num_pixels * settings.minRelativeParentWeight) {
+    uint32_t const comp_pixels = components.numPixels(comp);
+    if (sqdist <= comp_pixels * settings.pixelsToSqDist) {
+        if (components.numPixels(target) >= comp_pixels * settings.minRelativeParentWeight) {
             return true;
         }
     }
     return false;
 }
 
-void voronoi(ConnectivityMap& cmap, std::vector<Distance>& dist)
-{
-    int const width = cmap.size().width() + 2;
-    int const height = cmap.size().height() + 2;
-
-    assert(dist.empty());
-    dist.resize(width * height, Distance::zero());
+/**
+ * The Voronoi passes process the image in bands of this many lines.
+ * Bands don't depend on the number of threads, so the results don't either.
+ */
+int const VORONOI_BAND_HEIGHT = 256;
 
-    std::vector<uint32_t> sqdists(width * 2, 0);
-    uint32_t* prev_sqdist_line = &sqdists[0];
-    uint32_t* this_sqdist_line = &sqdists[width];
+/**
+ * \brief The padded label and distance planes of a Voronoi diagram.
+ */
+struct VoronoiPlanes {
+    uint32_t* labels;
+    Distance* dist;
+    int width;  /**< Including the padding. */
+    int height; /**< Including the padding. */
+};
 
-    Distance* dist_line = &dist[0];
-    uint32_t* cmap_line = cmap.paddedData();
+void lineSqDists(Distance const* dist_line, uint32_t* sqdist_line, int const width)
+{
+    for (int x = 0; x < width; ++x) {
+        sqdist_line[x] = dist_line[x].sqdist();
+    }
+}
 
+/**
+ * \brief A line of the top to bottom pass of a Voronoi diagram.
+ *
+ * Distances come from the left, from the line above and from the right.
+ * Without SPECIAL, pixels at zero distance belong to connected components
+ * and every other pixel is overwritten, whatever it held before.  With
+ * SPECIAL, pixels with the special distance neither change nor spread,
+ * and the others are only replaced by smaller distances.
+ */
+template<bool SPECIAL>
+void topDownLine(
+    Distance* const dist_line, uint32_t* const label_line, uint32_t* const sqdist_line,
+    Distance const* const above_dist_line, uint32_t const* const above_label_line,
+    uint32_t const* const above_sqdist_line, int const width,
+    Distance const special_distance)
+{
     dist_line[0].reset(0);
-    prev_sqdist_line[0] = dist_line[0].sqdist();
-    for (int x = 1; x < width; ++x) {
-        dist_line[x].vec.x = dist_line[x - 1].vec.x - 1;
-        prev_sqdist_line[x] = prev_sqdist_line[x - 1]
-                              - (int(dist_line[x - 1].vec.x) << 1) + 1;
-    }
-
-    // Top to bottom scan.
-    for (int y = 1; y < height; ++y) {
-        dist_line += width;
-        cmap_line += width;
-        dist_line[0].reset(0);
-        dist_line[width - 1].reset(width - 1);
-        this_sqdist_line[0] = dist_line[0].sqdist();
-        this_sqdist_line[width - 1] = dist_line[width - 1].sqdist();
-        // Left to right scan.
-        for (int x = 1; x < width - 1; ++x) {
-            if (cmap_line[x]) {
-                this_sqdist_line[x] = 0;
-                assert(dist_line[x] == Distance::zero());
+    dist_line[width - 1].reset(width - 1);
+    sqdist_line[0] = dist_line[0].sqdist();
+    sqdist_line[width - 1] = dist_line[width - 1].sqdist();
+
+    // Left to right scan.
+    for (int x = 1; x < width - 1; ++x) {
+        if (!SPECIAL) {
+            if (dist_line[x] == Distance::zero()) {
+                sqdist_line[x] = 0;
                 continue;
             }
 
             // Propagate from left.
             Distance left_dist = dist_line[x - 1];
-            uint32_t sqdist_left = this_sqdist_line[x - 1];
+            uint32_t sqdist_left = sqdist_line[x - 1];
             sqdist_left += 1 - (int(left_dist.vec.x) << 1);
 
             // Propagate from top.
-            Distance top_dist = dist_line[x - width];
-            uint32_t sqdist_top = prev_sqdist_line[x];
+            Distance top_dist = above_dist_line[x];
+            uint32_t sqdist_top = above_sqdist_line[x];
             sqdist_top += VERTICAL_SCALE_SQ - 2 * VERTICAL_SCALE_SQ * int(top_dist.vec.y);
 
             if (sqdist_left < sqdist_top) {
-                this_sqdist_line[x] = sqdist_left;
+                sqdist_line[x] = sqdist_left;
                 --left_dist.vec.x;
                 dist_line[x] = left_dist;
-                cmap_line[x] = cmap_line[x - 1];
+                label_line[x] = label_line[x - 1];
             } else {
-                this_sqdist_line[x] = sqdist_top;
+                sqdist_line[x] = sqdist_top;
                 --top_dist.vec.y;
                 dist_line[x] = top_dist;
-                cmap_line[x] = cmap_line[x - width];
+                label_line[x] = above_label_line[x];
             }
+            continue;
         }
 
-        // Right to left scan.
-        for (int x = width - 2; x >= 1; --x) {
-            // Propagate from right.
-            Distance right_dist = dist_line[x + 1];
-            uint32_t sqdist_right = this_sqdist_line[x + 1];
-            sqdist_right += 1 + (int(right_dist.vec.x) << 1);
+        if (dist_line[x] == special_distance) {
+            continue;
+        }
 
-            if (sqdist_right < this_sqdist_line[x]) {
-                this_sqdist_line[x] = sqdist_right;
-                ++right_dist.vec.x;
-                dist_line[x] = right_dist;
-                cmap_line[x] = cmap_line[x + 1];
+        sqdist_line[x] = dist_line[x].sqdist();
+
+        // Propagate from left.
+        Distance left_dist = dist_line[x - 1];
+        if (left_dist != special_distance) {
+            uint32_t sqdist_left = sqdist_line[x - 1];
+            sqdist_left += 1 - (int(left_dist.vec.x) << 1);
+            if (sqdist_left < sqdist_line[x]) {
+                sqdist_line[x] = sqdist_left;
+                --left_dist.vec.x;
+                dist_line[x] = left_dist;
+                label_line[x] = label_line[x - 1];
+            }
+        }
+
+        // Propagate from top.
+        Distance top_dist = above_dist_line[x];
+        if (top_dist != special_distance) {
+            uint32_t sqdist_top = above_sqdist_line[x];
+            sqdist_top += VERTICAL_SCALE_SQ - 2 * VERTICAL_SCALE_SQ * int(top_dist.vec.y);
+            if (sqdist_top < sqdist_line[x]) {
+                sqdist_line[x] = sqdist_top;
+                --top_dist.vec.y;
+                dist_line[x] = top_dist;
+                label_line[x] = above_label_line[x];
             }
         }
+    }
+
+    // Right to left scan.
+    for (int x = width - 2; x >= 1; --x) {
+        Distance right_dist = dist_line[x + 1];
+        if (SPECIAL && (dist_line[x] == special_distance || right_dist == special_distance)) {
+            continue;
+        }
 
-        std::swap(this_sqdist_line, prev_sqdist_line);
+        // Propagate from right.
+        uint32_t sqdist_right = sqdist_line[x + 1];
+        sqdist_right += 1 + (int(right_dist.vec.x) << 1);
+        if (sqdist_right < sqdist_line[x]) {
+            sqdist_line[x] = sqdist_right;
+            ++right_dist.vec.x;
+            dist_line[x] = right_dist;
+            label_line[x] = label_line[x + 1];
+        }
     }
+}
 
-    // Bottom to top scan.
-    for (int y = height - 2; y >= 1; --y) {
-        dist_line -= width;
-        cmap_line -= width;
-        dist_line[0].reset(0);
-        dist_line[width - 1].reset(width - 1);
-        this_sqdist_line[0] = dist_line[0].sqdist();
-        this_sqdist_line[width - 1] = dist_line[width - 1].sqdist();
-        // Right to left scan.
-        for (int x = width - 2; x >= 1; --x) {
-            // Propagate from right.
-            Distance right_dist = dist_line[x + 1];
-            uint32_t sqdist_right = this_sqdist_line[x + 1];
-            sqdist_right += 1 + (int(right_dist.vec.x) << 1);
+/**
+ * \brief A line of the bottom to top pass of a Voronoi diagram.
+ *
+ * Distances come from the right, from the line below and from the left,
+ * and only ever get smaller.  If SPECIAL is set, pixels with the special
+ * distance neither change nor spread.
+ */
+template<bool SPECIAL>
+void bottomUpLine(
+    Distance* const dist_line, uint32_t* const label_line, uint32_t* const sqdist_line,
+    Distance const* const below_dist_line, uint32_t const* const below_label_line,
+    uint32_t const* const below_sqdist_line, int const width,
+    Distance const special_distance)
+{
+    dist_line[0].reset(0);
+    dist_line[width - 1].reset(width - 1);
+    sqdist_line[0] = dist_line[0].sqdist();
+    sqdist_line[width - 1] = dist_line[width - 1].sqdist();
 
-            // Propagate from bottom.
-            Distance bottom_dist = dist_line[x + width];
-            uint32_t sqdist_bottom = prev_sqdist_line[x];
-            sqdist_bottom += VERTICAL_SCALE_SQ + 2 * VERTICAL_SCALE_SQ * int(bottom_dist.vec.y);
+    // Right to left scan.
+    for (int x = width - 2; x >= 1; --x) {
+        if (SPECIAL && dist_line[x] == special_distance) {
+            continue;
+        }
 
-            this_sqdist_line[x] = dist_line[x].sqdist();
+        sqdist_line[x] = dist_line[x].sqdist();
 
-            if (sqdist_right < this_sqdist_line[x]) {
-                this_sqdist_line[x] = sqdist_right;
+        // Propagate from right.
+        Distance right_dist = dist_line[x + 1];
+        if (!SPECIAL || right_dist != special_distance) {
+            uint32_t sqdist_right = sqdist_line[x + 1];
+            sqdist_right += 1 + (int(right_dist.vec.x) << 1);
+            if (sqdist_right < sqdist_line[x]) {
+                sqdist_line[x] = sqdist_right;
                 ++right_dist.vec.x;
                 dist_line[x] = right_dist;
-                assert(cmap_line[x] == 0 || cmap_line[x + 1] != 0);
-                cmap_line[x] = cmap_line[x + 1];
+                label_line[x] = label_line[x + 1];
             }
-            if (sqdist_bottom < this_sqdist_line[x]) {
-                this_sqdist_line[x] = sqdist_bottom;
+        }
+
+        // Propagate from bottom.
+        Distance bottom_dist = below_dist_line[x];
+        if (!SPECIAL || bottom_dist != special_distance) {
+            uint32_t sqdist_bottom = below_sqdist_line[x];
+            sqdist_bottom += VERTICAL_SCALE_SQ + 2 * VERTICAL_SCALE_SQ * int(bottom_dist.vec.y);
+            if (sqdist_bottom < sqdist_line[x]) {
+                sqdist_line[x] = sqdist_bottom;
                 ++bottom_dist.vec.y;
                 dist_line[x] = bottom_dist;
-                assert(cmap_line[x] == 0 || cmap_line[x + width] != 0);
-                cmap_line[x] = cmap_line[x + width];
+                label_line[x] = below_label_line[x];
             }
         }
+    }
 
-        // Left to right scan.
-        for (int x = 1; x < width - 1; ++x) {
-            // Propagate from left.
-            Distance left_dist = dist_line[x - 1];
-            uint32_t sqdist_left = this_sqdist_line[x - 1];
-            sqdist_left += 1 - (int(left_dist.vec.x) << 1);
-
-            if (sqdist_left < this_sqdist_line[x]) {
-                this_sqdist_line[x] = sqdist_left;
-                --left_dist.vec.x;
-                dist_line[x] = left_dist;
-                assert(cmap_line[x] == 0 || cmap_line[x - 1] != 0);
-                cmap_line[x] = cmap_line[x - 1];
-            }
+    // Left to right scan.
+    for (int x = 1; x < width - 1; ++x) {
+        Distance left_dist = dist_line[x - 1];
+        if (SPECIAL && (dist_line[x] == special_distance || left_dist == special_distance)) {
+            continue;
         }
 
-        std::swap(this_sqdist_line, prev_sqdist_line);
+        // Propagate from left.
+        uint32_t sqdist_left = sqdist_line[x - 1];
+        sqdist_left += 1 - (int(left_dist.vec.x) << 1);
+        if (sqdist_left < sqdist_line[x]) {
+            sqdist_line[x] = sqdist_left;
+            --left_dist.vec.x;
+            dist_line[x] = left_dist;
+            label_line[x] = label_line[x - 1];
+        }
     }
 }
 
-void voronoiSpecial(ConnectivityMap& cmap, std::vector<Distance>& dist, Distance const special_distance)
+template<bool SPECIAL, bool DOWN>
+inline void propagateLine(
+    Distance* dist_line, uint32_t* label_line, uint32_t* sqdist_line,
+    Distance const* adj_dist_line, uint32_t const* adj_label_line,
+    uint32_t const* adj_sqdist_line, int const width, Distance const special_distance)
 {
-    int const width = cmap.size().width() + 2;
-    int const height = cmap.size().height() + 2;
-
-    std::vector<uint32_t> sqdists(width * 2, 0);
-    uint32_t* prev_sqdist_line = &sqdists[0];
-    uint32_t* this_sqdist_line = &sqdists[width];
-
-    Distance* dist_line = &dist[0];
-    uint32_t* cmap_line = cmap.paddedData();
-
-    dist_line[0].reset(0);
-    prev_sqdist_line[0] = dist_line[0].sqdist();
-    for (int x = 1; x < width; ++x) {
-        dist_line[x].vec.x = dist_line[x - 1].vec.x - 1;
-        prev_sqdist_line[x] = prev_sqdist_line[x - 1]
-                              - (int(dist_line[x - 1].vec.x) << 1) + 1;
-    }
-
-    // Top to bottom scan.
-    for (int y = 1; y < height - 1; ++y) {
-        dist_line += width;
-        cmap_line += width;
-        dist_line[0].reset(0);
-        dist_line[width - 1].reset(width - 1);
-        this_sqdist_line[0] = dist_line[0].sqdist();
-        this_sqdist_line[width - 1] = dist_line[width - 1].sqdist();
-        // Left to right scan.
-        for (int x = 1; x < width - 1; ++x) {
-            if (dist_line[x] == special_distance) {
-                continue;
-            }
-
-            this_sqdist_line[x] = dist_line[x].sqdist();
+    if (DOWN) {
+        topDownLine<SPECIAL>(
+            dist_line, label_line, sqdist_line,
+            adj_dist_line, adj_label_line, adj_sqdist_line, width, special_distance
+        );
+    } else {
+        bottomUpLine<SPECIAL>(
+            dist_line, label_line, sqdist_line,
+            adj_dist_line, adj_label_line, adj_sqdist_line, width, special_distance
+        );
+    }
+}
 
-            // Propagate from left.
-            Distance left_dist = dist_line[x - 1];
-            if (left_dist != special_distance) {
-                uint32_t sqdist_left = this_sqdist_line[x - 1];
-                sqdist_left += 1 - (int(left_dist.vec.x) << 1);
-                if (sqdist_left < this_sqdist_line[x]) {
-                    this_sqdist_line[x] = sqdist_left;
-                    --left_dist.vec.x;
-                    dist_line[x] = left_dist;
-                    assert(cmap_line[x] == 0 || cmap_line[x - 1] != 0);
-                    cmap_line[x] = cmap_line[x - 1];
-                }
-            }
+/**
+ * \brief Runs a top to bottom (DOWN) or a bottom to top pass over
+ *        lines from \p first to \p last inclusive.
+ *
+ * The result is that of sweeping the lines one by one.  The lines are
+ * split into bands, which are propagated in parallel, every band but the
+ * first one starting from a snapshot of the line before it, which is not
+ * final yet.  Then, in order, each band is propagated again from the final
+ * line before it, until a line comes out the same as the first time.
+ * The rest of the band would come out the same as well.  On typical pages
+ * that happens within a few lines, but the more distances have to cross
+ * a seam, the longer it takes.
+ */
+template<bool SPECIAL, bool DOWN>
+void voronoiPass(
+    VoronoiPlanes const& planes, int const first, int const last,
+    Distance const special_distance)
+{
+    int const width = planes.width;
+    int const step = DOWN ? 1 : -1;
+    int const num_lines = (last - first) * step + 1;
+    if (num_lines <= 0) {
+        return;
+    }
+    int const num_bands = (num_lines + VORONOI_BAND_HEIGHT - 1) / VORONOI_BAND_HEIGHT;
+
+    // The lines just before each band, as they were before this pass.
+    std::vector<Distance> seam_dists(size_t(num_bands) * width);
+    std::vector<uint32_t> seam_labels(size_t(num_bands) * width);
+    for (int band = 0; band < num_bands; ++band) {
+        int const y = first + (band * VORONOI_BAND_HEIGHT - 1) * step;
+        std::copy(planes.dist + y * width, planes.dist + (y + 1) * width, &seam_dists[band * width]);
+        std::copy(planes.labels + y * width, planes.labels + (y + 1) * width, &seam_labels[band * width]);
+    }
 
-            // Propagate from top.
-            Distance top_dist = dist_line[x - width];
-            if (top_dist != special_distance) {
-                uint32_t sqdist_top = prev_sqdist_line[x];
-                sqdist_top += VERTICAL_SCALE_SQ - 2 * VERTICAL_SCALE_SQ * int(top_dist.vec.y);
-                if (sqdist_top < this_sqdist_line[x]) {
-                    this_sqdist_line[x] = sqdist_top;
-                    --top_dist.vec.y;
-                    dist_line[x] = top_dist;
-                    assert(cmap_line[x] == 0 || cmap_line[x - width] != 0);
-                    cmap_line[x] = cmap_line[x - width];
+    #pragma omp parallel
+    {
+        std::vector<uint32_t> sqdists(2 * width);
+        std::vector<Distance> saved_dists;
+        std::vector<uint32_t> saved_labels;
+        std::vector<Distance> line_dists(width);
+        std::vector<uint32_t> line_labels(width);
+
+        #pragma omp for schedule(dynamic) ordered
+        for (int band = 0; band < num_bands; ++band) {
+            int const band_begin = band * VORONOI_BAND_HEIGHT;
+            int const band_lines = std::min<int>(VORONOI_BAND_HEIGHT, num_lines - band_begin);
+
+            if (band > 0) {
+                saved_dists.resize(size_t(band_lines) * width);
+                saved_labels.resize(size_t(band_lines) * width);
+                for (int i = 0; i < band_lines; ++i) {
+                    int const y = first + (band_begin + i) * step;
+                    std::copy(planes.dist + y * width, planes.dist + (y + 1) * width, &saved_dists[i * width]);
+                    std::copy(planes.labels + y * width, planes.labels + (y + 1) * width, &saved_labels[i * width]);
                 }
             }
-        }
 
-        // Right to left scan.
-        for (int x = width - 2; x >= 1; --x) {
-            if (dist_line[x] == special_distance) {
-                continue;
+            uint32_t* adj_sqdist_line = &sqdists[0];
+            uint32_t* this_sqdist_line = &sqdists[width];
+            Distance const* adj_dist_line = &seam_dists[band * width];
+            uint32_t const* adj_label_line = &seam_labels[band * width];
+            lineSqDists(adj_dist_line, adj_sqdist_line, width);
+            for (int i = 0; i < band_lines; ++i) {
+                int const y = first + (band_begin + i) * step;
+                Distance* const dist_line = planes.dist + y * width;
+                uint32_t* const label_line = planes.labels + y * width;
+                propagateLine<SPECIAL, DOWN>(
+                    dist_line, label_line, this_sqdist_line,
+                    adj_dist_line, adj_label_line, adj_sqdist_line,
+                    width, special_distance
+                );
+                adj_dist_line = dist_line;
+                adj_label_line = label_line;
+                std::swap(adj_sqdist_line, this_sqdist_line);
             }
 
-            // Propagate from right.
-            Distance right_dist = dist_line[x + 1];
-            if (right_dist != special_distance) {
-                uint32_t sqdist_right = this_sqdist_line[x + 1];
-                sqdist_right += 1 + (int(right_dist.vec.x) << 1);
-                if (sqdist_right < this_sqdist_line[x]) {
-                    this_sqdist_line[x] = sqdist_right;
-                    ++right_dist.vec.x;
-                    dist_line[x] = right_dist;
-                    assert(cmap_line[x] == 0 || cmap_line[x + 1] != 0);
-                    cmap_line[x] = cmap_line[x + 1];
+            #pragma omp ordered
+            {
+                if (band > 0) {
+                    // The lines before this band are final by now.
+                    int const y_before = first + (band_begin - 1) * step;
+                    adj_dist_line = planes.dist + y_before * width;
+                    adj_label_line = planes.labels + y_before * width;
+                    lineSqDists(adj_dist_line, adj_sqdist_line, width);
+                    for (int i = 0; i < band_lines; ++i) {
+                        std::copy(&saved_dists[i * width], &saved_dists[(i + 1) * width], line_dists.begin());
+                        std::copy(&saved_labels[i * width], &saved_labels[(i + 1) * width], line_labels.begin());
+                        propagateLine<SPECIAL, DOWN>(
+                            &line_dists[0], &line_labels[0], this_sqdist_line,
+                            adj_dist_line, adj_label_line, adj_sqdist_line,
+                            width, special_distance
+                        );
+
+                        int const y = first + (band_begin + i) * step;
+                        Distance* const dist_line = planes.dist + y * width;
+                        uint32_t* const label_line = planes.labels + y * width;
+                        if (std::equal(line_dists.begin(), line_dists.end(), dist_line)
+                                && std::equal(line_labels.begin(), line_labels.end(), label_line)) {
+                            break;
+                        }
+                        std::copy(line_dists.begin(), line_dists.end(), dist_line);
+                        std::copy(line_labels.begin(), line_labels.end(), label_line);
+
+                        adj_dist_line = dist_line;
+                        adj_label_line = label_line;
+                        std::swap(adj_sqdist_line, this_sqdist_line);
+                    }
                 }
             }
         }
-
-        std::swap(this_sqdist_line, prev_sqdist_line);
     }
+}
 
-    // Bottom to top scan.
-    for (int y = height - 2; y >= 1; --y) {
-        dist_line -= width;
-        cmap_line -= width;
-        dist_line[0].reset(0);
-        dist_line[width - 1].reset(width - 1);
-        this_sqdist_line[0] = dist_line[0].sqdist();
-        this_sqdist_line[width - 1] = dist_line[width - 1].sqdist();
-        // Right to left scan.
-        for (int x = width - 2; x >= 1; --x) {
-            if (dist_line[x] == special_distance) {
-                continue;
-            }
+void voronoi(ConnectivityMap& cmap, std::vector<Distance>& dist)
+{
+    int const width = cmap.size().width() + 2;
+    int const height = cmap.size().height() + 2;
 
-            this_sqdist_line[x] = dist_line[x].sqdist();
-
-            // Propagate from right.
-            Distance right_dist = dist_line[x + 1];
-            if (right_dist != special_distance) {
-                uint32_t sqdist_right = this_sqdist_line[x + 1];
-                sqdist_right += 1 + (int(right_dist.vec.x) << 1);
-                if (sqdist_right < this_sqdist_line[x]) {
-                    this_sqdist_line[x] = sqdist_right;
-                    ++right_dist.vec.x;
-                    dist_line[x] = right_dist;
-                    assert(cmap_line[x] == 0 || cmap_line[x + 1] != 0);
-                    cmap_line[x] = cmap_line[x + 1];
-                }
-            }
+    assert(dist.empty());
+    dist.resize(width * height);
 
-            // Propagate from bottom.
-            Distance bottom_dist = dist_line[x + width];
-            if (bottom_dist != special_distance) {
-                uint32_t sqdist_bottom = prev_sqdist_line[x];
-                sqdist_bottom += VERTICAL_SCALE_SQ + 2 * VERTICAL_SCALE_SQ * int(bottom_dist.vec.y);
-                if (sqdist_bottom < this_sqdist_line[x]) {
-                    this_sqdist_line[x] = sqdist_bottom;
-                    ++bottom_dist.vec.y;
-                    dist_line[x] = bottom_dist;
-                    assert(cmap_line[x] == 0 || cmap_line[x + width] != 0);
-                    cmap_line[x] = cmap_line[x + width];
-                }
+    VoronoiPlanes const planes = { cmap.paddedData(), &dist[0], width, height };
+
+    // Labeled pixels are at zero distance, the rest (including the padding)
+    // is far away, and will be taken over by the nearest labeled pixel.
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; ++y) {
+        uint32_t const* label_line = planes.labels + y * width;
+        Distance* dist_line = planes.dist + y * width;
+        for (int x = 0; x < width; ++x) {
+            if (label_line[x]) {
+                dist_line[x] = Distance::zero();
+            } else {
+                dist_line[x].reset(x);
             }
         }
+    }
 
-        // Left to right scan.
-        for (int x = 1; x < width - 1; ++x) {
-            if (dist_line[x] == special_distance) {
-                continue;
-            }
+    // The top to bottom pass includes the bottom padding line.
+    voronoiPass<false, true>(planes, 1, height - 1, Distance::special());
+    voronoiPass<false, false>(planes, height - 2, 1, Distance::special());
+}
 
-            // Propagate from left.
-            Distance left_dist = dist_line[x - 1];
-            if (left_dist != special_distance) {
-                uint32_t sqdist_left = this_sqdist_line[x - 1];
-                sqdist_left += 1 - (int(left_dist.vec.x) << 1);
-                if (sqdist_left < this_sqdist_line[x]) {
-                    this_sqdist_line[x] = sqdist_left;
-                    --left_dist.vec.x;
-                    dist_line[x] = left_dist;
-                    assert(cmap_line[x] == 0 || cmap_line[x - 1] != 0);
-                    cmap_line[x] = cmap_line[x - 1];
-                }
-            }
-        }
+void voronoiSpecial(ConnectivityMap& cmap, std::vector<Distance>& dist, Distance const special_distance)
+{
+    int const width = cmap.size().width() + 2;
+    int const height = cmap.size().height() + 2;
 
-        std::swap(this_sqdist_line, prev_sqdist_line);
-    }
+    VoronoiPlanes const planes = { cmap.paddedData(), &dist[0], width, height };
+
+    // Unlike in voronoi(), the bottom to top pass starts a line higher
+    // and goes through the top padding line.  That's how this function
+    // has always worked, and the results are kept the same.
+    voronoiPass<true, true>(planes, 1, height - 2, special_distance);
+    voronoiPass<true, false>(planes, height - 3, 0, special_distance);
 }
 
 /**
  * Calculate the minimum distance between components from neighboring
- * Voronoi segments.
+ * Voronoi segments.  New connections are merged with the existing ones.
  */
 void voronoiDistances(
     ConnectivityMap const& cmap,
     std::vector<Distance> const& distance_matrix,
-    std::map<Connection, uint32_t>& conns)
+    Connections& conns)
 {
     int const width = cmap.size().width();
     int const height = cmap.size().height();
@@ -681,158 +801,231 @@ void voronoiDistances(
 
     uint32_t const* const cmap_data = cmap.data();
     Distance const* const distance_data = &distance_matrix[0] + width + 3;
-    for (int y = 0, offset = 0; y < height; ++y, offset += 2) {
-        for (int x = 0; x < width; ++x, ++offset) {
-            uint32_t const label = cmap_data[offset];
-            assert(label != 0);
-
-            int const x1 = x + distance_data[offset].vec.x;
-            int const y1 = y + distance_data[offset].vec.y;
-
-            for (int i = 0; i < 4; ++i) {
-                int const nbh_offset = offset + offsets[i];
-                uint32_t const nbh_label = cmap_data[nbh_offset];
-                if (nbh_label == 0 || nbh_label == label) {
-                    // label 0 can be encountered in
-                    // padding lines.
-                    continue;
-                }
 
-                int const x2 = x + distance_data[nbh_offset].vec.x;
-                int const y2 = y + distance_data[nbh_offset].vec.y;
-                int const dx = x1 - x2;
-                int const dy = y1 - y2;
-                uint32_t const sqdist = dx * dx + dy * dy;
+    #pragma omp parallel
+    {
+        Connections conns_l;
+
+        // Neighbouring pixels mostly produce the same pairs of components.
+        // Remembering recently seen pairs keeps conns_l small.
+        size_t const RECENT_SIZE = 256;
+        std::vector<size_t> recent(RECENT_SIZE, size_t(-1));
+
+        #pragma omp for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            int offset = y * (width + 2);
+            for (int x = 0; x < width; ++x, ++offset) {
+                uint32_t const label = cmap_data[offset];
+                assert(label != 0);
+
+                int const x1 = x + distance_data[offset].vec.x;
+                int const y1 = y + distance_data[offset].vec.y;
 
-                updateDistance(conns, label, nbh_label, sqdist);
+                for (int i = 0; i < 4; ++i) {
+                    int const nbh_offset = offset + offsets[i];
+                    uint32_t const nbh_label = cmap_data[nbh_offset];
+                    if (nbh_label == 0 || nbh_label == label) {
+                        // label 0 can be encountered in
+                        // padding lines.
+                        continue;
+                    }
+
+                    int const x2 = x + distance_data[nbh_offset].vec.x;
+                    int const y2 = y + distance_data[nbh_offset].vec.y;
+                    int const dx = x1 - x2;
+                    int const dy = y1 - y2;
+                    uint32_t const sqdist = dx * dx + dy * dy;
+
+                    Connection const conn(label, nbh_label);
+                    size_t& idx = recent[(conn.lesser_label * 31 + conn.greater_label) & (RECENT_SIZE - 1)];
+                    if (idx < conns_l.size() && conns_l[idx].first.lesser_label == conn.lesser_label
+                            && conns_l[idx].first.greater_label == conn.greater_label) {
+                        conns_l[idx].second = std::min(conns_l[idx].second, sqdist);
+                    } else {
+                        idx = conns_l.size();
+                        conns_l.push_back(Connections::value_type(conn, sqdist));
+                    }
+                }
             }
         }
+
+        #pragma omp critical
+        {
+            conns.insert(conns.end(), conns_l.begin(), conns_l.end());
+        }
     }
-}
 
-} // anonymous namespace
+    mergeConnections(conns);
+}
 
-BinaryImage
-Despeckle::despeckle(
-    BinaryImage const& src, Dpi const& dpi, Level const level,
-    TaskStatus const& status, DebugImages* const dbg)
+/**
+ * \brief Maps connections to the labels of \p remapping_table and merges
+ *        them with \p dst.  Connections within a single new label are dropped.
+ */
+void remapConnections(
+    Connections const& src, std::vector<uint32_t> const& remapping_table,
+    Connections& dst)
 {
-    BinaryImage dst(src);
-    despeckleInPlace(dst, dpi, level, status, dbg);
-    return dst;
+    for (Connections::value_type const& pair : src) {
+        uint32_t const label1 = remapping_table[pair.first.lesser_label];
+        uint32_t const label2 = remapping_table[pair.first.greater_label];
+        if (label1 != label2) {
+            dst.push_back(Connections::value_type(Connection(label1, label2), pair.second));
+        }
+    }
+    mergeConnections(dst);
 }
 
-void
-Despeckle::despeckleInPlace(
-    BinaryImage& image, Dpi const& dpi, Level const level,
+/**
+ * \brief The part of despeckling that doesn't depend on the level.
+ */
+struct Analysis {
+    /**
+     * Connected components, spread over the whole image by voronoi().
+     */
+    ConnectivityMap cmap;
+
+    std::vector<Distance> distanceMatrix;
+
+    /**
+     * Pixel counts, indexed by the labels of cmap.
+     */
+    Components components;
+
+    BoundingBoxes boundingBoxes;
+
+    /**
+     * Distances between neighbouring components, by the labels of cmap.
+     */
+    Connections conns;
+};
+
+/**
+ * \brief Labels connected components, collects their statistics and finds
+ *        the distances between them.
+ *
+ * \return false if the image doesn't have any black pixels.
+ */
+bool analyze(
+    BinaryImage const& image, Analysis& analysis,
     TaskStatus const& status, DebugImages* const dbg)
 {
-    Settings const settings(Settings::get(level, dpi));
-
-    ConnectivityMap cmap(image, CONN8);
+    ConnectivityMap(image, CONN8).swap(analysis.cmap);
+    ConnectivityMap& cmap = analysis.cmap;
     if (cmap.maxLabel() == 0) {
         // Completely white image?
-        return;
+        return false;
     }
 
     status.throwIfCancelled();
 
-    std::vector<Component> components(cmap.maxLabel() + 1);
-    std::vector<BoundingBox> bounding_boxes(cmap.maxLabel() + 1);
+    size_t const num_labels = cmap.maxLabel() + 1;
+    Components& components = analysis.components;
+    BoundingBoxes& bounding_boxes = analysis.boundingBoxes;
+    components = Components(num_labels);
+    bounding_boxes = BoundingBoxes(num_labels);
 
     int const width = image.width();
     int const height = image.height();
 
-    uint32_t* const cmap_data = cmap.data();
+    uint32_t const* const cmap_data = cmap.data();
 
     // Count the number of pixels and a bounding rect of each component.
+    // Lines are processed as runs of the same label.
     int const cmap_stride = cmap.stride();
     #pragma omp parallel
     {
-        std::vector<Component> components_l(cmap.maxLabel() + 1);
-        std::vector<BoundingBox> bounding_boxes_l(cmap.maxLabel() + 1);
-        #pragma omp for
+        Components components_l(num_labels);
+        BoundingBoxes bounding_boxes_l(num_labels);
+        #pragma omp for schedule(static)
         for (int y = 0; y < height; ++y) {
-            uint32_t* cmap_line = cmap_data + y * cmap_stride;
-            for (int x = 0; x < width; ++x) {
+            uint32_t const* cmap_line = cmap_data + y * cmap_stride;
+            for (int x = 0; x < width;) {
                 uint32_t const label = cmap_line[x];
-                ++components_l[label].num_pixels;
-                bounding_boxes_l[label].extend(x, y);
+                int const run_begin = x;
+                for (++x; x < width && cmap_line[x] == label; ++x) {
+                    // Skip to the end of the run.
+                }
+                components_l.addPixels(label, x - run_begin);
+                bounding_boxes_l.extendByRun(label, run_begin, x, y);
             }
         }
         #pragma omp critical
         {
-            for (size_t i = 0; i < components_l.size(); ++i) {
-                components[i].num_pixels += components_l[i].num_pixels;
-                bounding_boxes[i].extend(bounding_boxes_l[i]);
+            for (uint32_t label = 0; label < num_labels; ++label) {
+                components.addPixels(label, components_l.numPixels(label));
             }
+            bounding_boxes.extend(bounding_boxes_l);
         }
     }
 
     status.throwIfCancelled();
 
+    // Build a Voronoi diagram.  Distances don't depend on labels,
+    // so the diagram of original components serves all levels.
+    analysis.distanceMatrix.clear();
+    voronoi(cmap, analysis.distanceMatrix);
+    if (dbg) {
+        dbg->add(cmap.visualized(), "voronoi");
+    }
+
+    status.throwIfCancelled();
+
+    // Now build a bidirectional map of distances between neighboring
+    // connected components.
+    analysis.conns.clear();
+    voronoiDistances(cmap, analysis.distanceMatrix, analysis.conns);
+
+    return true;
+}
+
+/**
+ * \brief Decides which components to remove at a particular level.
+ *
+ * The second Voronoi diagram is built in \p analysis if \p may_modify
+ * is set, and in a copy of its planes otherwise.  Either way, black pixels
+ * of analysis.cmap keep their labels.
+ *
+ * \return Non-zero values for the labels of analysis.cmap to be removed.
+ */
+std::vector<uint8_t> findRemovedComponents(
+    Analysis& analysis, bool const may_modify, Settings const& settings,
+    TaskStatus const& status, DebugImages* const dbg)
+{
+    size_t const num_labels = analysis.cmap.maxLabel() + 1;
+    int const width = analysis.cmap.size().width();
+    int const height = analysis.cmap.size().height();
+
+    Components components(num_labels);
+    BoundingBoxes const& bounding_boxes = analysis.boundingBoxes;
+
     // Unify big components into one.
-    std::vector<uint32_t> remapping_table(components.size());
+    std::vector<uint32_t> remapping_table(num_labels);
     uint32_t unified_big_component = 0;
     uint32_t next_avail_component = 1;
-    for (uint32_t label = 1; label <= cmap.maxLabel(); ++label) {
-        if (bounding_boxes[label].width() < settings.bigObjectThreshold &&
-                bounding_boxes[label].height() < settings.bigObjectThreshold) {
-            components[next_avail_component] = components[label];
+    for (uint32_t label = 1; label < num_labels; ++label) {
+        if (bounding_boxes.width(label) < settings.bigObjectThreshold &&
+                bounding_boxes.height(label) < settings.bigObjectThreshold) {
+            components.setNumPixels(next_avail_component, analysis.components.numPixels(label));
             remapping_table[label] = next_avail_component;
             ++next_avail_component;
         } else {
             if (unified_big_component == 0) {
                 unified_big_component = next_avail_component;
                 ++next_avail_component;
-                components[unified_big_component] = components[label];
                 // Set num_pixels to a large value so that canBeAttachedTo()
                 // always allows attaching to any such component.
-                components[unified_big_component].num_pixels = width * height;
+                components.setNumPixels(unified_big_component, width * height);
             }
             remapping_table[label] = unified_big_component;
         }
     }
     components.resize(next_avail_component);
-    std::vector<BoundingBox>().swap(bounding_boxes); // We don't need them any more.
-
-    status.throwIfCancelled();
 
     uint32_t const max_label = next_avail_component - 1;
 
-    // Remapping individual pixels.
-    #pragma omp parallel for
-    for (int y = 0; y < height; ++y) {
-        uint32_t* cmap_line = cmap_data + y * cmap_stride;
-        for (int x = 0; x < width; ++x) {
-            cmap_line[x] = remapping_table[cmap_line[x]];
-        }
-    }
-
-    if (dbg) {
-        dbg->add(cmap.visualized(), "big_components_unified");
-    }
-
-    status.throwIfCancelled();
-
-    // Build a Voronoi diagram.
-    std::vector<Distance> distance_matrix;
-    voronoi(cmap, distance_matrix);
-    if (dbg) {
-        dbg->add(cmap.visualized(), "voronoi");
-    }
-
-    status.throwIfCancelled();
-
-    Distance* const distance_data = &distance_matrix[0] + width + 3;
-
-    // Now build a bidirectional map of distances between neighboring
-    // connected components.
-
-    typedef std::map<Connection, uint32_t> Connections; // conn -> sqdist
     Connections conns;
-
-    voronoiDistances(cmap, distance_matrix, conns);
+    remapConnections(analysis.conns, remapping_table, conns);
 
     status.throwIfCancelled();
 
@@ -840,41 +1033,45 @@ Despeckle::despeckleInPlace(
     for (Connections::value_type const& pair : conns) {
         Connection const conn(pair.first);
         uint32_t const sqdist = pair.second;
-        Component& comp1 = components[conn.lesser_label];
-        Component& comp2 = components[conn.greater_label];
-        tagSourceComponent(comp1, comp2, sqdist, settings);
-        tagSourceComponent(comp2, comp1, sqdist, settings);
+        tagSourceComponent(components, conn.lesser_label, conn.greater_label, sqdist, settings);
+        tagSourceComponent(components, conn.greater_label, conn.lesser_label, sqdist, settings);
     }
 
     // Prevent it from growing when we compute the Voronoi diagram
     // the second time.
-    components[unified_big_component].setAnchoredToBig();
-
-    bool have_anchored_to_small_but_not_big = false;
-    for (Component const& comp : components) {
-        if (comp.anchoredToSmallButNotBig()) {
-            have_anchored_to_small_but_not_big = true;
-            break;
-        }
-    }
+    components.setAnchoredToBig(unified_big_component);
 
-    if (have_anchored_to_small_but_not_big) {
+    if (components.haveAnchoredToSmallButNotBig()) {
 
         status.throwIfCancelled();
 
+        ConnectivityMap cmap_copy;
+        std::vector<Distance> distance_matrix_copy;
+        if (!may_modify) {
+            cmap_copy = analysis.cmap;
+            distance_matrix_copy = analysis.distanceMatrix;
+        }
+        ConnectivityMap& cmap = may_modify ? analysis.cmap : cmap_copy;
+        std::vector<Distance>& distance_matrix = may_modify
+                ? analysis.distanceMatrix : distance_matrix_copy;
+
+        uint32_t const* const cmap_data = cmap.data();
+        Distance* const distance_data = &distance_matrix[0] + width + 3;
+
         // Give such components a second chance.  Maybe they do have
         // big neighbors, but Voronoi regions from a smaller ones
         // block the path to the bigger ones.
 
         Distance const zero_distance(Distance::zero());
         Distance const special_distance(Distance::special());
-        for (int y = 0, offset = 0; y < height; ++y, offset += 2) {
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            int offset = y * (width + 2);
             for (int x = 0; x < width; ++x, ++offset) {
-                uint32_t const label = cmap_data[offset];
+                uint32_t const label = remapping_table[cmap_data[offset]];
                 assert(label != 0);
 
-                Component const& comp = components[label];
-                if (!comp.anchoredToSmallButNotBig()) {
+                if (!components.anchoredToSmallButNotBig(label)) {
                     if (distance_data[offset] == zero_distance) {
                         // Prevent this region from growing
                         // and from being taken over by another
@@ -904,42 +1101,36 @@ Despeckle::despeckleInPlace(
         status.throwIfCancelled();
 
         // We've got new connections.  Add them to the map.
-        voronoiDistances(cmap, distance_matrix, conns);
+        Connections new_conns;
+        voronoiDistances(cmap, distance_matrix, new_conns);
+        remapConnections(new_conns, remapping_table, conns);
     }
 
     status.throwIfCancelled();
 
-    // Clear the distance matrix.
-    std::vector<Distance>().swap(distance_matrix);
-
     // Remove tags from components.
-    for (Component& comp : components) {
-        comp.clearTags();
-    }
+    components.clearTags();
 
     // Build a directional connection map and only include
     // good connections, that is those with a small enough
     // distance.
-    // While at it, clear the bidirectional connection map.
     std::vector<TargetSourceConn> target_source;
-    while (!conns.empty()) {
-        Connections::iterator const it(conns.begin());
-        uint32_t const label1 = it->first.lesser_label;
-        uint32_t const label2 = it->first.greater_label;
-        uint32_t const sqdist = it->second;
-        Component const& comp1 = components[label1];
-        Component const& comp2 = components[label2];
-        if (canBeAttachedTo(comp1, comp2, sqdist, settings)) {
+    for (Connections::value_type const& pair : conns) {
+        uint32_t const label1 = pair.first.lesser_label;
+        uint32_t const label2 = pair.first.greater_label;
+        uint32_t const sqdist = pair.second;
+        if (canBeAttachedTo(components, label1, label2, sqdist, settings)) {
             target_source.push_back(TargetSourceConn(label2, label1));
         }
-        if (canBeAttachedTo(comp2, comp1, sqdist, settings)) {
+        if (canBeAttachedTo(components, label2, label1, sqdist, settings)) {
             target_source.push_back(TargetSourceConn(label1, label2));
         }
-        conns.erase(it);
     }
+    Connections().swap(conns);
 
     std::sort(target_source.begin(), target_source.end());
 
+
     status.throwIfCancelled();
 
     // Create an index for quick access to a group of connections
@@ -968,12 +1159,11 @@ Despeckle::despeckleInPlace(
         uint32_t const label = ok_labels.front();
         ok_labels.pop();
 
-        Component& comp = components[label];
-        if (comp.anchoredToBig()) {
+        if (components.anchoredToBig(label)) {
             continue;
         }
 
-        comp.setAnchoredToBig();
+        components.setAnchoredToBig(label);
 
         size_t idx = target_source_idx[label];
         while (idx < num_target_sources &&
@@ -983,19 +1173,127 @@ Despeckle::despeckleInPlace(
         }
     }
 
+    std::vector<uint8_t> removed(num_labels);
+    for (uint32_t label = 0; label < num_labels; ++label) {
+        removed[label] = components.anchoredToBig(remapping_table[label]) ? 0 : 1;
+    }
+    return removed;
+}
+
+} // anonymous namespace
+
+Despeckle::MultiLevelSpeckles
+Despeckle::findSpeckles(
+    BinaryImage const& src, Dpi const& dpi,
+    TaskStatus const& status, DebugImages* const dbg)
+{
+    MultiLevelSpeckles result;
+    for (int level = CAUTIOUS; level <= AGGRESSIVE; ++level) {
+        result.m_speckles[level] = BinaryImage(src.size(), WHITE);
+    }
+
+    Analysis analysis;
+    if (!analyze(src, analysis, status, dbg)) {
+        return result;
+    }
+
+    // Bit N is set for components removed at level N.
+    size_t const num_labels = analysis.cmap.maxLabel() + 1;
+    std::vector<uint8_t> level_flags(num_labels, 0);
+    for (int level = CAUTIOUS; level <= AGGRESSIVE; ++level) {
+        status.throwIfCancelled();
+
+        // The last level may take the analysis apart.
+        std::vector<uint8_t> const removed(
+            findRemovedComponents(
+                analysis, level == AGGRESSIVE,
+                Settings::get(Level(level), dpi), status, dbg
+            )
+        );
+        for (size_t label = 0; label < num_labels; ++label) {
+            level_flags[label] |= removed[label] << level;
+        }
+    }
+
+    status.throwIfCancelled();
+
+    int const width = src.width();
+    int const height = src.height();
+    uint32_t const msb = uint32_t(1) << 31;
+
+    uint32_t const* const src_data = src.data();
+    int const src_stride = src.wordsPerLine();
+    uint32_t* speckles_data[AGGRESSIVE + 1];
+    for (int level = CAUTIOUS; level <= AGGRESSIVE; ++level) {
+        speckles_data[level] = result.m_speckles[level].data();
+    }
+    uint32_t const* const cmap_data = analysis.cmap.data();
+    int const cmap_stride = analysis.cmap.stride();
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; ++y) {
+        uint32_t const* src_line = src_data + y * src_stride;
+        uint32_t const* cmap_line = cmap_data + y * cmap_stride;
+        for (int x = 0; x < width; ++x) {
+            uint32_t const mask = msb >> (x & 31);
+            if (!(src_line[x >> 5] & mask)) {
+                continue;
+            }
+            uint8_t const flags = level_flags[cmap_line[x]];
+            for (int level = CAUTIOUS; level <= AGGRESSIVE; ++level) {
+                if (flags & (1 << level)) {
+                    speckles_data[level][y * src_stride + (x >> 5)] |= mask;
+                }
+            }
+        }
+    }
+
+    return result;
+}
+
+BinaryImage
+Despeckle::despeckle(
+    BinaryImage const& src, Dpi const& dpi, Level const level,
+    TaskStatus const& status, DebugImages* const dbg)
+{
+    BinaryImage dst(src);
+    despeckleInPlace(dst, dpi, level, status, dbg);
+    return dst;
+}
+
+void
+Despeckle::despeckleInPlace(
+    BinaryImage& image, Dpi const& dpi, Level const level,
+    TaskStatus const& status, DebugImages* const dbg)
+{
+    Analysis analysis;
+    if (!analyze(image, analysis, status, dbg)) {
+        return;
+    }
+
+    std::vector<uint8_t> const removed(
+        findRemovedComponents(
+            analysis, true, Settings::get(level, dpi), status, dbg
+        )
+    );
+
     status.throwIfCancelled();
 
     // Remove unmarked components from the binary image.
+    int const width = image.width();
+    int const height = image.height();
     uint32_t const msb = uint32_t(1) << 31;
     int const image_stride = image.wordsPerLine();
     uint32_t* image_data = image.data(); // never call image.data() inside omp
+    uint32_t const* const cmap_data = analysis.cmap.data();
+    int const cmap_stride = analysis.cmap.stride();
 
     #pragma omp parallel for
     for (int y = 0; y < height; ++y) {
         uint32_t* image_line = image_data + y * image_stride;
-        uint32_t* cmap_line = cmap_data + y * cmap_stride;
+        uint32_t const* cmap_line = cmap_data + y * cmap_stride;
         for (int x = 0; x < width; ++x) {
-            if (!components[cmap_line[x]].anchoredToBig()) {
+            if (removed[cmap_line[x]]) {
                 image_line[x >> 5] &= ~(msb >> (x & 31));
             }
         }
@@ -19,20 +19,55 @@
 #ifndef DESPECKLE_H_
 #define DESPECKLE_H_
 
+#include "imageproc/BinaryImage.h"
+
 class Dpi;
 class TaskStatus;
 class DebugImages;
 
-namespace imageproc
-{
-class BinaryImage;
-}
-
 class Despeckle
 {
 public:
     enum Level { CAUTIOUS, NORMAL, AGGRESSIVE };
 
+    /**
+     * \brief Speckles of one image at every despeckling level.
+     *
+     * Switching between levels doesn't require despeckling again.
+     */
+    class MultiLevelSpeckles
+    {
+    public:
+        /**
+         * \brief The black pixels of the source image that
+         *        despeckling at \p level removes.
+         */
+        imageproc::BinaryImage const& speckles(Level level) const
+        {
+            return m_speckles[level];
+        }
+    private:
+        friend class Despeckle;
+
+        imageproc::BinaryImage m_speckles[AGGRESSIVE + 1];
+    };
+
+    /**
+     * \brief Finds speckles at all levels at once.
+     *
+     * Connected components, their statistics and the Voronoi diagram
+     * don't depend on the level, so they are only computed once.
+     * Only the attachment of components to each other is done per level.
+     *
+     * \param src The image to despeckle.  Must not be null.
+     * \param dpi DPI of \p src.
+     * \param status For asynchronous task cancellation.
+     * \param dbg An optional sink for debugging images.
+     */
+    static MultiLevelSpeckles findSpeckles(
+        imageproc::BinaryImage const& src, Dpi const& dpi,
+        TaskStatus const& status, DebugImages* dbg = 0);
+
     /**
      * \brief Removes small speckles from a binary image.
      *
@@ -26,19 +26,19 @@ using namespace imageproc;
 FilterData::FilterData(QString const& filename, QImage const& image)
     :   m_origImageFilename(filename),
         m_origImage(image),
-        m_grayImage(toGrayscale(m_origImage)),
         m_xform(image.rect(), Dpm(image)),
-        m_bwThreshold(BinaryThreshold::otsuThreshold(m_grayImage))
+        m_bwThreshold(0)
 {
+    initGrayImage();
 }
 
 FilterData::FilterData(QString const& filename, QImage const& image, QPolygonF const& preCropArea)
     : m_origImageFilename(filename),
     m_origImage(image),
-    m_grayImage(toGrayscale(m_origImage)),
     m_xform(image.rect(), Dpm(image)),
-    m_bwThreshold(BinaryThreshold::otsuThreshold(m_grayImage))
+    m_bwThreshold(0)
 {
+    initGrayImage();
     m_xform.setPreCropArea(preCropArea);
 }
 
@@ -50,3 +50,12 @@ FilterData::FilterData(FilterData const& other, ImageTransformation const& xform
         m_bwThreshold(other.m_bwThreshold)
 {
 }
+
+void
+FilterData::initGrayImage()
+{
+    // The histogram Otsu's method needs comes with the conversion.
+    GrayscaleHistogram hist;
+    m_grayImage = GrayImage(toGrayscale(m_origImage, hist));
+    m_bwThreshold = BinaryThreshold::otsuThreshold(hist);
+}
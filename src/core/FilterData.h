@@ -60,6 +60,8 @@ public:
         return m_grayImage;
     }
 private:
+    void initGrayImage();
+
     QString m_origImageFilename;
     QImage m_origImage;
     imageproc::GrayImage m_grayImage;
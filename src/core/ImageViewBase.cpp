@@ -305,7 +305,8 @@ ImageViewBase::createDownscaledImage(QImage const& image)
     xform.scale((double)d_w / o_w, (double)d_h / o_h);
     return transform(
                image, xform, QRect(0, 0, d_w, d_h),
-               OutsidePixels::assumeColor(Qt::white)
+               OutsidePixels::assumeColor(Qt::white),
+               QSizeF(0.0, 0.0), PREVIEW_QUALITY
            );
 }
 
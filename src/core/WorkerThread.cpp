@@ -19,9 +19,11 @@
 
 #include "ThreadPriority.h"
 #include "OutOfMemoryHandler.h"
+#include "ScratchArena.h"
 #include <QCoreApplication>
 #include <QThread>
 #include <QEvent>
+#include <QAtomicInt>
 #include "settings/ini_keys.h"
 #include <QtGlobal> // For Q_OS_LINUX
 #include <new>
@@ -71,6 +73,13 @@ public:
     ~Impl();
 
     void performTask(BackgroundTaskPtr const& task);
+
+    /**
+     * \brief Called by the dispatcher once a task is processed or dropped.
+     *
+     * \return true if no more tasks are waiting.
+     */
+    bool taskFinished();
 protected:
     virtual void run();
 
@@ -83,6 +92,7 @@ private:
     WorkerThread& m_rOwner;
     Dispatcher m_dispatcher;
     bool m_threadStarted;
+    QAtomicInt m_numPendingTasks;
 };
 
 class WorkerThread::PerformTaskEvent : public QEvent
@@ -238,19 +248,24 @@ WorkerThread::Dispatcher::customEvent(QEvent* event)
 void
 WorkerThread::Dispatcher::processTask(BackgroundTaskPtr const& task)
 {
-    if (task->isCancelled()) {
-        return;
+    if (!task->isCancelled()) {
+        try {
+            FilterResultPtr const result((*task)());
+            if (result) {
+                QCoreApplication::postEvent(
+                    &m_rOwner, new TaskResultEvent(task, result)
+                );
+            }
+        } catch (std::bad_alloc const&) {
+            OutOfMemoryHandler::instance().handleOutOfMemorySituation();
+        }
     }
 
-    try {
-        FilterResultPtr const result((*task)());
-        if (result) {
-            QCoreApplication::postEvent(
-                &m_rOwner, new TaskResultEvent(task, result)
-            );
-        }
-    } catch (std::bad_alloc const&) {
-        OutOfMemoryHandler::instance().handleOutOfMemorySituation();
+    // Scratch buffers are likely to be reused by the next page, so keep
+    // them while there is more work, within MAX_TOTAL_CACHED_BYTES.
+    // Don't keep them while the thread is idle though.
+    if (m_rOwner.taskFinished()) {
+        ScratchArena::trimAll();
     }
 }
 
@@ -259,7 +274,8 @@ WorkerThread::Dispatcher::processTask(BackgroundTaskPtr const& task)
 WorkerThread::Impl::Impl(WorkerThread& owner)
     :   m_rOwner(owner),
         m_dispatcher(*this),
-        m_threadStarted(false)
+        m_threadStarted(false),
+        m_numPendingTasks(0)
 {
     m_dispatcher.moveToThread(this);
 }
@@ -273,6 +289,7 @@ WorkerThread::Impl::~Impl()
 void
 WorkerThread::Impl::performTask(BackgroundTaskPtr const& task)
 {
+    m_numPendingTasks.ref();
     QCoreApplication::postEvent(&m_dispatcher, new PerformTaskEvent(task));
     if (!m_threadStarted) {
         start();
@@ -280,6 +297,12 @@ WorkerThread::Impl::performTask(BackgroundTaskPtr const& task)
     }
 }
 
+bool
+WorkerThread::Impl::taskFinished()
+{
+    return !m_numPendingTasks.deref();
+}
+
 void
 WorkerThread::Impl::run()
 {
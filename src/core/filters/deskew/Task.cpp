@@ -50,6 +50,7 @@
 #include "math/XSpline.h"
 #include <QString>
 #include <memory>
+#include <vector>
 
 namespace deskew
 {
@@ -739,16 +740,16 @@ Task::cleanup(TaskStatus const& status, BinaryImage& image)
     // We don't have to clean up every piece of garbage.
     // The only concern are the horizontal shadows, which we remove here.
 
-    BinaryImage reduced_image;
-
+    // Same as reducing by 2 while both dimensions are at least 2000,
+    // but done in a single pass over the image.
+    int num_reductions = 0;
+    for (int w = image.width(), h = image.height(); w >= 2000 && h >= 2000; w /= 2, h /= 2)
     {
-        ReduceThreshold reductor(image);
-        while (reductor.image().width() >= 2000 && reductor.image().height() >= 2000)
-        {
-            reductor.reduce(2);
-        }
-        reduced_image = reductor.image();
+        ++num_reductions;
     }
+    BinaryImage reduced_image(
+        ReduceThreshold::pyramid(image, std::vector<int>(num_reductions, 2)).back()
+    );
 
     status.throwIfCancelled();
 
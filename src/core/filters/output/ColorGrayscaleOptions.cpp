@@ -32,6 +32,10 @@ ColorGrayscaleOptions::ColorGrayscaleOptions(QDomElement const& el, bool mixed_m
     m_autoLayerEnabled = el.attribute("autoLayer", default_value) == "1";
     m_pictureZonesLayerEnabled = el.attribute("pictureZonesLayer", "0") == "1";
     m_foregroundLayerEnabled = el.attribute("foregroundLayer", "0") == "1";
+    m_denoiseFilter = parseDenoiseFilter(el.attribute("denoiseFilter"));
+    m_denoiseRadius = el.attribute("denoiseRadius", "3").toInt();
+    m_denoiseStrength = el.attribute("denoiseStrength", "0.2").toDouble();
+    m_paletteSize = el.attribute("paletteSize", "0").toInt();
 }
 
 QDomElement
@@ -43,6 +47,10 @@ ColorGrayscaleOptions::toXml(QDomDocument& doc, QString const& name) const
     el.setAttribute("autoLayer", m_autoLayerEnabled ? "1" : "0");
     el.setAttribute("pictureZonesLayer", m_pictureZonesLayerEnabled ? "1" : "0");
     el.setAttribute("foregroundLayer", m_foregroundLayerEnabled ? "1" : "0");
+    el.setAttribute("denoiseFilter", formatDenoiseFilter(m_denoiseFilter));
+    el.setAttribute("denoiseRadius", m_denoiseRadius);
+    el.setAttribute("denoiseStrength", m_denoiseStrength);
+    el.setAttribute("paletteSize", m_paletteSize);
     return el;
 }
 
@@ -69,6 +77,22 @@ ColorGrayscaleOptions::operator==(ColorGrayscaleOptions const& other) const
         return false;
     }
 
+    if (m_denoiseFilter != other.m_denoiseFilter) {
+        return false;
+    }
+
+    if (m_denoiseRadius != other.m_denoiseRadius) {
+        return false;
+    }
+
+    if (m_denoiseStrength != other.m_denoiseStrength) {
+        return false;
+    }
+
+    if (m_paletteSize != other.m_paletteSize) {
+        return false;
+    }
+
     return true;
 }
 
@@ -78,4 +102,34 @@ ColorGrayscaleOptions::operator!=(ColorGrayscaleOptions const& other) const
     return !(*this == other);
 }
 
+DenoiseFilter
+ColorGrayscaleOptions::parseDenoiseFilter(QString const& str)
+{
+    if (str == "knn") {
+        return DENOISE_KNN;
+    } else if (str == "wiener") {
+        return DENOISE_WIENER;
+    } else {
+        return DENOISE_NONE;
+    }
+}
+
+QString
+ColorGrayscaleOptions::formatDenoiseFilter(DenoiseFilter type)
+{
+    QString str = "";
+    switch (type) {
+    case DENOISE_NONE:
+        str = "off";
+        break;
+    case DENOISE_KNN:
+        str = "knn";
+        break;
+    case DENOISE_WIENER:
+        str = "wiener";
+        break;
+    }
+    return str;
+}
+
 } // namespace output
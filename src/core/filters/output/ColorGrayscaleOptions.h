@@ -26,6 +26,14 @@ class QDomElement;
 namespace output
 {
 
+/**
+ * \brief The filter applied to color and grayscale output before it's written.
+ *
+ * DENOISE_KNN and DENOISE_WIENER correspond to imageproc::knnDenoiserFilter()
+ * and imageproc::wienerColorFilter() respectively.
+ */
+enum DenoiseFilter { DENOISE_NONE, DENOISE_KNN, DENOISE_WIENER };
+
 class ColorGrayscaleOptions
 {
 public:
@@ -33,7 +41,8 @@ public:
                           bool autoLayer = true, bool pictureZonesLayer = false, bool foregroundLayer = false)
         : m_whiteMargins(whiteMargins), m_normalizeIllumination(normalizeIllumination),
           m_autoLayerEnabled(autoLayer), m_pictureZonesLayerEnabled(pictureZonesLayer),
-          m_foregroundLayerEnabled(foregroundLayer) {}
+          m_foregroundLayerEnabled(foregroundLayer), m_denoiseFilter(DENOISE_NONE),
+          m_denoiseRadius(3), m_denoiseStrength(0.2), m_paletteSize(0) {}
 
     ColorGrayscaleOptions(QDomElement const& el, bool mixed_mode);
 
@@ -89,6 +98,61 @@ public:
         m_foregroundLayerEnabled = enabled;
     }
 
+    DenoiseFilter denoiseFilter() const
+    {
+        return m_denoiseFilter;
+    }
+
+    void setDenoiseFilter(DenoiseFilter val)
+    {
+        m_denoiseFilter = val;
+    }
+
+    /**
+     * The window radius of DENOISE_KNN.  DENOISE_WIENER uses
+     * a (2 * radius + 1) x (2 * radius + 1) window.
+     */
+    int denoiseRadius() const
+    {
+        return m_denoiseRadius;
+    }
+
+    void setDenoiseRadius(int val)
+    {
+        m_denoiseRadius = val;
+    }
+
+    /**
+     * The coef parameter of the denoise filter, in [0, 1].
+     */
+    double denoiseStrength() const
+    {
+        return m_denoiseStrength;
+    }
+
+    void setDenoiseStrength(double val)
+    {
+        m_denoiseStrength = val;
+    }
+
+    /**
+     * The number of colors of a palette-reduced output, in [4, 16],
+     * or 0 to keep all the colors.  Black and white come on top of that.
+     */
+    int paletteSize() const
+    {
+        return m_paletteSize;
+    }
+
+    void setPaletteSize(int val)
+    {
+        m_paletteSize = val;
+    }
+
+    static DenoiseFilter parseDenoiseFilter(QString const& str);
+
+    static QString formatDenoiseFilter(DenoiseFilter type);
+
     bool operator==(ColorGrayscaleOptions const& other) const;
 
     bool operator!=(ColorGrayscaleOptions const& other) const;
@@ -98,6 +162,10 @@ private:
     bool m_autoLayerEnabled;
     bool m_pictureZonesLayerEnabled;
     bool m_foregroundLayerEnabled;
+    DenoiseFilter m_denoiseFilter;
+    int m_denoiseRadius;
+    double m_denoiseStrength;
+    int m_paletteSize;
 };
 
 } // namespace output
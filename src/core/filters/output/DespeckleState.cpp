@@ -21,7 +21,6 @@
 #include "Despeckle.h"
 #include "TaskStatus.h"
 #include "DebugImages.h"
-#include "imageproc/RasterOp.h"
 #include <new>
 #include <stdint.h>
 
@@ -78,13 +77,13 @@ DespeckleState::redespeckle(
         break;
     }
 
-    new_state.m_speckles = Despeckle::despeckle(
-                               m_everythingBW, m_dpi, level2, status, dbg
-                           );
-
-    status.throwIfCancelled();
+    if (!new_state.m_ptrAllSpeckles) {
+        new_state.m_ptrAllSpeckles = std::make_shared<Despeckle::MultiLevelSpeckles>(
+                                         Despeckle::findSpeckles(m_everythingBW, m_dpi, status, dbg)
+                                     );
+    }
 
-    rasterOp<RopSubtract<RopSrc, RopDst> >(new_state.m_speckles, m_everythingBW);
+    new_state.m_speckles = new_state.m_ptrAllSpeckles->speckles(level2);
 
     return new_state;
 }
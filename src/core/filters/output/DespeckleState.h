@@ -21,8 +21,10 @@
 
 #include "DespeckleLevel.h"
 #include "Dpi.h"
+#include "Despeckle.h"
 #include "imageproc/BinaryImage.h"
 #include <QImage>
+#include <memory>
 
 class TaskStatus;
 class DebugImages;
@@ -88,6 +90,12 @@ private:
      * m_everythingBW.
      */
     DespeckleLevel m_despeckleLevel;
+
+    /**
+     * Speckles of m_everythingBW at every level.  Computed by the first
+     * redespeckle() and shared by the states derived from this one.
+     */
+    std::shared_ptr<Despeckle::MultiLevelSpeckles const> m_ptrAllSpeckles;
 };
 
 } // namespace output
@@ -51,9 +51,11 @@
 #include "imageproc/SavGolFilter.h"
 #include "imageproc/DrawOver.h"
 #include "imageproc/AdjustBrightness.h"
+#include "imageproc/ColorFilter.h"
 #include "imageproc/PolygonRasterizer.h"
 #include "imageproc/ConnectivityMap.h"
 #include "imageproc/InfluenceMap.h"
+#include "imageproc/Shear.h"
 #include "config.h"
 #include "settings/globalstaticsettings.h"
 #ifdef HAVE_EXIV2
@@ -85,6 +87,7 @@
 #include <assert.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
 //begin of modified by monday2000
 //Marginal_Dewarping
 #include "imageproc/OrthogonalRotation.h"
@@ -236,6 +239,72 @@ void combineMixed(
     }
 }
 
+/**
+ * Renders \p rect of a bilevel \p src transformed by \p xform, keeping it
+ * bilevel.  Quarter turns are done by orthogonalRotation(), and whatever
+ * remains by rotateBinaryByShears(), which doesn't interpolate, so pixels
+ * land on the nearest position rather than being resampled.
+ *
+ * \return A null image, unless \p src is bilevel and \p xform does
+ *         nothing but rotating and translating.
+ */
+QImage rotateBilevelByShears(QImage const& src, QTransform const& xform, QRect const& rect)
+{
+    if ((src.format() != QImage::Format_Mono && src.format() != QImage::Format_MonoLSB)
+            || xform.type() == QTransform::TxProject || rect.isEmpty()) {
+        return QImage();
+    }
+
+    int const quarter_turns = qRound(atan2(xform.m12(), xform.m11()) * constants::RAD2DEG / 90.0);
+    int const orthogonal_deg = (quarter_turns + 4) % 4 * 90;
+
+    QTransform orthogonal;
+    orthogonal.rotate(orthogonal_deg);
+    QRectF const rotated_rect(orthogonal.mapRect(QRectF(src.rect())));
+    orthogonal *= QTransform().translate(-rotated_rect.left(), -rotated_rect.top());
+
+    // What's left must be a rotation by at most 45 degrees, without scaling.
+    QTransform const residual(orthogonal.inverted() * xform);
+    double const angle = atan2(residual.m12(), residual.m11());
+    double const cos_a = cos(angle);
+    double const sin_a = sin(angle);
+    double const tolerance = 1e-6;
+    if (fabs(residual.m11() - cos_a) > tolerance || fabs(residual.m22() - cos_a) > tolerance
+            || fabs(residual.m12() - sin_a) > tolerance || fabs(residual.m21() + sin_a) > tolerance) {
+        return QImage();
+    }
+
+    BinaryImage oriented(src);
+    if (orthogonal_deg != 0) {
+        oriented = orthogonalRotation(oriented, orthogonal_deg);
+    }
+    int const width = oriented.width();
+    int const height = oriented.height();
+
+    // The intermediate shears must not push anything off the canvas either.
+    // Equal padding on opposite sides keeps the center in place.
+    int const padding = (int)ceil(0.5 * fabs(sin_a) * (width + height)) + 1;
+    BinaryImage canvas(width + 2 * padding, height + 2 * padding, WHITE);
+    rasterOp<RopSrc>(canvas, QRect(padding, padding, width, height), oriented, QPoint(0, 0));
+    oriented.release();
+
+    BinaryImage const rotated(rotateBinaryByShears(canvas, angle * constants::RAD2DEG, WHITE));
+    canvas.release();
+
+    // The canvas is rotated about its center rather than transformed
+    // by residual, so the two differ by a translation.
+    QPointF const center(0.5 * width, 0.5 * height);
+    QPointF const offset(residual.map(center) - center - QPointF(padding, padding));
+    QPoint const shift(qRound(offset.x()), qRound(offset.y()));
+
+    BinaryImage dst(rect.size(), WHITE);
+    QRect const src_rect(rect.translated(-shift).intersected(rotated.rect()));
+    if (!src_rect.isEmpty()) {
+        rasterOp<RopSrc>(dst, src_rect.translated(shift - rect.topLeft()), rotated, src_rect.topLeft());
+    }
+    return dst.toQImage();
+}
+
 } // anonymous namespace
 
 OutputGenerator::OutputGenerator(
@@ -306,6 +375,16 @@ OutputGenerator::process(
     );
     assert(!image.isNull());
 
+    int const palette_size = m_colorParams.colorGrayscaleOptions().paletteSize();
+    if ((palette_size > 0) && !keep_orig_fore_subscan
+            && (m_colorParams.colorMode() != ColorParams::BLACK_AND_WHITE)
+            && (image.format() != QImage::Format_Mono) && (image.format() != QImage::Format_MonoLSB)) {
+        // Pure black and white stay as they are, so the black and white
+        // layer of mixed output is untouched.
+        image = colorQuantize(image, qBound(4, palette_size, 16));
+        status.throwIfCancelled();
+    }
+
     // Set the correct DPI.
     Dpm const output_dpm(m_dpi);
     image.setDotsPerMeterX(output_dpm.horizontal());
@@ -450,6 +529,10 @@ OutputGenerator::modifyBinarizationMask(
     xform *= QTransform().translate(-mask_rect.x(), -mask_rect.y());
 
     typedef PictureLayerProperty PLP;
+    typedef PolygonRasterizer::ColoredPolygon ColoredPolygon;
+
+    // All the zones are rasterized in one go, in the order of the passes.
+    std::vector<ColoredPolygon> polys;
 
     // Pass 1: ERASER1
     if (filter & BINARIZATION_MASK_ERASER1) {
@@ -457,7 +540,7 @@ OutputGenerator::modifyBinarizationMask(
             if (zone.properties().locateOrDefault<PLP>()->layer() == PLP::ERASER1) {
                 if (zone.type() == Zone::SplineType) {
                     QPolygonF const poly(zone.spline().toPolygon());
-                    PolygonRasterizer::fill(bw_mask, BLACK, xform.map(poly), Qt::WindingFill);
+                    polys.push_back(ColoredPolygon(xform.map(poly), BLACK));
                 } else if (zone.type() == Zone::EllipseType) {
                     QPainterPath path;
                     QTransform t;
@@ -467,7 +550,7 @@ OutputGenerator::modifyBinarizationMask(
                     path.addEllipse(zone.ellipse().center(), zone.ellipse().rx(), zone.ellipse().ry());
                     path = t.map(path);
 //                    path = xform.map(path);
-                    PolygonRasterizer::fill(bw_mask, BLACK, xform.map(path.toFillPolygon()), Qt::WindingFill);
+                    polys.push_back(ColoredPolygon(xform.map(path.toFillPolygon()), BLACK));
                 }
             }
         }
@@ -479,7 +562,7 @@ OutputGenerator::modifyBinarizationMask(
             if (zone.properties().locateOrDefault<PLP>()->layer() == PLP::PAINTER2) {
                 if (zone.type() == Zone::SplineType) {
                     QPolygonF const poly(zone.spline().toPolygon());
-                    PolygonRasterizer::fill(bw_mask, WHITE, xform.map(poly), Qt::WindingFill);
+                    polys.push_back(ColoredPolygon(xform.map(poly), WHITE));
                 } else if (zone.type() == Zone::EllipseType) {
                     QPainterPath path;
                     QTransform t;
@@ -489,7 +572,7 @@ OutputGenerator::modifyBinarizationMask(
                     path.addEllipse(zone.ellipse().center(), zone.ellipse().rx(), zone.ellipse().ry());
                     path = t.map(path);
 //                    path = xform.map(path);
-                    PolygonRasterizer::fill(bw_mask, WHITE, xform.map(path.toFillPolygon()), Qt::WindingFill);
+                    polys.push_back(ColoredPolygon(xform.map(path.toFillPolygon()), WHITE));
                 }
             }
         }
@@ -501,7 +584,7 @@ OutputGenerator::modifyBinarizationMask(
             if (zone.properties().locateOrDefault<PLP>()->layer() == PLP::ERASER3) {
                 if (zone.type() == Zone::SplineType) {
                     QPolygonF const poly(zone.spline().toPolygon());
-                    PolygonRasterizer::fill(bw_mask, BLACK, xform.map(poly), Qt::WindingFill);
+                    polys.push_back(ColoredPolygon(xform.map(poly), BLACK));
                 } else if (zone.type() == Zone::EllipseType) {
                     QPainterPath path;
                     QTransform t;
@@ -511,11 +594,15 @@ OutputGenerator::modifyBinarizationMask(
                     path.addEllipse(zone.ellipse().center(), zone.ellipse().rx(), zone.ellipse().ry());
                     path = t.map(path);
 //                    path = xform.map(path);
-                    PolygonRasterizer::fill(bw_mask, BLACK, xform.map(path.toFillPolygon()), Qt::WindingFill);
+                    polys.push_back(ColoredPolygon(xform.map(path.toFillPolygon()), BLACK));
                 }
             }
         }
     }
+
+    if (!polys.empty()) {
+        PolygonRasterizer::fill(bw_mask, polys, Qt::WindingFill);
+    }
 }
 
 QImage
@@ -606,6 +693,7 @@ OutputGenerator::processAsIs(
               );
     }
 
+    maybeDenoiseInPlace(out, status);
     applyFillZonesInPlace(out, fill_zones);
     reserveBlackAndWhite(out);
 
@@ -680,10 +768,17 @@ OutputGenerator::processWithoutDewarping(TaskStatus const& status, FilterData co
                                m_xform.transform(), normalize_illumination_rect, 0, dbg
                            );
     } else {
-        maybe_normalized = transform(
-                               input.origImage(), m_xform.transform(),
-                               normalize_illumination_rect, OutsidePixels::assumeColor(Qt::white)
-                           );
+        if (GlobalStaticSettings::m_bw_rotate_by_shears && render_params.binaryOutput()) {
+            maybe_normalized = rotateBilevelByShears(
+                                   input.origImage(), m_xform.transform(), normalize_illumination_rect
+                               );
+        }
+        if (maybe_normalized.isNull()) {
+            maybe_normalized = transform(
+                                   input.origImage(), m_xform.transform(),
+                                   normalize_illumination_rect, OutsidePixels::assumeColor(Qt::white)
+                               );
+        }
     }
 
     status.throwIfCancelled();
@@ -691,7 +786,9 @@ OutputGenerator::processWithoutDewarping(TaskStatus const& status, FilterData co
     QImage maybe_smoothed;
 
     // We only do smoothing if we are going to do binarization later.
-    if (!render_params.needBinarization() || suppress_smoothing) {
+    // A bilevel image, from rotateBilevelByShears(), needs no binarization.
+    if (!render_params.needBinarization() || suppress_smoothing
+            || maybe_normalized.format() == QImage::Format_Mono) {
         maybe_smoothed = maybe_normalized;
     } else {
         maybe_smoothed =  smoothToGrayscale(maybe_normalized, m_dpi);
@@ -865,6 +962,8 @@ OutputGenerator::processWithoutDewarping(TaskStatus const& status, FilterData co
 
     }
 
+    maybeDenoiseInPlace(maybe_normalized, status);
+
     if (!render_params.mixedOutput()) {
         // It's "Color / Grayscale" mode, as we handle B/W above.
         reserveBlackAndWhite(maybe_normalized);
@@ -1154,6 +1253,30 @@ OutputGenerator::detectPictures(
     return holes_filled;
 }
 
+void
+OutputGenerator::maybeDenoiseInPlace(QImage& image, TaskStatus const& status) const
+{
+    ColorGrayscaleOptions const& options = m_colorParams.colorGrayscaleOptions();
+    int const radius = options.denoiseRadius();
+    float const coef = (float) qBound(0.0, options.denoiseStrength(), 1.0);
+    if (radius <= 0 || coef <= 0.0f) {
+        return;
+    }
+
+    switch (options.denoiseFilter()) {
+    case DENOISE_NONE:
+        return;
+    case DENOISE_KNN:
+        knnDenoiserFilterInPlace(image, radius, coef);
+        break;
+    case DENOISE_WIENER:
+        wienerColorFilterInPlace(image, QSize(2 * radius + 1, 2 * radius + 1), coef);
+        break;
+    }
+
+    status.throwIfCancelled();
+}
+
 QImage
 OutputGenerator::smoothToGrayscale(QImage const& src, Dpi const& dpi)
 {
@@ -1526,12 +1649,13 @@ OutputGenerator::calcDominantBackgroundGrayLevel(QImage const& img)
     // In ColorPickupInteraction.cpp we have code for median color finding.
     // We can use that.
 
-    QImage const gray(toGrayscale(img));
-
-    BinaryImage mask(binarizeOtsu(gray));
-    mask.invert();
-
-    GrayscaleHistogram const hist(gray, mask);
+    // Only count the pixels binarizeOtsu() would leave white,
+    // that is the ones at or above the threshold.
+    GrayscaleHistogram hist(img);
+    int const threshold = BinaryThreshold::otsuThreshold(hist);
+    for (int i = 0; i < threshold && i < 256; ++i) {
+        hist[i] = 0;
+    }
 
     int integral_hist[256];
     integral_hist[0] = hist[0];
@@ -1629,12 +1753,13 @@ OutputGenerator::applyFillZonesInPlace(
         return;
     }
 
+    std::vector<PolygonRasterizer::ColoredPolygon> polys;
     for (Zone const& zone : zones) {
         QColor const color(zone.properties().locateOrDefault<FillColorProperty>()->color());
         BWColor const bw_color = qGray(color.rgb()) < 128 ? BLACK : WHITE;
         if (zone.type() == Zone::SplineType) {
             QPolygonF const poly(zone.spline().transformed(orig_to_output).toPolygon());
-            PolygonRasterizer::fill(img, bw_color, poly, Qt::WindingFill);
+            polys.push_back(PolygonRasterizer::ColoredPolygon(poly, bw_color));
         } else if (zone.type() == Zone::EllipseType) {
             const SerializableEllipse e = zone.ellipse().transformed(orig_to_output);
             QPainterPath path;
@@ -1644,9 +1769,11 @@ OutputGenerator::applyFillZonesInPlace(
             t.translate(-e.center().x(), -e.center().y());
             path.addEllipse(e.center(), e.rx(), e.ry());
             path = t.map(path);
-            PolygonRasterizer::fill(img, bw_color, path.toFillPolygon(), Qt::WindingFill);
+            polys.push_back(PolygonRasterizer::ColoredPolygon(path.toFillPolygon(), bw_color));
         }
     }
+
+    PolygonRasterizer::fill(img, polys, Qt::WindingFill);
 }
 
 /**
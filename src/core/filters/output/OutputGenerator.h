@@ -216,6 +216,8 @@ private:
         imageproc::BinaryImage* speckles_img,
         Dpi const& dpi, TaskStatus const& status, DebugImages* dbg) const;
 
+    void maybeDenoiseInPlace(QImage& image, TaskStatus const& status) const;
+
     static QImage smoothToGrayscale(QImage const& src, Dpi const& dpi);
 
     static void morphologicalSmoothInPlace(
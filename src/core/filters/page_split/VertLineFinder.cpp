@@ -30,6 +30,7 @@
 #include "imageproc/Constants.h"
 #include <QLineF>
 #include <QSizeF>
+#include <QRect>
 #include <QColor>
 #include <QImage>
 #include <QPainter>
@@ -147,15 +148,14 @@ VertLineFinder::findLines(
 
     int const x_limit = raster_lines.width() - margin;
     int const height = raster_lines.height();
-    uint8_t const* line = raster_lines.data();
-    int const stride = raster_lines.stride();
-    for (int y = 0; y < height; ++y, line += stride) {
-        for (int x = margin; x < x_limit; ++x) {
-            unsigned const val = line[x];
-            if (val > 1) {
-                line_detector.process(x, y, weight_table[val]);
-            }
-        }
+
+    // Gray levels of 0 and 1 are skipped.
+    weight_table[0] = 0;
+    weight_table[1] = 0;
+    if (x_limit > margin) {
+        line_detector.process(
+            raster_lines, QRect(margin, 0, x_limit - margin, height), weight_table
+        );
     }
 
     unsigned const min_quality = (unsigned)(height * line_thickness * 1.8) + 1;
@@ -290,14 +290,7 @@ ContentBoxFinder::findContentBox(
         rasterOp<RopOr<RopNot<RopSrc>, RopDst> >(tmp, content_blocks);
         MaxWhitespaceFinder ws_finder(tmp.release(), QSize(4, 4));
 
-        for (int i = 0; i < 10; ++i) {
-            QRect ws(ws_finder.next());
-            if (ws.isNull()) {
-                break;
-            }
-            if (ws.width() * ws.height() < area_threshold) {
-                break;
-            }
+        for (QRect const& ws : ws_finder.nextMany(10, area_threshold)) {
             content_blocks.fill(ws, WHITE);
         }
     }
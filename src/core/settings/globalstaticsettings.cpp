@@ -38,6 +38,7 @@ int  GlobalStaticSettings::m_currentStage = 0;
 int  GlobalStaticSettings::m_binrization_threshold_control_default = 0;
 bool GlobalStaticSettings::m_use_horizontal_predictor = false;
 bool GlobalStaticSettings::m_disable_bw_smoothing = false;
+bool GlobalStaticSettings::m_bw_rotate_by_shears = false;
 qreal GlobalStaticSettings::m_zone_editor_min_angle = 3.0;
 float GlobalStaticSettings::m_picture_detection_sensitivity = 100.;
 QColor GlobalStaticSettings::m_deskew_controls_color;
@@ -188,6 +189,7 @@ void GlobalStaticSettings::updateSettings()
     m_binrization_threshold_control_default = settings.value(_key_output_bin_threshold_default, _key_output_bin_threshold_default_def).toInt();
     m_use_horizontal_predictor = settings.value(_key_tiff_compr_horiz_pred, _key_tiff_compr_horiz_pred_def).toBool();
     m_disable_bw_smoothing = settings.value(_key_mode_bw_disable_smoothing, _key_mode_bw_disable_smoothing_def).toBool();
+    m_bw_rotate_by_shears = settings.value(_key_mode_bw_rotate_by_shears, _key_mode_bw_rotate_by_shears_def).toBool();
     m_zone_editor_min_angle = settings.value(_key_zone_editor_min_angle, _key_zone_editor_min_angle_def).toReal();
     m_picture_detection_sensitivity = settings.value(_key_picture_zones_layer_sensitivity, _key_picture_zones_layer_sensitivity_def).toInt();
     m_deskew_controls_color.setNamedColor(settings.value(_key_deskew_controls_color, _key_deskew_controls_color_def).toString());
@@ -78,6 +78,7 @@ public:
     static int m_binrization_threshold_control_default;
     static bool m_use_horizontal_predictor;
     static bool m_disable_bw_smoothing;
+    static bool m_bw_rotate_by_shears;
     static qreal m_zone_editor_min_angle;
     static float m_picture_detection_sensitivity;
     static QColor m_deskew_controls_color;
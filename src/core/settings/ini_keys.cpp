@@ -259,6 +259,8 @@ const bool _key_tiff_compr_show_all_def = false;
 
 const char* _key_mode_bw_disable_smoothing = "mode_bw/disable_smoothing";
 const bool _key_mode_bw_disable_smoothing_def = false;
+const char* _key_mode_bw_rotate_by_shears = "mode_bw/rotate_bilevel_by_shears";
+const bool _key_mode_bw_rotate_by_shears_def = false;
 const char* _key_zone_editor_min_angle = "zone_editor/min_angle";
 const float _key_zone_editor_min_angle_def = 3.;
 const char* _key_picture_zones_layer_sensitivity = "picture_zones_layer/sensitivity";
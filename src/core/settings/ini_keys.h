@@ -267,6 +267,8 @@ extern const bool _key_tiff_compr_show_all_def;
 
 extern const char* _key_mode_bw_disable_smoothing;
 extern const bool _key_mode_bw_disable_smoothing_def;
+extern const char* _key_mode_bw_rotate_by_shears;
+extern const bool _key_mode_bw_rotate_by_shears_def;
 extern const char* _key_zone_editor_min_angle;
 extern const float _key_zone_editor_min_angle_def;
 extern const char* _key_picture_zones_layer_sensitivity;
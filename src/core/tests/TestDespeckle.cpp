@@ -0,0 +1,486 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C) 2007-2008  Joseph Artsimovich <joseph_a@mail.ru>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "Despeckle.h"
+#include "Dpi.h"
+#include "TaskStatus.h"
+#include "imageproc/BinaryImage.h"
+#include "imageproc/BWColor.h"
+#include "imageproc/ConnectivityMap.h"
+#include "imageproc/RasterOp.h"
+#include <QRect>
+#include <QElapsedTimer>
+#include <QtGlobal>
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace Tests
+{
+
+using namespace imageproc;
+
+namespace
+{
+
+class NeverCancelled : public TaskStatus
+{
+public:
+    virtual void cancel() {}
+
+    virtual bool isCancelled() const
+    {
+        return false;
+    }
+
+    virtual void throwIfCancelled() const {}
+};
+
+bool isBlack(BinaryImage const& img, int x, int y)
+{
+    uint32_t const word = img.data()[y * img.wordsPerLine() + x / 32];
+    return (word >> (31 - x % 32)) & 1;
+}
+
+/**
+ * A page with lines of glyph-like outlines, dots and random specks.
+ */
+BinaryImage makePage(int const dpi)
+{
+    int const scale = dpi / 100;
+    BinaryImage page(dpi * 85 / 10, dpi * 11, WHITE);
+
+    for (int y = 50 * scale; y < page.height() - 50 * scale; y += 18 * scale) {
+        for (int x = 40 * scale; x < page.width() - 50 * scale;) {
+            int const w = (3 + rand() % 5) * scale;
+            int const h = (6 + rand() % 4) * scale;
+            QRect const glyph(x, y + 10 * scale - h, w, h);
+            page.fill(glyph, BLACK);
+            page.fill(glyph.adjusted(scale, scale, -scale, -scale), WHITE);
+            if (rand() % 6 == 0) {
+                page.fill(QRect(x, y - 2 * scale, scale, scale), BLACK);
+            }
+            x += w + scale + (rand() % 8 == 0 ? 4 * scale : 0);
+        }
+    }
+
+    int const num_specks = page.width() * page.height() / 400;
+    for (int i = 0; i < num_specks; ++i) {
+        int const size = 1 + rand() % 3;
+        page.fill(
+            QRect(rand() % (page.width() - size), rand() % (page.height() - size), size, size),
+            BLACK
+        );
+    }
+
+    return page;
+}
+
+/**
+ * The vector from a pixel to the nearest black pixel.
+ * The vertical component counts twice, as in Despeckle.cpp.
+ */
+struct RefDistance {
+    int x;
+    int y;
+
+    uint32_t sqdist() const
+    {
+        return uint32_t(x * x + 4 * y * y);
+    }
+
+    bool operator==(RefDistance const& other) const
+    {
+        return x == other.x && y == other.y;
+    }
+};
+
+RefDistance const REF_ZERO = { 0, 0 };
+RefDistance const REF_SPECIAL = { 32767, 32767 };
+
+RefDistance refReset(int const x)
+{
+    RefDistance const dist = { 32767 - x, 0 };
+    return dist;
+}
+
+/**
+ * Distances and labels of a connectivity map with its padding.
+ */
+struct RefPlanes {
+    std::vector<RefDistance> dist;
+    std::vector<uint32_t> labels;
+    int width;
+    int height;
+};
+
+/**
+ * Gives pixel \p idx the distance of pixel \p from, moved by (dx, dy),
+ * if that's closer.  Special distances neither change nor spread.
+ */
+void refRelax(RefPlanes& p, int const idx, int const from, int const dx, int const dy)
+{
+    if (p.dist[idx] == REF_SPECIAL || p.dist[from] == REF_SPECIAL) {
+        return;
+    }
+    RefDistance dist(p.dist[from]);
+    dist.x += dx;
+    dist.y += dy;
+    if (dist.sqdist() < p.dist[idx].sqdist()) {
+        p.dist[idx] = dist;
+        p.labels[idx] = p.labels[from];
+    }
+}
+
+/**
+ * A sequential top to bottom sweep over lines [down_first, down_last]
+ * followed by a bottom to top one over lines [up_last, up_first].
+ * Unless \p special is set, the top to bottom sweep overwrites every pixel
+ * that is not black with its left or top neighbour, preferring the top one.
+ */
+void refSweeps(
+    RefPlanes& p, int const down_first, int const down_last,
+    int const up_first, int const up_last, bool const special)
+{
+    int const w = p.width;
+    for (int y = down_first; y <= down_last; ++y) {
+        for (int x = 1; x < w - 1; ++x) {
+            int const i = y * w + x;
+            if (special) {
+                refRelax(p, i, i - 1, -1, 0);
+                refRelax(p, i, i - w, 0, -1);
+            } else if (!(p.dist[i] == REF_ZERO)) {
+                RefDistance left(p.dist[i - 1]);
+                --left.x;
+                RefDistance top(p.dist[i - w]);
+                --top.y;
+                bool const from_left = left.sqdist() < top.sqdist();
+                p.dist[i] = from_left ? left : top;
+                p.labels[i] = p.labels[from_left ? i - 1 : i - w];
+            }
+        }
+        for (int x = w - 2; x >= 1; --x) {
+            refRelax(p, y * w + x, y * w + x + 1, 1, 0);
+        }
+    }
+    for (int y = up_first; y >= up_last; --y) {
+        for (int x = w - 2; x >= 1; --x) {
+            refRelax(p, y * w + x, y * w + x + 1, 1, 0);
+            refRelax(p, y * w + x, y * w + x + w, 0, 1);
+        }
+        for (int x = 1; x < w - 1; ++x) {
+            refRelax(p, y * w + x, y * w + x - 1, -1, 0);
+        }
+    }
+}
+
+typedef std::map<std::pair<uint32_t, uint32_t>, uint32_t> RefConnections;
+
+/**
+ * Minimum distances between components of neighbouring Voronoi regions.
+ * Like in Despeckle.cpp, the offset between the two neighbouring pixels
+ * themselves isn't taken into account.
+ */
+void refConnections(RefPlanes const& p, RefConnections& conns)
+{
+    int const w = p.width;
+    int const offsets[] = { -w, -1, 1, w };
+    for (int y = 1; y < p.height - 1; ++y) {
+        for (int x = 1; x < w - 1; ++x) {
+            int const i = y * w + x;
+            uint32_t const label = p.labels[i];
+            for (int const offset : offsets) {
+                uint32_t const nbh_label = p.labels[i + offset];
+                if (nbh_label == 0 || nbh_label == label) {
+                    continue;
+                }
+                uint32_t const dx = p.dist[i].x - p.dist[i + offset].x;
+                uint32_t const dy = p.dist[i].y - p.dist[i + offset].y;
+                uint32_t const sqdist = dx * dx + dy * dy;
+                std::pair<uint32_t, uint32_t> const key(
+                    std::min(label, nbh_label), std::max(label, nbh_label)
+                );
+                RefConnections::iterator const it(conns.find(key));
+                if (it == conns.end()) {
+                    conns[key] = sqdist;
+                } else {
+                    it->second = std::min(it->second, sqdist);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * A straightforward copy of single level despeckling as it was before
+ * levels shared their analysis: big components are unified by relabelling
+ * pixels, and both Voronoi diagrams are built by sequential sweeps.
+ */
+BinaryImage referenceDespeckle(BinaryImage const& src, Dpi const& dpi, Despeckle::Level const level)
+{
+    double const dpi_factor = std::min(dpi.horizontal(), dpi.vertical()) / 300.0;
+    static double const parent_weights[] = { 0.125, 0.175, 0.225 };
+    static uint32_t const pixels_to_sqdists[] = { 100, 42, 12 };
+    static int const big_thresholds[] = { 7, 12, 17 };
+    double const min_relative_parent_weight = parent_weights[level] * dpi_factor;
+    uint32_t const pixels_to_sqdist = pixels_to_sqdists[level];
+    int const big_object_threshold = qRound(big_thresholds[level] * dpi_factor);
+
+    ConnectivityMap const cmap(src, CONN8);
+    if (cmap.maxLabel() == 0) {
+        return src;
+    }
+
+    RefPlanes p;
+    p.width = src.width() + 2;
+    p.height = src.height() + 2;
+    p.labels.assign(cmap.paddedData(), cmap.paddedData() + p.width * p.height);
+
+    // Pixel counts and bounding boxes.
+    uint32_t const num_labels = cmap.maxLabel() + 1;
+    std::vector<uint32_t> num_pixels(num_labels, 0);
+    std::vector<QRect> boxes(num_labels);
+    for (int y = 0; y < src.height(); ++y) {
+        for (int x = 0; x < src.width(); ++x) {
+            uint32_t const label = p.labels[(y + 1) * p.width + x + 1];
+            ++num_pixels[label];
+            boxes[label] |= QRect(x, y, 1, 1);
+        }
+    }
+
+    // Unify big components into one.
+    std::vector<uint32_t> remapping_table(num_labels, 0);
+    std::vector<uint32_t> counts(1, 0);
+    uint32_t big = 0;
+    for (uint32_t label = 1; label < num_labels; ++label) {
+        if (boxes[label].width() < big_object_threshold && boxes[label].height() < big_object_threshold) {
+            remapping_table[label] = counts.size();
+            counts.push_back(num_pixels[label]);
+        } else {
+            if (big == 0) {
+                big = counts.size();
+                counts.push_back(src.width() * src.height());
+            }
+            remapping_table[label] = big;
+        }
+    }
+    for (uint32_t& label : p.labels) {
+        label = remapping_table[label];
+    }
+
+    p.dist.resize(p.labels.size());
+    for (int y = 0; y < p.height; ++y) {
+        for (int x = 0; x < p.width; ++x) {
+            int const i = y * p.width + x;
+            p.dist[i] = (y > 0 && p.labels[i]) ? REF_ZERO : refReset(x);
+        }
+    }
+    refSweeps(p, 1, p.height - 1, p.height - 2, 1, false);
+
+    RefConnections conns;
+    refConnections(p, conns);
+
+    // Bit 0: anchored to big, bit 1: anchored to small.
+    std::vector<int> tags(counts.size(), 0);
+    for (RefConnections::value_type const& conn : conns) {
+        uint32_t const labels[] = { conn.first.first, conn.first.second };
+        for (int i = 0; i < 2; ++i) {
+            uint32_t const source = labels[i];
+            uint32_t const target = labels[1 - i];
+            if ((tags[source] & 1) || conn.second > counts[source] * pixels_to_sqdist) {
+                continue;
+            }
+            tags[source] |= counts[target] >= min_relative_parent_weight * counts[source] ? 1 : 2;
+        }
+    }
+    tags[big] |= 1;
+
+    if (std::find(tags.begin(), tags.end(), 2) != tags.end()) {
+        // The second chance for components only anchored to small ones.
+        for (int y = 1; y < p.height - 1; ++y) {
+            for (int x = 1; x < p.width - 1; ++x) {
+                int const i = y * p.width + x;
+                if (tags[p.labels[i]] != 2) {
+                    p.dist[i] = p.dist[i] == REF_ZERO ? REF_SPECIAL : refReset(x);
+                }
+            }
+        }
+        // The bottom to top sweep did start a line higher and went
+        // through the top padding line.
+        refSweeps(p, 1, p.height - 2, p.height - 3, 0, true);
+        refConnections(p, conns);
+    }
+
+    // Keep whatever may be attached to the unified big component,
+    // directly or through other components.
+    std::vector<std::vector<uint32_t> > sources(counts.size());
+    for (RefConnections::value_type const& conn : conns) {
+        uint32_t const labels[] = { conn.first.first, conn.first.second };
+        for (int i = 0; i < 2; ++i) {
+            uint32_t const comp = labels[i];
+            uint32_t const target = labels[1 - i];
+            if (conn.second <= counts[comp] * pixels_to_sqdist
+                    && counts[target] >= counts[comp] * min_relative_parent_weight) {
+                sources[target].push_back(comp);
+            }
+        }
+    }
+    std::vector<char> keep(counts.size(), 0);
+    std::vector<uint32_t> stack(1, big);
+    while (!stack.empty()) {
+        uint32_t const label = stack.back();
+        stack.pop_back();
+        if (!keep[label]) {
+            keep[label] = 1;
+            stack.insert(stack.end(), sources[label].begin(), sources[label].end());
+        }
+    }
+
+    BinaryImage dst(src);
+    for (int y = 0; y < src.height(); ++y) {
+        for (int x = 0; x < src.width(); ++x) {
+            if (isBlack(src, x, y) && !keep[p.labels[(y + 1) * p.width + x + 1]]) {
+                dst.fill(QRect(x, y, 1, 1), WHITE);
+            }
+        }
+    }
+    return dst;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(DespeckleTestSuite);
+
+BOOST_AUTO_TEST_CASE(test_white_image)
+{
+    BinaryImage const img(300, 200, WHITE);
+    BinaryImage const res(Despeckle::despeckle(img, Dpi(300, 300), Despeckle::NORMAL, NeverCancelled()));
+    BOOST_CHECK(res == img);
+}
+
+BOOST_AUTO_TEST_CASE(test_speckles_and_dots)
+{
+    // A tall image, so that the Voronoi diagram is built in several bands.
+    BinaryImage img(400, 1500, WHITE);
+
+    // Big objects and the dots of "i" letters above them.
+    int const tops[] = { 100, 500, 760, 1300 };
+    for (int const top : tops) {
+        img.fill(QRect(100, top, 4, 40), BLACK);
+        img.fill(QRect(100, top - 8, 4, 4), BLACK);
+    }
+
+    // Isolated specks.
+    img.fill(QRect(300, 300, 1, 1), BLACK);
+    img.fill(QRect(320, 1000, 2, 2), BLACK);
+
+    Despeckle::Level const levels[] = {
+        Despeckle::CAUTIOUS, Despeckle::NORMAL, Despeckle::AGGRESSIVE
+    };
+    for (Despeckle::Level const level : levels) {
+        BinaryImage const res(Despeckle::despeckle(img, Dpi(300, 300), level, NeverCancelled()));
+        for (int const top : tops) {
+            BOOST_CHECK(isBlack(res, 101, top + 20));
+            BOOST_CHECK(isBlack(res, 101, top - 7));
+        }
+        BOOST_CHECK(!isBlack(res, 300, 300));
+        BOOST_CHECK(!isBlack(res, 320, 1000));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_in_place)
+{
+    BinaryImage const page(makePage(100));
+    BinaryImage img(page);
+    Despeckle::despeckleInPlace(img, Dpi(100, 100), Despeckle::NORMAL, NeverCancelled());
+    BOOST_CHECK(img == Despeckle::despeckle(page, Dpi(100, 100), Despeckle::NORMAL, NeverCancelled()));
+    BOOST_CHECK(img.countBlackPixels() < page.countBlackPixels());
+}
+
+BOOST_AUTO_TEST_CASE(test_all_levels)
+{
+    BinaryImage const page(makePage(100));
+    Despeckle::MultiLevelSpeckles const all_levels(
+        Despeckle::findSpeckles(page, Dpi(100, 100), NeverCancelled())
+    );
+    for (int level = Despeckle::CAUTIOUS; level <= Despeckle::AGGRESSIVE; ++level) {
+        BinaryImage const res(
+            Despeckle::despeckle(page, Dpi(100, 100), Despeckle::Level(level), NeverCancelled())
+        );
+        BinaryImage speckles(page);
+        rasterOp<RopSubtract<RopDst, RopSrc> >(speckles, res);
+        BOOST_CHECK(all_levels.speckles(Despeckle::Level(level)) == speckles);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_matches_reference)
+{
+    int const dpis[] = { 100, 200 };
+    for (int const dpi : dpis) {
+        BinaryImage const page(makePage(dpi));
+        Despeckle::MultiLevelSpeckles const all_levels(
+            Despeckle::findSpeckles(page, Dpi(dpi, dpi), NeverCancelled())
+        );
+        for (int level = Despeckle::CAUTIOUS; level <= Despeckle::AGGRESSIVE; ++level) {
+            BinaryImage const ref(referenceDespeckle(page, Dpi(dpi, dpi), Despeckle::Level(level)));
+            BOOST_CHECK(
+                Despeckle::despeckle(page, Dpi(dpi, dpi), Despeckle::Level(level), NeverCancelled()) == ref
+            );
+
+            BinaryImage speckles(page);
+            rasterOp<RopSubtract<RopDst, RopSrc> >(speckles, ref);
+            BOOST_CHECK(all_levels.speckles(Despeckle::Level(level)) == speckles);
+        }
+    }
+}
+
+/**
+ * Only runs when the SCANTAILOR_BENCHMARK environment variable is set.
+ */
+BOOST_AUTO_TEST_CASE(benchmark_levels)
+{
+    if (!getenv("SCANTAILOR_BENCHMARK")) {
+        return;
+    }
+
+    int const dpis[] = { 300, 600 };
+    char const* const level_names[] = { "cautious", "normal", "aggressive" };
+    for (int const dpi : dpis) {
+        BinaryImage const page(makePage(dpi));
+        for (int level = Despeckle::CAUTIOUS; level <= Despeckle::AGGRESSIVE; ++level) {
+            QElapsedTimer timer;
+            timer.start();
+            BinaryImage const res(
+                Despeckle::despeckle(page, Dpi(dpi, dpi), Despeckle::Level(level), NeverCancelled())
+            );
+            BOOST_TEST_MESSAGE(
+                "Despeckle " << level_names[level] << " at " << dpi << " dpi: "
+                << timer.elapsed() << " ms, " << page.countBlackPixels() - res.countBlackPixels()
+                << " pixels removed"
+            );
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace Tests
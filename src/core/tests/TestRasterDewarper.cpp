@@ -0,0 +1,331 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C) 2015  Joseph Artsimovich <joseph.artsimovich@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "dewarping/RasterDewarper.h"
+#include "dewarping/CylindricalSurfaceDewarper.h"
+#include "dewarping/HomographicTransform.h"
+#include "dewarping/STEX_VecNT.h"
+#include "dewarping/FovParams.h"
+#include "dewarping/FrameParams.h"
+#include "dewarping/BendParams.h"
+#include "imageproc/ColorMixer.h"
+#include "imageproc/GrayImage.h"
+#include <QImage>
+#include <QColor>
+#include <QPointF>
+#include <QRectF>
+#include <QSize>
+#include <QSizeF>
+#include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace Tests
+{
+
+using namespace dewarping;
+using namespace imageproc;
+
+namespace
+{
+
+/**
+ * Area mapping of a single destination pixel, given the four corners of its
+ * source quadrilateral.  Every source pixel is weighted by its overlap with
+ * the quadrilateral's bounding box, in 1/32 pixel units.
+ */
+template<typename ColorMixer, typename PixelType>
+PixelType referencePixel(
+    PixelType const* const src_data, QSize const src_size, int const src_stride,
+    PixelType const bg_color, Vec2f const& top_left, Vec2f const& top_right,
+    Vec2f const& bottom_left, Vec2f const& bottom_right,
+    float const f_src32_min_mapping_width, float const f_src32_min_mapping_height)
+{
+    int const sw = src_size.width();
+    int const sh = src_size.height();
+
+    // Mid-points of the edges, in 1/32 pixel units.
+    Vec2f const quad[4] = {
+        16.0f * (top_left + top_right),
+        16.0f * (top_right + bottom_right),
+        16.0f * (bottom_right + bottom_left),
+        16.0f * (top_left + bottom_left)
+    };
+
+    float f_left = quad[0][0];
+    float f_right = f_left;
+    float f_top = quad[0][1];
+    float f_bottom = f_top;
+    for (int i = 1; i < 4; ++i) {
+        f_left = std::min(f_left, quad[i][0]);
+        f_right = std::max(f_right, quad[i][0]);
+        f_top = std::min(f_top, quad[i][1]);
+        f_bottom = std::max(f_bottom, quad[i][1]);
+    }
+
+    if (f_right - f_left < f_src32_min_mapping_width) {
+        float const midpoint = 0.5f * (f_left + f_right);
+        f_left = midpoint - f_src32_min_mapping_width * 0.5f;
+        f_right = midpoint + f_src32_min_mapping_width * 0.5f;
+    }
+    if (f_bottom - f_top < f_src32_min_mapping_height) {
+        float const midpoint = 0.5f * (f_top + f_bottom);
+        f_top = midpoint - f_src32_min_mapping_height * 0.5f;
+        f_bottom = midpoint + f_src32_min_mapping_height * 0.5f;
+    }
+
+    if (f_top < -32.0f * 10000.0f || f_left < -32.0f * 10000.0f
+            || f_bottom > 32.0f * (float(sh) + 10000.f)
+            || f_right > 32.0f * (float(sw) + 10000.f)) {
+        return bg_color;
+    }
+
+    int const left = (int)floor(f_left);
+    int const right = (int)ceil(f_right);
+    int const top = (int)floor(f_top);
+    int const bottom = (int)ceil(f_bottom);
+    if (((bottom - 1) >> 5) < 0 || ((right - 1) >> 5) < 0 || (left >> 5) >= sw || (top >> 5) >= sh) {
+        return bg_color;
+    }
+
+    ColorMixer mixer;
+    unsigned src_area = 0;
+    for (int sy = std::max(0, top >> 5); sy <= std::min(sh - 1, (bottom - 1) >> 5); ++sy) {
+        int const h = std::min(bottom, (sy + 1) * 32) - std::max(top, sy * 32);
+        for (int sx = std::max(0, left >> 5); sx <= std::min(sw - 1, (right - 1) >> 5); ++sx) {
+            int const w = std::min(right, (sx + 1) * 32) - std::max(left, sx * 32);
+            mixer.add(src_data[sy * src_stride + sx], unsigned(w * h));
+            src_area += w * h;
+        }
+    }
+    if (src_area == 0) {
+        return bg_color;
+    }
+
+    unsigned const total_area = (right - left) * (bottom - top);
+    mixer.add(bg_color, total_area - src_area);
+    return mixer.mix(total_area);
+}
+
+/**
+ * The way RasterDewarper used to work: generatrices mapped left to right
+ * with a single state, and each grid column computed from its generatrix
+ * homography just before it's used.
+ */
+template<typename ColorMixer, typename PixelType>
+void referenceDewarp(
+    PixelType const* const src_data, QSize const src_size, int const src_stride,
+    PixelType* const dst_data, QSize const dst_size, int const dst_stride,
+    CylindricalSurfaceDewarper const& distortion_model,
+    QRectF const& model_domain, PixelType const bg_color,
+    QSizeF const& min_mapping_area)
+{
+    int const dst_width = dst_size.width();
+    int const dst_height = dst_size.height();
+
+    CylindricalSurfaceDewarper::State state;
+
+    double const model_domain_left = model_domain.left();
+    double const model_x_scale = 1.f / model_domain.width();
+
+    float const model_domain_top = model_domain.top();
+    float const model_domain_height = model_domain.height();
+    float const model_y_scale = 1.f / model_domain_height;
+
+    float const f_src32_min_mapping_width = min_mapping_area.width() * 32.f;
+    float const f_src32_min_mapping_height = min_mapping_area.height() * 32.f;
+
+    std::vector<Vec2f> prev_grid_column(dst_height + 1);
+    std::vector<Vec2f> next_grid_column(dst_height + 1);
+
+    for (int dst_x = 0; dst_x <= dst_width; ++dst_x) {
+        double const model_x = (dst_x - model_domain_left) * model_x_scale;
+        CylindricalSurfaceDewarper::Generatrix const generatrix(
+            distortion_model.mapGeneratrix(model_x, state)
+        );
+
+        HomographicTransform<1, float> const homog(generatrix.pln2img.mat().cast<float>());
+        Vec2f const origin(generatrix.imgLine.p1());
+        Vec2f const vec(generatrix.imgLine.p2() - generatrix.imgLine.p1());
+        for (int dst_y = 0; dst_y <= dst_height; ++dst_y) {
+            float const model_y = (float(dst_y) - model_domain_top) * model_y_scale;
+            next_grid_column[dst_y] = origin + vec * homog(model_y);
+        }
+
+        if (dst_x != 0) {
+            for (int dst_y = 0; dst_y < dst_height; ++dst_y) {
+                dst_data[dst_y * dst_stride + dst_x - 1] = referencePixel<ColorMixer, PixelType>(
+                    src_data, src_size, src_stride, bg_color,
+                    prev_grid_column[dst_y], next_grid_column[dst_y],
+                    prev_grid_column[dst_y + 1], next_grid_column[dst_y + 1],
+                    f_src32_min_mapping_width, f_src32_min_mapping_height
+                );
+            }
+        }
+
+        prev_grid_column.swap(next_grid_column);
+    }
+}
+
+/**
+ * A curved quadrilateral covering most of a \p width x \p height image.
+ */
+CylindricalSurfaceDewarper curvedPage(int const width, int const height)
+{
+    std::vector<QPointF> top_curve;
+    std::vector<QPointF> bottom_curve;
+    for (int i = 0; i <= 16; ++i) {
+        double const x = width * (0.1 + 0.8 * i / 16.0);
+        double const bulge = sin(M_PI * i / 16.0);
+        top_curve.push_back(QPointF(x, height * (0.15 + 0.1 * bulge)));
+        bottom_curve.push_back(QPointF(x, height * (0.85 + 0.05 * bulge)));
+    }
+    return CylindricalSurfaceDewarper(
+        top_curve, bottom_curve, FovParams(), FrameParams(), BendParams()
+    );
+}
+
+GrayImage noisyGrayImage(int const width, int const height)
+{
+    GrayImage img(QSize(width, height));
+    uint8_t* line = img.data();
+    for (int y = 0; y < height; ++y, line += img.stride()) {
+        for (int x = 0; x < width; ++x) {
+            line[x] = (uint8_t) (((x / 7 + y / 5) & 1) ? 200 : 40) + rand() % 50;
+        }
+    }
+    return img;
+}
+
+QImage noisyRgbImage(int const width, int const height)
+{
+    QImage img(width, height, QImage::Format_RGB32);
+    for (int y = 0; y < height; ++y) {
+        uint32_t* const line = (uint32_t*)img.scanLine(y);
+        for (int x = 0; x < width; ++x) {
+            line[x] = 0xff000000u | ((x * 3 + rand() % 40) << 16)
+                      | ((y * 2 + rand() % 40) << 8) | (rand() % 256);
+        }
+    }
+    return img;
+}
+
+QImage dewarpWithThreads(
+    QImage const& src, QSize const& dst_size, CylindricalSurfaceDewarper const& dewarper,
+    QRectF const& model_domain, QColor const& bg_color,
+    QSizeF const& min_mapping_area, int const num_threads)
+{
+#ifdef _OPENMP
+    int const max_threads = omp_get_max_threads();
+    omp_set_num_threads(num_threads);
+#endif
+    QImage const result(
+        RasterDewarper::dewarp(src, dst_size, dewarper, model_domain, bg_color, min_mapping_area)
+    );
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
+    return result;
+}
+
+struct DewarpSetup {
+    QSize dstSize;
+    QRectF modelDomain;
+    QSizeF minMappingArea;
+};
+
+/**
+ * Upscaling with a margin around the page, so that some destination
+ * pixels map outside of the source image, and downscaling, so that every
+ * destination pixel mixes many source ones.  Neither width is a multiple
+ * of the column group size.
+ */
+DewarpSetup const setups[] = {
+    { QSize(263, 187), QRectF(-7.5, -9.0, 250.0, 170.0), QSizeF(0.9, 0.9) },
+    { QSize(45, 33), QRectF(0.0, 0.0, 45.0, 33.0), QSizeF(0.0, 0.0) }
+};
+
+int const thread_counts[] = { 1, 3 };
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(RasterDewarperTestSuite);
+
+BOOST_AUTO_TEST_CASE(test_gray_matches_reference)
+{
+    GrayImage const src(noisyGrayImage(211, 157));
+    CylindricalSurfaceDewarper const dewarper(curvedPage(src.width(), src.height()));
+    QColor const bg_color(0xff, 0xff, 0xff);
+
+    for (DewarpSetup const& setup : setups) {
+        GrayImage reference(setup.dstSize);
+        reference.fill(0xff);
+        referenceDewarp<GrayColorMixer<uint32_t>, uint8_t>(
+            src.data(), src.size(), src.stride(),
+            reference.data(), reference.size(), reference.stride(),
+            dewarper, setup.modelDomain, 0xff, setup.minMappingArea
+        );
+
+        for (int const num_threads : thread_counts) {
+            GrayImage const dst(
+                dewarpWithThreads(
+                    src.toQImage(), setup.dstSize, dewarper, setup.modelDomain,
+                    bg_color, setup.minMappingArea, num_threads
+                )
+            );
+            BOOST_CHECK(dst == reference);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_rgb_matches_reference)
+{
+    QImage const src(noisyRgbImage(211, 157));
+    CylindricalSurfaceDewarper const dewarper(curvedPage(src.width(), src.height()));
+    QColor const bg_color(10, 200, 30);
+
+    for (DewarpSetup const& setup : setups) {
+        QImage reference(setup.dstSize, QImage::Format_RGB32);
+        reference.fill(bg_color.rgb());
+        referenceDewarp<RgbColorMixer<uint32_t>, uint32_t>(
+            (uint32_t const*)src.bits(), src.size(), src.bytesPerLine() / 4,
+            (uint32_t*)reference.bits(), reference.size(), reference.bytesPerLine() / 4,
+            dewarper, setup.modelDomain, bg_color.rgb(), setup.minMappingArea
+        );
+
+        for (int const num_threads : thread_counts) {
+            QImage const dst(
+                dewarpWithThreads(
+                    src, setup.dstSize, dewarper, setup.modelDomain,
+                    bg_color, setup.minMappingArea, num_threads
+                )
+            );
+            BOOST_CHECK(dst == reference);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace Tests
@@ -0,0 +1,200 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C) 2007-2008  Joseph Artsimovich <joseph_a@mail.ru>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ScratchArena.h"
+#include "Grid.h"
+#include <boost/test/unit_test.hpp>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+namespace Tests
+{
+
+BOOST_AUTO_TEST_SUITE(ScratchArenaTestSuite);
+
+BOOST_AUTO_TEST_CASE(test_size_classes)
+{
+    BOOST_CHECK_EQUAL(ScratchArena::sizeClass(0), size_t(ScratchArena::MIN_BLOCK_SIZE));
+    BOOST_CHECK_EQUAL(ScratchArena::sizeClass(4096), size_t(4096));
+    BOOST_CHECK_EQUAL(ScratchArena::sizeClass(4097), size_t(5120));
+    BOOST_CHECK_EQUAL(ScratchArena::sizeClass(8192), size_t(8192));
+    BOOST_CHECK_EQUAL(ScratchArena::sizeClass(1000000), size_t(1048576));
+
+    for (size_t bytes = 4000; bytes < 100000000; bytes = bytes * 5 / 3) {
+        size_t const size = ScratchArena::sizeClass(bytes);
+        BOOST_CHECK(size >= bytes);
+        BOOST_CHECK(size - bytes <= bytes / 4);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_reuse)
+{
+    ScratchArena::local().trim();
+    ScratchArena::Stats const before(ScratchArena::stats());
+
+    uint32_t const* first = 0;
+    {
+        ScratchBuffer<uint32_t> buffer(100000);
+        first = buffer.data();
+        BOOST_CHECK_EQUAL(uintptr_t(first) % ScratchArena::ALIGNMENT, uintptr_t(0));
+        buffer[99999] = 1;
+    }
+    BOOST_CHECK(ScratchArena::local().cachedBytes() >= 100000 * sizeof(uint32_t));
+    {
+        // Same size class, so the same block.
+        ScratchBuffer<float> buffer(99000);
+        BOOST_CHECK(static_cast<void const*>(buffer.data()) == first);
+    }
+
+    ScratchArena::Stats const after(ScratchArena::stats());
+    size_t const block_size = ScratchArena::sizeClass(100000 * sizeof(uint32_t));
+    BOOST_CHECK_EQUAL(after.blocksAllocated - before.blocksAllocated, uint64_t(1));
+    BOOST_CHECK_EQUAL(after.blocksReused - before.blocksReused, uint64_t(1));
+    BOOST_CHECK_EQUAL(after.bytesAllocated - before.bytesAllocated, uint64_t(block_size));
+    BOOST_CHECK_EQUAL(after.bytesReused - before.bytesReused, uint64_t(block_size));
+
+    ScratchArena::local().trim();
+    BOOST_CHECK_EQUAL(ScratchArena::local().cachedBytes(), size_t(0));
+}
+
+BOOST_AUTO_TEST_CASE(test_containers)
+{
+    ScratchArena::local().trim();
+    ScratchArena::Stats const before(ScratchArena::stats());
+
+    float const* first = 0;
+    {
+        Grid<float> grid(300, 200, 1);
+        first = grid.paddedData();
+        grid.initPadding(0.0f);
+        grid.initInterior(1.0f);
+
+        Grid<float> copy(grid);
+        BOOST_CHECK_EQUAL(copy(299, 199), 1.0f);
+        BOOST_CHECK_EQUAL(copy(-1, -1), 0.0f);
+
+        Grid<float> moved(std::move(copy));
+        BOOST_CHECK(copy.isNull());
+        BOOST_CHECK_EQUAL(moved(150, 100), 1.0f);
+    }
+    {
+        // Temporaries of similar sizes get the same blocks.
+        std::vector<uint32_t, ScratchAllocator<uint32_t> > labels(302 * 202, 0);
+        BOOST_CHECK(static_cast<void const*>(&labels[0]) == first);
+        labels.resize(302 * 202 * 2);
+        BOOST_CHECK_EQUAL(labels[0], uint32_t(0));
+    }
+
+    ScratchArena::Stats const after(ScratchArena::stats());
+    BOOST_CHECK_EQUAL(after.blocksAllocated - before.blocksAllocated, uint64_t(3));
+    BOOST_CHECK_EQUAL(after.blocksReused - before.blocksReused, uint64_t(1));
+
+    ScratchArena::local().trim();
+}
+
+BOOST_AUTO_TEST_CASE(test_limits)
+{
+    ScratchArena::local().trim();
+
+    {
+        // Too big to be cached.
+        ScratchBuffer<char> buffer(size_t(ScratchArena::MAX_CACHED_BYTES) + 1);
+    }
+    BOOST_CHECK_EQUAL(ScratchArena::local().cachedBytes(), size_t(0));
+
+    for (int i = 0; i < ScratchArena::MAX_CACHED_BLOCKS * 2; ++i) {
+        ScratchBuffer<char> buffer(size_t(4096) << (i % 12));
+    }
+    BOOST_CHECK(ScratchArena::local().cachedBytes() <= size_t(ScratchArena::MAX_CACHED_BYTES));
+
+    ScratchArena::local().trim();
+}
+
+BOOST_AUTO_TEST_CASE(test_trim_all)
+{
+    ScratchArena::local().trim();
+    size_t const total_before = ScratchArena::totalCachedBytes();
+
+    {
+        ScratchBuffer<char> buffer(1 << 20);
+    }
+    BOOST_CHECK_EQUAL(
+        ScratchArena::totalCachedBytes() - total_before, ScratchArena::local().cachedBytes()
+    );
+
+    ScratchArena::trimAll();
+    BOOST_CHECK_EQUAL(ScratchArena::local().cachedBytes(), size_t(0));
+    BOOST_CHECK_EQUAL(ScratchArena::totalCachedBytes(), total_before);
+}
+
+BOOST_AUTO_TEST_CASE(test_total_limit)
+{
+    ScratchArena::local().trim();
+
+    // Every thread caches a block as big as a thread may, and then
+    // waits for the others, so that all of them are cached at once.
+    int const num_threads = ScratchArena::MAX_TOTAL_CACHED_BYTES / ScratchArena::MAX_CACHED_BYTES + 2;
+    std::atomic<int> num_cached(0);
+    std::atomic<int> num_done(0);
+    std::atomic<bool> within_limit(true);
+    std::atomic<bool> trimmed(true);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; ++i) {
+        threads.emplace_back([&]() {
+            {
+                ScratchBuffer<char> buffer(ScratchArena::MAX_CACHED_BYTES);
+            }
+            ++num_cached;
+            while (num_cached.load() < num_threads) {
+                std::this_thread::yield();
+            }
+            if (ScratchArena::totalCachedBytes() > size_t(ScratchArena::MAX_TOTAL_CACHED_BYTES)) {
+                within_limit = false;
+            }
+            ++num_done;
+            while (num_done.load() <= num_threads) {
+                std::this_thread::yield();
+            }
+
+            // The main thread has called trimAll().
+            ScratchBuffer<char> buffer(1);
+            if (ScratchArena::local().cachedBytes() != 0) {
+                trimmed = false;
+            }
+        });
+    }
+
+    while (num_done.load() < num_threads) {
+        std::this_thread::yield();
+    }
+    ScratchArena::trimAll();
+    ++num_done;
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    BOOST_CHECK(within_limit.load());
+    BOOST_CHECK(trimmed.load());
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace Tests
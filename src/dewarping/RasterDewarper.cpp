@@ -32,6 +32,8 @@
 #include <cstdint>
 #include <utility>
 #include <cmath>
+#include <vector>
+#include <algorithm>
 
 using namespace imageproc;
 
@@ -41,6 +43,82 @@ namespace dewarping
 namespace
 {
 
+/**
+ * Destination columns are handed out to threads in groups of this size,
+ * so that threads don't write to the same cache lines.
+ */
+int const COLUMN_GROUP_SIZE = 16;
+
+/**
+ * Same as RgbColorMixer<uint32_t>, except red and blue are accumulated
+ * together, in the two halves of a 64-bit integer.
+ */
+class PackedRgbColorMixer
+{
+public:
+    PackedRgbColorMixer() : m_redBlueAccum(0), m_greenAccum(0) {}
+
+    void add(uint32_t rgb, uint32_t weight)
+    {
+        uint64_t const red_blue = rgb & 0x00FF00FF;
+        m_redBlueAccum += ((red_blue | (red_blue << 16)) & UINT64_C(0x000000FF000000FF)) * weight;
+        m_greenAccum += ((rgb >> 8) & 0xFF) * weight;
+    }
+
+    uint32_t mix(uint32_t total_weight) const
+    {
+        uint32_t const half_weight = total_weight >> 1;
+        uint32_t const r = (uint32_t(m_redBlueAccum >> 32) + half_weight) / total_weight;
+        uint32_t const g = (m_greenAccum + half_weight) / total_weight;
+        uint32_t const b = (uint32_t(m_redBlueAccum) + half_weight) / total_weight;
+        return (r << 16) | (g << 8) | b;
+    }
+private:
+    uint64_t m_redBlueAccum;
+    uint32_t m_greenAccum;
+};
+
+/**
+ * A generatrix reduced to what's needed to sample points on it.
+ * The point corresponding to model_y is:
+ * origin + vec * homog(model_y), where homog is a 1D homography
+ * given by a 2x2 matrix [m00 m01; m10 m11].
+ */
+struct GeneratrixSampler
+{
+    Vec2f origin;
+    Vec2f vec;
+    float m00, m01, m10, m11;
+
+    GeneratrixSampler() : m00(), m01(), m10(), m11() {}
+
+    explicit GeneratrixSampler(CylindricalSurfaceDewarper::Generatrix const& generatrix)
+        : origin(generatrix.imgLine.p1())
+        , vec(generatrix.imgLine.p2() - generatrix.imgLine.p1())
+    {
+        Eigen::Matrix2f const mat(generatrix.pln2img.mat().cast<float>());
+        m00 = mat(0, 0);
+        m01 = mat(0, 1);
+        m10 = mat(1, 0);
+        m11 = mat(1, 1);
+    }
+
+    /**
+     * Fills \p grid_column with points corresponding to each of \p model_ys.
+     */
+    void sample(std::vector<float> const& model_ys, std::vector<Vec2f>& grid_column) const
+    {
+        size_t const size = model_ys.size();
+        float const* const ys = &model_ys[0];
+        Vec2f* const points = &grid_column[0];
+        for (size_t i = 0; i < size; ++i)
+        {
+            float const y = ys[i];
+            points[i] = origin + vec * ((y * m00 + m01) / (y * m10 + m11));
+        }
+    }
+};
+
 template<typename ColorMixer, typename PixelType>
 void areaMapGeneratrix(
     PixelType const* const src_data, QSize const src_size,
@@ -92,22 +170,10 @@ void areaMapGeneratrix(
         for (int i = 1; i < 4; ++i)
         {
             Vec2f const pt(f_src32_quad[i]);
-            if (pt[0] < f_src32_left)
-            {
-                f_src32_left = pt[0];
-            }
-            else if (pt[0] > f_src32_right)
-            {
-                f_src32_right = pt[0];
-            }
-            if (pt[1] < f_src32_top)
-            {
-                f_src32_top = pt[1];
-            }
-            else if (pt[1] > f_src32_bottom)
-            {
-                f_src32_bottom = pt[1];
-            }
+            f_src32_left = std::min(f_src32_left, pt[0]);
+            f_src32_right = std::max(f_src32_right, pt[0]);
+            f_src32_top = std::min(f_src32_top, pt[1]);
+            f_src32_bottom = std::max(f_src32_bottom, pt[1]);
         }
 
         // Enforce the minimum mapping area.
@@ -367,8 +433,6 @@ void dewarpGeneric(
     int const dst_width = dst_size.width();
     int const dst_height = dst_size.height();
 
-    CylindricalSurfaceDewarper::State state;
-
     double const model_domain_left = model_domain.left();
     double const model_x_scale = 1.f / model_domain.width();
 
@@ -379,46 +443,57 @@ void dewarpGeneric(
     float const f_src32_min_mapping_width = min_mapping_area.width() * 32.f;
     float const f_src32_min_mapping_height = min_mapping_area.height() * 32.f;
 
-    std::vector<Vec2f> prev_grid_column(dst_height + 1);
-    std::vector<Vec2f> next_grid_column(dst_height + 1);
-    std::pair<int, int> prev_dst_y_range(0, dst_height - 1); // Inclusive.
+    // Model y coordinates are the same for every generatrix.
+    std::vector<float> model_ys(dst_height + 1);
+    for (int dst_y = 0; dst_y <= dst_height; ++dst_y)
+    {
+        model_ys[dst_y] = (float(dst_y) - model_domain_top) * model_y_scale;
+    }
+
+    // Mapping generatrices is the expensive part, so we do it once per
+    // column boundary, rather than once per column per neighbour.
+    std::vector<GeneratrixSampler> samplers(dst_width + 1);
 
-    for (int dst_x = 0; dst_x <= dst_width; ++dst_x)
+    #pragma omp parallel
     {
-        double const model_x = (dst_x - model_domain_left) * model_x_scale;
-        CylindricalSurfaceDewarper::Generatrix const generatrix(
-            distortion_model.mapGeneratrix(model_x, state)
-        );
-
-        HomographicTransform<1, float> const homog(generatrix.pln2img.mat().cast<float>());
-        Vec2f const origin(generatrix.imgLine.p1());
-        Vec2f const vec(generatrix.imgLine.p2() - generatrix.imgLine.p1());
-        for (int dst_y = 0; dst_y <= dst_height; ++dst_y)
+        CylindricalSurfaceDewarper::State state;
+
+        #pragma omp for schedule(static)
+        for (int dst_x = 0; dst_x <= dst_width; ++dst_x)
         {
-            float const model_y = (float(dst_y) - model_domain_top) * model_y_scale;
-            next_grid_column[dst_y] = origin + vec * homog(model_y);
+            double const model_x = (dst_x - model_domain_left) * model_x_scale;
+            samplers[dst_x] = GeneratrixSampler(distortion_model.mapGeneratrix(model_x, state));
         }
+    }
 
-        std::pair<int, int> dst_y_range(0, dst_height - 1); // Inclusive.
+    int const dst_y_first = 0;
+    int const dst_y_last = dst_height - 1; // Inclusive.
+    int const num_groups = (dst_width + COLUMN_GROUP_SIZE - 1) / COLUMN_GROUP_SIZE;
 
-        int const dst_y_first = std::max(prev_dst_y_range.first, dst_y_range.first);
-        int const dst_y_last = std::min(prev_dst_y_range.second, dst_y_range.second);
-        // The case with dst_y_first > dst_y_first is not a problem, as long as both
-        // are within [0, dst_height)
+    #pragma omp parallel for schedule(dynamic)
+    for (int group = 0; group < num_groups; ++group)
+    {
+        int const group_begin = group * COLUMN_GROUP_SIZE;
+        int const group_end = std::min(group_begin + COLUMN_GROUP_SIZE, dst_width);
+
+        std::vector<Vec2f> prev_grid_column(dst_height + 1);
+        std::vector<Vec2f> next_grid_column(dst_height + 1);
+        samplers[group_begin].sample(model_ys, prev_grid_column);
 
-        if (dst_x != 0)
+        for (int dst_x = group_begin; dst_x < group_end; ++dst_x)
         {
+            samplers[dst_x + 1].sample(model_ys, next_grid_column);
+
             areaMapGeneratrix<ColorMixer, PixelType>(
                 src_data, src_size, src_stride,
-                dst_data + dst_x - 1, dst_size, dst_stride,
+                dst_data + dst_x, dst_size, dst_stride,
                 dst_y_first, dst_y_last, bg_color,
                 prev_grid_column, next_grid_column,
                 f_src32_min_mapping_width, f_src32_min_mapping_height
             );
-        }
 
-        prev_grid_column.swap(next_grid_column);
-        prev_dst_y_range = dst_y_range;
+            prev_grid_column.swap(next_grid_column);
+        }
     }
 }
 
@@ -458,7 +533,7 @@ QImage dewarpRgb(
     badAllocIfNull(dst);
 
     dst.fill(bg_color.rgb());
-    dewarpGeneric<RgbColorMixer<MixingWeight>, uint32_t>(
+    dewarpGeneric<PackedRgbColorMixer, uint32_t>(
         (uint32_t const*)src.bits(), src.size(), src.bytesPerLine()/4,
         (uint32_t*)dst.bits(), dst_size, dst.bytesPerLine()/4,
         distortion_model, model_domain, bg_color.rgb(),
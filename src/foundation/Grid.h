@@ -20,8 +20,10 @@
 #define GRID_H_
 
 #include "GridAccessor.h"
-#include <boost/scoped_array.hpp>
+#include "ScratchArena.h"
+#include <type_traits>
 #include <utility>
+#include <stddef.h>
 
 template<typename Node>
 class Grid
@@ -36,6 +38,8 @@ public:
      * \brief Creates a width x height grid with specified padding on each side.
      *
      * If type Node doesn't require construction, the grid data is left uninitialized.
+     * Such grids take their memory from ScratchArena::local(), so that temporary
+     * grids reuse the blocks of earlier ones.
      */
     Grid(int width, int height, int padding = 0);
 
@@ -61,6 +65,8 @@ public:
      */
     Grid& operator=(Grid&& other);
 
+    ~Grid();
+
     bool isNull() const
     {
         return m_width <= 0 || m_height <= 0;
@@ -105,7 +111,7 @@ public:
      */
     Node* paddedData()
     {
-        return m_storage.get();
+        return m_pStorage;
     }
 
     /**
@@ -113,7 +119,7 @@ public:
      */
     Node const* paddedData() const
     {
-        return m_storage.get();
+        return m_pStorage;
     }
 
     /**
@@ -166,7 +172,16 @@ private:
         T tmp(o1); o1 = o2; o2 = tmp;
     }
 
-    boost::scoped_array<Node> m_storage;
+    static Node* allocate(size_t size, size_t& capacity, std::true_type);
+
+    static Node* allocate(size_t size, size_t& capacity, std::false_type);
+
+    static void deallocate(Node* storage, size_t capacity, std::true_type);
+
+    static void deallocate(Node* storage, size_t capacity, std::false_type);
+
+    size_t m_capacity; // Goes first, as it's set while initializing m_pStorage.
+    Node* m_pStorage;
     Node* m_pData;
     int m_width;
     int m_height;
@@ -176,7 +191,9 @@ private:
 
 template<typename Node>
 Grid<Node>::Grid()
-    :   m_pData(0),
+    :   m_capacity(0),
+        m_pStorage(0),
+        m_pData(0),
         m_width(0),
         m_height(0),
         m_stride(0),
@@ -186,8 +203,13 @@ Grid<Node>::Grid()
 
 template<typename Node>
 Grid<Node>::Grid(int width, int height, int padding)
-    :   m_storage(new Node[(width + padding * 2) * (height + padding * 2)]),
-        m_pData(m_storage.get() + (width + padding * 2) * padding + padding),
+    :   m_pStorage(
+            allocate(
+                size_t(width + padding * 2) * size_t(height + padding * 2),
+                m_capacity, std::is_trivial<Node>()
+            )
+        ),
+        m_pData(m_pStorage + (width + padding * 2) * padding + padding),
         m_width(width),
         m_height(height),
         m_stride(width + padding * 2),
@@ -197,8 +219,13 @@ Grid<Node>::Grid(int width, int height, int padding)
 
 template<typename Node>
 Grid<Node>::Grid(Grid const& other)
-    :   m_storage(new Node[(other.stride() * (other.height() + other.padding() * 2))]),
-        m_pData(m_storage.get() + other.stride() * other.padding() + other.padding()),
+    :   m_pStorage(
+            allocate(
+                size_t(other.stride()) * size_t(other.height() + other.padding() * 2),
+                m_capacity, std::is_trivial<Node>()
+            )
+        ),
+        m_pData(m_pStorage + other.stride() * other.padding() + other.padding()),
         m_width(other.width()),
         m_height(other.height()),
         m_stride(other.stride()),
@@ -206,7 +233,7 @@ Grid<Node>::Grid(Grid const& other)
 {
     int const len = m_stride * (m_height + m_padding * 2);
     for (int i = 0; i < len; ++i) {
-        m_storage[i] = other.m_storage[i];
+        m_pStorage[i] = other.m_pStorage[i];
     }
 }
 
@@ -233,6 +260,46 @@ Grid<Node>::operator=(Grid&& other)
     return *this;
 }
 
+template<typename Node>
+Grid<Node>::~Grid()
+{
+    deallocate(m_pStorage, m_capacity, std::is_trivial<Node>());
+}
+
+template<typename Node>
+Node*
+Grid<Node>::allocate(size_t const size, size_t& capacity, std::true_type)
+{
+    if (size == 0) {
+        // Copies of null grids are common.
+        capacity = 0;
+        return 0;
+    }
+    return static_cast<Node*>(ScratchArena::local().acquire(size * sizeof(Node), capacity));
+}
+
+template<typename Node>
+Node*
+Grid<Node>::allocate(size_t const size, size_t& capacity, std::false_type)
+{
+    capacity = 0;
+    return new Node[size];
+}
+
+template<typename Node>
+void
+Grid<Node>::deallocate(Node* const storage, size_t const capacity, std::true_type)
+{
+    ScratchArena::local().release(storage, capacity);
+}
+
+template<typename Node>
+void
+Grid<Node>::deallocate(Node* const storage, size_t, std::false_type)
+{
+    delete[] storage;
+}
+
 template<typename Node>
 void
 Grid<Node>::initPadding(Node const& padding_node)
@@ -242,7 +309,7 @@ Grid<Node>::initPadding(Node const& padding_node)
         return;
     }
 
-    Node* line = m_storage.get();
+    Node* line = m_pStorage;
     for (int row = 0; row < m_padding; ++row) {
         for (int x = 0; x < m_stride; ++x) {
             line[x] = padding_node;
@@ -299,7 +366,8 @@ template<typename Node>
 void
 Grid<Node>::swap(Grid& other)
 {
-    m_storage.swap(other.m_storage);
+    basicSwap(m_capacity, other.m_capacity);
+    basicSwap(m_pStorage, other.m_pStorage);
     basicSwap(m_pData, other.m_pData);
     basicSwap(m_width, other.m_width);
     basicSwap(m_height, other.m_height);
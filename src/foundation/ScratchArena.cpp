@@ -0,0 +1,201 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C)  Joseph Artsimovich <joseph.artsimovich@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ScratchArena.h"
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+namespace
+{
+
+std::atomic<uint64_t> bytes_reused(0);
+std::atomic<uint64_t> bytes_allocated(0);
+std::atomic<uint64_t> blocks_reused(0);
+std::atomic<uint64_t> blocks_allocated(0);
+std::atomic<size_t> total_cached_bytes(0);
+std::atomic<unsigned> trim_generation(0);
+
+/**
+ * The pointer returned by malloc() is stored right before the aligned block.
+ * malloc() aligns to at least sizeof(void*), so there is always room for it.
+ */
+void* allocateAligned(size_t const bytes)
+{
+    size_t const alignment = ScratchArena::ALIGNMENT;
+    char* const raw = static_cast<char*>(malloc(bytes + alignment));
+    if (!raw) {
+        throw std::bad_alloc();
+    }
+    char* const aligned = raw + alignment - (uintptr_t(raw) & (alignment - 1));
+    reinterpret_cast<void**>(aligned)[-1] = raw;
+    return aligned;
+}
+
+void freeAligned(void* const block)
+{
+    free(static_cast<void**>(block)[-1]);
+}
+
+} // anonymous namespace
+
+ScratchArena::ScratchArena()
+    :   m_cachedBytes(0),
+        m_trimGeneration(trim_generation.load(std::memory_order_relaxed))
+{
+    m_blocks.reserve(MAX_CACHED_BLOCKS);
+}
+
+ScratchArena::~ScratchArena()
+{
+    trim();
+}
+
+ScratchArena&
+ScratchArena::local()
+{
+    static thread_local ScratchArena arena;
+    return arena;
+}
+
+ScratchArena::Stats
+ScratchArena::stats()
+{
+    Stats stats;
+    stats.bytesReused = bytes_reused.load(std::memory_order_relaxed);
+    stats.bytesAllocated = bytes_allocated.load(std::memory_order_relaxed);
+    stats.blocksReused = blocks_reused.load(std::memory_order_relaxed);
+    stats.blocksAllocated = blocks_allocated.load(std::memory_order_relaxed);
+    return stats;
+}
+
+size_t
+ScratchArena::totalCachedBytes()
+{
+    return total_cached_bytes.load(std::memory_order_relaxed);
+}
+
+void
+ScratchArena::trimAll()
+{
+    trim_generation.fetch_add(1, std::memory_order_relaxed);
+    local().trimIfRequested();
+}
+
+size_t
+ScratchArena::sizeClass(size_t const bytes)
+{
+    if (bytes <= (size_t)MIN_BLOCK_SIZE) {
+        return MIN_BLOCK_SIZE;
+    }
+
+    // Round up to 4, 5, 6, 7 or 8 times a power of two.
+    size_t const v = bytes - 1;
+    int exp = 0;
+    while (v >> (exp + 3)) {
+        ++exp;
+    }
+    return ((v >> exp) + 1) << exp;
+}
+
+void*
+ScratchArena::acquire(size_t const bytes, size_t& capacity)
+{
+    capacity = sizeClass(bytes);
+    trimIfRequested();
+
+    // The most recently released blocks are the most likely to be in cache.
+    for (size_t i = m_blocks.size(); i > 0; --i) {
+        if (m_blocks[i - 1].capacity == capacity) {
+            void* const data = m_blocks[i - 1].data;
+            m_blocks.erase(m_blocks.begin() + (i - 1));
+            m_cachedBytes -= capacity;
+            total_cached_bytes.fetch_sub(capacity, std::memory_order_relaxed);
+            bytes_reused.fetch_add(capacity, std::memory_order_relaxed);
+            blocks_reused.fetch_add(1, std::memory_order_relaxed);
+            return data;
+        }
+    }
+
+    void* const data = allocateAligned(capacity);
+    bytes_allocated.fetch_add(capacity, std::memory_order_relaxed);
+    blocks_allocated.fetch_add(1, std::memory_order_relaxed);
+    return data;
+}
+
+void
+ScratchArena::release(void* const block, size_t const capacity)
+{
+    if (!block) {
+        return;
+    }
+
+    trimIfRequested();
+
+    if (capacity > (size_t)MAX_CACHED_BYTES) {
+        freeAligned(block);
+        return;
+    }
+
+    while (!m_blocks.empty() && (m_blocks.size() >= (size_t)MAX_CACHED_BLOCKS
+            || m_cachedBytes + capacity > (size_t)MAX_CACHED_BYTES
+            || totalCachedBytes() + capacity > (size_t)MAX_TOTAL_CACHED_BYTES)) {
+        evictOldest();
+    }
+
+    // Other threads may be doing the same, so the total is checked
+    // once more after claiming our share of it.
+    size_t const total = total_cached_bytes.fetch_add(capacity, std::memory_order_relaxed);
+    if (total + capacity > (size_t)MAX_TOTAL_CACHED_BYTES) {
+        total_cached_bytes.fetch_sub(capacity, std::memory_order_relaxed);
+        freeAligned(block);
+        return;
+    }
+
+    Block const b = { block, capacity };
+    m_blocks.push_back(b);
+    m_cachedBytes += capacity;
+}
+
+void
+ScratchArena::trim()
+{
+    while (!m_blocks.empty()) {
+        evictOldest();
+    }
+}
+
+void
+ScratchArena::evictOldest()
+{
+    Block const& oldest = m_blocks.front();
+    freeAligned(oldest.data);
+    m_cachedBytes -= oldest.capacity;
+    total_cached_bytes.fetch_sub(oldest.capacity, std::memory_order_relaxed);
+    m_blocks.erase(m_blocks.begin());
+}
+
+void
+ScratchArena::trimIfRequested()
+{
+    unsigned const generation = trim_generation.load(std::memory_order_relaxed);
+    if (m_trimGeneration != generation) {
+        m_trimGeneration = generation;
+        trim();
+    }
+}
@@ -0,0 +1,237 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C)  Joseph Artsimovich <joseph.artsimovich@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCRATCH_ARENA_H_
+#define SCRATCH_ARENA_H_
+
+#include "NonCopyable.h"
+#include <vector>
+#include <type_traits>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * \brief A per-thread cache of large aligned memory blocks.
+ *
+ * Image processing code allocates page-sized temporaries over and over.
+ * Like DynamicPool, the arena hands out raw memory, but blocks are given
+ * back one by one and kept for reuse by the same thread.  Requests are
+ * rounded up to a size class, with at most 25% overhead, so that blocks
+ * of similar sizes are interchangeable.
+ *
+ * Blocks start at ALIGNMENT-byte boundaries and their contents are
+ * undefined.  Use ScratchBuffer or ScratchAllocator rather than calling
+ * acquire() and release() directly.
+ *
+ * Besides the per thread limits, all arenas together cache at most
+ * MAX_TOTAL_CACHED_BYTES.  Blocks are kept from one page to the next,
+ * as pages tend to be of similar sizes.  Code that processes pages should
+ * call trimAll() once it runs out of them, so that idle threads don't keep
+ * blocks sized for the last page.
+ */
+class ScratchArena
+{
+    DECLARE_NON_COPYABLE(ScratchArena)
+public:
+    enum { ALIGNMENT = 64 };
+    enum { MIN_BLOCK_SIZE = 4096 }; /**< Smaller requests are rounded up to this. */
+    enum { MAX_CACHED_BYTES = 64 << 20 }; /**< Per thread.  Bigger blocks are not cached. */
+    enum { MAX_CACHED_BLOCKS = 16 }; /**< Per thread. */
+    enum { MAX_TOTAL_CACHED_BYTES = 256 << 20 }; /**< Over all threads. */
+
+    struct Stats
+    {
+        uint64_t bytesReused;
+        uint64_t bytesAllocated;
+        uint64_t blocksReused;
+        uint64_t blocksAllocated;
+    };
+
+    /**
+     * \brief The arena of the calling thread.
+     */
+    static ScratchArena& local();
+
+    /**
+     * \brief Totals over all threads since the program started.
+     *
+     * Bytes are counted in block sizes, that is after rounding up
+     * to a size class.
+     */
+    static Stats stats();
+
+    /**
+     * \brief The number of bytes cached by all arenas together.
+     */
+    static size_t totalCachedBytes();
+
+    /**
+     * \brief Makes every arena free its cached blocks.
+     *
+     * The arena of the calling thread is trimmed right away.  Other
+     * arenas are trimmed by their threads, the next time they acquire
+     * or release a block.
+     */
+    static void trimAll();
+
+    /**
+     * \brief Takes a cached block of the right size class or allocates one.
+     *
+     * \param bytes The requested size.
+     * \param capacity Receives the size of the block, to be passed to release().
+     */
+    void* acquire(size_t bytes, size_t& capacity);
+
+    /**
+     * \brief Gives a block back for reuse.
+     *
+     * The block may come from another thread's arena.  If this arena
+     * is full, the least recently released blocks are freed.
+     */
+    void release(void* block, size_t capacity);
+
+    /**
+     * \brief Frees all cached blocks.
+     */
+    void trim();
+
+    size_t cachedBytes() const
+    {
+        return m_cachedBytes;
+    }
+
+    /**
+     * \brief The block size for a request of \p bytes.
+     */
+    static size_t sizeClass(size_t bytes);
+private:
+    struct Block
+    {
+        void* data;
+        size_t capacity;
+    };
+
+    ScratchArena();
+
+    ~ScratchArena();
+
+    void evictOldest();
+
+    void trimIfRequested();
+
+    std::vector<Block> m_blocks; /**< Least recently released first. */
+    size_t m_cachedBytes;
+    unsigned m_trimGeneration;
+};
+
+/**
+ * \brief An array of POD elements borrowed from ScratchArena::local().
+ *
+ * The contents of a buffer are undefined.
+ */
+template<typename T>
+class ScratchBuffer
+{
+    DECLARE_NON_COPYABLE(ScratchBuffer)
+    static_assert(std::is_trivial<T>::value, "ScratchBuffer doesn't construct its elements");
+public:
+    explicit ScratchBuffer(size_t size)
+        : m_pData(static_cast<T*>(ScratchArena::local().acquire(size * sizeof(T), m_capacity))),
+          m_size(size)
+    {
+    }
+
+    ~ScratchBuffer()
+    {
+        ScratchArena::local().release(m_pData, m_capacity);
+    }
+
+    T* data()
+    {
+        return m_pData;
+    }
+
+    T const* data() const
+    {
+        return m_pData;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    T& operator[](size_t idx)
+    {
+        return m_pData[idx];
+    }
+
+    T const& operator[](size_t idx) const
+    {
+        return m_pData[idx];
+    }
+private:
+    size_t m_capacity; // Goes first, as it's set while initializing m_pData.
+    T* m_pData;
+    size_t m_size;
+};
+
+/**
+ * \brief A standard allocator taking blocks from ScratchArena::local().
+ *
+ * Unlike ScratchBuffer, this one suits containers that are copied,
+ * swapped or resized, like the label storage of a ConnectivityMap.
+ * Any two instances are interchangeable.
+ */
+template<typename T>
+class ScratchAllocator
+{
+    static_assert(std::is_trivial<T>::value, "ScratchArena blocks are only good for POD types");
+public:
+    typedef T value_type;
+
+    ScratchAllocator() {}
+
+    template<typename U>
+    ScratchAllocator(ScratchAllocator<U> const&) {}
+
+    T* allocate(size_t size)
+    {
+        size_t capacity;
+        return static_cast<T*>(ScratchArena::local().acquire(size * sizeof(T), capacity));
+    }
+
+    void deallocate(T* block, size_t size)
+    {
+        ScratchArena::local().release(block, ScratchArena::sizeClass(size * sizeof(T)));
+    }
+};
+
+template<typename T, typename U>
+inline bool operator==(ScratchAllocator<T> const&, ScratchAllocator<U> const&)
+{
+    return true;
+}
+
+template<typename T, typename U>
+inline bool operator!=(ScratchAllocator<T> const&, ScratchAllocator<U> const&)
+{
+    return false;
+}
+
+#endif
@@ -23,6 +23,7 @@
 #include "GrayImage.h"
 #include "IntegralImage.h"
 #include "ColorFilter.h"
+#include "SimdKernels.h"
 #include <QImage>
 #include <QRect>
 #include <QDebug>
@@ -110,12 +111,10 @@ BinaryImage binarizeFromMap(GrayImage const& src, GrayImage const& threshold,
     uint32_t* bw_line = bw_img.data();
     unsigned int const bw_stride = bw_img.wordsPerLine();
 
+    SimdKernels const& kernels = simdKernels();
     for (unsigned int y = 0; y < h; ++y)
     {
-        for (unsigned int x = 0; x < w; ++x)
-        {
-            binarySetBW(bw_line, x, (src_line[x] < lower_bound || (src_line[x] <= upper_bound && ((int)src_line[x] < ((int)threshold_line[x] + delta)))));
-        }
+        kernels.binarizeLine(src_line, threshold_line, bw_line, w, lower_bound, upper_bound, delta);
         src_line += src_stride;
         threshold_line += threshold_stride;
         bw_line += bw_stride;
@@ -153,33 +152,16 @@ GrayImage binarizeNiblackMap(
 
     int const w = src.width();
     int const h = src.height();
-    uint8_t const* src_line = src.data();
-    int const src_stride = src.stride();
     uint8_t* gray_line = gray.data();
     int const gray_stride = gray.stride();
 
-    IntegralImage<uint32_t> integral_image(w, h);
-    IntegralImage<uint64_t> integral_sqimage(w, h);
-
-    for (int y = 0; y < h; ++y)
-    {
-        integral_image.beginRow();
-        integral_sqimage.beginRow();
-        for (int x = 0; x < w; ++x)
-        {
-            uint32_t const pixel = src_line[x];
-            integral_image.push(pixel);
-            integral_sqimage.push(pixel * pixel);
-        }
-        src_line += src_stride;
-    }
+    IntegralImage<GraySumAndSquare<uint64_t> > const integral_image(src);
 
     int const window_lower_half = window_size.height() >> 1;
     int const window_upper_half = window_size.height() - window_lower_half;
     int const window_left_half = window_size.width() >> 1;
     int const window_right_half = window_size.width() - window_left_half;
 
-    src_line = src.data();
     for (int y = 0; y < h; ++y)
     {
         int const top = std::max(0, y - window_lower_half);
@@ -193,8 +175,9 @@ GrayImage binarizeNiblackMap(
             assert(area > 0); // because window_size > 0 and w > 0 and h > 0
 
             QRect const rect(left, top, right - left, bottom - top);
-            double const window_sum = integral_image.sum(rect);
-            double const window_sqsum = integral_sqimage.sum(rect);
+            GraySumAndSquare<uint64_t> const window(integral_image.sum(rect));
+            double const window_sum = window.sum;
+            double const window_sqsum = window.sqsum;
 
             double const r_area = 1.0 / area;
             double const mean = window_sum * r_area;
@@ -208,7 +191,6 @@ GrayImage binarizeNiblackMap(
             threshold = (threshold < 0.0) ? 0.0 : ((threshold < 255.0) ? threshold : 255.0);
             gray_line[x] = (uint8_t) threshold;
         }
-        src_line += src_stride;
         gray_line += gray_stride;
     }
 
@@ -451,19 +433,7 @@ GrayImage binarizeSauvolaMap(
     uint8_t* gray_line = gray.data();
     int const gray_stride = gray.stride();
 
-    IntegralImage<uint32_t> integral_image(w, h);
-    IntegralImage<uint64_t> integral_sqimage(w, h);
-
-    for (int y = 0; y < h; ++y) {
-        integral_image.beginRow();
-        integral_sqimage.beginRow();
-        for (int x = 0; x < w; ++x) {
-            uint32_t const pixel = gray_line[x];
-            integral_image.push(pixel);
-            integral_sqimage.push(pixel * pixel);
-        }
-        gray_line += gray_stride;
-    }
+    IntegralImage<GraySumAndSquare<uint64_t> > const integral_image(gray);
 
     int const window_lower_half = window_size.height() >> 1;
     int const window_upper_half = window_size.height() - window_lower_half;
@@ -482,8 +452,9 @@ GrayImage binarizeSauvolaMap(
             assert(area > 0); // because window_size > 0 and w > 0 and h > 0
 
             QRect const rect(left, top, right - left, bottom - top);
-            long double const window_sum = integral_image.sum(rect);
-            long double const window_sqsum = integral_sqimage.sum(rect);
+            GraySumAndSquare<uint64_t> const window(integral_image.sum(rect));
+            long double const window_sum = window.sum;
+            long double const window_sqsum = window.sqsum;
 
             long double const r_area = 1.0 / area;
             long double const mean = window_sum * r_area;
@@ -563,18 +534,13 @@ GrayImage binarizeWolfMap(
     uint8_t* gray_line = gray.data();
     int const gray_stride = gray.stride();
 
-    IntegralImage<uint32_t> integral_image(w, h);
-    IntegralImage<uint64_t> integral_sqimage(w, h);
+    IntegralImage<GraySumAndSquare<uint64_t> > const integral_image(gray);
 
     uint32_t min_gray_level = 255;
 
     for (int y = 0; y < h; ++y) {
-        integral_image.beginRow();
-        integral_sqimage.beginRow();
         for (int x = 0; x < w; ++x) {
             uint32_t const pixel = gray_line[x];
-            integral_image.push(pixel);
-            integral_sqimage.push(pixel * pixel);
             min_gray_level = std::min(min_gray_level, pixel);
         }
         gray_line += gray_stride;
@@ -601,8 +567,9 @@ GrayImage binarizeWolfMap(
             assert(area > 0); // because window_size > 0 and w > 0 and h > 0
 
             QRect const rect(left, top, right - left, bottom - top);
-            long double const window_sum = integral_image.sum(rect);
-            long double const window_sqsum = integral_sqimage.sum(rect);
+            GraySumAndSquare<uint64_t> const window(integral_image.sum(rect));
+            long double const window_sum = window.sum;
+            long double const window_sqsum = window.sqsum;
 
             long double const r_area = 1.0 / area;
             long double const mean = window_sum * r_area;
@@ -26,7 +26,9 @@
 #include <stdexcept>
 #include <vector>
 #include <algorithm>
+#include <new>
 #include <QImage>
+#include <QVector>
 #include <QtGlobal>
 #include <QRect>
 #include <QDebug>
@@ -40,6 +42,98 @@
 namespace imageproc
 {
 
+namespace
+{
+
+/**
+ * Builds a (w + 1) x (h + 1) summed area table of image,
+ * with pixel values mapped through op.  Row 0 and column 0 are zeros.
+ */
+template<typename T, typename Op>
+void buildIntegralTable(GrayImage const& image, std::vector<T>& table, Op op)
+{
+    int const w = image.width();
+    int const h = image.height();
+    int const stride = w + 1;
+    table.assign(size_t(stride) * (h + 1), T());
+
+    uint8_t const* image_line = image.data();
+    int const image_stride = image.stride();
+    T* above = &table[0];
+    for (int y = 0; y < h; ++y)
+    {
+        T* cur = above + stride;
+        T line_sum = T();
+        for (int x = 0; x < w; ++x)
+        {
+            line_sum += op(image_line[x]);
+            cur[x + 1] = above[x + 1] + line_sum;
+        }
+        image_line += image_stride;
+        above = cur;
+    }
+}
+
+/**
+ * Stores the column sums of rows [top, bottom) of an integral table
+ * into col_sums, so that col_sums[right] - col_sums[left] gives the sum
+ * over [left, right) x [top, bottom).
+ */
+template<typename T>
+void columnSums(std::vector<T> const& table, int const w, int const top, int const bottom, T* col_sums)
+{
+    int const stride = w + 1;
+    T const* top_line = &table[0] + size_t(top) * stride;
+    T const* bottom_line = &table[0] + size_t(bottom) * stride;
+    for (int x = 0; x <= w; ++x)
+    {
+        col_sums[x] = bottom_line[x] - top_line[x];
+    }
+}
+
+/**
+ * Moves every channel of a line of pixels towards its new gray level,
+ * keeping the differences between the channels.
+ */
+void applyGrayLevels(
+    uint8_t* image_line, unsigned int const cnum,
+    uint8_t const* gray_line, float const* new_gray_line, int const w)
+{
+    for (int x = 0; x < w; ++x)
+    {
+        float const origin = gray_line[x];
+        float const color = new_gray_line[x];
+
+        float const colscale = (color + 1.0f) / (origin + 1.0f);
+        float const coldelta = color - origin * colscale;
+        uint8_t* pixel = image_line + x * cnum;
+        for (unsigned int c = 0; c < cnum; ++c)
+        {
+            float val = pixel[c] * colscale + coldelta;
+            val = (val < 0.0f) ? 0.0f : (val < 255.0f) ? val : 255.0f;
+            pixel[c] = (uint8_t) (val + 0.5f);
+        }
+    }
+}
+
+struct Identity
+{
+    uint32_t operator()(uint8_t val) const
+    {
+        return val;
+    }
+};
+
+struct Square
+{
+    uint64_t operator()(uint8_t val) const
+    {
+        return uint32_t(val) * val;
+    }
+};
+
+} // anonymous namespace
+
 GrayImage wienerFilter(
     GrayImage const& image, QSize const& window_size, float const noise_sigma)
 {
@@ -66,63 +160,59 @@ void wienerFilterInPlace(
         int const h = image.height();
         float const noise_variance = noise_sigma * noise_sigma;
 
-        IntegralImage<uint32_t> integral_image(w, h);
-        IntegralImage<uint64_t> integral_sqimage(w, h);
+        std::vector<uint32_t> integral_image;
+        std::vector<uint64_t> integral_sqimage;
+        buildIntegralTable(image, integral_image, Identity());
+        buildIntegralTable(image, integral_sqimage, Square());
 
-        uint8_t* image_line = image.data();
+        uint8_t* const image_data = image.data();
         int const image_stride = image.stride();
 
-        for (int y = 0; y < h; ++y)
-        {
-            integral_image.beginRow();
-            integral_sqimage.beginRow();
-            for (int x = 0; x < w; ++x)
-            {
-                uint32_t const pixel = image_line[x];
-                integral_image.push(pixel);
-                integral_sqimage.push(pixel * pixel);
-            }
-            image_line += image_stride;
-        }
-
         int const window_lower_half = window_size.height() >> 1;
         int const window_upper_half = window_size.height() - window_lower_half;
         int const window_left_half = window_size.width() >> 1;
         int const window_right_half = window_size.width() - window_left_half;
 
-        image_line = image.data();
-        for (int y = 0; y < h; ++y)
+        #pragma omp parallel
         {
-            int const top = ((y - window_lower_half) < 0) ? 0 : (y - window_lower_half);
-            int const bottom = ((y + window_upper_half) < h) ? (y + window_upper_half) : h; // exclusive
+            std::vector<uint32_t> col_sums(w + 1);
+            std::vector<uint64_t> col_sqsums(w + 1);
 
-            for (int x = 0; x < w; ++x)
+            #pragma omp for schedule(static)
+            for (int y = 0; y < h; ++y)
             {
-                int const left = ((x - window_left_half) < 0) ? 0 : (x - window_left_half);
-                int const right = ((x + window_right_half) < w) ? (x + window_right_half) : w; // exclusive
-                int const area = (bottom - top) * (right - left);
-                assert(area > 0); // because window_size > 0 and w > 0 and h > 0
-
-                QRect const rect(left, top, right - left, bottom - top);
-                float const window_sum = integral_image.sum(rect);
-                float const window_sqsum = integral_sqimage.sum(rect);
+                int const top = ((y - window_lower_half) < 0) ? 0 : (y - window_lower_half);
+                int const bottom = ((y + window_upper_half) < h) ? (y + window_upper_half) : h; // exclusive
+                columnSums(integral_image, w, top, bottom, &col_sums[0]);
+                columnSums(integral_sqimage, w, top, bottom, &col_sqsums[0]);
 
-                float const r_area = 1.0f / area;
-                float const mean = window_sum * r_area;
-                float const sqmean = window_sqsum * r_area;
-                float const variance = sqmean - mean * mean;
-
-                float const src_pixel = (float) image_line[x];
-                float const delta_pixel = src_pixel - mean;
-                float const delta_variance = variance - noise_variance;
-                float dst_pixel = mean;
-                if (delta_variance > 0.0f)
+                uint8_t* image_line = image_data + y * image_stride;
+                for (int x = 0; x < w; ++x)
                 {
-                    dst_pixel += delta_pixel * delta_variance / variance;
+                    int const left = ((x - window_left_half) < 0) ? 0 : (x - window_left_half);
+                    int const right = ((x + window_right_half) < w) ? (x + window_right_half) : w; // exclusive
+                    int const area = (bottom - top) * (right - left);
+                    assert(area > 0); // because window_size > 0 and w > 0 and h > 0
+
+                    float const window_sum = col_sums[right] - col_sums[left];
+                    float const window_sqsum = col_sqsums[right] - col_sqsums[left];
+
+                    float const r_area = 1.0f / area;
+                    float const mean = window_sum * r_area;
+                    float const sqmean = window_sqsum * r_area;
+                    float const variance = sqmean - mean * mean;
+
+                    float const src_pixel = (float) image_line[x];
+                    float const delta_pixel = src_pixel - mean;
+                    float const delta_variance = variance - noise_variance;
+                    float dst_pixel = mean;
+                    if (delta_variance > 0.0f)
+                    {
+                        dst_pixel += delta_pixel * delta_variance / variance;
+                    }
+                    image_line[x] = (uint8_t) (dst_pixel + 0.5f);
                 }
-                image_line[x] = (uint8_t) (dst_pixel + 0.5f);
             }
-            image_line += image_stride;
         }
     }
 }
@@ -151,39 +241,34 @@ void wienerColorFilterInPlace(
     {
         int const w = image.width();
         int const h = image.height();
-        uint8_t* image_line = (uint8_t*) image.bits();
+        uint8_t* const image_data = (uint8_t*) image.bits();
         int const image_bpl = image.bytesPerLine();
         unsigned int const cnum = image_bpl / w;
 
-        GrayImage gray = GrayImage(image);
-        uint8_t* gray_line = gray.data();
+        GrayImage const gray = GrayImage(image);
+        uint8_t const* const gray_data = gray.data();
         int const gray_bpl = gray.stride();
-        GrayImage wiener(wienerFilter(gray, window_size, 255.0f * coef));
-        uint8_t* wiener_line = wiener.data();
+        GrayImage const wiener(wienerFilter(gray, window_size, 255.0f * coef));
+        uint8_t const* const wiener_data = wiener.data();
         int const wiener_bpl = wiener.stride();
 
-        for (int y = 0; y < h; ++y)
+        #pragma omp parallel
         {
-            for (int x = 0; x < w; ++x)
-            {
-                float const origin = gray_line[x];
-                float color = wiener_line[x];
-                // color = coef * color + (1.0 - coef) * origin;
+            std::vector<float> new_gray_line(w);
 
-                float const colscale = (color + 1.0f) / (origin + 1.0f);
-                float const coldelta = color - origin * colscale;
-                for (unsigned int c = 0; c < cnum; ++c)
+            #pragma omp for schedule(static)
+            for (int y = 0; y < h; ++y)
+            {
+                uint8_t const* wiener_line = wiener_data + y * wiener_bpl;
+                for (int x = 0; x < w; ++x)
                 {
-                    int const indx = x * cnum + c;
-                    float origcol = image_line[indx];
-                    float val = origcol * colscale + coldelta;
-                    val = (val < 0.0f) ? 0.0f : (val < 255.0f) ? val : 255.0f;
-                    image_line[indx] = (uint8_t) (val + 0.5f);
+                    new_gray_line[x] = wiener_line[x];
                 }
+                applyGrayLevels(
+                    image_data + y * image_bpl, cnum,
+                    gray_data + y * gray_bpl, &new_gray_line[0], w
+                );
             }
-            image_line += image_bpl;
-            gray_line += gray_bpl;
-            wiener_line += wiener_bpl;
         }
     }
 }
@@ -212,89 +297,128 @@ void knnDenoiserFilterInPlace(
 
         int const w = image.width();
         int const h = image.height();
-        uint8_t* image_line = (uint8_t*) image.bits();
+        uint8_t* const image_data = (uint8_t*) image.bits();
         int const image_bpl = image.bytesPerLine();
         unsigned int const cnum = image_bpl / w;
 
-        GrayImage gray = GrayImage(image);
-        uint8_t* gray_line = gray.data();
+        GrayImage const gray = GrayImage(image);
+        uint8_t const* const gray_data = gray.data();
         int const gray_bpl = gray.stride();
 
-        IntegralImage<uint32_t> integral_image(w, h);
-
-        for (int y = 0; y < h; ++y)
-        {
-            integral_image.beginRow();
-            for (int x = 0; x < w; ++x)
-            {
-                uint32_t const pixel = gray_line[x];
-                integral_image.push(pixel);
-            }
-            gray_line += gray_bpl;
-        }
+        std::vector<uint32_t> integral_image;
+        buildIntegralTable(gray, integral_image, Identity());
 
         int const noise_area = ((2 * radius + 1) * (2 * radius + 1));
         float const noise_area_inv = (1.0f / (float) noise_area);
         float const noise_weight = (1.0f / (coef * coef));
         float const pixel_weight = (1.0f / 255.0f);
 
-        gray_line = gray.data();
-        for (int y = 0; y < h; ++y)
+        // The weight of a window of radius r only depends on r and on the
+        // difference between a pixel and the window mean.  Tabulating it
+        // for differences in steps of 1 / LUT_SCALE avoids calling expf()
+        // for every radius at every pixel.  Whether a window counts towards
+        // f_count is decided exactly, as weight_f > threshold_weight is
+        // equivalent to deltasq * noise_weight < weight_limit[r - 1].
+        int const LUT_SCALE = 16;
+        int const lut_size = 255 * LUT_SCALE + 1;
+        std::vector<float> weight_lut(size_t(radius) * lut_size);
+        std::vector<float> weight_limit(radius);
+        for (int r = 1; r <= radius; ++r)
         {
-            for (int x = 0; x < w; ++x)
+            float const r2 = r * r;
+            float* lut = &weight_lut[0] + (r - 1) * lut_size;
+            for (int i = 0; i < lut_size; ++i)
             {
-                float const origin = gray_line[x];
-                float f_count = noise_area_inv;
-                float sum_weights = 1.0f;
-                float color = origin;
+                float const delta = (float(i) / LUT_SCALE) * pixel_weight * r;
+                float const deltasq = delta * delta;
+                lut[i] = expf(-(r2 * noise_area_inv + deltasq * noise_weight));
+            }
+            weight_limit[r - 1] = -logf(threshold_weight) - r2 * noise_area_inv;
+        }
+
+        #pragma omp parallel
+        {
+            std::vector<uint32_t> col_sums(w + 1);
+            std::vector<float> means(w);
+            std::vector<float> colors(w);
+            std::vector<float> sum_weights(w);
+            std::vector<float> f_counts(w);
+
+            #pragma omp for schedule(static)
+            for (int y = 0; y < h; ++y)
+            {
+                uint8_t const* gray_line = gray_data + y * gray_bpl;
+                for (int x = 0; x < w; ++x)
+                {
+                    colors[x] = gray_line[x];
+                    sum_weights[x] = 1.0f;
+                    f_counts[x] = noise_area_inv;
+                }
 
                 for (int r = 1; r <= radius; r++)
                 {
+                    // Box means of radius r for the whole line.
                     int const top = ((y - r) < 0) ? 0 : (y - r);
                     int const bottom = ((y + r) < h) ? (y + r) : h;
-                    int const left = ((x - r) < 0) ? 0 : (x - r);
-                    int const right = ((x + r) < w) ? (x + r) : w;
-                    int const area = (bottom - top) * (right - left);
-                    QRect const rect(left, top, right - left, bottom - top);
-                    float const window_sum = integral_image.sum(rect);
-                    float const r_area = 1.0f / area;
-                    float const mean = window_sum * r_area;
-                    float const delta = (origin - mean) * pixel_weight * r;
-                    float const deltasq = delta * delta;
+                    int const win_height = bottom - top;
+                    columnSums(integral_image, w, top, bottom, &col_sums[0]);
+
+                    int const inner_begin = std::min(r, w);
+                    int const inner_end = std::max(inner_begin, w - r);
+                    for (int x = 0; x < inner_begin; ++x)
+                    {
+                        int const right = ((x + r) < w) ? (x + r) : w;
+                        float const window_sum = col_sums[right] - col_sums[0];
+                        means[x] = window_sum * (1.0f / (win_height * right));
+                    }
+                    float const inner_r_area = 1.0f / (win_height * 2 * r);
+                    for (int x = inner_begin; x < inner_end; ++x)
+                    {
+                        float const window_sum = col_sums[x + r] - col_sums[x - r];
+                        means[x] = window_sum * inner_r_area;
+                    }
+                    for (int x = inner_end; x < w; ++x)
+                    {
+                        int const left = ((x - r) < 0) ? 0 : (x - r);
+                        float const window_sum = col_sums[w] - col_sums[left];
+                        means[x] = window_sum * (1.0f / (win_height * (w - left)));
+                    }
 
                     // Denoising
-                    float r2 = r * r;
-                    float weight_f = expf(-(r2 * noise_area_inv + deltasq * noise_weight));
-                    float weight_r = (r << 3);
-                    float weight_fr = weight_f * weight_r;
-                    color += mean * weight_fr;
-                    sum_weights += weight_fr;
-                    f_count += (weight_f > threshold_weight) ? (noise_area_inv * weight_r) : 0.0f;
+                    float const* lut = &weight_lut[0] + (r - 1) * lut_size;
+                    float const limit = weight_limit[r - 1];
+                    float const weight_r = (r << 3);
+                    float const f_increment = noise_area_inv * weight_r;
+                    for (int x = 0; x < w; ++x)
+                    {
+                        float const mean = means[x];
+                        float const diff = gray_line[x] - mean;
+                        float const delta = diff * pixel_weight * r;
+                        float const deltasq = delta * delta;
+                        float const weight_f = lut[(int)(std::abs(diff) * LUT_SCALE + 0.5f)];
+                        float const weight_fr = weight_f * weight_r;
+                        colors[x] += mean * weight_fr;
+                        sum_weights[x] += weight_fr;
+                        f_counts[x] += (deltasq * noise_weight < limit) ? f_increment : 0.0f;
+                    }
                 }
 
-                // Normalize result color
-                sum_weights = (sum_weights > 0.0f) ? (1.0f / sum_weights) : 1.0f;
-                color *= sum_weights;
+                for (int x = 0; x < w; ++x)
+                {
+                    float const origin = gray_line[x];
 
-                float lerp_q = (f_count > threshold_lerp) ? noise_lerpc : (1.0f - noise_lerpc);
-                color = color + (origin - color) * lerp_q;
+                    // Normalize result color
+                    float const r_sum_weights = (sum_weights[x] > 0.0f) ? (1.0f / sum_weights[x]) : 1.0f;
+                    float color = colors[x] * r_sum_weights;
 
-                // Result to memory
-                color = (color < 0.0f) ? 0.0f : ((color < 255.0f) ? color : 255.0f);
+                    float const lerp_q = (f_counts[x] > threshold_lerp) ? noise_lerpc : (1.0f - noise_lerpc);
+                    color = color + (origin - color) * lerp_q;
 
-                float const colscale = (color + 1.0f) / (origin + 1.0f);
-                float const coldelta = color - origin * colscale;
-                for (unsigned int c = 0; c < cnum; ++c)
-                {
-                    int const indx = x * cnum + c;
-                    float origcol = image_line[indx];
-                    float val = origcol * colscale + coldelta;
-                    val = (val < 0.0f) ? 0.0f : (val < 255.0f) ? val : 255.0f;
-                    image_line[indx] = (uint8_t) (val + 0.5f);
+                    colors[x] = (color < 0.0f) ? 0.0f : ((color < 255.0f) ? color : 255.0f);
                 }
+
+                applyGrayLevels(image_data + y * image_bpl, cnum, gray_line, &colors[0], w);
             }
-            image_line += image_bpl;
-            gray_line += gray_bpl;
         }
     }
 }
@@ -327,18 +451,9 @@ void blurFilterInPlace(
         uint8_t* gray_line = gray.data();
         int const gray_bpl = gray.stride();
 
-        IntegralImage<uint32_t> integral_image(w, h);
-
-        for (int y = 0; y < h; ++y)
-        {
-            integral_image.beginRow();
-            for (int x = 0; x < w; ++x)
-            {
-                uint32_t const pixel = gray_line[x];
-                integral_image.push(pixel);
-            }
-            gray_line += gray_bpl;
-        }
+        // Sums may wrap around on big images, but the differences
+        // making up window sums are still right.
+        IntegralImage<uint32_t> const integral_image(gray);
 
         int const window_lower_half = window_size.height() >> 1;
         int const window_upper_half = window_size.height() - window_lower_half;
@@ -413,18 +528,7 @@ void screenFilterInPlace(
         uint8_t* gray_line = gray.data();
         int const gray_bpl = gray.stride();
 
-        IntegralImage<uint32_t> integral_image(w, h);
-
-        for (int y = 0; y < h; ++y)
-        {
-            integral_image.beginRow();
-            for (int x = 0; x < w; ++x)
-            {
-                uint32_t const pixel = gray_line[x];
-                integral_image.push(pixel);
-            }
-            gray_line += gray_bpl;
-        }
+        IntegralImage<uint32_t> const integral_image(gray);
 
         int const window_lower_half = window_size.height() >> 1;
         int const window_upper_half = window_size.height() - window_lower_half;
@@ -757,59 +861,130 @@ void coloredMaskInPlace(
     }
 }
 
-void hsvKMeansInPlace(
-    QImage& dst, QImage const& image, BinaryImage const& mask, int const ncount, float const coef_sat, float const coef_norm, float const coef_bg)
+namespace
 {
-    if (dst.isNull() || image.isNull() || mask.isNull())
-    {
-        return;
-    }
 
-    if ((ncount > 0) && (ncount < 256))
-    {
-        unsigned int const w = dst.width();
-        unsigned int const h = dst.height();
-        unsigned int const wi = image.width();
-        unsigned int const hi = image.height();
-        unsigned int const wm = mask.width();
-        unsigned int const hm = mask.height();
+/**
+ * \brief K-means clustering of the masked pixels of an image in
+ *        an HSV-like color space.
+ *
+ * Each pixel is mapped to (128 + s/2 * cos(h), 128 + s/2 * sin(h), v),
+ * with all components in [0, 255].  The components of the masked pixels
+ * are kept in three planes, row after row, so that every pass over them
+ * is a linear walk.  Clusters are seeded by k-means++ on a sample of
+ * the masked pixels and refined by mini-batch iterations.  Cluster 0
+ * is reserved for the mean of the unmasked pixels.
+ */
+class HsvKMeans
+{
+public:
+    enum { MAX_CLUSTERS = 256 };
+
+    HsvKMeans(QImage const& image, BinaryImage const& mask);
+
+    void clusterize(int ncount);
+
+    /**
+     * Converts the cluster centers back to RGB, applying the saturation,
+     * value and background adjustments of hsvKMeansInPlace().
+     */
+    void palette(QRgb* palette, float coef_sat, float coef_norm, float coef_bg) const;
+
+    /**
+     * Stores the nearest cluster of each masked pixel of line y
+     * into labels, in left to right order.
+     */
+    void labelLine(int y, int* labels, float* dist_min) const;
+private:
+    enum { HUE_STEPS = 4096, SAMPLE_SIZE = 16384, BATCH_SIZE = 4096, MAX_BATCHES = 100 };
+
+    int nearest(size_t i) const;
+
+    uint32_t random();
+
+    int m_width;
+    int m_height;
+    int m_ncount;
+    std::vector<uint8_t> m_planeH;
+    std::vector<uint8_t> m_planeS;
+    std::vector<uint8_t> m_planeV;
+    std::vector<size_t> m_lineOffsets;
+    float m_meanH[MAX_CLUSTERS];
+    float m_meanS[MAX_CLUSTERS];
+    float m_meanV[MAX_CLUSTERS];
+    uint32_t m_randomState;
+};
+
+HsvKMeans::HsvKMeans(QImage const& image, BinaryImage const& mask)
+    : m_width(image.width()),
+      m_height(image.height()),
+      m_ncount(0),
+      m_lineOffsets(image.height() + 1, 0),
+      m_randomState(2463534242u)
+{
+    QImage const rgb(image.convertToFormat(QImage::Format_RGB32));
 
-        if ((w != wi) || (h != hi) || (w != wm) || (h != hm))
+    uint32_t const* const mask_data = mask.data();
+    int const mask_wpl = mask.wordsPerLine();
+    uint32_t const msb = uint32_t(1) << 31;
+
+    for (int y = 0; y < m_height; ++y)
+    {
+        uint32_t const* mask_line = mask_data + y * mask_wpl;
+        size_t count = 0;
+        for (int x = 0; x < m_width; ++x)
         {
-            return;
+            if (mask_line[x >> 5] & (msb >> (x & 31)))
+            {
+                ++count;
+            }
         }
+        m_lineOffsets[y + 1] = m_lineOffsets[y] + count;
+    }
 
-        uint32_t const* mask_line = mask.data();
-        int const mask_wpl = mask.wordsPerLine();
+    size_t const total = m_lineOffsets[m_height];
+    m_planeH.resize(total);
+    m_planeS.resize(total);
+    m_planeV.resize(total);
 
-        QImage hsv_img(w, h, QImage::Format_RGB32);
+    // The hue only matters through cos() and sin(), which are tabulated
+    // in steps far below what survives rounding to 8 bits.
+    float cos_table[HUE_STEPS];
+    float sin_table[HUE_STEPS];
+    for (int i = 0; i < HUE_STEPS; ++i)
+    {
+        float const angle = (float) (2.0 * M_PI * i / HUE_STEPS);
+        cos_table[i] = cosf(angle);
+        sin_table[i] = sinf(angle);
+    }
+    float const hue_scale = HUE_STEPS / 256.0f;
 
-        unsigned long mean_len[256] = {0};
-        double mean_h0[256] = {0.0};
-        double mean_s0[256] = {0.0};
-        double mean_h[256] = {0.0};
-        double mean_s[256] = {0.0};
-        double mean_v[256] = {0.0};
+    double bg_h = 0.0;
+    double bg_s = 0.0;
+    double bg_v = 0.0;
+    unsigned long bg_count = 0;
 
-        float ctorad = (float)(2.0 * M_PI / 256.0);
-        uint32_t const msb = uint32_t(1) << 31;
+    #pragma omp parallel
+    {
+        double local_h = 0.0;
+        double local_s = 0.0;
+        double local_v = 0.0;
+        unsigned long local_count = 0;
 
-        for (unsigned int y = 0; y < h; y++)
+        #pragma omp for schedule(static)
+        for (int y = 0; y < m_height; ++y)
         {
-            QRgb *rowh = (QRgb*)hsv_img.constScanLine(y);
-            for (unsigned int x = 0; x < w; x++)
+            QRgb const* rgb_line = (QRgb const*) rgb.constScanLine(y);
+            uint32_t const* mask_line = mask_data + y * mask_wpl;
+            size_t idx = m_lineOffsets[y];
+            for (int x = 0; x < m_width; ++x)
             {
-                QRgb pixel = image.pixel(x, y);
-                int r = qRed(pixel);
-                int g = qGreen(pixel);
-                int b = qBlue(pixel);
-                float hsv_h, hsv_s, hsv_v;
-                int max = 0, min = 255;
-                max = (r < g) ? g : r;
-                max = (max < b) ? b : max;
-                min = (r > g) ? g : r;
-                min = (min > b) ? b : min;
-                hsv_h = max - min;
+                int const r = qRed(rgb_line[x]);
+                int const g = qGreen(rgb_line[x]);
+                int const b = qBlue(rgb_line[x]);
+                int const max = std::max(std::max(r, g), b);
+                int const min = std::min(std::min(r, g), b);
+                float hsv_h = max - min;
                 if (hsv_h > 0.0f)
                 {
                     if (max == r)
@@ -829,335 +1004,514 @@ void hsvKMeansInPlace(
                         hsv_h = (256.0f * (4.0f + (float) (r - g) / hsv_h)) / 6.0f;
                     }
                 }
-                hsv_s = max - min;
-                if (max > 0)
+                float const hsv_s = (max > 0) ? ((max - min) * 256.0f / max) : 0.0f;
+                int const hue_idx = ((int) (hsv_h * hue_scale + 0.5f)) & (HUE_STEPS - 1);
+                int fh = (int) (128.0f + 0.5f * hsv_s * cos_table[hue_idx]);
+                fh = (fh < 0) ? 0 : (fh < 255) ? fh : 255;
+                int fs = (int) (128.0f + 0.5f * hsv_s * sin_table[hue_idx]);
+                fs = (fs < 0) ? 0 : (fs < 255) ? fs : 255;
+                int const fv = max;
+
+                if (mask_line[x >> 5] & (msb >> (x & 31)))
                 {
-                    hsv_s *= 256.0f;
-                    hsv_s /= max;
+                    m_planeH[idx] = (uint8_t) fh;
+                    m_planeS[idx] = (uint8_t) fs;
+                    m_planeV[idx] = (uint8_t) fv;
+                    ++idx;
                 }
-                hsv_v = max;
-                r = (int) (128.0f + 0.5f * hsv_s * cos(hsv_h * ctorad)); // +0.5f for round
-                r = (r < 0) ? 0 : (r < 255) ? r : 255;
-                g = (int) (128.0f + 0.5f * hsv_s * sin(hsv_h * ctorad)); // +0.5f for round
-                g = (g < 0) ? 0 : (g < 255) ? g : 255;
-                b = (int) (0.5f + hsv_v); // +0.5f for round
-                b = (b < 0) ? 0 : (b < 255) ? b : 255;
-                if (!(mask_line[x >> 5] & (msb >> (x & 31))))
+                else
                 {
-                    mean_h[0] += r;
-                    mean_s[0] += g;
-                    mean_v[0] += b;
-                    mean_len[0]++;
+                    local_h += fh;
+                    local_s += fs;
+                    local_v += fv;
+                    ++local_count;
                 }
-                rowh[x] = qRgb(r, g, b);
             }
-            mask_line += mask_wpl;
         }
 
-        if (mean_len[0] > 0)
+        #pragma omp critical
+        {
+            bg_h += local_h;
+            bg_s += local_s;
+            bg_v += local_v;
+            bg_count += local_count;
+        }
+    }
+
+    for (int k = 0; k < MAX_CLUSTERS; ++k)
+    {
+        m_meanH[k] = 0.0f;
+        m_meanS[k] = 0.0f;
+        m_meanV[k] = 0.0f;
+    }
+    if (bg_count > 0)
+    {
+        double const mean_bg_part = 1.0 / (double) bg_count;
+        m_meanH[0] = (float) (bg_h * mean_bg_part);
+        m_meanS[0] = (float) (bg_s * mean_bg_part);
+        m_meanV[0] = (float) (bg_v * mean_bg_part);
+    }
+}
+
+uint32_t
+HsvKMeans::random()
+{
+    // xorshift32: deterministic, so that the same page always
+    // gets the same palette.
+    m_randomState ^= m_randomState << 13;
+    m_randomState ^= m_randomState >> 17;
+    m_randomState ^= m_randomState << 5;
+    return m_randomState;
+}
+
+int
+HsvKMeans::nearest(size_t const i) const
+{
+    float const hsv_h = m_planeH[i];
+    float const hsv_s = m_planeS[i];
+    float const hsv_v = m_planeV[i];
+    float dist_min = 196608.0f;
+    int indx_min = 0;
+    for (int k = 1; k <= m_ncount; k++)
+    {
+        float const delta_h = hsv_h - m_meanH[k];
+        float const delta_s = hsv_s - m_meanS[k];
+        float const delta_v = hsv_v - m_meanV[k];
+        float const dist = delta_h * delta_h + delta_s * delta_s + delta_v * delta_v;
+        if (dist < dist_min)
+        {
+            indx_min = k;
+            dist_min = dist;
+        }
+    }
+    return indx_min;
+}
+
+void
+HsvKMeans::clusterize(int const ncount)
+{
+    m_ncount = ncount;
+    size_t const total = m_planeH.size();
+
+    if (total == 0)
+    {
+        // Nothing to cluster.  Spread the centers over the hue circle.
+        float const ctorad = (float) (2.0 * M_PI / 256.0);
+        float const fk = 256.0f / (float) ncount;
+        for (int k = 1; k <= ncount; k++)
         {
-            double mean_bg_part = 1.0 / (double) mean_len[0];
-            mean_h[0] *= mean_bg_part;
-            mean_s[0] *= mean_bg_part;
-            mean_v[0] *= mean_bg_part;
+            float const hsv_h = ((float) k - 0.5f) * fk;
+            m_meanH[k] = 128.0f * (1.0f + cosf(hsv_h * ctorad));
+            m_meanS[k] = 128.0f * (1.0f + sinf(hsv_h * ctorad));
+            m_meanV[k] = 255.0f;
         }
+        return;
+    }
 
-        GrayImage clusters(image);
-        uint8_t* clusters_line = clusters.data();
-        int const clusters_bpl = clusters.stride();
+    // k-means++ seeding on an evenly spaced sample.
+    size_t const sample_size = std::min<size_t>(total, SAMPLE_SIZE);
+    std::vector<size_t> sample(sample_size);
+    for (size_t i = 0; i < sample_size; ++i)
+    {
+        sample[i] = i * total / sample_size;
+    }
 
-        float const fk = (ncount > 0) ? (256.0f / (float) ncount) : 0.0f;
-        for (int i = 1; i <= ncount; i++)
+    std::vector<float> sample_dist(sample_size, 196608.0f);
+    size_t chosen = sample[random() % sample_size];
+    for (int k = 1; k <= ncount; k++)
+    {
+        m_meanH[k] = m_planeH[chosen];
+        m_meanS[k] = m_planeS[chosen];
+        m_meanV[k] = m_planeV[chosen];
+        if (k == ncount)
         {
-            float const hsv_h = ((float) i - 0.5f) * fk;
-            mean_h0[i] = 128.0 * (1.0 + cos(hsv_h * ctorad));
-            mean_s0[i] = 128.0 * (1.0 + sin(hsv_h * ctorad));
-            mean_h[i] = mean_h0[i];
-            mean_s[i] = mean_s0[i];
-            mean_v[i] = 255.0;
+            break;
         }
 
-        mask_line = mask.data();
-        for (unsigned int y = 0; y < h; y++)
+        double dist_sum = 0.0;
+        for (size_t i = 0; i < sample_size; ++i)
         {
-            QRgb *rowh = (QRgb*)hsv_img.constScanLine(y);
-            for (unsigned int x = 0; x < w; x++)
-            {
-                if (mask_line[x >> 5] & (msb >> (x & 31)))
-                {
-                    float const hsv_h = qRed(rowh[x]);
-                    float const hsv_s = qGreen(rowh[x]);
-                    float const hsv_v = qBlue(rowh[x]);
-                    float dist_min = 196608.0f;
-                    int indx_min = 0;
-                    for (int k = 1; k <= ncount; k++)
-                    {
-                        float const delta_h = hsv_h - mean_h[k];
-                        float const delta_s = hsv_s - mean_s[k];
-                        float const delta_v = hsv_v - mean_v[k];
-                        float const dist = delta_h * delta_h + delta_s * delta_s + delta_v * delta_v;
-                        if (dist < dist_min)
-                        {
-                            indx_min = k;
-                            dist_min = dist;
-                        }
-                    }
-                    clusters_line[x] = indx_min;
-                }
-            }
-            mask_line += mask_wpl;
-            clusters_line += clusters_bpl;
+            size_t const idx = sample[i];
+            float const delta_h = m_planeH[idx] - m_meanH[k];
+            float const delta_s = m_planeS[idx] - m_meanS[k];
+            float const delta_v = m_planeV[idx] - m_meanV[k];
+            float const dist = delta_h * delta_h + delta_s * delta_s + delta_v * delta_v;
+            sample_dist[i] = std::min(sample_dist[i], dist);
+            dist_sum += sample_dist[i];
         }
 
-        for (unsigned int itr = 0; itr < 50; itr++)
+        if (dist_sum <= 0.0)
         {
-            for (int i = 1; i <= ncount; i++)
-            {
-                mean_h[i] = 0.0;
-                mean_s[i] = 0.0;
-                mean_v[i] = 0.0;
-                mean_len[i] = 0;
-            }
+            // Fewer distinct colors than clusters.
+            continue;
+        }
 
-            mask_line = mask.data();
-            clusters_line = clusters.data();
-            for (unsigned int y = 0; y < h; y++)
+        double target = dist_sum * (random() / 4294967296.0);
+        size_t pick = sample_size - 1;
+        for (size_t i = 0; i < sample_size; ++i)
+        {
+            target -= sample_dist[i];
+            if (target < 0.0)
             {
-                QRgb *rowh = (QRgb*)hsv_img.constScanLine(y);
-                for (unsigned int x = 0; x < w; x++)
-                {
-                    if (mask_line[x >> 5] & (msb >> (x & 31)))
-                    {
-                        int const cluster = clusters_line[x];
-                        float const hsv_h = qRed(rowh[x]);
-                        float const hsv_s = qGreen(rowh[x]);
-                        float const hsv_v = qBlue(rowh[x]);
-                        mean_h[cluster] += hsv_h;
-                        mean_s[cluster] += hsv_s;
-                        mean_v[cluster] += hsv_v;
-                        mean_len[cluster]++;
-                    }
-                }
-                mask_line += mask_wpl;
-                clusters_line += clusters_bpl;
+                pick = i;
+                break;
             }
-            unsigned long changes = 0;
-            for (int i = 1; i <= ncount; i++)
+        }
+        chosen = sample[pick];
+    }
+
+    // Mini-batch iterations.  A center moves to the running mean of all
+    // the batch pixels ever assigned to it.
+    size_t const batch_size = std::min<size_t>(total, BATCH_SIZE);
+    std::vector<size_t> batch(batch_size);
+    double counts[MAX_CLUSTERS] = {0.0};
+
+    for (int itr = 0; itr < MAX_BATCHES; ++itr)
+    {
+        for (size_t i = 0; i < batch_size; ++i)
+        {
+            batch[i] = random() % total;
+        }
+
+        double sum_h[MAX_CLUSTERS] = {0.0};
+        double sum_s[MAX_CLUSTERS] = {0.0};
+        double sum_v[MAX_CLUSTERS] = {0.0};
+        unsigned long len[MAX_CLUSTERS] = {0};
+
+        #pragma omp parallel
+        {
+            double local_h[MAX_CLUSTERS] = {0.0};
+            double local_s[MAX_CLUSTERS] = {0.0};
+            double local_v[MAX_CLUSTERS] = {0.0};
+            unsigned long local_len[MAX_CLUSTERS] = {0};
+
+            #pragma omp for schedule(static)
+            for (int i = 0; i < (int) batch_size; ++i)
             {
-                if (mean_len[i] > 0)
-                {
-                    float const mean_lr = 1.0f / (float) mean_len[i];
-                    mean_h[i] *= mean_lr;
-                    mean_s[i] *= mean_lr;
-                    mean_v[i] *= mean_lr;
-                }
-                else
-                {
-                    float const hsv_hmc = mean_h0[i];
-                    float const hsv_hms = mean_s0[i];
-                    mean_h[i] = hsv_hmc;
-                    mean_s[i] = hsv_hms;
-                    mean_v[i] = 255.0;
-
-                    mask_line = mask.data();
-                    float dist_min = 196608.0f;
-                    for (unsigned int y = 0; y < h; y++)
-                    {
-                        QRgb *rowh = (QRgb*)hsv_img.constScanLine(y);
-                        for (unsigned int x = 0; x < w; x++)
-                        {
-                            if (mask_line[x >> 5] & (msb >> (x & 31)))
-                            {
-                                float const hsv_h = qRed(rowh[x]);
-                                float const hsv_s = qGreen(rowh[x]);
-                                float const hsv_v = qBlue(rowh[x]);
-                                float const delta_h = hsv_h - hsv_hmc;
-                                float const delta_s = hsv_s - hsv_hms;
-                                float const delta_v = 255.0f - hsv_v;
-                                float const dist = delta_h * delta_h + delta_s * delta_s + delta_v * delta_v;
-                                if (dist < dist_min)
-                                {
-                                    mean_h[i] = hsv_h;
-                                    mean_s[i] = hsv_s;
-                                    mean_v[i] = hsv_v;
-                                    dist_min = dist;
-                                }
-                            }
-                        }
-                        mask_line += mask_wpl;
-                    }
-                    mean_len[i] = 1;
-                    changes++;
-                }
+                size_t const idx = batch[i];
+                int const cluster = nearest(idx);
+                local_h[cluster] += m_planeH[idx];
+                local_s[cluster] += m_planeS[idx];
+                local_v[cluster] += m_planeV[idx];
+                local_len[cluster]++;
             }
 
-            mask_line = mask.data();
-            clusters_line = clusters.data();
-            for (unsigned int y = 0; y < h; y++)
+            #pragma omp critical
             {
-                QRgb *rowh = (QRgb*)hsv_img.constScanLine(y);
-                for (unsigned int x = 0; x < w; x++)
+                for (int k = 1; k <= ncount; k++)
                 {
-                    if (mask_line[x >> 5] & (msb >> (x & 31)))
-                    {
-                        float const hsv_h = qRed(rowh[x]);
-                        float const hsv_s = qGreen(rowh[x]);
-                        float const hsv_v = qBlue(rowh[x]);
-                        float dist_min = 196608.0f;
-                        int indx_min = 0;
-                        for (int k = 1; k <= ncount; k++)
-                        {
-                            float const delta_h = hsv_h - mean_h[k];
-                            float const delta_s = hsv_s - mean_s[k];
-                            float const delta_v = hsv_v - mean_v[k];
-                            float const dist = delta_h * delta_h + delta_s * delta_s + delta_v * delta_v;
-                            if (dist < dist_min)
-                            {
-                                indx_min = k;
-                                dist_min = dist;
-                            }
-                        }
-                        if (indx_min != clusters_line[x])
-                        {
-                            clusters_line[x] = indx_min;
-                            changes++;
-                        }
-                    }
+                    sum_h[k] += local_h[k];
+                    sum_s[k] += local_s[k];
+                    sum_v[k] += local_v[k];
+                    len[k] += local_len[k];
                 }
-                mask_line += mask_wpl;
-                clusters_line += clusters_bpl;
             }
+        }
 
-            if (changes == 0)
+        float max_shift = 0.0f;
+        for (int k = 1; k <= ncount; k++)
+        {
+            if (len[k] == 0)
             {
-                break;
+                continue;
             }
+            double const old_count = counts[k];
+            counts[k] += len[k];
+            double const r_count = 1.0 / counts[k];
+            float const new_h = (float) ((m_meanH[k] * old_count + sum_h[k]) * r_count);
+            float const new_s = (float) ((m_meanS[k] * old_count + sum_s[k]) * r_count);
+            float const new_v = (float) ((m_meanV[k] * old_count + sum_v[k]) * r_count);
+            float const delta_h = new_h - m_meanH[k];
+            float const delta_s = new_s - m_meanS[k];
+            float const delta_v = new_v - m_meanV[k];
+            max_shift = std::max(max_shift, delta_h * delta_h + delta_s * delta_s + delta_v * delta_v);
+            m_meanH[k] = new_h;
+            m_meanS[k] = new_s;
+            m_meanV[k] = new_v;
+        }
+
+        if ((itr > 0) && (max_shift < 0.01f))
+        {
+            break;
+        }
+    }
+}
+
+void
+HsvKMeans::labelLine(int const y, int* labels, float* dist_min) const
+{
+    size_t const begin = m_lineOffsets[y];
+    int const count = (int) (m_lineOffsets[y + 1] - begin);
+    uint8_t const* const plane_h = m_planeH.data() + begin;
+    uint8_t const* const plane_s = m_planeS.data() + begin;
+    uint8_t const* const plane_v = m_planeV.data() + begin;
+
+    for (int i = 0; i < count; ++i)
+    {
+        dist_min[i] = 196608.0f;
+        labels[i] = 0;
+    }
+
+    // Clusters in the outer loop, so that the inner one vectorizes.
+    for (int k = 1; k <= m_ncount; k++)
+    {
+        float const mean_h = m_meanH[k];
+        float const mean_s = m_meanS[k];
+        float const mean_v = m_meanV[k];
+        for (int i = 0; i < count; ++i)
+        {
+            float const delta_h = plane_h[i] - mean_h;
+            float const delta_s = plane_s[i] - mean_s;
+            float const delta_v = plane_v[i] - mean_v;
+            float const dist = delta_h * delta_h + delta_s * delta_s + delta_v * delta_v;
+            bool const closer = dist < dist_min[i];
+            dist_min[i] = closer ? dist : dist_min[i];
+            labels[i] = closer ? k : labels[i];
         }
+    }
+}
+
+void
+HsvKMeans::palette(QRgb* palette, float const coef_sat, float const coef_norm, float const coef_bg) const
+{
+    float const ctorad = (float) (2.0 * M_PI / 256.0);
+    float mean_h[MAX_CLUSTERS];
+    float mean_s[MAX_CLUSTERS];
+    float mean_v[MAX_CLUSTERS];
 
-        for (int k = 0; k <= ncount; k++)
+    for (int k = 0; k <= m_ncount; k++)
+    {
+        float const hsv_hsc = (m_meanH[k] - 128.0f) * 2.0f;
+        float const hsv_hss = (m_meanS[k] - 128.0f) * 2.0f;
+        float const hsv_h = atan2(hsv_hss, hsv_hsc) / ctorad;
+        mean_h[k] = (hsv_h < 0.0f) ? (hsv_h + 256.0f) : hsv_h;
+        mean_s[k] = sqrt(hsv_hsc * hsv_hsc + hsv_hss * hsv_hss);
+        mean_v[k] = m_meanV[k];
+    }
+    float min_sat = 512.0f;
+    float max_sat = 0.0f;
+    float min_vol = 512.0f;
+    float max_vol = 0.0f;
+    for (int k = 0; k <= m_ncount; k++)
+    {
+        min_sat = (mean_s[k] < min_sat) ? mean_s[k] : min_sat;
+        max_sat = (mean_s[k] > max_sat) ? mean_s[k] : max_sat;
+        min_vol = (mean_v[k] < min_vol) ? mean_v[k] : min_vol;
+        max_vol = (mean_v[k] > max_vol) ? mean_v[k] : max_vol;
+    }
+    float d_sat = max_sat - min_sat;
+    float d_vol = max_vol - min_vol;
+    for (int k = 0; k <= m_ncount; k++)
+    {
+        double sat_new = (d_sat > 0.0f) ? ((mean_s[k] - min_sat) * 255.0f / d_sat) : 255.0f;
+        sat_new = sat_new * coef_sat + mean_s[k] * (1.0f - coef_sat);
+        double vol_new = (d_vol > 0.0f) ? ((mean_v[k] - min_vol) * 255.0f / d_vol) : 0.0f;
+        vol_new = vol_new * coef_norm + mean_v[k] * (1.0f - coef_norm);
+        mean_s[k] = sat_new;
+        mean_v[k] = vol_new;
+    }
+    for (int k = 0; k <= m_ncount; k++)
+    {
+        int r, g, b;
+        float const hsv_h = mean_h[k];
+        float const hsv_s = mean_s[k];
+        float const hsv_v = mean_v[k];
+        r = g = b = (int) (hsv_v + 0.5f);
+        int const i = (int) (hsv_h * 6.0f / 256.0f) % 6;
+        int const vm = (int) ((256.0f - hsv_s) * hsv_v + 127)/ 256;
+        int const va = (int) ((hsv_v - vm) * (6.0f * hsv_h - i * 256.0f) + 127)/ 256;
+        int const vi = vm + va;
+        int const vd = hsv_v - va;
+        if (hsv_s > 0.0f)
         {
-            float const hsv_hsc = (mean_h[k] - 128.0f) * 2.0f;
-            float const hsv_hss = (mean_s[k] - 128.0f) * 2.0f;
-            float hsv_h = atan2(hsv_hss, hsv_hsc) / ctorad;
-            float const hsv_s = sqrt(hsv_hsc * hsv_hsc + hsv_hss * hsv_hss);
-            mean_h[k] = hsv_h;
-            mean_s[k] = hsv_s;
+            switch (i)
+            {
+            default:
+            case 0:
+                g = vi;
+                b = vm;
+                break;
+            case 1:
+                r = vd;
+                b = vm;
+                break;
+            case 2:
+                r = vm;
+                b = vi;
+                break;
+            case 3:
+                r = vm;
+                g = vd;
+                break;
+            case 4:
+                r = vi;
+                g = vm;
+                break;
+            case 5:
+                g = vm;
+                b = vd;
+                break;
+            }
         }
-        float min_sat = 512.0f;
-        float max_sat = 0.0f;
-        float min_vol = 512.0f;
-        float max_vol = 0.0f;
-        for (int k = 0; k <= ncount; k++)
+        r = (r < 0) ? 0 : (r < 255) ? r : 255;
+        g = (g < 0) ? 0 : (g < 255) ? g : 255;
+        b = (b < 0) ? 0 : (b < 255) ? b : 255;
+        if (k == 0)
         {
-            min_sat = (mean_s[k] < min_sat) ? mean_s[k] : min_sat;
-            max_sat = (mean_s[k] > max_sat) ? mean_s[k] : max_sat;
-            min_vol = (mean_v[k] < min_vol) ? mean_v[k] : min_vol;
-            max_vol = (mean_v[k] > max_vol) ? mean_v[k] : max_vol;
+            r = (int) (r * coef_bg + (1.0f - coef_bg) * 255.0f);
+            g = (int) (g * coef_bg + (1.0f - coef_bg) * 255.0f);
+            b = (int) (b * coef_bg + (1.0f - coef_bg) * 255.0f);
         }
-        float d_sat = max_sat - min_sat;
-        float d_vol = max_vol - min_vol;
-        for (int k = 0; k <= ncount; k++)
+        palette[k] = qRgb(r, g, b);
+    }
+}
+
+} // anonymous namespace
+
+void hsvKMeansInPlace(
+    QImage& dst, QImage const& image, BinaryImage const& mask, int const ncount, float const coef_sat, float const coef_norm, float const coef_bg)
+{
+    if (dst.isNull() || image.isNull() || mask.isNull())
+    {
+        return;
+    }
+
+    if ((ncount > 0) && (ncount < 256))
+    {
+        int const w = dst.width();
+        int const h = dst.height();
+        if ((w != image.width()) || (h != image.height()) || (w != mask.width()) || (h != mask.height()))
         {
-            double sat_new = (d_sat > 0.0f) ? ((mean_s[k] - min_sat) * 255.0f / d_sat) : 255.0f;
-            sat_new = sat_new * coef_sat + mean_s[k] * (1.0f - coef_sat);
-            double vol_new = (d_vol > 0.0f) ? ((mean_v[k] - min_vol) * 255.0f / d_vol) : 0.0f;
-            vol_new = vol_new * coef_norm + mean_v[k] * (1.0f - coef_norm);
-            mean_s[k] = sat_new;
-            mean_v[k] = vol_new;
+            return;
         }
-        for (int k = 0; k <= ncount; k++)
+
+        HsvKMeans kmeans(image, mask);
+        kmeans.clusterize(ncount);
+        QRgb palette[HsvKMeans::MAX_CLUSTERS];
+        kmeans.palette(palette, coef_sat, coef_norm, coef_bg);
+
+        QImage const background(dst.convertToFormat(QImage::Format_RGB32));
+        QImage result(w, h, QImage::Format_RGB32);
+        uint32_t const* const mask_data = mask.data();
+        int const mask_wpl = mask.wordsPerLine();
+        uint32_t const msb = uint32_t(1) << 31;
+
+        #pragma omp parallel
         {
-            int r, g, b;
-            float const hsv_h = mean_h[k];
-            float const hsv_s = mean_s[k];
-            float const hsv_v = mean_v[k];
-            r = g = b = (int) (hsv_v + 0.5f);
-            int const i = (int) (hsv_h * 6.0f / 256.0f) % 6;
-            int const vm = (int) ((256.0f - hsv_s) * hsv_v + 127)/ 256;
-            int const va = (int) ((hsv_v - vm) * (6.0f * hsv_h - i * 256.0f) + 127)/ 256;
-            int const vi = vm + va;
-            int const vd = hsv_v - va;
-            if (hsv_s > 0.0f)
+            std::vector<int> labels(w);
+            std::vector<float> dist_min(w);
+
+            #pragma omp for schedule(static)
+            for (int y = 0; y < h; ++y)
             {
-                switch (i)
+                kmeans.labelLine(y, &labels[0], &dist_min[0]);
+
+                uint32_t const* mask_line = mask_data + y * mask_wpl;
+                QRgb const* background_line = (QRgb const*) background.constScanLine(y);
+                QRgb* result_line = (QRgb*) result.scanLine(y);
+                int const* label = &labels[0];
+                for (int x = 0; x < w; ++x)
                 {
-                default:
-                case 0:
-                    g = vi;
-                    b = vm;
-                    break;
-                case 1:
-                    r = vd;
-                    b = vm;
-                    break;
-                case 2:
-                    r = vm;
-                    b = vi;
-                    break;
-                case 3:
-                    r = vm;
-                    g = vd;
-                    break;
-                case 4:
-                    r = vi;
-                    g = vm;
-                    break;
-                case 5:
-                    g = vm;
-                    b = vd;
-                    break;
+                    if (mask_line[x >> 5] & (msb >> (x & 31)))
+                    {
+                        result_line[x] = palette[*label++];
+                    }
+                    else
+                    {
+                        QRgb const pixel = background_line[x];
+                        result_line[x] = ((pixel & 0x00ffffff) == 0x00ffffff) ? palette[0] : (pixel | 0xff000000);
+                    }
                 }
             }
-            r = (r < 0) ? 0 : (r < 255) ? r : 255;
-            g = (g < 0) ? 0 : (g < 255) ? g : 255;
-            b = (b < 0) ? 0 : (b < 255) ? b : 255;
-            mean_h[k] = r;
-            mean_s[k] = g;
-            mean_v[k] = b;
         }
-        mean_h[0] *= coef_bg;
-        mean_s[0] *= coef_bg;
-        mean_v[0] *= coef_bg;
-        mean_h[0] += ((1.0f - coef_bg) * 255.0f);
-        mean_s[0] += ((1.0f - coef_bg) * 255.0f);
-        mean_v[0] += ((1.0f - coef_bg) * 255.0f);
-
-        mask_line = mask.data();
-        clusters_line = clusters.data();
-        for (unsigned int y = 0; y < h; y++)
+
+        dst = result;
+    }
+}
+
+QImage colorQuantize(QImage const& image, int const ncount)
+{
+    if (image.isNull() || (ncount <= 0) || (ncount > 254))
+    {
+        return image;
+    }
+
+    int const w = image.width();
+    int const h = image.height();
+    QImage const rgb(image.convertToFormat(QImage::Format_RGB32));
+
+    // Pure black and pure white are left to the black and white layer.
+    BinaryImage mask(w, h, WHITE);
+    uint32_t* const mask_data = mask.data();
+    int const mask_wpl = mask.wordsPerLine();
+    uint32_t const msb = uint32_t(1) << 31;
+    for (int y = 0; y < h; ++y)
+    {
+        QRgb const* rgb_line = (QRgb const*) rgb.constScanLine(y);
+        uint32_t* mask_line = mask_data + y * mask_wpl;
+        for (int x = 0; x < w; ++x)
         {
-            QRgb *rowh = (QRgb*)hsv_img.constScanLine(y);
-            for (unsigned int x = 0; x < w; x++)
+            uint32_t const color = rgb_line[x] & 0x00ffffff;
+            if ((color != 0) && (color != 0x00ffffff))
+            {
+                mask_line[x >> 5] |= msb >> (x & 31);
+            }
+        }
+    }
+
+    HsvKMeans kmeans(rgb, mask);
+    kmeans.clusterize(ncount);
+    QRgb palette[HsvKMeans::MAX_CLUSTERS];
+    kmeans.palette(palette, 0.0f, 0.0f, 0.0f);
+
+    // Index 0 is white (the background cluster with coef_bg = 0),
+    // indices 1 to ncount are the clusters, ncount + 1 is black.
+    int const black_idx = ncount + 1;
+    QVector<QRgb> color_table(ncount + 2);
+    for (int k = 0; k <= ncount; ++k)
+    {
+        color_table[k] = palette[k];
+    }
+    color_table[black_idx] = qRgb(0, 0, 0);
+
+    QImage result(w, h, QImage::Format_Indexed8);
+    result.setColorTable(color_table);
+    if (result.isNull())
+    {
+        throw std::bad_alloc();
+    }
+
+    #pragma omp parallel
+    {
+        std::vector<int> labels(w);
+        std::vector<float> dist_min(w);
+
+        #pragma omp for schedule(static)
+        for (int y = 0; y < h; ++y)
+        {
+            kmeans.labelLine(y, &labels[0], &dist_min[0]);
+
+            QRgb const* rgb_line = (QRgb const*) rgb.constScanLine(y);
+            uint32_t const* mask_line = mask_data + y * mask_wpl;
+            uint8_t* result_line = result.scanLine(y);
+            int const* label = &labels[0];
+            for (int x = 0; x < w; ++x)
             {
-                int r, g, b;
                 if (mask_line[x >> 5] & (msb >> (x & 31)))
                 {
-                    int const cluster = clusters_line[x];
-                    r = mean_h[cluster];
-                    g = mean_s[cluster];
-                    b = mean_v[cluster];
+                    result_line[x] = (uint8_t) *label++;
                 }
                 else
                 {
-                    QRgb const pixel = dst.pixel(x, y);
-                    r = qRed(pixel);
-                    g = qGreen(pixel);
-                    b = qBlue(pixel);
-                    if ((r == 255) && (g == 255) && (b == 255))
-                    {
-                        r = mean_h[0];
-                        g = mean_s[0];
-                        b = mean_v[0];
-                    }
+                    result_line[x] = (rgb_line[x] & 0x00ffffff) ? 0 : black_idx;
                 }
-                rowh[x] = qRgb(r, g, b);
             }
-            mask_line += mask_wpl;
-            clusters_line += clusters_bpl;
         }
-
-        dst = hsv_img;
     }
+
+    result.setDotsPerMeterX(image.dotsPerMeterX());
+    result.setDotsPerMeterY(image.dotsPerMeterY());
+    return result;
 }
 
 void maskMorphologicalErode(
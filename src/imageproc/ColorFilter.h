@@ -109,10 +109,33 @@ void coloredDimmingFilterInPlace(
 void coloredMaskInPlace(
     QImage& image, BinaryImage content, BinaryImage mask);
 
+/**
+ * @brief Replaces the colors of the black pixels of mask with ncount
+ *        colors found by k-means clustering.
+ *
+ * Pixels outside of the mask are taken from dst, except for pure white
+ * ones, which get the mean color of the unmasked part of image, mixed
+ * with white according to coef_bg.  coef_sat and coef_norm stretch the
+ * saturation and value of the cluster colors.  The result is stored
+ * into dst as an RGB32 image.
+ */
 void hsvKMeansInPlace(
     QImage& dst, QImage const& image, BinaryImage const& mask, int const ncount,
     float coef_sat = 0.0f, float coef_norm = 0.0f, float coef_bg = 0.0f);
 
+/**
+ * @brief Reduces an image to at most ncount colors plus black and white.
+ *
+ * Pixels other than pure black and pure white are clustered by
+ * hsvKMeansInPlace().
+ *
+ * @param image The image to quantize. A null image is allowed.
+ * @param ncount The number of colors, in [1, 254].  Other values
+ *        return the image unchanged.
+ * @return An Indexed8 image with ncount + 2 palette entries.
+ */
+QImage colorQuantize(QImage const& image, int ncount);
+
 void maskMorphologicalErode(
     QImage& image, BinaryImage const& mask, int radius = 0);
 
@@ -27,6 +27,7 @@
 #include <algorithm>
 #include <stdexcept>
 #include <assert.h>
+#include <string.h>
 
 namespace imageproc
 {
@@ -34,11 +35,151 @@ namespace imageproc
 uint32_t const ConnectivityMap::BACKGROUND = ~uint32_t(0);
 uint32_t const ConnectivityMap::UNTAGGED_FG = BACKGROUND - 1;
 
+namespace
+{
+
+/**
+ * Rows per strip.  Strips are labelled independently (and in parallel),
+ * then merged along their seams.
+ */
+int const STRIP_HEIGHT = 64;
+
+/**
+ * \brief A horizontal run of black pixels, covering [x0, x1).
+ */
+struct Run {
+    int x0;
+    int x1;
+
+    Run(int x0, int x1) : x0(x0), x1(x1) {}
+};
+
+struct RunStrip {
+    std::vector<Run> runs;
+
+    /**
+     * Union-find parents of runs, indexed locally within a strip.
+     */
+    std::vector<uint32_t> parents;
+
+    /**
+     * rowStarts[i] is the index of the first run on the i-th row of a strip.
+     * There is an extra element at the end, equal to runs.size().
+     */
+    std::vector<uint32_t> rowStarts;
+};
+
+uint32_t findRoot(std::vector<uint32_t>& parents, uint32_t idx)
+{
+    while (parents[idx] != idx) {
+        // Path halving.
+        parents[idx] = parents[parents[idx]];
+        idx = parents[idx];
+    }
+    return idx;
+}
+
+/**
+ * The root with a smaller index wins, which means a root is always the
+ * first run of a component in raster order, and a parent index never
+ * exceeds the index of its child.
+ */
+void unite(std::vector<uint32_t>& parents, uint32_t idx1, uint32_t idx2)
+{
+    idx1 = findRoot(parents, idx1);
+    idx2 = findRoot(parents, idx2);
+    if (idx1 < idx2) {
+        parents[idx2] = idx1;
+    } else if (idx2 < idx1) {
+        parents[idx1] = idx2;
+    }
+}
+
+/**
+ * Appends the runs of black pixels found on a line of a BinaryImage.
+ * Words that are entirely white (outside of a run) or entirely black
+ * (inside of a run) are skipped without looking at individual bits.
+ */
+void extractRuns(uint32_t const* line, int const width, std::vector<Run>& runs)
+{
+    int const num_words = (width + 31) >> 5;
+    uint32_t const last_word_mask = ~uint32_t(0) << ((32 - width) & 31);
+
+    int run_start = -1;
+    for (int i = 0; i < num_words; ++i) {
+        uint32_t word = line[i];
+        if (i == num_words - 1) {
+            word &= last_word_mask;
+        }
+
+        if (run_start < 0) {
+            if (word == 0) {
+                continue;
+            }
+        } else if (word == ~uint32_t(0)) {
+            continue;
+        }
+
+        int const base = i << 5;
+        int pos = 0;
+        for (;;) {
+            if (run_start < 0) {
+                uint32_t const rest = word << pos;
+                if (!rest) {
+                    break;
+                }
+                pos += countMostSignificantZeroes(rest);
+                run_start = base + pos;
+            } else {
+                uint32_t const rest = ~word << pos;
+                if (!rest) {
+                    break;
+                }
+                pos += countMostSignificantZeroes(rest);
+                runs.push_back(Run(run_start, base + pos));
+                run_start = -1;
+            }
+        }
+    }
+
+    if (run_start >= 0) {
+        runs.push_back(Run(run_start, width));
+    }
+}
+
+/**
+ * Unites runs on adjacent lines.
+ *
+ * \param slack 0 for 4-connectivity, 1 for 8-connectivity.
+ */
+void connectRuns(
+    Run const* prev, uint32_t const num_prev, uint32_t const prev_base,
+    Run const* cur, uint32_t const num_cur, uint32_t const cur_base,
+    int const slack, std::vector<uint32_t>& parents)
+{
+    uint32_t first_prev = 0;
+    for (uint32_t i = 0; i < num_cur; ++i) {
+        Run const& run = cur[i];
+
+        // Runs ending before this one can't touch any of the following ones either.
+        while (first_prev < num_prev && prev[first_prev].x1 + slack <= run.x0) {
+            ++first_prev;
+        }
+
+        for (uint32_t j = first_prev; j < num_prev && prev[j].x0 < run.x1 + slack; ++j) {
+            unite(parents, prev_base + j, cur_base + i);
+        }
+    }
+}
+
+} // anonymous namespace
+
 ConnectivityMap::ConnectivityMap()
     :   m_pData(0),
         m_size(),
         m_stride(0),
-        m_maxLabel(0)
+        m_maxLabel(0),
+        m_compactLabels(false)
 {
 }
 
@@ -46,7 +187,8 @@ ConnectivityMap::ConnectivityMap(QSize const& size)
     :   m_pData(0),
         m_size(size),
         m_stride(0),
-        m_maxLabel(0)
+        m_maxLabel(0),
+        m_compactLabels(false)
 {
     if (m_size.isEmpty()) {
         return;
@@ -65,7 +207,8 @@ ConnectivityMap::ConnectivityMap(
     :   m_pData(0),
         m_size(image.size()),
         m_stride(0),
-        m_maxLabel(0)
+        m_maxLabel(0),
+        m_compactLabels(false)
 {
     if (m_size.isEmpty()) {
         return;
@@ -74,28 +217,11 @@ ConnectivityMap::ConnectivityMap(
     int const width = m_size.width();
     int const height = m_size.height();
 
-    m_data.resize((width + 2) * (height + 2), BACKGROUND);
+    m_data.resize((width + 2) * (height + 2), 0);
     m_stride = width + 2;
     m_pData = &m_data[0] + 1 + m_stride;
 
-    uint32_t* dst = m_pData;
-    int const dst_stride = m_stride;
-
-    uint32_t const* src = image.data();
-    int const src_stride = image.wordsPerLine();
-
-    uint32_t const msb = uint32_t(1) << 31;
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            if (src[x >> 5] & (msb >> (x & 31))) {
-                dst[x] = UNTAGGED_FG;
-            }
-        }
-        src += src_stride;
-        dst += dst_stride;
-    }
-
-    assignIds(conn);
+    m_maxLabel = labelRuns(image, conn);
 }
 
 ConnectivityMap::ConnectivityMap(ConnectivityMap const& other)
@@ -103,9 +229,10 @@ ConnectivityMap::ConnectivityMap(ConnectivityMap const& other)
         m_pData(0),
         m_size(other.size()),
         m_stride(other.stride()),
-        m_maxLabel(other.m_maxLabel)
+        m_maxLabel(other.m_maxLabel),
+        m_compactLabels(other.m_compactLabels)
 {
-    if (!m_size.isEmpty()) {
+    if (!m_size.isEmpty() && !m_compactLabels) {
         m_pData = &m_data[0] + m_stride + 1;
     }
 }
@@ -114,7 +241,8 @@ ConnectivityMap::ConnectivityMap(InfluenceMap const& imap)
     :   m_pData(0),
         m_size(imap.size()),
         m_stride(imap.stride()),
-        m_maxLabel(imap.maxLabel())
+        m_maxLabel(imap.maxLabel()),
+        m_compactLabels(false)
 {
     if (m_size.isEmpty()) {
         return;
@@ -134,7 +262,7 @@ ConnectivityMap::operator=(ConnectivityMap const& other)
 ConnectivityMap&
 ConnectivityMap::operator=(InfluenceMap const& imap)
 {
-    if (m_size == imap.size() && !m_size.isEmpty()) {
+    if (m_size == imap.size() && !m_size.isEmpty() && !m_compactLabels) {
         // Common case optimization.
         copyFromInfluenceMap(imap);
     } else {
@@ -151,11 +279,14 @@ ConnectivityMap::swap(ConnectivityMap& other)
     std::swap(m_size, other.m_size);
     std::swap(m_stride, other.m_stride);
     std::swap(m_maxLabel, other.m_maxLabel);
+    std::swap(m_compactLabels, other.m_compactLabels);
 }
 
 void
 ConnectivityMap::addComponent(BinaryImage const& image)
 {
+    assert(!m_compactLabels);
+
     if (m_size != image.size()) {
         throw std::invalid_argument("ConnectivityMap::addComponent: sizes don't match");
     }
@@ -187,6 +318,40 @@ ConnectivityMap::addComponent(BinaryImage const& image)
     m_maxLabel = new_label;
 }
 
+bool
+ConnectivityMap::compactLabels()
+{
+    if (m_compactLabels) {
+        return true;
+    }
+    if (m_size.isEmpty() || m_maxLabel > 0xffff) {
+        return false;
+    }
+
+    // The label at index i goes to bytes [2 * i, 2 * i + 2), which have
+    // already been read.  Going through memcpy() keeps these stores
+    // from being reordered with 32-bit loads of the following labels.
+    char* const dst = reinterpret_cast<char*>(&m_data[0]);
+    size_t const size = m_data.size();
+    for (size_t i = 0; i < size; ++i) {
+        uint16_t const label = static_cast<uint16_t>(m_data[i]);
+        memcpy(dst + i * sizeof(label), &label, sizeof(label));
+    }
+
+    m_pData = 0;
+    m_compactLabels = true;
+    return true;
+}
+
+uint16_t const*
+ConnectivityMap::compactData() const
+{
+    if (!m_compactLabels) {
+        return 0;
+    }
+    return reinterpret_cast<uint16_t const*>(&m_data[0]) + m_stride + 1;
+}
+
 GridAccessor<uint32_t const>
 ConnectivityMap::accessor() const
 {
@@ -205,6 +370,8 @@ ConnectivityMap::accessor()
 QImage
 ConnectivityMap::visualized(QColor bgcolor) const
 {
+    assert(!m_compactLabels);
+
     if (m_size.isEmpty()) {
         return QImage();
     }
@@ -259,6 +426,139 @@ ConnectivityMap::copyFromInfluenceMap(InfluenceMap const& imap)
     }
 }
 
+/**
+ * Labels a BinaryImage through runs of black pixels, which are united
+ * into components with a union-find structure.  Horizontal strips of
+ * the image are processed in parallel, and then merged along their seams.
+ * Labels are assigned in the raster order of components' first pixels,
+ * just like assignIds() does.
+ *
+ * The map is expected to be filled with zeroes.
+ *
+ * \return The maximum label assigned.
+ */
+uint32_t
+ConnectivityMap::labelRuns(BinaryImage const& image, Connectivity const conn)
+{
+    int const width = m_size.width();
+    int const height = m_size.height();
+    int const slack = conn == CONN8 ? 1 : 0;
+
+    uint32_t const* const src_data = image.data();
+    int const src_stride = image.wordsPerLine();
+
+    int const num_strips = (height + STRIP_HEIGHT - 1) / STRIP_HEIGHT;
+    std::vector<RunStrip> strips(num_strips);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int s = 0; s < num_strips; ++s) {
+        RunStrip& strip = strips[s];
+        int const y0 = s * STRIP_HEIGHT;
+        int const num_rows = std::min(STRIP_HEIGHT, height - y0);
+
+        strip.rowStarts.reserve(num_rows + 1);
+        uint32_t const* src_line = src_data + src_stride * y0;
+        for (int row = 0; row < num_rows; ++row, src_line += src_stride) {
+            strip.rowStarts.push_back(strip.runs.size());
+            extractRuns(src_line, width, strip.runs);
+        }
+        strip.rowStarts.push_back(strip.runs.size());
+
+        uint32_t const num_runs = strip.runs.size();
+        strip.parents.resize(num_runs);
+        for (uint32_t i = 0; i < num_runs; ++i) {
+            strip.parents[i] = i;
+        }
+
+        Run const* const runs = strip.runs.empty() ? 0 : &strip.runs[0];
+        for (int row = 1; row < num_rows; ++row) {
+            uint32_t const prev_begin = strip.rowStarts[row - 1];
+            uint32_t const cur_begin = strip.rowStarts[row];
+            uint32_t const cur_end = strip.rowStarts[row + 1];
+            connectRuns(
+                runs + prev_begin, cur_begin - prev_begin, prev_begin,
+                runs + cur_begin, cur_end - cur_begin, cur_begin,
+                slack, strip.parents
+            );
+        }
+    }
+
+    std::vector<uint32_t> offsets(num_strips + 1, 0);
+    for (int s = 0; s < num_strips; ++s) {
+        offsets[s + 1] = offsets[s] + strips[s].runs.size();
+    }
+
+    uint32_t const total_runs = offsets[num_strips];
+    if (total_runs == 0) {
+        return 0;
+    }
+
+    std::vector<uint32_t> parents(total_runs);
+
+    #pragma omp parallel for
+    for (int s = 0; s < num_strips; ++s) {
+        uint32_t const offset = offsets[s];
+        std::vector<uint32_t> const& local_parents = strips[s].parents;
+        uint32_t const num_runs = local_parents.size();
+        for (uint32_t i = 0; i < num_runs; ++i) {
+            parents[offset + i] = local_parents[i] + offset;
+        }
+    }
+
+    // Merge strips along their seams.
+    for (int s = 1; s < num_strips; ++s) {
+        RunStrip const& upper = strips[s - 1];
+        RunStrip const& lower = strips[s];
+        if (upper.runs.empty() || lower.runs.empty()) {
+            continue;
+        }
+
+        uint32_t const upper_begin = upper.rowStarts[upper.rowStarts.size() - 2];
+        uint32_t const upper_end = upper.runs.size();
+        uint32_t const lower_end = lower.rowStarts[1];
+        connectRuns(
+            &upper.runs[0] + upper_begin, upper_end - upper_begin, offsets[s - 1] + upper_begin,
+            &lower.runs[0], lower_end, offsets[s],
+            slack, parents
+        );
+    }
+
+    // Turn parents into labels.  As a parent index never exceeds the index
+    // of its child, the parent's entry has already been turned into a label
+    // of its root by the time we get to the child.
+    uint32_t next_label = 1;
+    for (uint32_t i = 0; i < total_runs; ++i) {
+        uint32_t const parent = parents[i];
+        if (parent == i) {
+            parents[i] = next_label;
+            ++next_label;
+        } else {
+            parents[i] = parents[parent];
+        }
+    }
+
+    uint32_t* const dst_data = m_pData;
+    int const dst_stride = m_stride;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int s = 0; s < num_strips; ++s) {
+        RunStrip const& strip = strips[s];
+        uint32_t const* const labels = &parents[0] + offsets[s];
+        int const num_rows = strip.rowStarts.size() - 1;
+
+        uint32_t* dst_line = dst_data + dst_stride * s * STRIP_HEIGHT;
+        for (int row = 0; row < num_rows; ++row, dst_line += dst_stride) {
+            uint32_t const end = strip.rowStarts[row + 1];
+            for (uint32_t i = strip.rowStarts[row]; i < end; ++i) {
+                Run const& run = strip.runs[i];
+                std::fill(dst_line + run.x0, dst_line + run.x1, labels[i]);
+            }
+        }
+    }
+
+    return next_label - 1;
+}
+
 void
 ConnectivityMap::assignIds(Connectivity const conn)
 {
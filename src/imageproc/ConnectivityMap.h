@@ -22,6 +22,7 @@
 #include "Connectivity.h"
 #include "FastQueue.h"
 #include "foundation/GridAccessor.h"
+#include "foundation/ScratchArena.h"
 #include <QSize>
 #include <QColor>
 #include <Qt>
@@ -65,6 +66,9 @@ public:
 
     /**
      * \brief Labels components in a binary image.
+     *
+     * Labelling works on runs of black pixels rather than on individual
+     * pixels, and horizontal strips of the image are processed in parallel.
      */
     ConnectivityMap(BinaryImage const& image, Connectivity conn);
 
@@ -105,6 +109,37 @@ public:
      */
     void addComponent(BinaryImage const& image);
 
+    /**
+     * \brief Switches to 16-bit labels, if maxLabel() fits into them.
+     *
+     * The labels are packed in place, at the beginning of the same storage,
+     * and keep the same stride(), so label lookups touch half the memory.
+     * After that, labels are read through compactData(), while data(),
+     * paddedData() and accessor() return null.  Other methods that need
+     * 32-bit labels, like addComponent() and visualized(), must not be
+     * called on such a map.
+     *
+     * \return true if the map now has compact labels.  Null maps and maps
+     *         with labels exceeding 65535 are left as they are.
+     */
+    bool compactLabels();
+
+    /**
+     * \brief Returns true if labels are 16-bit, see compactLabels().
+     */
+    bool hasCompactLabels() const
+    {
+        return m_compactLabels;
+    }
+
+    /**
+     * \brief Returns a pointer to the top-left corner of a compact map.
+     *
+     * Moving to the next line requires adding stride().  Returns null
+     * unless hasCompactLabels() is true.
+     */
+    uint16_t const* compactData() const;
+
     /**
      * \brief Returns a pointer to the top-left corner of the map.
      *
@@ -224,6 +259,8 @@ public:
 private:
     void copyFromInfluenceMap(InfluenceMap const& imap);
 
+    uint32_t labelRuns(BinaryImage const& image, Connectivity conn);
+
     void assignIds(Connectivity conn);
 
     uint32_t initialTagging();
@@ -249,11 +286,16 @@ private:
     static uint32_t const BACKGROUND;
     static uint32_t const UNTAGGED_FG;
 
-    std::vector<uint32_t> m_data;
+    /**
+     * Connectivity maps are built over and over for pages of similar
+     * sizes, so their storage comes from ScratchArena::local().
+     */
+    std::vector<uint32_t, ScratchAllocator<uint32_t> > m_data;
     uint32_t* m_pData;
     QSize m_size;
     int m_stride;
     uint32_t m_maxLabel;
+    bool m_compactLabels;
 };
 
 inline void swap(ConnectivityMap& o1, ConnectivityMap& o2)
@@ -268,7 +310,8 @@ ConnectivityMap::ConnectivityMap(
     :   m_pData(0),
         m_size(size),
         m_stride(0),
-        m_maxLabel(0)
+        m_maxLabel(0),
+        m_compactLabels(false)
 {
     if (size.isEmpty()) {
         return;
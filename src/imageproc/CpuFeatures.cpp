@@ -0,0 +1,113 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C)  Joseph Artsimovich <joseph.artsimovich@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "CpuFeatures.h"
+#include "SimdKernels.h"
+#include <stdlib.h>
+#include <string.h>
+
+namespace imageproc
+{
+
+namespace
+{
+
+CpuFeatures::Level detectLevel()
+{
+#if defined(IMAGEPROC_TARGET_DISPATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+        return CpuFeatures::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return CpuFeatures::SSE42;
+    }
+#endif
+    return CpuFeatures::BASELINE;
+}
+
+CpuFeatures::Level applyOverride(CpuFeatures::Level const detected)
+{
+    char const* const forced = getenv("SCANTAILOR_SIMD");
+    if (!forced) {
+        return detected;
+    }
+
+    CpuFeatures::Level requested = detected;
+    if (strcmp(forced, "baseline") == 0) {
+        requested = CpuFeatures::BASELINE;
+    } else if (strcmp(forced, "sse4.2") == 0) {
+        requested = CpuFeatures::SSE42;
+    } else if (strcmp(forced, "avx2") == 0) {
+        requested = CpuFeatures::AVX2;
+    }
+
+    return requested < detected ? requested : detected;
+}
+
+} // anonymous namespace
+
+CpuFeatures::Level
+CpuFeatures::detectedLevel()
+{
+    static Level const detected = detectLevel();
+    return detected;
+}
+
+CpuFeatures::Level
+CpuFeatures::level()
+{
+    static Level const level = applyOverride(detectedLevel());
+    return level;
+}
+
+char const*
+CpuFeatures::levelName(Level const level)
+{
+    switch (level) {
+        case AVX2:
+            return "avx2";
+        case SSE42:
+            return "sse4.2";
+        case BASELINE:
+            break;
+    }
+    return "baseline";
+}
+
+std::vector<std::pair<char const*, char const*> >
+CpuFeatures::kernelImplementations()
+{
+#if defined(IMAGEPROC_TARGET_DISPATCH)
+    char const* const templates = levelName(level());
+#else
+    char const* const templates = levelName(BASELINE);
+#endif
+    char const* const tables = simdKernels().name;
+
+    std::vector<std::pair<char const*, char const*> > impls;
+    impls.push_back(std::make_pair("toGrayscale", tables));
+    impls.push_back(std::make_pair("ReduceThreshold", tables));
+    impls.push_back(std::make_pair("binarizeFromMap", tables));
+    impls.push_back(std::make_pair("grayRasterOp", templates));
+    impls.push_back(std::make_pair("rasterOp", templates));
+    impls.push_back(std::make_pair("rasterOpGeneric", templates));
+    return impls;
+}
+
+} // namespace imageproc
@@ -0,0 +1,81 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C)  Joseph Artsimovich <joseph.artsimovich@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGEPROC_CPU_FEATURES_H_
+#define IMAGEPROC_CPU_FEATURES_H_
+
+#include <utility>
+#include <vector>
+
+/**
+ * IMAGEPROC_TARGET_SSE42 and IMAGEPROC_TARGET_AVX2 make the compiler
+ * generate code for a specific instruction set for one function, regardless
+ * of the global compiler flags.  They are only defined where such functions
+ * may be called after checking CpuFeatures::level().
+ * A loop shared by such functions should be IMAGEPROC_FORCE_INLINE,
+ * so that each of them gets its own copy.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGEPROC_TARGET_DISPATCH 1
+#define IMAGEPROC_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define IMAGEPROC_TARGET_AVX2 __attribute__((target("avx2,bmi2")))
+#define IMAGEPROC_FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define IMAGEPROC_FORCE_INLINE inline
+#endif
+
+namespace imageproc
+{
+
+/**
+ * \brief The instruction set level imageproc kernels are allowed to use.
+ *
+ * The level is detected once, with cpuid.  The SCANTAILOR_SIMD environment
+ * variable, set to "baseline", "sse4.2" or "avx2", lowers it, so that
+ * different implementations of a kernel can be compared on one machine.
+ * It can't raise the level above what the CPU supports.
+ */
+class CpuFeatures
+{
+public:
+    enum Level { BASELINE, SSE42, AVX2 };
+
+    /**
+     * \brief The level to use, taking SCANTAILOR_SIMD into account.
+     */
+    static Level level();
+
+    /**
+     * \brief The highest level supported by the CPU.
+     */
+    static Level detectedLevel();
+
+    static char const* levelName(Level level);
+
+    /**
+     * \brief Pairs of (kernel, implementation) for the dispatched kernels.
+     *
+     * The implementation is the name of the level the kernel runs at,
+     * which may be below level() if the kernel wasn't built for it.
+     */
+    static std::vector<std::pair<char const*, char const*> > kernelImplementations();
+};
+
+} // namespace imageproc
+
+#endif
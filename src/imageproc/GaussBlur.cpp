@@ -23,6 +23,11 @@
 #include "GrayImage.h"
 #include "Constants.h"
 #include <Eigen/Core>
+#include <algorithm>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace Eigen;
 
@@ -215,17 +220,12 @@ calcBackwardPassInitialConditions(FilterParams const& p, float* w_end, float fut
     w_end[2] = result[2];
 }
 
-void initPaddingLayers(Grid<float>& intermediate_image)
+void initPaddingLayers(float* const padded_data, int const width, int const height, int const stride)
 {
-    assert(intermediate_image.padding() == 2);
-
-    int const width = intermediate_image.width();
-    int const height = intermediate_image.height();
-    int const stride = intermediate_image.stride();
-    float* line = intermediate_image.paddedData();
+    float* line = padded_data;
 
     // Outer padding.
-    memset(line, 0, stride);
+    memset(line, 0, stride * sizeof(float));
     line += stride;
 
     // 1px outer padding - inner padding - 1px outer padding.
@@ -259,9 +259,310 @@ void initPaddingLayers(Grid<float>& intermediate_image)
     line += stride;
 
     // Outer padding.
-    memset(line, 0, stride);
+    memset(line, 0, stride * sizeof(float));
+}
+
+IirConstants::IirConstants(float const std_dev)
+{
+    find_iir_constants(n_p, n_m, d_p, d_m, bd_p, bd_m, std_dev);
+}
+
+void filterLine(IirConstants const& c, float const* in, float* vp, float* vm, int const size)
+{
+    float const initial_p = in[0];
+    float const initial_m = in[size - 1];
+
+    // Causal part.
+    for (int x = 0; x < size; ++x)
+    {
+        int const terms = x < 4 ? x : 4;
+        float val = c.n_p[0] * in[x];
+        int i = 1;
+        for (; i <= terms; ++i)
+        {
+            val += c.n_p[i] * in[x - i] - c.d_p[i] * vp[x - i];
+        }
+        for (; i <= 4; ++i)
+        {
+            val += (c.n_p[i] - c.bd_p[i]) * initial_p;
+        }
+        vp[x] = val;
+    }
+
+    // Anti-causal part.
+    for (int x = size - 1; x >= 0; --x)
+    {
+        int const terms = size - 1 - x < 4 ? size - 1 - x : 4;
+        float val = 0.0f; // n_m[0] is zero.
+        int i = 1;
+        for (; i <= terms; ++i)
+        {
+            val += c.n_m[i] * in[x + i] - c.d_m[i] * vm[x + i];
+        }
+        for (; i <= 4; ++i)
+        {
+            val += (c.n_m[i] - c.bd_m[i]) * initial_m;
+        }
+        vm[x] = val;
+    }
+
+    for (int x = 0; x < size; ++x)
+    {
+        vp[x] += vm[x];
+    }
+}
+
+#ifdef __SSE2__
+
+void filterColumns(IirConstants const& c, float const* in, float* vp, float* vm, int const height)
+{
+    int const L = COLUMN_LANES;
+    float const* last_in = in + (height - 1) * L;
+
+    // Causal part.
+    for (int y = 0; y < height; ++y)
+    {
+        int const terms = y < 4 ? y : 4;
+        for (int lane = 0; lane < L; lane += 4)
+        {
+            float const* p_in = in + y * L + lane;
+            float* p_vp = vp + y * L + lane;
+            __m128 val = _mm_mul_ps(_mm_set1_ps(c.n_p[0]), _mm_loadu_ps(p_in));
+            int i = 1;
+            for (; i <= terms; ++i)
+            {
+                __m128 const n = _mm_mul_ps(_mm_set1_ps(c.n_p[i]), _mm_loadu_ps(p_in - i * L));
+                __m128 const d = _mm_mul_ps(_mm_set1_ps(c.d_p[i]), _mm_loadu_ps(p_vp - i * L));
+                val = _mm_add_ps(val, _mm_sub_ps(n, d));
+            }
+            if (i <= 4)
+            {
+                __m128 const initial = _mm_loadu_ps(in + lane);
+                for (; i <= 4; ++i)
+                {
+                    __m128 const k = _mm_set1_ps(c.n_p[i] - c.bd_p[i]);
+                    val = _mm_add_ps(val, _mm_mul_ps(k, initial));
+                }
+            }
+            _mm_storeu_ps(p_vp, val);
+        }
+    }
+
+    // Anti-causal part.
+    for (int y = height - 1; y >= 0; --y)
+    {
+        int const terms = height - 1 - y < 4 ? height - 1 - y : 4;
+        for (int lane = 0; lane < L; lane += 4)
+        {
+            float const* p_in = in + y * L + lane;
+            float* p_vm = vm + y * L + lane;
+            // n_m[0] is zero.
+            __m128 val = _mm_setzero_ps();
+            int i = 1;
+            for (; i <= terms; ++i)
+            {
+                __m128 const n = _mm_mul_ps(_mm_set1_ps(c.n_m[i]), _mm_loadu_ps(p_in + i * L));
+                __m128 const d = _mm_mul_ps(_mm_set1_ps(c.d_m[i]), _mm_loadu_ps(p_vm + i * L));
+                val = _mm_add_ps(val, _mm_sub_ps(n, d));
+            }
+            if (i <= 4)
+            {
+                __m128 const initial = _mm_loadu_ps(last_in + lane);
+                for (; i <= 4; ++i)
+                {
+                    __m128 const k = _mm_set1_ps(c.n_m[i] - c.bd_m[i]);
+                    val = _mm_add_ps(val, _mm_mul_ps(k, initial));
+                }
+            }
+            _mm_storeu_ps(p_vm, val);
+        }
+    }
+
+    int const total = height * L;
+    for (int i = 0; i < total; i += 4)
+    {
+        _mm_storeu_ps(vp + i, _mm_add_ps(_mm_loadu_ps(vp + i), _mm_loadu_ps(vm + i)));
+    }
+}
+
+void filterColumns(FilterParams const& p, float* w, int const height)
+{
+    int const L = COLUMN_LANES;
+    float* const rows = w + 3 * L;
+
+    __m128 const a1 = _mm_set1_ps(p.a1);
+    __m128 const a2 = _mm_set1_ps(p.a2);
+    __m128 const a3 = _mm_set1_ps(p.a3);
+
+    float last_pixels[L];
+    for (int lane = 0; lane < L; ++lane)
+    {
+        last_pixels[lane] = rows[(height - 1) * L + lane];
+        rows[-L + lane] = rows[-2 * L + lane] = rows[-3 * L + lane] = rows[lane] / p.B;
+    }
+
+    // Forward pass.
+    for (int y = 0; y < height; ++y)
+    {
+        float* row = rows + y * L;
+        for (int lane = 0; lane < L; lane += 4)
+        {
+            __m128 val = _mm_loadu_ps(row + lane);
+            val = _mm_add_ps(val, _mm_mul_ps(a1, _mm_loadu_ps(row + lane - L)));
+            val = _mm_add_ps(val, _mm_mul_ps(a2, _mm_loadu_ps(row + lane - 2 * L)));
+            val = _mm_add_ps(val, _mm_mul_ps(a3, _mm_loadu_ps(row + lane - 3 * L)));
+            _mm_storeu_ps(row + lane, val);
+        }
+    }
+
+    // Backward pass initial conditions, one column at a time.
+    float* const end = rows + height * L;
+    for (int lane = 0; lane < L; ++lane)
+    {
+        float w_tail[6] = { end[lane - 3 * L], end[lane - 2 * L], end[lane - L] };
+        calcBackwardPassInitialConditions(p, w_tail + 3, last_pixels[lane]);
+        end[lane] = w_tail[3];
+        end[lane + L] = w_tail[4];
+        end[lane + 2 * L] = w_tail[5];
+    }
+
+    // Backward pass.
+    for (int y = height - 1; y >= 0; --y)
+    {
+        float* row = rows + y * L;
+        for (int lane = 0; lane < L; lane += 4)
+        {
+            __m128 val = _mm_loadu_ps(row + lane);
+            val = _mm_add_ps(val, _mm_mul_ps(a1, _mm_loadu_ps(row + lane + L)));
+            val = _mm_add_ps(val, _mm_mul_ps(a2, _mm_loadu_ps(row + lane + 2 * L)));
+            val = _mm_add_ps(val, _mm_mul_ps(a3, _mm_loadu_ps(row + lane + 3 * L)));
+            _mm_storeu_ps(row + lane, val);
+        }
+    }
+
+    // Re-scale by B^2.
+    __m128 const B2 = _mm_set1_ps(p.B * p.B);
+    int const total = height * L;
+    for (int i = 0; i < total; i += 4)
+    {
+        _mm_storeu_ps(rows + i, _mm_mul_ps(_mm_loadu_ps(rows + i), B2));
+    }
+}
+
+#else // !__SSE2__
+
+void filterColumns(IirConstants const& c, float const* in, float* vp, float* vm, int const height)
+{
+    int const L = COLUMN_LANES;
+    float const* last_in = in + (height - 1) * L;
+
+    // Causal part.
+    for (int y = 0; y < height; ++y)
+    {
+        int const terms = y < 4 ? y : 4;
+        float const* p_in = in + y * L;
+        float* p_vp = vp + y * L;
+        for (int lane = 0; lane < L; ++lane)
+        {
+            float val = c.n_p[0] * p_in[lane];
+            int i = 1;
+            for (; i <= terms; ++i)
+            {
+                val += c.n_p[i] * p_in[lane - i * L] - c.d_p[i] * p_vp[lane - i * L];
+            }
+            for (; i <= 4; ++i)
+            {
+                val += (c.n_p[i] - c.bd_p[i]) * in[lane];
+            }
+            p_vp[lane] = val;
+        }
+    }
+
+    // Anti-causal part.
+    for (int y = height - 1; y >= 0; --y)
+    {
+        int const terms = height - 1 - y < 4 ? height - 1 - y : 4;
+        float const* p_in = in + y * L;
+        float* p_vm = vm + y * L;
+        for (int lane = 0; lane < L; ++lane)
+        {
+            float val = 0.0f; // n_m[0] is zero.
+            int i = 1;
+            for (; i <= terms; ++i)
+            {
+                val += c.n_m[i] * p_in[lane + i * L] - c.d_m[i] * p_vm[lane + i * L];
+            }
+            for (; i <= 4; ++i)
+            {
+                val += (c.n_m[i] - c.bd_m[i]) * last_in[lane];
+            }
+            p_vm[lane] = val;
+        }
+    }
+
+    int const total = height * L;
+    for (int i = 0; i < total; ++i)
+    {
+        vp[i] += vm[i];
+    }
+}
+
+void filterColumns(FilterParams const& p, float* w, int const height)
+{
+    int const L = COLUMN_LANES;
+    float* const rows = w + 3 * L;
+
+    float last_pixels[L];
+    for (int lane = 0; lane < L; ++lane)
+    {
+        last_pixels[lane] = rows[(height - 1) * L + lane];
+        rows[-L + lane] = rows[-2 * L + lane] = rows[-3 * L + lane] = rows[lane] / p.B;
+    }
+
+    // Forward pass.
+    for (int y = 0; y < height; ++y)
+    {
+        float* row = rows + y * L;
+        for (int lane = 0; lane < L; ++lane)
+        {
+            row[lane] = row[lane] + p.a1 * row[lane - L]
+                + p.a2 * row[lane - 2 * L] + p.a3 * row[lane - 3 * L];
+        }
+    }
+
+    // Backward pass initial conditions, one column at a time.
+    float* const end = rows + height * L;
+    for (int lane = 0; lane < L; ++lane)
+    {
+        float w_tail[6] = { end[lane - 3 * L], end[lane - 2 * L], end[lane - L] };
+        calcBackwardPassInitialConditions(p, w_tail + 3, last_pixels[lane]);
+        end[lane] = w_tail[3];
+        end[lane + L] = w_tail[4];
+        end[lane + 2 * L] = w_tail[5];
+    }
+
+    // Backward pass.
+    for (int y = height - 1; y >= 0; --y)
+    {
+        float* row = rows + y * L;
+        for (int lane = 0; lane < L; ++lane)
+        {
+            row[lane] = row[lane] + p.a1 * row[lane + L]
+                + p.a2 * row[lane + 2 * L] + p.a3 * row[lane + 3 * L];
+        }
+    }
+
+    // Re-scale by B^2.
+    float const B2 = p.B * p.B;
+    int const total = height * L;
+    for (int i = 0; i < total; ++i)
+    {
+        rows[i] *= B2;
+    }
 }
 
+#endif // __SSE2__
+
 } // namespace gauss_blur_impl
 
 GrayImage gaussBlur(GrayImage const& src, float h_sigma, float v_sigma)
@@ -23,6 +23,8 @@
 #define IMAGEPROC_GAUSSBLUR_H_
 
 #include "foundation/Grid.h"
+#include "foundation/NonCopyable.h"
+#include "foundation/ScratchArena.h"
 #include "ValueConv.h"
 #include "foundation/GridAccessor.h"
 #include "imageproc/RasterOpGeneric.h"
@@ -30,7 +32,9 @@
 #ifndef Q_MOC_RUN
 #include <boost/scoped_array.hpp>
 #endif
+#include <algorithm>
 #include <cmath>
+#include <stddef.h>
 
 namespace imageproc
 {
@@ -82,6 +86,8 @@ GrayImage gaussBlur(GrayImage const& src, float h_sigma, float v_sigma);
  * RoundAndClipValueConv<uint8_t> const float2byte;
  * gaussBlurGeneric(..., [float2byte](uint8_t& dst, float src) { dst = float2byte(src); });
  * \endcode
+ *
+ * \note float_reader and float_writer may be called from several threads at once.
  */
 template<typename SrcIt, typename DstIt, typename FloatReader, typename FloatWriter>
 void gaussBlurGeneric(QSize size, float h_sigma, float v_sigma,
@@ -129,6 +135,8 @@ void gaussBlurGeneric(QSize size, float h_sigma, float v_sigma,
  * RoundAndClipValueConv<uint8_t> const float2byte;
  * anisotropicGaussBlurGeneric(..., [float2byte](uint8_t& dst, float src) { dst = float2byte(src); });
  * \endcode
+ *
+ * \note float_reader and float_writer may be called from several threads at once.
  */
 template<typename SrcIt, typename DstIt, typename FloatReader, typename FloatWriter>
 void anisotropicGaussBlurGeneric(
@@ -144,27 +152,6 @@ void find_iir_constants(
     float* n_p, float* n_m, float* d_p,
     float* d_m, float* bd_p, float* bd_m, float std_dev);
 
-template<typename Src1It, typename Src2It, typename DstIt, typename FloatWriter>
-void save(int num_items, Src1It src1, Src2It src2,
-          DstIt dst, int dst_stride, FloatWriter writer)
-{
-    while (num_items-- != 0) {
-        writer(*dst, *src1 + *src2);
-        ++src1;
-        ++src2;
-        dst += dst_stride;
-    }
-}
-
-class FloatToFloatWriter
-{
-public:
-    void operator()(float& dst, float src) const
-    {
-        dst = src;
-    }
-};
-
 class FilterParams
 {
 public:
@@ -196,7 +183,47 @@ public:
 void calcBackwardPassInitialConditions(
     FilterParams const& p, float* w_end, float future_signal_val);
 
-void initPaddingLayers(Grid<float>& intermediate_image);
+/**
+ * Fills the 2px padding around an image stored at padded_data + 2 * stride + 2.
+ */
+void initPaddingLayers(float* padded_data, int width, int height, int stride);
+
+/**
+ * \brief Constants of the recursive filter used by gaussBlurGeneric().
+ */
+class IirConstants
+{
+public:
+    float n_p[5], n_m[5], d_p[5], d_m[5], bd_p[5], bd_m[5];
+
+    explicit IirConstants(float std_dev);
+};
+
+/**
+ * The number of columns the vertical passes process at once.
+ * Such columns are stored interleaved: data[y * COLUMN_LANES + lane].
+ */
+enum { COLUMN_LANES = 8 };
+
+/**
+ * Applies the filter described by \p c to a line of \p size values.
+ * The result is written to \p vp, while \p vm is used as a scratch space.
+ */
+void filterLine(IirConstants const& c, float const* in, float* vp, float* vm, int size);
+
+/**
+ * Same as filterLine(), but for COLUMN_LANES interleaved columns
+ * of \p height values each.
+ */
+void filterColumns(IirConstants const& c, float const* in, float* vp, float* vm, int height);
+
+/**
+ * Applies both passes of the filter described by \p p to COLUMN_LANES
+ * interleaved columns.  The input is expected at w + 3 * COLUMN_LANES
+ * and is replaced by the output, re-scaled by B^2.  Three extra rows
+ * on each side are used to store the initial conditions.
+ */
+void filterColumns(FilterParams const& p, float* w, int height);
 
 } // namespace gauss_blur_impl
 
@@ -205,95 +232,81 @@ void gaussBlurGeneric(QSize const size, float const h_sigma, float const v_sigma
                       SrcIt const input, int const input_stride, FloatReader const float_reader,
                       DstIt const output, int const output_stride, FloatWriter const float_writer)
 {
+    using namespace gauss_blur_impl;
+
     if (size.isEmpty()) {
         return;
     }
 
     int const width = size.width();
     int const height = size.height();
-    int const width_height_max = width > height ? width : height;
 
-    boost::scoped_array<float> val_p(new float[width_height_max]);
-    boost::scoped_array<float> val_m(new float[width_height_max]);
-    boost::scoped_array<float> intermediate_image(new float[width * height]);
+    ScratchBuffer<float> intermediate_image(size_t(width) * height);
+    float* const intermediate_data = intermediate_image.data();
     int const intermediate_stride = width;
 
-    // IIR parameters.
-    float n_p[5], n_m[5], d_p[5], d_m[5], bd_p[5], bd_m[5];
+    // Vertical pass, COLUMN_LANES columns at a time.
+    IirConstants const v_iir(v_sigma);
+    int const num_column_groups = (width + COLUMN_LANES - 1) / COLUMN_LANES;
 
-    // Vertical pass.
-    gauss_blur_impl::find_iir_constants(n_p, n_m, d_p, d_m, bd_p, bd_m, v_sigma);
-    for (int x = 0; x < width; ++x) {
-        memset(&val_p[0], 0, height * sizeof(val_p[0]));
-        memset(&val_m[0], 0, height * sizeof(val_m[0]));
+    #pragma omp parallel
+    {
+        ScratchBuffer<float> buffer(size_t(height) * COLUMN_LANES * 3);
+        float* const in = buffer.data();
+        float* const vp = in + height * COLUMN_LANES;
+        float* const vm = vp + height * COLUMN_LANES;
+
+        #pragma omp for schedule(static)
+        for (int group = 0; group < num_column_groups; ++group) {
+            int const x0 = group * COLUMN_LANES;
+            int const num_lanes = std::min<int>(COLUMN_LANES, width - x0);
+
+            SrcIt input_line(input + x0);
+            float* p_in = in;
+            for (int y = 0; y < height; ++y) {
+                int lane = 0;
+                for (; lane < num_lanes; ++lane) {
+                    p_in[lane] = float_reader(input_line[lane]);
+                }
+                for (; lane < COLUMN_LANES; ++lane) {
+                    p_in[lane] = 0.0f;
+                }
+                input_line += input_stride;
+                p_in += COLUMN_LANES;
+            }
 
-        SrcIt sp_p(input + x);
-        SrcIt sp_m(sp_p + (height - 1) * input_stride);
-        float* vp = &val_p[0];
-        float* vm = &val_m[0] + height - 1;
-        float const initial_p = float_reader(sp_p[0]);
-        float const initial_m = float_reader(sp_m[0]);
+            filterColumns(v_iir, in, vp, vm, height);
 
-        for (int y = 0; y < height; ++y) {
-            int const terms = y < 4 ? y : 4;
-            int i = 0;
-            int sp_off = 0;
-            for (; i <= terms; ++i, sp_off += input_stride) {
-                *vp += n_p[i] * float_reader(sp_p[-sp_off]) - d_p[i] * vp[-i];
-                *vm += n_m[i] * float_reader(sp_m[sp_off]) - d_m[i] * vm[i];
-            }
-            for (; i <= 4; ++i) {
-                *vp += (n_p[i] - bd_p[i]) * initial_p;
-                *vm += (n_m[i] - bd_m[i]) * initial_m;
+            float const* p_out = vp;
+            float* intermediate_line = intermediate_data + x0;
+            for (int y = 0; y < height; ++y) {
+                for (int lane = 0; lane < num_lanes; ++lane) {
+                    intermediate_line[lane] = p_out[lane];
+                }
+                p_out += COLUMN_LANES;
+                intermediate_line += intermediate_stride;
             }
-            sp_p += input_stride;
-            sp_m -= input_stride;
-            ++vp;
-            --vm;
         }
-
-        gauss_blur_impl::save(
-            height, &val_p[0], &val_m[0], &intermediate_image[0] + x,
-            intermediate_stride, gauss_blur_impl::FloatToFloatWriter()
-        );
     }
 
     // Horizontal pass.
-    gauss_blur_impl::find_iir_constants(n_p, n_m, d_p, d_m, bd_p, bd_m, h_sigma);
-    float const* intermediate_line = &intermediate_image[0];
-    DstIt output_line(output);
-    for (int y = 0; y < height; ++y) {
-        memset(&val_p[0], 0, width * sizeof(val_p[0]));
-        memset(&val_m[0], 0, width * sizeof(val_m[0]));
-
-        float const* sp_p = intermediate_line;
-        float const* sp_m = intermediate_line + width - 1;
-        float* vp = &val_p[0];
-        float* vm = &val_m[0] + width - 1;
-        float const initial_p = sp_p[0];
-        float const initial_m = sp_m[0];
-
-        for (int x = 0; x < width; ++x) {
-            int const terms = x < 4 ? x : 4;
-            int i = 0;
-            for (; i <= terms; ++i) {
-                *vp += n_p[i] * sp_p[-i] - d_p[i] * vp[-i];
-                *vm += n_m[i] * sp_m[i] - d_m[i] * vm[i];
-            }
-            for (; i <= 4; ++i) {
-                *vp += (n_p[i] - bd_p[i]) * initial_p;
-                *vm += (n_m[i] - bd_m[i]) * initial_m;
-            }
-            ++sp_p;
-            --sp_m;
-            ++vp;
-            --vm;
-        }
+    IirConstants const h_iir(h_sigma);
 
-        gauss_blur_impl::save(width, &val_p[0], &val_m[0], output_line, 1, float_writer);
+    #pragma omp parallel
+    {
+        ScratchBuffer<float> buffer(size_t(width) * 2);
+        float* const vp = buffer.data();
+        float* const vm = vp + width;
+
+        #pragma omp for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            filterLine(h_iir, intermediate_data + y * intermediate_stride, vp, vm, width);
 
-        intermediate_line += intermediate_stride;
-        output_line += output_stride;
+            DstIt output_line(output + y * output_stride);
+            for (int x = 0; x < width; ++x) {
+                float_writer(output_line[x], vp[x]);
+            }
+        }
     }
 }
 
@@ -353,15 +366,16 @@ void anisotropicGaussBlurGeneric(
         }
     };
 
-    boost::scoped_array<float> const w(new float[3 + width_height_max + 3]);
+    ScratchBuffer<float> w(3 + width_height_max + 3);
     boost::scoped_array<InterpolatedCoord> skewed_line(new InterpolatedCoord[width_height_max]);
 
     // We add 2 extra pixels on each side. The inner 1px layer is necessary to
     // be able to interpolate pixels at a boundary. The outer layer is necessary
     // because on a "skewed" pass we write to positions offseted by -1 in order
     // for our writes not to contaminate reads on the next pass.
-    Grid<float> intermediate_image(width, height, /*padding=*/2);
-    int const intermediate_stride = intermediate_image.stride();
+    int const intermediate_stride = width + 4;
+    ScratchBuffer<float> intermediate_image(size_t(intermediate_stride) * (height + 4));
+    float* const intermediate_data = intermediate_image.data() + 2 * intermediate_stride + 2;
 
     HorizontalDecompositionParams const hdp(dir_x, dir_y, dir_sigma, ortho_dir_sigma);
     VerticalDecompositionParams const vdp(dir_x, dir_y, dir_sigma, ortho_dir_sigma);
@@ -374,82 +388,103 @@ void anisotropicGaussBlurGeneric(
     // decomposition. The new approach achieves lower errors overall, while the largest
     // errors now correspond to diagonal gaussians.
 
+    // Unlike the skewed pass that follows, this one processes independent lines,
+    // so it's split across threads.
     if (horizontal_decomposition)
     {
         // Horizontal pass.
         gauss_blur_impl::FilterParams const p(hdp.sigma_x);
         float const B2 = p.B * p.B;
-        SrcIt input_line = input;
-        float* intermediate_line = intermediate_image.data();
 
-        for (int y = 0; y < height; ++y)
+        #pragma omp parallel
         {
-            // Forward pass.
-            SrcIt inp_it = input_line;
-            float pixel = *inp_it;
-            float* p_w = &w[3];
-            p_w[-1] = p_w[-2] = p_w[-3] = pixel / p.B;
-            for (int x = 0; x < width; ++x)
-            {
-                pixel = float_reader(*inp_it);
-                *p_w = pixel + p.a1 * p_w[-1] + p.a2 * p_w[-2] + p.a3 * p_w[-3];
-                ++p_w;
-                ++inp_it;
-            }
+            ScratchBuffer<float> line_w(3 + width + 3);
 
-            // Backward pass.
-            calcBackwardPassInitialConditions(p, p_w, pixel);
-            for (int x = width - 1; x >= 0; --x)
+            #pragma omp for schedule(static)
+            for (int y = 0; y < height; ++y)
             {
-                --p_w;
-                *p_w = *p_w + p.a1 * p_w[1] + p.a2 * p_w[2] + p.a3 * p_w[3];
-                intermediate_line[x] = *p_w * B2; // Re-scale by B^2.
-            }
+                SrcIt const input_line(input + y * input_stride);
+                float* const intermediate_line = intermediate_data + y * intermediate_stride;
+
+                // Forward pass.
+                SrcIt inp_it = input_line;
+                float pixel = float_reader(*inp_it);
+                float* p_w = line_w.data() + 3;
+                p_w[-1] = p_w[-2] = p_w[-3] = pixel / p.B;
+                for (int x = 0; x < width; ++x)
+                {
+                    pixel = float_reader(*inp_it);
+                    *p_w = pixel + p.a1 * p_w[-1] + p.a2 * p_w[-2] + p.a3 * p_w[-3];
+                    ++p_w;
+                    ++inp_it;
+                }
 
-            input_line += input_stride;
-            intermediate_line += intermediate_stride;
+                // Backward pass.
+                calcBackwardPassInitialConditions(p, p_w, pixel);
+                for (int x = width - 1; x >= 0; --x)
+                {
+                    --p_w;
+                    *p_w = *p_w + p.a1 * p_w[1] + p.a2 * p_w[2] + p.a3 * p_w[3];
+                    intermediate_line[x] = *p_w * B2; // Re-scale by B^2.
+                }
+            }
         }
     }
     else
     {
-        // Vertical pass.
+        // Vertical pass, COLUMN_LANES columns at a time.
         gauss_blur_impl::FilterParams const p(vdp.sigma_y);
-        float const B2 = p.B * p.B;
+        int const num_column_groups = (width + COLUMN_LANES - 1) / COLUMN_LANES;
 
-        for (int x = 0; x < width; ++x)
+        #pragma omp parallel
         {
-            // Forward pass.
-            SrcIt inp_it = input + x;
-            float pixel = float_reader(*inp_it);
-            float* p_w = &w[3];
-            p_w[-1] = p_w[-2] = p_w[-3] = pixel / p.B;
+            ScratchBuffer<float> columns_w((3 + height + 3) * COLUMN_LANES);
 
-            for (int y = 0; y < height; ++y)
+            #pragma omp for schedule(static)
+            for (int group = 0; group < num_column_groups; ++group)
             {
-                pixel = float_reader(*inp_it);
-                *p_w = pixel + p.a1 * p_w[-1] + p.a2 * p_w[-2] + p.a3 * p_w[-3];
-                inp_it += input_stride;
-                ++p_w;
-            }
+                int const x0 = group * COLUMN_LANES;
+                int const num_lanes = std::min<int>(COLUMN_LANES, width - x0);
 
-            // Backward pass.
-            calcBackwardPassInitialConditions(p, p_w, pixel);
-            float* p_int = intermediate_image.data() + x + height * intermediate_stride;
-            for (int y = height - 1; y >= 0; --y)
-            {
-                --p_w;
-                p_int -= intermediate_stride;
-                *p_w = *p_w + p.a1 * p_w[1] + p.a2 * p_w[2] + p.a3 * p_w[3];
-                *p_int = *p_w * B2; // Re-scale by B^2.
+                SrcIt input_line(input + x0);
+                float* p_w = columns_w.data() + 3 * COLUMN_LANES;
+                for (int y = 0; y < height; ++y)
+                {
+                    int lane = 0;
+                    for (; lane < num_lanes; ++lane)
+                    {
+                        p_w[lane] = float_reader(input_line[lane]);
+                    }
+                    for (; lane < COLUMN_LANES; ++lane)
+                    {
+                        p_w[lane] = 0.0f;
+                    }
+                    input_line += input_stride;
+                    p_w += COLUMN_LANES;
+                }
+
+                filterColumns(p, columns_w.data(), height);
+
+                p_w = columns_w.data() + 3 * COLUMN_LANES;
+                float* intermediate_line = intermediate_data + x0;
+                for (int y = 0; y < height; ++y)
+                {
+                    for (int lane = 0; lane < num_lanes; ++lane)
+                    {
+                        intermediate_line[lane] = p_w[lane];
+                    }
+                    p_w += COLUMN_LANES;
+                    intermediate_line += intermediate_stride;
+                }
             }
         }
     }
 
     // Initialise padded areas of intermediate_image. The outer area is filled with zeros
     // while the inner area mirrors the adjacent in-image pixels.
-    initPaddingLayers(intermediate_image);
+    initPaddingLayers(intermediate_image.data(), width, height, intermediate_stride);
 
-    // This will be either intermediate_image.data() - 1 or intermediate_image.data() -
+    // This will be either intermediate_data - 1 or intermediate_data -
     // intermediate_stride, depending on whether we traverse phi direction horizontally
     // or vertically.
     float* output_origin;
@@ -556,12 +591,12 @@ void anisotropicGaussBlurGeneric(
                 ++y1;
             }
 
-            float* intermediate_line = intermediate_image.data() + intermediate_stride * y0;
+            float* intermediate_line = intermediate_data + intermediate_stride * y0;
             InterpolatedCoord coord = skewed_line[y0];
 
             float pixel = (1.0f - coord.alpha) * intermediate_line[coord.lower_bound + x_offset]
                 + coord.alpha * intermediate_line[coord.lower_bound + x_offset + 1];
-            float* p_w = &w[3];
+            float* p_w = w.data() + 3;
             p_w[-1] = p_w[-2] = p_w[-3] = pixel / p.B;
 
             for (int y = y0;; ++y, intermediate_line += intermediate_stride)
@@ -609,7 +644,7 @@ void anisotropicGaussBlurGeneric(
         }
 
         // Our writes are shifted horizontally by -1.
-        output_origin = intermediate_image.data() - 1;
+        output_origin = intermediate_data - 1;
 
     }
     else
@@ -705,14 +740,14 @@ void anisotropicGaussBlurGeneric(
                 ++x1;
             }
 
-            float* intermediate_col = intermediate_image.data() + x0;
+            float* intermediate_col = intermediate_data + x0;
             InterpolatedCoord coord = skewed_line[x0];
 
             float pixel = (1.0f - coord.alpha) *
                 intermediate_col[(coord.lower_bound + y_offset) * intermediate_stride]
                 + coord.alpha *
                 intermediate_col[(coord.lower_bound + y_offset + 1) * intermediate_stride];
-            float* p_w = &w[3];
+            float* p_w = w.data() + 3;
             p_w[-1] = p_w[-2] = p_w[-3] = pixel / p.B;
 
             for (int x = x0;; ++x, ++intermediate_col)
@@ -760,7 +795,7 @@ void anisotropicGaussBlurGeneric(
         }
 
         // Our writes are shifted vertically by -1.
-        output_origin = intermediate_image.data() - intermediate_stride;
+        output_origin = intermediate_data - intermediate_stride;
     }
 
     // Copy from intermediate image to output image.
@@ -21,6 +21,7 @@
 
 #include "Grayscale.h"
 #include "GrayImage.h"
+#include "CpuFeatures.h"
 #include <QPoint>
 #include <QRect>
 #include <QSize>
@@ -196,6 +197,68 @@ public:
     }
 };
 
+namespace gray_raster_op_impl
+{
+
+typedef void (*TransformLineFunc)(uint8_t const* src_line, uint8_t* dst_line, int width);
+
+/*
+ * GRop::transform() is a pure function of its arguments, and each pixel
+ * only depends on the source and destination pixels at the same position,
+ * so the lines may be processed in SIMD fashion.  The same loop is also
+ * instantiated for wider instruction sets, to be picked at runtime.
+ */
+
+template<typename GRop>
+IMAGEPROC_FORCE_INLINE
+void transformLineImpl(uint8_t const* src_line, uint8_t* dst_line, int const width)
+{
+    #pragma omp simd
+    for (int x = 0; x < width; ++x) {
+        dst_line[x] = GRop::transform(src_line[x], dst_line[x]);
+    }
+}
+
+template<typename GRop>
+void transformLine(uint8_t const* src_line, uint8_t* dst_line, int const width)
+{
+    transformLineImpl<GRop>(src_line, dst_line, width);
+}
+
+#if defined(IMAGEPROC_TARGET_DISPATCH)
+template<typename GRop>
+IMAGEPROC_TARGET_SSE42
+void transformLineSse42(uint8_t const* src_line, uint8_t* dst_line, int const width)
+{
+    transformLineImpl<GRop>(src_line, dst_line, width);
+}
+
+template<typename GRop>
+IMAGEPROC_TARGET_AVX2
+void transformLineAvx2(uint8_t const* src_line, uint8_t* dst_line, int const width)
+{
+    transformLineImpl<GRop>(src_line, dst_line, width);
+}
+#endif
+
+template<typename GRop>
+TransformLineFunc selectTransformLine()
+{
+#if defined(IMAGEPROC_TARGET_DISPATCH)
+    switch (CpuFeatures::level()) {
+        case CpuFeatures::AVX2:
+            return &transformLineAvx2<GRop>;
+        case CpuFeatures::SSE42:
+            return &transformLineSse42<GRop>;
+        case CpuFeatures::BASELINE:
+            break;
+    }
+#endif
+    return &transformLine<GRop>;
+}
+
+} // namespace gray_raster_op_impl
+
 template<typename GRop>
 void grayRasterOp(GrayImage& dst, GrayImage const& src)
 {
@@ -214,14 +277,12 @@ void grayRasterOp(GrayImage& dst, GrayImage const& src)
     int const height = src.height();
     uint8_t* dst_data = dst.data(); // never call .data() inside omp
     const uint8_t* src_data = src.data(); // never call .data() inside omp
+    gray_raster_op_impl::TransformLineFunc const transform_line =
+        gray_raster_op_impl::selectTransformLine<GRop>();
 
     #pragma omp parallel for //if(dst.data() != src.data())
     for (int y = 0; y < height; ++y) {
-        uint8_t const* src_line = src_data + y * src_stride;
-        uint8_t* dst_line = dst_data + y * dst_stride;
-        for (int x = 0; x < width; ++x) {
-            dst_line[x] = GRop::transform(src_line[x], dst_line[x]);
-        }
+        transform_line(src_data + y * src_stride, dst_data + y * dst_stride, width);
     }
 }
 
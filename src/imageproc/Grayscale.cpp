@@ -20,6 +20,7 @@
 #include "GrayImage.h"
 #include "BinaryImage.h"
 #include "BitOps.h"
+#include "SimdKernels.h"
 #include <QImage>
 #include <QColor>
 #include <QtGlobal>
@@ -28,6 +29,7 @@
 #include <new>
 #include <string.h>
 #include <stdint.h>
+#include <vector>
 
 namespace imageproc
 {
@@ -118,7 +120,148 @@ static QImage monoLsbToGrayscale(QImage const& src)
     return dst;
 }
 
-static QImage rgbToGrayscale(QImage const& src)
+namespace
+{
+
+/**
+ * \brief Converts lines of RGB32, ARGB32, RGB888 and Indexed8 images
+ *        to gray levels, the way qGray() does.
+ */
+class GrayLineConverter
+{
+public:
+    static bool isSupported(QImage const& src);
+
+    explicit GrayLineConverter(QImage const& src);
+
+    void convert(int y, uint8_t* dst_line) const;
+private:
+    SimdKernels const& m_kernels;
+    uint8_t const* m_pData;
+    int m_bpl;
+    int m_width;
+    QImage::Format m_format;
+    uint8_t m_colorToGray[256];
+};
+
+bool
+GrayLineConverter::isSupported(QImage const& src)
+{
+    switch (src.format()) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGB888:
+    case QImage::Format_Indexed8:
+        return true;
+    default:
+        return false;
+    }
+}
+
+GrayLineConverter::GrayLineConverter(QImage const& src)
+    :   m_kernels(simdKernels()),
+        m_pData(src.bits()),
+        m_bpl(src.bytesPerLine()),
+        m_width(src.width()),
+        m_format(src.format())
+{
+    memset(m_colorToGray, 0, sizeof(m_colorToGray));
+    if (m_format == QImage::Format_Indexed8) {
+        int const num_colors = std::min(src.colorCount(), 256);
+        for (int i = 0; i < num_colors; ++i) {
+            m_colorToGray[i] = static_cast<uint8_t>(qGray(src.color(i)));
+        }
+    }
+}
+
+void
+GrayLineConverter::convert(int const y, uint8_t* dst_line) const
+{
+    uint8_t const* src_line = m_pData + y * m_bpl;
+    switch (m_format) {
+    case QImage::Format_RGB888:
+        m_kernels.rgb888ToGrayLine(src_line, dst_line, m_width);
+        break;
+    case QImage::Format_Indexed8:
+        for (int x = 0; x < m_width; ++x) {
+            dst_line[x] = m_colorToGray[src_line[x]];
+        }
+        break;
+    default:
+        m_kernels.rgb32ToGrayLine(
+            reinterpret_cast<uint32_t const*>(src_line), dst_line, m_width
+        );
+        break;
+    }
+}
+
+/**
+ * \brief Counts gray levels line by line.
+ *
+ * Pages mostly consist of long runs of the same gray level.  Spreading
+ * them over 4 sets of counters avoids waiting for the previous increment
+ * of the same counter.
+ */
+class HistogramAccumulator
+{
+public:
+    HistogramAccumulator()
+    {
+        memset(m_counts, 0, sizeof(m_counts));
+    }
+
+    void addLine(uint8_t const* line, int width);
+
+    void addLine(uint8_t const* line, uint32_t const* mask_line, int width);
+
+    void addTo(GrayscaleHistogram& hist) const;
+private:
+    int m_counts[4][256];
+};
+
+void
+HistogramAccumulator::addLine(uint8_t const* line, int const width)
+{
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        ++m_counts[0][line[x]];
+        ++m_counts[1][line[x + 1]];
+        ++m_counts[2][line[x + 2]];
+        ++m_counts[3][line[x + 3]];
+    }
+    for (; x < width; ++x) {
+        ++m_counts[0][line[x]];
+    }
+}
+
+void
+HistogramAccumulator::addLine(
+    uint8_t const* line, uint32_t const* mask_line, int const width)
+{
+    uint32_t const msb = uint32_t(1) << 31;
+    for (int x = 0; x < width; ++x) {
+        if (mask_line[x >> 5] & (msb >> (x & 31))) {
+            ++m_counts[x & 3][line[x]];
+        }
+    }
+}
+
+void
+HistogramAccumulator::addTo(GrayscaleHistogram& hist) const
+{
+    for (int i = 0; i < 256; ++i) {
+        hist[i] += m_counts[0][i] + m_counts[1][i] + m_counts[2][i] + m_counts[3][i];
+    }
+}
+
+} // anonymous namespace
+
+/**
+ * Converts an image GrayLineConverter supports.  If \p hist is provided,
+ * the gray levels of the result are added to it.
+ */
+static QImage convertToGrayscale(QImage const& src, GrayscaleHistogram* hist)
 {
     int const width = src.width();
     int const height = src.height();
@@ -129,12 +272,28 @@ static QImage rgbToGrayscale(QImage const& src)
         throw std::bad_alloc();
     }
 
-    #pragma omp parallel for
-    for (int y = 0; y < height; ++y) {
-        uint8_t* dst_line = dst.scanLine(y);
-        const QRgb* src_line = reinterpret_cast<const QRgb*>(src.scanLine(y));
-        for (int x = 0; x < width; ++x) {
-            dst_line[x] = static_cast<uint8_t>(qGray(*src_line++));
+    GrayLineConverter const converter(src);
+    uint8_t* const dst_data = dst.bits();
+    int const dst_bpl = dst.bytesPerLine();
+
+    #pragma omp parallel
+    {
+        HistogramAccumulator pixels;
+
+        #pragma omp for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            uint8_t* dst_line = dst_data + y * dst_bpl;
+            converter.convert(y, dst_line);
+            if (hist) {
+                pixels.addLine(dst_line, width);
+            }
+        }
+
+        if (hist) {
+            #pragma omp critical
+            {
+                pixels.addTo(*hist);
+            }
         }
     }
 
@@ -194,10 +353,6 @@ QImage toGrayscale(QImage const& src)
         return monoMsbToGrayscale(src);
     case QImage::Format_MonoLSB:
         return monoLsbToGrayscale(src);
-    case QImage::Format_RGB32:
-    case QImage::Format_ARGB32:
-    case QImage::Format_ARGB32_Premultiplied:
-        return rgbToGrayscale(src);
     case QImage::Format_Indexed8:
         if (src.isGrayscale()) {
             if (src.colorCount() == 256) {
@@ -211,12 +366,31 @@ QImage toGrayscale(QImage const& src)
                 return dst;
             }
         }
-    // fall though
+        return convertToGrayscale(src, 0);
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGB888:
+        return convertToGrayscale(src, 0);
     default:
         return anyToGrayscale(src);
     }
 }
 
+QImage toGrayscale(QImage const& src, GrayscaleHistogram& hist)
+{
+    hist = GrayscaleHistogram();
+
+    bool const already_gray = src.format() == QImage::Format_Indexed8 && src.isGrayscale();
+    if (!src.isNull() && !already_gray && GrayLineConverter::isSupported(src)) {
+        return convertToGrayscale(src, &hist);
+    }
+
+    QImage const dst(toGrayscale(src));
+    hist = GrayscaleHistogram(dst);
+    return dst;
+}
+
 GrayImage stretchGrayRange(
     GrayImage const& src,
     double const black_clip_fraction, double const white_clip_fraction)
@@ -337,6 +511,11 @@ unsigned char darkestGrayLevel(GrayImage const& image)
     return darkest;
 }
 
+GrayscaleHistogram::GrayscaleHistogram()
+{
+    memset(m_pixels, 0, sizeof(m_pixels));
+}
+
 GrayscaleHistogram::GrayscaleHistogram(QImage const& img)
 {
     memset(m_pixels, 0, sizeof(m_pixels));
@@ -479,24 +658,20 @@ GrayscaleHistogram::fromGrayscaleImage(QImage const& img)
     int const w = img.width();
     int const h = img.height();
     int const bpl = img.bytesPerLine();
+    uint8_t const* const data = img.bits();
 
     #pragma omp parallel
     {
-        int pixels[256] = { 0 };
+        HistogramAccumulator pixels;
 
-        #pragma omp parallel for 
+        #pragma omp for schedule(static)
         for (int y = 0; y < h; ++y) {
-            uint8_t const* line = img.bits() + y * bpl;
-            for (int x = 0; x < w; ++x) {
-                ++pixels[line[x]];
-            }
+            pixels.addLine(data + y * bpl, w);
         }
 
-        #pragma omp critical 
+        #pragma omp critical
         {
-            for (int i = 0; i < 256; ++i) {
-                m_pixels[i] = pixels[i];
-            }
+            pixels.addTo(*this);
         }
     }
 }
@@ -507,16 +682,22 @@ GrayscaleHistogram::fromGrayscaleImage(QImage const& img, BinaryImage const& mas
     int const w = img.width();
     int const h = img.height();
     int const bpl = img.bytesPerLine();
-    uint8_t const* line = img.bits();
-    uint32_t const* mask_line = mask.data();
+    uint8_t const* const data = img.bits();
+    uint32_t const* const mask_data = mask.data();
     int const mask_wpl = mask.wordsPerLine();
-    uint32_t const msb = uint32_t(1) << 31;
 
-    for (int y = 0; y < h; ++y, line += bpl, mask_line += mask_wpl) {
-        for (int x = 0; x < w; ++x) {
-            if (mask_line[x >> 5] & (msb >> (x & 31))) {
-                ++m_pixels[line[x]];
-            }
+    #pragma omp parallel
+    {
+        HistogramAccumulator pixels;
+
+        #pragma omp for schedule(static)
+        for (int y = 0; y < h; ++y) {
+            pixels.addLine(data + y * bpl, mask_data + y * mask_wpl, w);
+        }
+
+        #pragma omp critical
+        {
+            pixels.addTo(*this);
         }
     }
 }
@@ -527,6 +708,28 @@ GrayscaleHistogram::fromAnyImage(QImage const& img)
     int const w = img.width();
     int const h = img.height();
 
+    if (GrayLineConverter::isSupported(img)) {
+        GrayLineConverter const converter(img);
+
+        #pragma omp parallel
+        {
+            HistogramAccumulator pixels;
+            std::vector<uint8_t> gray_line(w);
+
+            #pragma omp for schedule(static)
+            for (int y = 0; y < h; ++y) {
+                converter.convert(y, &gray_line[0]);
+                pixels.addLine(&gray_line[0], w);
+            }
+
+            #pragma omp critical
+            {
+                pixels.addTo(*this);
+            }
+        }
+        return;
+    }
+
     for (int y = 0; y < h; ++y) {
         for (int x = 0; x < w; ++x) {
             ++m_pixels[qGray(img.pixel(x, y))];
@@ -543,6 +746,28 @@ GrayscaleHistogram::fromAnyImage(QImage const& img, BinaryImage const& mask)
     int const mask_wpl = mask.wordsPerLine();
     uint32_t const msb = uint32_t(1) << 31;
 
+    if (GrayLineConverter::isSupported(img)) {
+        GrayLineConverter const converter(img);
+
+        #pragma omp parallel
+        {
+            HistogramAccumulator pixels;
+            std::vector<uint8_t> gray_line(w);
+
+            #pragma omp for schedule(static)
+            for (int y = 0; y < h; ++y) {
+                converter.convert(y, &gray_line[0]);
+                pixels.addLine(&gray_line[0], mask_line + y * mask_wpl, w);
+            }
+
+            #pragma omp critical
+            {
+                pixels.addTo(*this);
+            }
+        }
+        return;
+    }
+
     for (int y = 0; y < h; ++y, mask_line += mask_wpl) {
         for (int x = 0; x < w; ++x) {
             if (mask_line[x >> 5] & (msb >> (x & 31))) {
@@ -34,6 +34,11 @@ class BinaryImage;
 class GrayscaleHistogram
 {
 public:
+    /**
+     * \brief Constructs a histogram with all counts set to zero.
+     */
+    GrayscaleHistogram();
+
     explicit GrayscaleHistogram(QImage const& img);
 
     GrayscaleHistogram(QImage const& img, BinaryImage const& mask);
@@ -77,6 +82,18 @@ QVector<QRgb> createGrayscalePalette();
  */
 QImage toGrayscale(QImage const& src);
 
+/**
+ * \brief Same as toGrayscale(), also building a histogram of the result.
+ *
+ * For color images the histogram is collected during the conversion,
+ * rather than with another pass over the image.
+ *
+ * \param src The source image in any format.
+ * \param hist Receives the histogram of the returned image.
+ * \return A grayscale image with proper palette.
+ */
+QImage toGrayscale(QImage const& src, GrayscaleHistogram& hist);
+
 /**
  * \brief Stetch the distribution of gray levels to cover the whole range.
  *
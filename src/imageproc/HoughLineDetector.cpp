@@ -27,6 +27,7 @@
 #include "RasterOp.h"
 #include "SeedFill.h"
 #include "Grayscale.h"
+#include "GrayImage.h"
 #include <QSize>
 #include <QRect>
 #include <QPoint>
@@ -41,6 +42,9 @@
 #include <math.h>
 #include <stdint.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace imageproc
 {
@@ -72,6 +76,8 @@ HoughLineDetector::HoughLineDetector(
     double min_distance = 0.0;
 
     m_angleUnitVectors.reserve(num_angles);
+    m_cosines.reserve(num_angles);
+    m_sines.reserve(num_angles);
     for (int i = 0; i < num_angles; ++i) {
         double angle = start_angle + angle_delta * i;
         angle *= constants::DEG2RAD;
@@ -84,6 +90,8 @@ HoughLineDetector::HoughLineDetector(
         }
 
         m_angleUnitVectors.push_back(uv);
+        m_cosines.push_back(uv.x());
+        m_sines.push_back(uv.y());
     }
 
     // We bias distances to make them non-negative.
@@ -102,10 +110,89 @@ HoughLineDetector::HoughLineDetector(
 void
 HoughLineDetector::process(int x, int y, unsigned weight)
 {
-    unsigned* hist_line = &m_histogram[0];
+    accumulate(&m_histogram[0], x, y, weight);
+}
+
+void
+HoughLineDetector::process(
+    GrayImage const& image, QRect const& area, unsigned const weight_table[256])
+{
+    QRect const rect(area.intersected(image.rect()));
+    if (rect.isEmpty()) {
+        return;
+    }
+
+    int const x_begin = rect.left();
+    int const x_end = rect.right() + 1;
+    int const y_begin = rect.top();
+    int const y_end = rect.bottom() + 1;
+    uint8_t const* const data = image.data();
+    int const stride = image.stride();
+    size_t const hist_size = m_histogram.size();
+
+    #pragma omp parallel
+    {
+        std::vector<unsigned> local_hist(hist_size, 0);
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int y = y_begin; y < y_end; ++y) {
+            uint8_t const* const line = data + y * stride;
+            for (int x = x_begin; x < x_end; ++x) {
+                unsigned const weight = weight_table[line[x]];
+                if (weight) {
+                    accumulate(&local_hist[0], x, y, weight);
+                }
+            }
+        }
 
-    for (QPointF const& uv : m_angleUnitVectors) {
-        double const distance = uv.x() * x + uv.y() * y;
+        #pragma omp critical
+        {
+            for (size_t i = 0; i < hist_size; ++i) {
+                m_histogram[i] += local_hist[i];
+            }
+        }
+    }
+}
+
+inline void
+HoughLineDetector::accumulate(unsigned* hist, int x, int y, unsigned weight) const
+{
+    int const num_angles = m_histHeight;
+    double const* const cosines = &m_cosines[0];
+    double const* const sines = &m_sines[0];
+    unsigned* hist_line = hist;
+
+    int i = 0;
+#ifdef __SSE2__
+    // Two angles at a time.  The arithmetic is the same as below,
+    // so the bins are the same as well.
+    __m128d const xs = _mm_set1_pd(x);
+    __m128d const ys = _mm_set1_pd(y);
+    __m128d const bias = _mm_set1_pd(m_distanceBias);
+    __m128d const recip = _mm_set1_pd(m_recipDistanceResolution);
+    __m128d const half = _mm_set1_pd(0.5);
+    for (; i + 2 <= num_angles; i += 2) {
+        __m128d const distance = _mm_add_pd(
+                                     _mm_mul_pd(_mm_loadu_pd(cosines + i), xs),
+                                     _mm_mul_pd(_mm_loadu_pd(sines + i), ys)
+                                 );
+        __m128d const biased_distance = _mm_add_pd(distance, bias);
+        __m128i const bins = _mm_cvttpd_epi32(
+                                 _mm_add_pd(_mm_mul_pd(biased_distance, recip), half)
+                             );
+        int const bin1 = _mm_cvtsi128_si32(bins);
+        int const bin2 = _mm_cvtsi128_si32(_mm_srli_si128(bins, 4));
+        assert(bin1 >= 0 && bin1 < m_histWidth);
+        assert(bin2 >= 0 && bin2 < m_histWidth);
+        hist_line[bin1] += weight;
+        hist_line[m_histWidth + bin2] += weight;
+
+        hist_line += m_histWidth * 2;
+    }
+#endif
+
+    for (; i < num_angles; ++i) {
+        double const distance = cosines[i] * x + sines[i] * y;
         double const biased_distance = distance + m_distanceBias;
 
         int const bin = (int)(biased_distance * m_recipDistanceResolution + 0.5);
@@ -221,7 +308,7 @@ HoughLineDetector::findHistogramPeaks(
     // Peak candidates are connected components of bins having the same
     // value.  Such a connected component may or may not be a peak.
     BinaryImage peak_candidates(
-        findPeakCandidates(hist, width, height, lower_bound)
+        findPeakCandidates(hist, 0, width, height, lower_bound)
     );
 
     // To check if a peak candidate is really a peak, we have to check
@@ -237,12 +324,13 @@ HoughLineDetector::findHistogramPeaks(
     // The second case indicates that our candidate is not really a peak.
     // To test for the second case we are going to increment the values
     // of the bins in the neighborhood of peak candidates, find the peak
-    // candidates again and analyze the differences.
-    std::vector<unsigned> new_hist(hist);
-    incrementBinsMasked(new_hist, width, height, neighborhood_mask);
+    // candidates again and analyze the differences.  Bins are incremented
+    // on the fly, as they are read, so the histogram is not copied.
+    BinaryImage diff(
+        findPeakCandidates(hist, &neighborhood_mask, width, height, lower_bound)
+    );
     neighborhood_mask.release();
 
-    BinaryImage diff(findPeakCandidates(new_hist, width, height, lower_bound));
     rasterOp<RopXor<RopSrc, RopDst> >(diff, peak_candidates);
 
     // If a bin that has changed its state was a part of a peak candidate,
@@ -259,47 +347,50 @@ HoughLineDetector::findHistogramPeaks(
  * histogram bin meets the following conditions:
  * \li It doesn't have a greater neighbor (in a 5x5 window).
  * \li It's value is not below \p lower_bound.
+ *
+ * If \p increment_mask is provided, bins corresponding to its black
+ * pixels are treated as if they were incremented.
  */
 BinaryImage
 HoughLineDetector::findPeakCandidates(
-    std::vector<unsigned> const& hist,
+    std::vector<unsigned> const& hist, BinaryImage const* increment_mask,
     int const width, int const height, unsigned const lower_bound)
 {
     std::vector<unsigned> maxed(hist.size(), 0);
 
     // Every bin becomes the maximum of itself and its neighbors.
-    max5x5(hist, maxed, width, height);
+    max5x5(hist, increment_mask, maxed, width, height);
 
     // Those that haven't changed didn't have a greater neighbor.
     BinaryImage equal_map(
-        buildEqualMap(hist, maxed, width, height, lower_bound)
+        buildEqualMap(hist, increment_mask, maxed, width, height, lower_bound)
     );
 
     return equal_map;
 }
 
 /**
- * Increment bins that correspond to black pixels in \p mask.
+ * Returns \p hist_line, or its copy in \p buffer with bins corresponding
+ * to black pixels of line \p y of \p increment_mask incremented.
  */
-void
-HoughLineDetector::incrementBinsMasked(
-    std::vector<unsigned>& hist,
-    int const width, int const height, BinaryImage const& mask)
+unsigned const*
+HoughLineDetector::incrementedLine(
+    unsigned const* const hist_line, BinaryImage const* const increment_mask,
+    int const y, int const width, std::vector<unsigned>& buffer)
 {
-    uint32_t const* mask_line = mask.data();
-    int const mask_wpl = mask.wordsPerLine();
-    unsigned* hist_line = &hist[0];
+    if (!increment_mask) {
+        return hist_line;
+    }
+
+    uint32_t const* mask_line = increment_mask->data() + y * increment_mask->wordsPerLine();
     uint32_t const msb = uint32_t(1) << 31;
 
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            if (mask_line[x >> 5] & (msb >> (x & 31))) {
-                ++hist_line[x];
-            }
-        }
-        mask_line += mask_wpl;
-        hist_line += width;
+    buffer.resize(width);
+    for (int x = 0; x < width; ++x) {
+        buffer[x] = hist_line[x] + ((mask_line[x >> 5] & (msb >> (x & 31))) ? 1 : 0);
     }
+
+    return &buffer[0];
 }
 
 /**
@@ -308,12 +399,12 @@ HoughLineDetector::incrementBinsMasked(
  */
 void
 HoughLineDetector::max5x5(
-    std::vector<unsigned> const& src, std::vector<unsigned>& dst,
-    int const width, int const height)
+    std::vector<unsigned> const& src, BinaryImage const* increment_mask,
+    std::vector<unsigned>& dst, int const width, int const height)
 {
     std::vector<unsigned> tmp(src.size(), 0);
-    max3x1(src, tmp, width, height);
-    max3x1(tmp, dst, width, height);
+    max3x1(src, increment_mask, tmp, width, height);
+    max3x1(tmp, 0, dst, width, height);
     max1x3(dst, tmp, width, height);
     max1x3(tmp, dst, width, height);
 }
@@ -324,33 +415,37 @@ HoughLineDetector::max5x5(
  */
 void
 HoughLineDetector::max3x1(
-    std::vector<unsigned> const& src, std::vector<unsigned>& dst,
-    int const width, int const height)
+    std::vector<unsigned> const& src, BinaryImage const* increment_mask,
+    std::vector<unsigned>& dst, int const width, int const height)
 {
-    if (width == 1) {
-        dst = src;
-        return;
-    }
-
-    unsigned const* src_line = &src[0];
+    std::vector<unsigned> buffer;
+    unsigned const* src_line_base = &src[0];
     unsigned* dst_line = &dst[0];
 
     for (int y = 0; y < height; ++y) {
-        // First column (no left neighbors).
-        int x = 0;
-        dst_line[x] = std::max(src_line[x], src_line[x + 1]);
-
-        for (++x; x < width - 1; ++x) {
-            unsigned const prev = src_line[x - 1];
-            unsigned const cur = src_line[x];
-            unsigned const next = src_line[x + 1];
-            dst_line[x] = std::max(prev, std::max(cur, next));
-        }
+        unsigned const* const src_line = incrementedLine(
+                                             src_line_base, increment_mask, y, width, buffer
+                                         );
+
+        if (width == 1) {
+            dst_line[0] = src_line[0];
+        } else {
+            // First column (no left neighbors).
+            int x = 0;
+            dst_line[x] = std::max(src_line[x], src_line[x + 1]);
+
+            for (++x; x < width - 1; ++x) {
+                unsigned const prev = src_line[x - 1];
+                unsigned const cur = src_line[x];
+                unsigned const next = src_line[x + 1];
+                dst_line[x] = std::max(prev, std::max(cur, next));
+            }
 
-        // Last column (no right neighbors).
-        dst_line[x] = std::max(src_line[x], src_line[x - 1]);
+            // Last column (no right neighbors).
+            dst_line[x] = std::max(src_line[x], src_line[x - 1]);
+        }
 
-        src_line += width;
+        src_line_base += width;
         dst_line += width;
     }
 }
@@ -405,17 +500,22 @@ HoughLineDetector::max1x3(
  */
 BinaryImage
 HoughLineDetector::buildEqualMap(
-    std::vector<unsigned> const& src1, std::vector<unsigned> const& src2,
+    std::vector<unsigned> const& src1, BinaryImage const* increment_mask,
+    std::vector<unsigned> const& src2,
     int const width, int const height, unsigned const lower_bound)
 {
     BinaryImage dst(width, height, WHITE);
     uint32_t* dst_line = dst.data();
     int const dst_wpl = dst.wordsPerLine();
-    unsigned const* src1_line = &src1[0];
+    unsigned const* src1_line_base = &src1[0];
     unsigned const* src2_line = &src2[0];
     uint32_t const msb = uint32_t(1) << 31;
+    std::vector<unsigned> buffer;
 
     for (int y = 0; y < height; ++y) {
+        unsigned const* const src1_line = incrementedLine(
+                                              src1_line_base, increment_mask, y, width, buffer
+                                          );
         for (int x = 0; x < width; ++x) {
             if (src1_line[x] >= lower_bound &&
                     src1_line[x] == src2_line[x]) {
@@ -423,7 +523,7 @@ HoughLineDetector::buildEqualMap(
             }
         }
         dst_line += dst_wpl;
-        src1_line += width;
+        src1_line_base += width;
         src2_line += width;
     }
 
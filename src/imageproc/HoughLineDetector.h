@@ -23,6 +23,7 @@
 #include <vector>
 
 class QSize;
+class QRect;
 class QLineF;
 class QImage;
 
@@ -30,6 +31,7 @@ namespace imageproc
 {
 
 class BinaryImage;
+class GrayImage;
 
 /**
  * \brief A line detected by HoughLineDetector.
@@ -110,6 +112,16 @@ public:
      */
     void process(int x, int y, unsigned weight = 1);
 
+    /**
+     * \brief Processes every pixel of an area of a grayscale image.
+     *
+     * Pixel (x, y) is processed with weight_table[image(x, y)].
+     * Pixels with zero weights are skipped.  Rows of the image are
+     * processed in parallel, each thread accumulating its own
+     * histogram, which are then summed up.
+     */
+    void process(GrayImage const& image, QRect const& area, unsigned const weight_table[256]);
+
     QImage visualizeHoughSpace(unsigned lower_bound) const;
 
     /**
@@ -129,19 +141,15 @@ private:
         unsigned lower_bound);
 
     static BinaryImage findPeakCandidates(
-        std::vector<unsigned> const& hist, int width, int height,
-        unsigned lower_bound);
-
-    static void incrementBinsMasked(
-        std::vector<unsigned>& hist,
-        int width, int height, BinaryImage const& mask);
+        std::vector<unsigned> const& hist, BinaryImage const* increment_mask,
+        int width, int height, unsigned lower_bound);
 
     static void max5x5(
-        std::vector<unsigned> const& src,
+        std::vector<unsigned> const& src, BinaryImage const* increment_mask,
         std::vector<unsigned>& dst, int width, int height);
 
     static void max3x1(
-        std::vector<unsigned> const& src,
+        std::vector<unsigned> const& src, BinaryImage const* increment_mask,
         std::vector<unsigned>& dst, int width, int height);
 
     static void max1x3(
@@ -149,10 +157,16 @@ private:
         std::vector<unsigned>& dst, int width, int height);
 
     static BinaryImage buildEqualMap(
-        std::vector<unsigned> const& src1,
+        std::vector<unsigned> const& src1, BinaryImage const* increment_mask,
         std::vector<unsigned> const& src2,
         int width, int height, unsigned lower_bound);
 
+    static unsigned const* incrementedLine(
+        unsigned const* hist_line, BinaryImage const* increment_mask,
+        int y, int width, std::vector<unsigned>& buffer);
+
+    void accumulate(unsigned* hist, int x, int y, unsigned weight) const;
+
     /**
      * \brief A 2D histogram laid out in raster order.
      *
@@ -166,6 +180,12 @@ private:
      */
     std::vector<QPointF> m_angleUnitVectors;
 
+    /**
+     * \brief Same as m_angleUnitVectors, laid out for vectorization.
+     */
+    std::vector<double> m_cosines;
+    std::vector<double> m_sines;
+
     /**
      * \see HoughLineDetector:HoughLineDetector()
      */
@@ -21,17 +21,178 @@
 #include "ConnectivityMap.h"
 #include "FastQueue.h"
 #include "BitOps.h"
+#include "Connectivity.h"
 #include <QImage>
 #include <QColor>
 #include <algorithm>
 #include <stdexcept>
+#include <vector>
 #include <assert.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 class QImage;
 
 namespace imageproc
 {
 
+namespace
+{
+
+typedef InfluenceMap::Cell Cell;
+
+/**
+ * Spreads the labels of queued cells over the cells with greater
+ * distances.  \p width is the stride of the padded map.
+ */
+void spreadLabels(FastQueue<Cell*>& queue, int const width)
+{
+    while (!queue.empty()) {
+        Cell* const cell = queue.front();
+        queue.pop();
+
+        assert(cell->distSq != ~uint32_t(0));
+        assert(cell->label != 0);
+
+        int32_t const dx2 = cell->vec.x << 1;
+        int32_t const dy2 = cell->vec.y << 1;
+
+        // North-western neighbor.
+        Cell* nbh = cell - width - 1;
+        uint32_t new_dist_sq = cell->distSq + dx2 + dy2 + 2;
+        if (new_dist_sq < nbh->distSq) {
+            nbh->label = cell->label;
+            nbh->distSq = new_dist_sq;
+            nbh->vec.x = cell->vec.x + 1;
+            nbh->vec.y = cell->vec.y + 1;
+            queue.push(nbh);
+        }
+
+        // Northern neighbor.
+        ++nbh;
+        new_dist_sq = cell->distSq + dy2 + 1;
+        if (new_dist_sq < nbh->distSq) {
+            nbh->label = cell->label;
+            nbh->distSq = new_dist_sq;
+            nbh->vec.x = cell->vec.x;
+            nbh->vec.y = cell->vec.y + 1;
+            queue.push(nbh);
+        }
+
+        // North-eastern neighbor.
+        ++nbh;
+        new_dist_sq = cell->distSq - dx2 + dy2 + 2;
+        if (new_dist_sq < nbh->distSq) {
+            nbh->label = cell->label;
+            nbh->distSq = new_dist_sq;
+            nbh->vec.x = cell->vec.x - 1;
+            nbh->vec.y = cell->vec.y + 1;
+            queue.push(nbh);
+        }
+
+        // Eastern neighbor.
+        nbh += width;
+        new_dist_sq = cell->distSq - dx2 + 1;
+        if (new_dist_sq < nbh->distSq) {
+            nbh->label = cell->label;
+            nbh->distSq = new_dist_sq;
+            nbh->vec.x = cell->vec.x - 1;
+            nbh->vec.y = cell->vec.y;
+            queue.push(nbh);
+        }
+
+        // South-eastern neighbor.
+        nbh += width;
+        new_dist_sq = cell->distSq - dx2 - dy2 + 2;
+        if (new_dist_sq < nbh->distSq) {
+            nbh->label = cell->label;
+            nbh->distSq = new_dist_sq;
+            nbh->vec.x = cell->vec.x - 1;
+            nbh->vec.y = cell->vec.y - 1;
+            queue.push(nbh);
+        }
+
+        // Southern neighbor.
+        --nbh;
+        new_dist_sq = cell->distSq - dy2 + 1;
+        if (new_dist_sq < nbh->distSq) {
+            nbh->label = cell->label;
+            nbh->distSq = new_dist_sq;
+            nbh->vec.x = cell->vec.x;
+            nbh->vec.y = cell->vec.y - 1;
+            queue.push(nbh);
+        }
+
+        // South-western neighbor.
+        --nbh;
+        new_dist_sq = cell->distSq + dx2 - dy2 + 2;
+        if (new_dist_sq < nbh->distSq) {
+            nbh->label = cell->label;
+            nbh->distSq = new_dist_sq;
+            nbh->vec.x = cell->vec.x + 1;
+            nbh->vec.y = cell->vec.y - 1;
+            queue.push(nbh);
+        }
+
+        // Western neighbor.
+        nbh -= width;
+        new_dist_sq = cell->distSq + dx2 + 1;
+        if (new_dist_sq < nbh->distSq) {
+            nbh->label = cell->label;
+            nbh->distSq = new_dist_sq;
+            nbh->vec.x = cell->vec.x + 1;
+            nbh->vec.y = cell->vec.y;
+            queue.push(nbh);
+        }
+    }
+}
+
+/**
+ * Groups the cells labelled in \p cmap_data by the region they are in,
+ * in the raster order.  On return, the seeds of region r are
+ * seeds[region_begin[r]] to seeds[region_begin[r + 1] - 1].
+ */
+template<typename RegionLabel>
+void groupSeedsByRegion(
+    QSize const size, uint32_t const* const cmap_data, int const cmap_stride,
+    RegionLabel const* const regions_data, int const regions_stride,
+    uint32_t const num_regions, Cell* const cells, int const cells_stride,
+    std::vector<uint32_t>& region_begin, std::vector<Cell*>& seeds)
+{
+    int const width = size.width();
+    int const height = size.height();
+
+    region_begin.assign(num_regions + 2, 0);
+    for (int y = 0; y < height; ++y) {
+        uint32_t const* cmap_line = cmap_data + y * cmap_stride;
+        RegionLabel const* regions_line = regions_data + y * regions_stride;
+        for (int x = 0; x < width; ++x) {
+            if (cmap_line[x] != 0) {
+                ++region_begin[regions_line[x] + 1];
+            }
+        }
+    }
+    for (uint32_t region = 1; region <= num_regions + 1; ++region) {
+        region_begin[region] += region_begin[region - 1];
+    }
+
+    seeds.resize(region_begin[num_regions + 1]);
+    std::vector<uint32_t> region_end(region_begin.begin(), region_begin.end() - 1);
+    for (int y = 0; y < height; ++y) {
+        uint32_t const* cmap_line = cmap_data + y * cmap_stride;
+        RegionLabel const* regions_line = regions_data + y * regions_stride;
+        Cell* cell_line = cells + y * cells_stride;
+        for (int x = 0; x < width; ++x) {
+            if (cmap_line[x] != 0) {
+                seeds[region_end[regions_line[x]]++] = cell_line + x;
+            }
+        }
+    }
+}
+
+} // anonymous namespace
+
 InfluenceMap::InfluenceMap()
     :   m_pData(0),
         m_size(),
@@ -112,8 +273,6 @@ InfluenceMap::init(
     m_pData = &m_data[0] + width + 1;
     m_maxLabel = cmap.maxLabel();
 
-    FastQueue<Cell*> queue;
-
     Cell* cell = &m_data[0];
     uint32_t const* label = cmap.paddedData();
     for (int i = width * height; i > 0; --i) {
@@ -122,9 +281,6 @@ InfluenceMap::init(
         cell->distSq = 0;
         cell->vec.x = 0;
         cell->vec.y = 0;
-        if (*label != 0) {
-            queue.push(cell);
-        }
         ++cell;
         ++label;
     }
@@ -157,107 +313,92 @@ InfluenceMap::init(
         }
     }
 
-    while (!queue.empty()) {
-        cell = queue.front();
-        queue.pop();
-
-        assert((cell - &m_data[0]) / width > 0);
-        assert((cell - &m_data[0]) / width < height - 1);
-        assert((cell - &m_data[0]) % width > 0);
-        assert((cell - &m_data[0]) % width < width - 1);
-        assert(cell->distSq != ~uint32_t(0));
-        assert(cell->label != 0);
-        assert(cell->label <= m_maxLabel);
+#ifdef _OPENMP
+    if (mask && omp_get_max_threads() > 1) {
+        spreadInRegions(cmap, *mask);
+        return;
+    }
+#endif
 
-        int32_t const dx2 = cell->vec.x << 1;
-        int32_t const dy2 = cell->vec.y << 1;
+    FastQueue<Cell*> queue;
 
-        // North-western neighbor.
-        Cell* nbh = cell - width - 1;
-        uint32_t new_dist_sq = cell->distSq + dx2 + dy2 + 2;
-        if (new_dist_sq < nbh->distSq) {
-            nbh->label = cell->label;
-            nbh->distSq = new_dist_sq;
-            nbh->vec.x = cell->vec.x + 1;
-            nbh->vec.y = cell->vec.y + 1;
-            queue.push(nbh);
+    cell = m_pData;
+    label = cmap.data();
+    for (int y = 0; y < height - 2; ++y) {
+        for (int x = 0; x < width - 2; ++x, ++cell) {
+            if (label[x] != 0) {
+                queue.push(cell);
+            }
         }
+        label += cmap.stride();
+        cell += 2;
+    }
 
-        // Northern neighbor.
-        ++nbh;
-        new_dist_sq = cell->distSq + dy2 + 1;
-        if (new_dist_sq < nbh->distSq) {
-            nbh->label = cell->label;
-            nbh->distSq = new_dist_sq;
-            nbh->vec.x = cell->vec.x;
-            nbh->vec.y = cell->vec.y + 1;
-            queue.push(nbh);
-        }
+    spreadLabels(queue, width);
+}
 
-        // North-eastern neighbor.
-        ++nbh;
-        new_dist_sq = cell->distSq - dx2 + dy2 + 2;
-        if (new_dist_sq < nbh->distSq) {
-            nbh->label = cell->label;
-            nbh->distSq = new_dist_sq;
-            nbh->vec.x = cell->vec.x - 1;
-            nbh->vec.y = cell->vec.y + 1;
-            queue.push(nbh);
-        }
+void
+InfluenceMap::spreadInRegions(ConnectivityMap const& cmap, BinaryImage const& mask)
+{
+    int const width = m_size.width();
+    int const height = m_size.height();
 
-        // Eastern neighbor.
-        nbh += width;
-        new_dist_sq = cell->distSq - dx2 + 1;
-        if (new_dist_sq < nbh->distSq) {
-            nbh->label = cell->label;
-            nbh->distSq = new_dist_sq;
-            nbh->vec.x = cell->vec.x - 1;
-            nbh->vec.y = cell->vec.y;
-            queue.push(nbh);
+    // Labels only spread into unlabelled cells of the mask, so 8-connected
+    // regions of labelled or masked pixels don't affect each other.
+    // Within a region, cells are processed in the same order as when
+    // spreading over the whole map, so the result is the same.
+    BinaryImage regions_img(mask);
+    uint32_t* const regions_img_data = regions_img.data();
+    int const regions_img_stride = regions_img.wordsPerLine();
+    uint32_t const* const cmap_data = cmap.data();
+    int const cmap_stride = cmap.stride();
+    uint32_t const msb = uint32_t(1) << 31;
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; ++y) {
+        uint32_t* regions_img_line = regions_img_data + y * regions_img_stride;
+        uint32_t const* cmap_line = cmap_data + y * cmap_stride;
+        for (int x = 0; x < width; ++x) {
+            if (cmap_line[x] != 0) {
+                regions_img_line[x >> 5] |= msb >> (x & 31);
+            }
         }
+    }
 
-        // South-eastern neighbor.
-        nbh += width;
-        new_dist_sq = cell->distSq - dx2 - dy2 + 2;
-        if (new_dist_sq < nbh->distSq) {
-            nbh->label = cell->label;
-            nbh->distSq = new_dist_sq;
-            nbh->vec.x = cell->vec.x - 1;
-            nbh->vec.y = cell->vec.y - 1;
-            queue.push(nbh);
-        }
+    ConnectivityMap regions(regions_img, CONN8);
+    regions_img.release();
+
+    // The region labels are read twice, and there are rarely more
+    // than 65535 regions.
+    uint32_t const num_regions = regions.maxLabel();
+    std::vector<uint32_t> region_begin;
+    std::vector<Cell*> seeds;
+    if (regions.compactLabels()) {
+        groupSeedsByRegion(
+            m_size, cmap_data, cmap_stride, regions.compactData(), regions.stride(),
+            num_regions, m_pData, m_stride, region_begin, seeds
+        );
+    } else {
+        groupSeedsByRegion(
+            m_size, cmap_data, cmap_stride, regions.data(), regions.stride(),
+            num_regions, m_pData, m_stride, region_begin, seeds
+        );
+    }
 
-        // Southern neighbor.
-        --nbh;
-        new_dist_sq = cell->distSq - dy2 + 1;
-        if (new_dist_sq < nbh->distSq) {
-            nbh->label = cell->label;
-            nbh->distSq = new_dist_sq;
-            nbh->vec.x = cell->vec.x;
-            nbh->vec.y = cell->vec.y - 1;
-            queue.push(nbh);
-        }
+    Cell* const* const seeds_data = seeds.empty() ? 0 : &seeds[0];
+    int const stride = m_stride;
 
-        // South-western neighbor.
-        --nbh;
-        new_dist_sq = cell->distSq + dx2 - dy2 + 2;
-        if (new_dist_sq < nbh->distSq) {
-            nbh->label = cell->label;
-            nbh->distSq = new_dist_sq;
-            nbh->vec.x = cell->vec.x + 1;
-            nbh->vec.y = cell->vec.y - 1;
-            queue.push(nbh);
-        }
+    #pragma omp parallel
+    {
+        FastQueue<Cell*> queue;
 
-        // Western neighbor.
-        nbh -= width;
-        new_dist_sq = cell->distSq + dx2 + 1;
-        if (new_dist_sq < nbh->distSq) {
-            nbh->label = cell->label;
-            nbh->distSq = new_dist_sq;
-            nbh->vec.x = cell->vec.x + 1;
-            nbh->vec.y = cell->vec.y;
-            queue.push(nbh);
+        #pragma omp for schedule(dynamic, 16)
+        for (uint32_t region = 1; region <= num_regions; ++region) {
+            uint32_t const end = region_begin[region + 1];
+            for (uint32_t i = region_begin[region]; i < end; ++i) {
+                queue.push(seeds_data[i]);
+            }
+            spreadLabels(queue, stride);
         }
     }
 }
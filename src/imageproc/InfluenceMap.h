@@ -177,6 +177,12 @@ public:
 private:
     void init(ConnectivityMap const& cmap, BinaryImage const* mask = 0);
 
+    /**
+     * Spreads labels within each connected region of the mask
+     * separately, processing regions in parallel.
+     */
+    void spreadInRegions(ConnectivityMap const& cmap, BinaryImage const& mask);
+
     std::vector<Cell> m_data;
     Cell* m_pData;
     QSize m_size;
@@ -20,9 +20,12 @@
 #define IMAGEPROC_INTEGRALIMAGE_H_
 
 #include "NonCopyable.h"
+#include "GrayImage.h"
 #include <QSize>
 #include <QRect>
+#include <algorithm>
 #include <new>
+#include <stdint.h>
 
 namespace imageproc
 {
@@ -48,6 +51,15 @@ public:
 
     explicit IntegralImage(QSize const& size);
 
+    /**
+     * \brief Builds the integral image of gray levels in one go.
+     *
+     * Gray levels are converted to T with T(level).  Rows are summed up
+     * in parallel, then columns are, in vertical strips.  No values may
+     * be pushed to an integral image constructed this way.
+     */
+    explicit IntegralImage(GrayImage const& image);
+
     ~IntegralImage();
 
     /**
@@ -102,6 +114,55 @@ IntegralImage<T>::IntegralImage(QSize const& size)
     init(size.width() + 1, size.height() + 1);
 }
 
+template<typename T>
+IntegralImage<T>::IntegralImage(GrayImage const& image)
+    :   m_lineSum()
+{
+    int const width = image.width();
+    int const height = image.height();
+
+    // The first row and column are fake.
+    init(width + 1, height + 1);
+
+    uint8_t const* const src_data = image.data();
+    int const src_stride = image.stride();
+    T* const data = m_pData;
+    int const stride = m_width;
+
+    // Sum up the rows.
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; ++y) {
+        uint8_t const* const src_line = src_data + y * src_stride;
+        T* const line = data + (y + 1) * stride;
+        T line_sum = T();
+        line[0] = T();
+        for (int x = 0; x < width; ++x) {
+            line_sum += T(src_line[x]);
+            line[x + 1] = line_sum;
+        }
+    }
+
+    // Add every row to the one below it, strip by strip.  Within a strip,
+    // that's an element-wise addition of two lines, which vectorizes.
+    int const strip_width = 256;
+    int const num_strips = (stride + strip_width - 1) / strip_width;
+    #pragma omp parallel for schedule(static)
+    for (int strip = 0; strip < num_strips; ++strip) {
+        int const begin = strip * strip_width;
+        int const end = std::min(begin + strip_width, stride);
+        for (int y = 1; y <= height; ++y) {
+            T* const line = data + y * stride;
+            T const* const above = line - stride;
+            for (int x = begin; x < end; ++x) {
+                line[x] += above[x];
+            }
+        }
+    }
+
+    m_pCur = m_pData + m_width * m_height;
+    m_pAbove = m_pCur - m_width;
+}
+
 template<typename T>
 IntegralImage<T>::~IntegralImage()
 {
@@ -166,6 +227,48 @@ IntegralImage<T>::sum(QRect const& rect) const
     return sum;
 }
 
+/**
+ * \brief A gray level together with its square.
+ *
+ * IntegralImage<GraySumAndSquare<T> > built from a GrayImage provides both
+ * the sum and the sum of squares over a window, as needed to calculate
+ * the local mean and variance.  Both are built in a single pass and are
+ * stored side by side.  A 32-bit T would overflow on big images, so use
+ * a 64-bit integer or a floating point type.
+ */
+template<typename T>
+struct GraySumAndSquare
+{
+    T sum;
+    T sqsum;
+
+    GraySumAndSquare() : sum(), sqsum() {}
+
+    explicit GraySumAndSquare(uint8_t const level)
+        : sum(level), sqsum(T(level) * T(level)) {}
+
+    GraySumAndSquare& operator+=(GraySumAndSquare const& other)
+    {
+        sum += other.sum;
+        sqsum += other.sqsum;
+        return *this;
+    }
+
+    GraySumAndSquare& operator-=(GraySumAndSquare const& other)
+    {
+        sum -= other.sum;
+        sqsum -= other.sqsum;
+        return *this;
+    }
+
+    GraySumAndSquare operator+(GraySumAndSquare const& other) const
+    {
+        GraySumAndSquare res(*this);
+        res += other;
+        return res;
+    }
+};
+
 } // namespace imageproc
 
 #endif
@@ -49,7 +49,9 @@ public:
 MaxWhitespaceFinder::MaxWhitespaceFinder(BinaryImage const& img, QSize min_size)
     :   m_integralImg(img.size()),
         m_ptrQueuedRegions(new PriorityStorageImpl<AreaCompare>(AreaCompare())),
-        m_minSize(min_size)
+        m_numLiveObstacles(0),
+        m_minSize(min_size),
+        m_minArea(0)
 {
     init(img);
 }
@@ -70,15 +72,25 @@ MaxWhitespaceFinder::init(BinaryImage const& img)
         }
     }
 
-    Region region(0, img.rect());
-    m_ptrQueuedRegions->push(region);
+    m_ptrQueuedRegions->push(Region(0, img.rect()));
 }
 
 void
 MaxWhitespaceFinder::addObstacle(QRect const& obstacle)
 {
     if (m_ptrQueuedRegions->size() == 1) {
-        m_ptrQueuedRegions->top().addObstacle(obstacle);
+        Region& region = m_ptrQueuedRegions->top();
+        if (region.obstaclesBegin + region.numObstacles != m_obstacles.size()) {
+            // Move the region's obstacles to the end, so we can append to them.
+            size_t const begin = m_obstacles.size();
+            for (uint32_t i = 0; i < region.numObstacles; ++i) {
+                m_obstacles.push_back(m_obstacles[region.obstaclesBegin + i]);
+            }
+            region.obstaclesBegin = begin;
+        }
+        m_obstacles.push_back(obstacle);
+        ++region.numObstacles;
+        ++m_numLiveObstacles;
     } else {
         m_newObstacles.push_back(obstacle);
     }
@@ -88,103 +100,180 @@ QRect
 MaxWhitespaceFinder::next(ObstacleMode const obstacle_mode, int max_iterations)
 {
     while (max_iterations-- > 0 && !m_ptrQueuedRegions->empty()) {
-        Region& top_region = m_ptrQueuedRegions->top();
-        Region region(top_region);
-        region.swapObstacles(top_region);
+        Region const region(m_ptrQueuedRegions->top());
         m_ptrQueuedRegions->pop();
+        m_numLiveObstacles -= region.numObstacles;
+
+        QRect const& bounds = region.bounds;
+        if (bounds.width() * bounds.height() < m_minArea) {
+            continue;
+        }
 
-        region.addNewObstacles(m_newObstacles);
+        m_regionObstacles.assign(
+            m_obstacles.begin() + region.obstaclesBegin,
+            m_obstacles.begin() + region.obstaclesBegin + region.numObstacles
+        );
 
-        if (!region.obstacles().empty()) {
-            subdivideUsingObstacles(region);
+        // Add global obstacles that were not there when this region was constructed.
+        for (size_t i = region.knownNewObstacles; i < m_newObstacles.size(); ++i) {
+            QRect const intersected(m_newObstacles[i].intersected(bounds));
+            if (!intersected.isEmpty()) {
+                m_regionObstacles.push_back(intersected);
+            }
+        }
+
+        if (m_obstacles.size() > 2 * m_numLiveObstacles + 4096) {
+            compactObstacles();
+        }
+
+        if (!m_regionObstacles.empty()) {
+            subdivideUsingObstacles(bounds);
             continue;
         }
 
-        if (m_integralImg.sum(region.bounds()) != 0) {
-            subdivideUsingRaster(region);
+        if (m_integralImg.sum(bounds) != 0) {
+            subdivideUsingRaster(bounds);
             continue;
         }
 
         if (obstacle_mode == AUTO_OBSTACLES) {
-            m_newObstacles.push_back(region.bounds());
+            m_newObstacles.push_back(bounds);
         }
 
-        return region.bounds();
+        return bounds;
     }
 
     return QRect();
 }
 
+std::vector<QRect>
+MaxWhitespaceFinder::nextMany(
+    int const max_count, int const min_area, int const max_iterations)
+{
+    m_minArea = std::max(m_minArea, min_area);
+
+    std::vector<QRect> found;
+    while ((int)found.size() < max_count) {
+        QRect const ws(next(AUTO_OBSTACLES, max_iterations));
+        if (ws.isNull()) {
+            break;
+        }
+        found.push_back(ws);
+    }
+
+    return found;
+}
+
+/**
+ * Queues a region with the obstacles of the region being subdivided
+ * that intersect \p bounds.
+ */
+void
+MaxWhitespaceFinder::pushRegion(QRect const& bounds)
+{
+    size_t const begin = m_obstacles.size();
+    if (bounds.width() * bounds.height() < m_minArea) {
+        // It will be dropped once popped, so don't bother with its obstacles.
+        // It still goes to the queue, not to change the order of the others.
+        m_ptrQueuedRegions->push(Region(m_newObstacles.size(), bounds, begin, 0));
+        return;
+    }
+
+    for (QRect const& obstacle : m_regionObstacles) {
+        QRect const intersected(obstacle.intersected(bounds));
+        if (!intersected.isEmpty()) {
+            m_obstacles.push_back(intersected);
+        }
+    }
+
+    uint32_t const num_obstacles = m_obstacles.size() - begin;
+    m_ptrQueuedRegions->push(Region(m_newObstacles.size(), bounds, begin, num_obstacles));
+    m_numLiveObstacles += num_obstacles;
+}
+
+/**
+ * Moves the obstacles of queued regions to the beginning of the buffer,
+ * getting rid of the obstacles of regions already popped.
+ */
+void
+MaxWhitespaceFinder::compactObstacles()
+{
+    m_spareObstacles.clear();
+
+    size_t const num_regions = m_ptrQueuedRegions->size();
+    for (size_t i = 0; i < num_regions; ++i) {
+        Region& region = m_ptrQueuedRegions->at(i);
+        uint32_t const begin = m_spareObstacles.size();
+        m_spareObstacles.insert(
+            m_spareObstacles.end(),
+            m_obstacles.begin() + region.obstaclesBegin,
+            m_obstacles.begin() + region.obstaclesBegin + region.numObstacles
+        );
+        region.obstaclesBegin = begin;
+    }
+
+    m_obstacles.swap(m_spareObstacles);
+}
+
 void
-MaxWhitespaceFinder::subdivideUsingObstacles(Region const& region)
+MaxWhitespaceFinder::subdivideUsingObstacles(QRect const& bounds)
 {
-    QRect const bounds(region.bounds());
-    QRect const pivot_rect(findPivotObstacle(region));
+    QRect const pivot_rect(findPivotObstacle(bounds));
 
-    subdivide(region, bounds, pivot_rect);
+    subdivide(bounds, pivot_rect);
 }
 
 void
-MaxWhitespaceFinder::subdivideUsingRaster(Region const& region)
+MaxWhitespaceFinder::subdivideUsingRaster(QRect const& bounds)
 {
-    QRect const bounds(region.bounds());
     QPoint const pivot_pixel(findBlackPixelCloseToCenter(bounds));
     QRect const pivot_rect(extendBlackPixelToBlackBox(pivot_pixel, bounds));
 
-    subdivide(region, bounds, pivot_rect);
+    subdivide(bounds, pivot_rect);
 }
 
 void
-MaxWhitespaceFinder::subdivide(
-    Region const& region, QRect const bounds, QRect const pivot)
+MaxWhitespaceFinder::subdivide(QRect const bounds, QRect const pivot)
 {
     // Area above the pivot obstacle.
     if (pivot.top() - bounds.top() >= m_minSize.height()) {
         QRect new_bounds(bounds);
         new_bounds.setBottom(pivot.top() - 1); // Bottom is inclusive.
-        Region new_region(m_newObstacles.size(), new_bounds);
-        new_region.addObstacles(region);
-        m_ptrQueuedRegions->push(new_region);
+        pushRegion(new_bounds);
     }
 
     // Area below the pivot obstacle.
     if (bounds.bottom() - pivot.bottom() >= m_minSize.height()) {
         QRect new_bounds(bounds);
         new_bounds.setTop(pivot.bottom() + 1);
-        Region new_region(m_newObstacles.size(), new_bounds);
-        new_region.addObstacles(region);
-        m_ptrQueuedRegions->push(new_region);
+        pushRegion(new_bounds);
     }
 
     // Area to the left of the pivot obstacle.
     if (pivot.left() - bounds.left() >= m_minSize.width()) {
         QRect new_bounds(bounds);
         new_bounds.setRight(pivot.left() - 1); // Right is inclusive.
-        Region new_region(m_newObstacles.size(), new_bounds);
-        new_region.addObstacles(region);
-        m_ptrQueuedRegions->push(new_region);
+        pushRegion(new_bounds);
     }
 
     // Area to the right of the pivot obstacle.
     if (bounds.right() - pivot.right() >= m_minSize.width()) {
         QRect new_bounds(bounds);
         new_bounds.setLeft(pivot.right() + 1);
-        Region new_region(m_newObstacles.size(), new_bounds);
-        new_region.addObstacles(region);
-        m_ptrQueuedRegions->push(new_region);
+        pushRegion(new_bounds);
     }
 }
 
 QRect
-MaxWhitespaceFinder::findPivotObstacle(Region const& region) const
+MaxWhitespaceFinder::findPivotObstacle(QRect const& bounds) const
 {
-    assert(!region.obstacles().empty());
+    assert(!m_regionObstacles.empty());
 
-    QPoint const center(region.bounds().center());
+    QPoint const center(bounds.center());
 
     QRect best_obstacle;
     int best_distance = std::numeric_limits<int>::max();
-    for (QRect const& obstacle : region.obstacles()) {
+    for (QRect const& obstacle : m_regionObstacles) {
         QPoint const vec(center - obstacle.center());
         int const distance = vec.x() * vec.x() + vec.y() * vec.y();
         if (distance <= best_distance) {
@@ -373,60 +462,4 @@ MaxWhitespaceFinder::extendBlackPixelToBlackBox(
     return inner_rect;
 }
 
-/*======================= MaxWhitespaceFinder::Region =====================*/
-
-MaxWhitespaceFinder::Region::Region(
-    unsigned known_new_obstacles, QRect const& bounds)
-    :   m_knownNewObstacles(known_new_obstacles),
-        m_bounds(bounds)
-{
-}
-
-MaxWhitespaceFinder::Region::Region(Region const& other)
-    :   m_knownNewObstacles(other.m_knownNewObstacles),
-        m_bounds(other.m_bounds)
-{
-    // Note that we don't copy m_obstacles.  This is a shallow copy.
-}
-
-/**
- * Adds obstacles from another region that intersect this region's area.
- */
-void
-MaxWhitespaceFinder::Region::addObstacles(Region const& other_region)
-{
-    for (QRect const& obstacle : other_region.obstacles()) {
-        QRect const intersected(obstacle.intersected(m_bounds));
-        if (!intersected.isEmpty()) {
-            m_obstacles.push_back(intersected);
-        }
-    }
-}
-
-/**
- * Adds global obstacles that were not there when this region was constructed.
- */
-void
-MaxWhitespaceFinder::Region::addNewObstacles(
-    std::vector<QRect> const& new_obstacles)
-{
-    for (size_t i = m_knownNewObstacles; i < new_obstacles.size(); ++i) {
-        QRect const intersected(new_obstacles[i].intersected(m_bounds));
-        if (!intersected.isEmpty()) {
-            m_obstacles.push_back(intersected);
-        }
-    }
-}
-
-/**
- * A fast and non-throwing swap operation.
- */
-void
-MaxWhitespaceFinder::Region::swap(Region& other)
-{
-    std::swap(m_bounds, other.m_bounds);
-    std::swap(m_knownNewObstacles, other.m_knownNewObstacles);
-    m_obstacles.swap(other.m_obstacles);
-}
-
 } // namespace imageproc
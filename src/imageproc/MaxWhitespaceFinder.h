@@ -25,9 +25,10 @@
 #include <QRect>
 #include <QSize>
 #include <vector>
-#include <deque>
 #include <memory>
+#include <utility>
 #include <stddef.h>
+#include <stdint.h>
 
 namespace imageproc
 {
@@ -122,59 +123,63 @@ public:
      *         rectangles confirming to the minimum size were found.
      */
     QRect next(ObstacleMode obstacle_mode = AUTO_OBSTACLES, int max_iterations = 1000);
+
+    /**
+     * \brief Find up to \p max_count white rectangles with an area
+     *        of at least \p min_area pixels.
+     *
+     * Rectangles are found like with next(AUTO_OBSTACLES), except that
+     * areas too small to hold such a rectangle are dropped rather than
+     * subdivided.  That applies to later calls to next() as well, so
+     * this finder won't return smaller rectangles any more.
+     * With the default (area) ordering, the result is the same as calling
+     * next() until it returns a rectangle smaller than \p min_area,
+     * or a null one.
+     *
+     * \param max_iterations The limit for each of the rectangles,
+     *        see next().
+     */
+    std::vector<QRect> nextMany(int max_count, int min_area, int max_iterations = 1000);
 private:
-    class Region
-    {
-    public:
-        Region(unsigned known_new_obstacles, QRect const& bounds);
+    /**
+     * \brief An area to look for white rectangles in.
+     *
+     * The obstacles intersecting the area are stored in m_obstacles,
+     * starting at obstaclesBegin.  Regions can be copied freely.
+     */
+    struct Region {
+        QRect bounds;
 
         /**
-         * A shallow copy.  Copies everything except the obstacle list.
+         * The number of elements of m_newObstacles that were taken
+         * into account when the region was created.
          */
-        Region(Region const& other);
-
-        QRect const& bounds() const
-        {
-            return m_bounds;
-        }
+        unsigned knownNewObstacles;
 
-        std::vector<QRect> const& obstacles() const
-        {
-            return m_obstacles;
-        }
-
-        void addObstacle(QRect const& obstacle)
-        {
-            m_obstacles.push_back(obstacle);
-        }
-
-        void addObstacles(Region const& other_region);
-
-        void addNewObstacles(std::vector<QRect> const& new_obstacles);
+        uint32_t obstaclesBegin;
+        uint32_t numObstacles;
 
-        void swap(Region& other);
-
-        void swapObstacles(Region& other)
-        {
-            m_obstacles.swap(other.m_obstacles);
-        }
-    private:
-        Region& operator=(Region const&);
-
-        unsigned m_knownNewObstacles;
-        QRect m_bounds;
-        std::vector<QRect> m_obstacles;
+        Region(unsigned known_new_obstacles, QRect const& bounds,
+               uint32_t obstacles_begin = 0, uint32_t num_obstacles = 0)
+            :   bounds(bounds),
+                knownNewObstacles(known_new_obstacles),
+                obstaclesBegin(obstacles_begin),
+                numObstacles(num_obstacles) {}
     };
 
     void init(BinaryImage const& img);
 
-    void subdivideUsingObstacles(Region const& region);
+    void pushRegion(QRect const& bounds);
+
+    void compactObstacles();
 
-    void subdivideUsingRaster(Region const& region);
+    void subdivideUsingObstacles(QRect const& bounds);
 
-    void subdivide(Region const& region, QRect bounds, QRect pivot);
+    void subdivideUsingRaster(QRect const& bounds);
 
-    QRect findPivotObstacle(Region const& region) const;
+    void subdivide(QRect bounds, QRect pivot);
+
+    QRect findPivotObstacle(QRect const& bounds) const;
 
     QPoint findBlackPixelCloseToCenter(QRect non_white_rect) const;
 
@@ -182,8 +187,32 @@ private:
 
     IntegralImage<unsigned> m_integralImg;
     std::unique_ptr<max_whitespace_finder::PriorityStorage> m_ptrQueuedRegions;
+
+    /**
+     * Obstacles of all queued regions, each region referencing its
+     * own range.  Ranges of popped regions become garbage, which is
+     * removed by compactObstacles().
+     */
+    std::vector<QRect> m_obstacles;
+
+    /**
+     * The buffer compactObstacles() moves live obstacles to.
+     */
+    std::vector<QRect> m_spareObstacles;
+
+    /**
+     * The total number of obstacles referenced by queued regions.
+     */
+    size_t m_numLiveObstacles;
+
+    /**
+     * Obstacles of the region being subdivided, including the new ones.
+     */
+    std::vector<QRect> m_regionObstacles;
+
     std::vector<QRect> m_newObstacles;
     QSize m_minSize;
+    int m_minArea;
 };
 
 namespace max_whitespace_finder
@@ -200,9 +229,16 @@ public:
 
     virtual size_t size() const = 0;
 
+    virtual Region const& top() const = 0;
+
     virtual Region& top() = 0;
 
-    virtual void push(Region& region) = 0;
+    /**
+     * \brief Access to queued regions in no particular order.
+     */
+    virtual Region& at(size_t idx) = 0;
+
+    virtual void push(Region const& region) = 0;
 
     virtual void pop() = 0;
 };
@@ -223,12 +259,22 @@ public:
         return m_priorityQueue.size();
     }
 
+    virtual Region const& top() const
+    {
+        return m_priorityQueue.front();
+    }
+
     virtual Region& top()
     {
         return m_priorityQueue.front();
     }
 
-    virtual void push(Region& region);
+    virtual Region& at(size_t idx)
+    {
+        return m_priorityQueue[idx];
+    }
+
+    virtual void push(Region const& region);
 
     virtual void pop();
 private:
@@ -239,30 +285,29 @@ private:
 
         bool operator()(Region const& lhs, Region const& rhs) const
         {
-            return m_delegate(lhs.bounds(), rhs.bounds());
+            return m_delegate(lhs.bounds, rhs.bounds);
         }
     private:
         QualityCompare m_delegate;
     };
 
     void pushHeap(
-        std::deque<Region>::iterator begin,
-        std::deque<Region>::iterator end);
+        std::vector<Region>::iterator begin,
+        std::vector<Region>::iterator end);
 
     void popHeap(
-        std::deque<Region>::iterator begin,
-        std::deque<Region>::iterator end);
+        std::vector<Region>::iterator begin,
+        std::vector<Region>::iterator end);
 
-    std::deque<Region> m_priorityQueue;
+    std::vector<Region> m_priorityQueue;
     ProxyComparator m_qualityLess;
 };
 
 template<typename QualityCompare>
 void
-PriorityStorageImpl<QualityCompare>::push(Region& region)
+PriorityStorageImpl<QualityCompare>::push(Region const& region)
 {
     m_priorityQueue.push_back(region);
-    m_priorityQueue.back().swapObstacles(region);
     pushHeap(m_priorityQueue.begin(), m_priorityQueue.end());
 }
 
@@ -275,14 +320,14 @@ PriorityStorageImpl<QualityCompare>::pop()
 }
 
 /**
- * Same as std::push_heap(), except this one never copies objects, but swap()'s
- * them instead.  We need this to avoid copying the obstacle list over and over.
+ * Same as std::push_heap().  Having our own implementation guarantees
+ * the same order of regions of equal quality on all platforms.
  */
 template<typename QualityCompare>
 void
 PriorityStorageImpl<QualityCompare>::pushHeap(
-    std::deque<Region>::iterator const begin,
-    std::deque<Region>::iterator const end)
+    std::vector<Region>::iterator const begin,
+    std::vector<Region>::iterator const end)
 {
     typedef std::vector<Region>::iterator::difference_type Distance;
 
@@ -292,24 +337,23 @@ PriorityStorageImpl<QualityCompare>::pushHeap(
     // While the node is bigger than its parent, swap them.
     while (valueIdx > 0 &&
             m_qualityLess(*(begin + parentIdx), *(begin + valueIdx))) {
-        (begin + valueIdx)->swap(*(begin + parentIdx));
+        std::swap(*(begin + valueIdx), *(begin + parentIdx));
         valueIdx = parentIdx;
         parentIdx = (valueIdx - 1) / 2;
     }
 }
 
 /**
- * Same as std::pop_heap(), except this one never copies objects, but swap()'s
- * them instead.  We need this to avoid copying the obstacle list over and over.
+ * Same as std::pop_heap(), see pushHeap().
  */
 template<typename QualityCompare>
 void
 PriorityStorageImpl<QualityCompare>::popHeap(
-    std::deque<Region>::iterator const begin,
-    std::deque<Region>::iterator const end)
+    std::vector<Region>::iterator const begin,
+    std::vector<Region>::iterator const end)
 {
     // Swap the first (top) and the last elements.
-    begin->swap(*(end - 1));
+    std::swap(*begin, *(end - 1));
 
     typedef std::vector<Region>::iterator::difference_type Distance;
     Distance const new_length = end - begin - 1;
@@ -327,7 +371,7 @@ PriorityStorageImpl<QualityCompare>::popHeap(
             biggestChildIdx = secondChildIdx;
         }
 
-        (begin + nodeIdx)->swap(*(begin + biggestChildIdx));
+        std::swap(*(begin + nodeIdx), *(begin + biggestChildIdx));
 
         nodeIdx = biggestChildIdx;
         secondChildIdx = 2 * (nodeIdx + 1);
@@ -335,7 +379,7 @@ PriorityStorageImpl<QualityCompare>::popHeap(
     if (secondChildIdx == new_length) {
         // Swap it with its only child.
         Distance const firstChildIdx = secondChildIdx - 1;
-        (begin + nodeIdx)->swap(*(begin + firstChildIdx));
+        std::swap(*(begin + nodeIdx), *(begin + firstChildIdx));
         nodeIdx = firstChildIdx;
     }
 
@@ -353,7 +397,9 @@ MaxWhitespaceFinder::MaxWhitespaceFinder(
     :   m_integralImg(img.size()),
         m_ptrQueuedRegions(
             new max_whitespace_finder::PriorityStorageImpl<QualityCompare>(comp)),
-        m_minSize(min_size)
+        m_numLiveObstacles(0),
+        m_minSize(min_size),
+        m_minArea(0)
 {
     init(img);
 }
@@ -85,6 +85,15 @@ Brick::flipped() const
 namespace
 {
 
+/**
+ * Temporary images of a single dilateOrErodeBrick() call.
+ *
+ * These are not taken from ScratchArena: BinaryImage owns reference
+ * counted storage, which would have to learn to come from and return
+ * to an arena.  Besides, the images are only needed for a few levels
+ * of recursion, so keeping them here already avoids all but the first
+ * allocations, and nothing is kept once the call returns.
+ */
 class ReusableImages
 {
 public:
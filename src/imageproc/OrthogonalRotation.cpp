@@ -19,7 +19,9 @@
 #include "OrthogonalRotation.h"
 #include "BinaryImage.h"
 #include "BWColor.h"
+#include "BadAllocIfNull.h"
 #include "RasterOp.h"
+#include <QImage>
 #include <QRect>
 #include <algorithm>
 #include <stdexcept>
@@ -28,70 +30,157 @@
 namespace imageproc
 {
 
-static inline uint32_t mask(int x)
+namespace
 {
-    return (uint32_t(1) << 31) >> (x % 32);
-}
 
-static BinaryImage rotate0(BinaryImage const& src, QRect const& src_rect)
+/**
+ * Returns 32 pixels of a line, starting at x, MSB first.
+ * x may be negative and the range may extend past the end of the line,
+ * pixels outside of the line are returned as zeros.
+ */
+inline uint32_t extractWord(uint32_t const* line, int const wpl, int const x)
 {
-    if (src_rect == src.rect()) {
-        return src;
+    int const word_idx = x >> 5; // Floor division, also for negative x.
+    int const shift = x & 31;
+    uint32_t const first = (word_idx >= 0 && word_idx < wpl) ? line[word_idx] : 0;
+    if (shift == 0) {
+        return first;
     }
+    uint32_t const second = (word_idx + 1 >= 0 && word_idx + 1 < wpl) ? line[word_idx + 1] : 0;
+    return (first << shift) | (second >> (32 - shift));
+}
 
-    BinaryImage dst(src_rect.width(), src_rect.height());
-    rasterOp<RopSrc>(dst, dst.rect(), src, src_rect.topLeft());
+inline uint32_t reverseBits(uint32_t v)
+{
+    v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+    v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F) | ((v & 0x0F0F0F0F) << 4);
+    v = ((v >> 8) & 0x00FF00FF) | ((v & 0x00FF00FF) << 8);
+    return (v >> 16) | (v << 16);
+}
 
-    return dst;
+/**
+ * Transposes a 32x32 bit matrix, where block[i] is row i and the
+ * most significant bit is column 0.  This is the recursive block swap
+ * from Hacker's Delight: 16x16 blocks, then 8x8 ones and so on.
+ */
+inline void transpose32(uint32_t* block)
+{
+    uint32_t m = 0x0000FFFF;
+    for (int j = 16; j != 0; j >>= 1, m ^= m << j) {
+        for (int k = 0; k < 32; k = (k + j + 1) & ~j) {
+            uint32_t const t = (block[k] ^ (block[k + j] >> j)) & m;
+            block[k] ^= t;
+            block[k + j] ^= t << j;
+        }
+    }
 }
 
-static BinaryImage rotate90(BinaryImage const& src, QRect const& src_rect)
+/**
+ * Number of 32-line strips of the destination image processed together.
+ * The source words they read come from the same cache lines.
+ */
+int const STRIPS_PER_BAND = 8;
+
+/**
+ * Rotates by 90 or 270 degrees, that is transposes and flips.
+ * The destination image is processed in 32x32 pixel blocks.  Block rows
+ * (dst.x) come from source lines and the block is transposed in registers.
+ */
+BinaryImage rotateByTranspose(BinaryImage const& src, QRect const& src_rect, bool const clockwise)
 {
     int const dst_w = src_rect.height();
     int const dst_h = src_rect.width();
     BinaryImage dst(dst_w, dst_h);
-    dst.fill(WHITE);
     int const src_wpl = src.wordsPerLine();
     int const dst_wpl = dst.wordsPerLine();
-    uint32_t const* const src_data = src.data() + src_rect.bottom() * src_wpl;
-    uint32_t* dst_line = dst.data();
+    uint32_t const* const src_data = src.data();
+    uint32_t* const dst_data = dst.data();
 
     /*
-     *   dst
-     *  ----->
-     * ^
-     * | src
-     * |
+     * clockwise:
+     *   dst             dst
+     *  ----->          ----->
+     * ^                      |
+     * | src            src   |
+     * |                      v
+     *
+     * Clockwise, dst(x, y) = src(left + y, bottom - x),
+     * otherwise, dst(x, y) = src(right - y, top + x).
      */
 
-    for (int dst_y = 0; dst_y < dst_h; ++dst_y) {
-        int const src_x = src_rect.left() + dst_y;
-        uint32_t const* src_pword = src_data + src_x / 32;
-        uint32_t const src_mask = mask(src_x);
+    int const num_strips = (dst_h + 31) / 32;
+    int const num_bands = (num_strips + STRIPS_PER_BAND - 1) / STRIPS_PER_BAND;
+
+    #pragma omp parallel for schedule(static)
+    for (int band = 0; band < num_bands; ++band) {
+        int const strip_begin = band * STRIPS_PER_BAND;
+        int const strip_end = std::min(strip_begin + STRIPS_PER_BAND, num_strips);
+        uint32_t block[32];
 
-        for (int dst_x = 0; dst_x < dst_w; ++dst_x) {
-            if (*src_pword & src_mask) {
-                dst_line[dst_x / 32] |= mask(dst_x);
+        for (int dst_word = 0; dst_word < dst_wpl; ++dst_word) {
+            int const dst_x0 = dst_word * 32;
+            int const block_w = std::min(32, dst_w - dst_x0);
+
+            for (int strip = strip_begin; strip < strip_end; ++strip) {
+                int const dst_y0 = strip * 32;
+                for (int i = 0; i < block_w; ++i) {
+                    if (clockwise) {
+                        uint32_t const* src_line = src_data + (src_rect.bottom() - dst_x0 - i) * src_wpl;
+                        block[i] = extractWord(src_line, src_wpl, src_rect.left() + dst_y0);
+                    } else {
+                        uint32_t const* src_line = src_data + (src_rect.top() + dst_x0 + i) * src_wpl;
+                        block[i] = reverseBits(
+                                       extractWord(src_line, src_wpl, src_rect.right() - dst_y0 - 31)
+                                   );
+                    }
+                }
+                for (int i = block_w; i < 32; ++i) {
+                    block[i] = 0;
+                }
+
+                transpose32(block);
+
+                int const block_h = std::min(32, dst_h - dst_y0);
+                uint32_t* dst_pword = dst_data + dst_y0 * dst_wpl + dst_word;
+                for (int j = 0; j < block_h; ++j) {
+                    *dst_pword = block[j];
+                    dst_pword += dst_wpl;
+                }
             }
-            src_pword -= src_wpl;
         }
+    }
+
+    return dst;
+}
 
-        dst_line += dst_wpl;
+BinaryImage rotate0(BinaryImage const& src, QRect const& src_rect)
+{
+    if (src_rect == src.rect()) {
+        return src;
     }
 
+    BinaryImage dst(src_rect.width(), src_rect.height());
+    rasterOp<RopSrc>(dst, dst.rect(), src, src_rect.topLeft());
+
     return dst;
 }
 
-static BinaryImage rotate180(BinaryImage const& src, QRect const& src_rect)
+BinaryImage rotate90(BinaryImage const& src, QRect const& src_rect)
+{
+    return rotateByTranspose(src, src_rect, true);
+}
+
+BinaryImage rotate180(BinaryImage const& src, QRect const& src_rect)
 {
     int const dst_w = src_rect.width();
     int const dst_h = src_rect.height();
     BinaryImage dst(dst_w, dst_h);
-    dst.fill(WHITE);
     int const src_wpl = src.wordsPerLine();
     int const dst_wpl = dst.wordsPerLine();
-    uint32_t const* src_line = src.data() + src_rect.bottom() * src_wpl;
-    uint32_t* dst_line = dst.data();
+    uint32_t const* const src_data = src.data() + src_rect.bottom() * src_wpl;
+    uint32_t* const dst_data = dst.data();
+    uint32_t const last_word_mask = ~uint32_t(0) << (31 - (dst_w - 1) % 32);
 
     /*
      *  dst
@@ -100,58 +189,92 @@ static BinaryImage rotate180(BinaryImage const& src, QRect const& src_rect)
      *  src
      */
 
+    #pragma omp parallel for schedule(static)
     for (int dst_y = 0; dst_y < dst_h; ++dst_y) {
-        int src_x = src_rect.right();
-        for (int dst_x = 0; dst_x < dst_w; --src_x, ++dst_x) {
-            if (src_line[src_x / 32] & mask(src_x)) {
-                dst_line[dst_x / 32] |= mask(dst_x);
-            }
-        }
+        uint32_t const* src_line = src_data - dst_y * src_wpl;
+        uint32_t* dst_line = dst_data + dst_y * dst_wpl;
 
-        src_line -= src_wpl;
-        dst_line += dst_wpl;
+        // dst_x = 32 * i + k corresponds to src_x = right - 32 * i - k.
+        for (int i = 0; i < dst_wpl; ++i) {
+            dst_line[i] = reverseBits(
+                              extractWord(src_line, src_wpl, src_rect.right() - 32 * i - 31)
+                          );
+        }
+        dst_line[dst_wpl - 1] &= last_word_mask;
     }
 
     return dst;
 }
 
-static BinaryImage rotate270(BinaryImage const& src, QRect const& src_rect)
+BinaryImage rotate270(BinaryImage const& src, QRect const& src_rect)
 {
-    int const dst_w = src_rect.height();
-    int const dst_h = src_rect.width();
-    BinaryImage dst(dst_w, dst_h);
-    dst.fill(WHITE);
-    int const src_wpl = src.wordsPerLine();
-    int const dst_wpl = dst.wordsPerLine();
-    uint32_t const* const src_data = src.data() + src_rect.top() * src_wpl;
-    uint32_t* dst_line = dst.data();
+    return rotateByTranspose(src, src_rect, false);
+}
 
-    /*
-     *  dst
-     * ----->
-     *       |
-     *   src |
-     *       v
-     */
+/**
+ * Tiled rotation of 8 or 32 bit pixels.  Each tile of TILE x TILE
+ * destination pixels reads a TILE x TILE area of the source,
+ * so that both fit into L1 cache at the same time.
+ */
+template<typename T, int TILE>
+void rotatePixels(
+    T const* const src_data, int const src_stride,
+    T* const dst_data, int const dst_stride,
+    QRect const& src_rect, int const degrees)
+{
+    int const dst_w = (degrees == 180) ? src_rect.width() : src_rect.height();
+    int const dst_h = (degrees == 180) ? src_rect.height() : src_rect.width();
 
-    for (int dst_y = 0; dst_y < dst_h; ++dst_y) {
-        int const src_x = src_rect.right() - dst_y;
-        uint32_t const* src_pword = src_data + src_x / 32;
-        uint32_t const src_mask = mask(src_x);
+    // dst(x, y) = src(x0 + x * dx_x + y * dy_x, y0 + x * dx_y + y * dy_y)
+    int x0 = 0, y0 = 0, dx_x = 0, dx_y = 0, dy_x = 0, dy_y = 0;
+    switch (degrees) {
+    case 90:
+        x0 = src_rect.left();
+        y0 = src_rect.bottom();
+        dx_y = -1;
+        dy_x = 1;
+        break;
+    case 180:
+        x0 = src_rect.right();
+        y0 = src_rect.bottom();
+        dx_x = -1;
+        dy_y = -1;
+        break;
+    default: // 270
+        x0 = src_rect.right();
+        y0 = src_rect.top();
+        dx_y = 1;
+        dy_x = -1;
+        break;
+    }
+    // Offset between neighbouring pixels of a dst line, in source pixels.
+    int const src_step = dx_x + dx_y * src_stride;
+
+    int const tiles_per_row = (dst_w + TILE - 1) / TILE;
+    int const num_tiles = tiles_per_row * ((dst_h + TILE - 1) / TILE);
+
+    #pragma omp parallel for schedule(static)
+    for (int tile = 0; tile < num_tiles; ++tile) {
+        int const tile_x = (tile % tiles_per_row) * TILE;
+        int const tile_y = (tile / tiles_per_row) * TILE;
+        int const tile_w = std::min(TILE, dst_w - tile_x);
+        int const tile_h = std::min(TILE, dst_h - tile_y);
 
-        for (int dst_x = 0; dst_x < dst_w; ++dst_x) {
-            if (*src_pword & src_mask) {
-                dst_line[dst_x / 32] |= mask(dst_x);
+        for (int y = tile_y; y < tile_y + tile_h; ++y) {
+            int const src_x = x0 + tile_x * dx_x + y * dy_x;
+            int const src_y = y0 + tile_x * dx_y + y * dy_y;
+            T const* src_pixel = src_data + src_y * src_stride + src_x;
+            T* const dst_line = dst_data + y * dst_stride + tile_x;
+            for (int x = 0; x < tile_w; ++x) {
+                dst_line[x] = *src_pixel;
+                src_pixel += src_step;
             }
-            src_pword += src_wpl;
         }
-
-        dst_line += dst_wpl;
     }
-
-    return dst;
 }
 
+} // anonymous namespace
+
 BinaryImage orthogonalRotation(
     BinaryImage const& src, QRect const& src_rect, int const degrees)
 {
@@ -185,4 +308,66 @@ BinaryImage orthogonalRotation(BinaryImage const& src, int const degrees)
     return orthogonalRotation(src, src.rect(), degrees);
 }
 
+QImage orthogonalRotation(QImage const& src, QRect const& src_rect, int const degrees)
+{
+    if (src.isNull() || src_rect.isNull()) {
+        return QImage();
+    }
+
+    if (src_rect.intersected(src.rect()) != src_rect) {
+        throw std::invalid_argument("orthogonalRotation: invalid src_rect");
+    }
+
+    int angle = degrees % 360;
+    if (angle < 0) {
+        angle += 360;
+    }
+    if (angle % 90 != 0) {
+        throw std::invalid_argument("orthogonalRotation: invalid angle");
+    }
+
+    if (src.depth() != 8 && src.depth() != 32) {
+        QImage::Format const format = src.hasAlphaChannel()
+                                      ? QImage::Format_ARGB32 : QImage::Format_RGB32;
+        return orthogonalRotation(src.convertToFormat(format), src_rect, degrees);
+    }
+
+    if (angle == 0) {
+        return badAllocIfNull(src.copy(src_rect));
+    }
+
+    QImage dst(
+        angle == 180 ? src_rect.size() : src_rect.size().transposed(),
+        src.format()
+    );
+    badAllocIfNull(dst);
+    dst.setColorTable(src.colorTable());
+    if (angle == 180) {
+        dst.setDotsPerMeterX(src.dotsPerMeterX());
+        dst.setDotsPerMeterY(src.dotsPerMeterY());
+    } else {
+        dst.setDotsPerMeterX(src.dotsPerMeterY());
+        dst.setDotsPerMeterY(src.dotsPerMeterX());
+    }
+
+    if (src.depth() == 8) {
+        rotatePixels<uint8_t, 64>(
+            src.bits(), src.bytesPerLine(),
+            dst.bits(), dst.bytesPerLine(), src_rect, angle
+        );
+    } else {
+        rotatePixels<uint32_t, 32>(
+            (uint32_t const*)src.bits(), src.bytesPerLine() / 4,
+            (uint32_t*)dst.bits(), dst.bytesPerLine() / 4, src_rect, angle
+        );
+    }
+
+    return dst;
+}
+
+QImage orthogonalRotation(QImage const& src, int const degrees)
+{
+    return orthogonalRotation(src, src.rect(), degrees);
+}
+
 } // namespace imageproc
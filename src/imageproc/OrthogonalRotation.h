@@ -19,6 +19,7 @@
 #ifndef IMAGEPROC_ORTHOGONAL_ROTATION_H_
 #define IMAGEPROC_ORTHOGONAL_ROTATION_H_
 
+class QImage;
 class QRect;
 
 namespace imageproc
@@ -50,6 +51,20 @@ BinaryImage orthogonalRotation(
  */
 BinaryImage orthogonalRotation(BinaryImage const& src, int degrees);
 
+/**
+ * \brief Rotation by 0, 90, 180 or 270 degrees of an 8 or 32 bit image.
+ *
+ * Works like the BinaryImage version.  The format and the color table
+ * are preserved for 8 and 32 bit images, while images of other formats
+ * are converted to RGB32 or ARGB32 first.
+ */
+QImage orthogonalRotation(QImage const& src, QRect const& src_rect, int degrees);
+
+/**
+ * \brief Rotation by 90, 180 or 270 degrees of the whole image.
+ */
+QImage orthogonalRotation(QImage const& src, int degrees);
+
 } // namespace imageproc
 
 #endif
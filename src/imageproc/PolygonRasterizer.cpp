@@ -28,8 +28,10 @@
 #include <QImage>
 #include <QtGlobal>
 #include <vector>
+#include <memory>
 #include <iterator>
 #include <algorithm>
+#include <limits>
 #include <stdexcept>
 #include <math.h>
 #include <string.h>
@@ -159,6 +161,9 @@ public:
 
     void fillBinary(BinaryImage& image, BWColor color) const;
 
+    void fillBinaryRows(
+        uint32_t* data, int wpl, uint32_t pattern, int top, int bottom) const;
+
     void fillGrayscale(QImage& image, uint8_t color) const;
 
     void fillGrayImage(GrayImage& image, uint8_t color) const;
@@ -184,6 +189,8 @@ private:
     static void fillBinarySegment(
         int x_from, int x_to, uint32_t* line, uint32_t pattern);
 
+    static void sortByX(std::vector<EdgeComponent>& edges);
+
     std::vector<Edge> m_edges; // m_edgeComponents references m_edges.
     std::vector<EdgeComponent> m_edgeComponents;
     QRect m_imageRect;
@@ -208,6 +215,46 @@ PolygonRasterizer::fill(
     rasterizer.fillBinary(image, color);
 }
 
+void
+PolygonRasterizer::fill(
+    BinaryImage& image, std::vector<ColoredPolygon> const& polys,
+    Qt::FillRule const fill_rule)
+{
+    if (image.isNull()) {
+        throw std::invalid_argument("PolygonRasterizer: target image is null");
+    }
+
+    QRect const image_rect(image.rect());
+    int const num_polys = polys.size();
+    std::vector<std::unique_ptr<Rasterizer> > rasterizers(num_polys);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < num_polys; ++i) {
+        rasterizers[i].reset(
+            new Rasterizer(image_rect, polys[i].poly, fill_rule, false)
+        );
+    }
+
+    uint32_t* const data = image.data(); // never call image.data() inside omp
+    int const wpl = image.wordsPerLine();
+    int const height = image.height();
+
+    // A band is a range of rows all the polygons are drawn into, in order.
+    // That keeps the order of painting for every pixel.
+    int const band_height = 64;
+    int const num_bands = (height + band_height - 1) / band_height;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int band = 0; band < num_bands; ++band) {
+        int const top = band * band_height;
+        int const bottom = std::min(top + band_height, height);
+        for (int i = 0; i < num_polys; ++i) {
+            uint32_t const pattern = (polys[i].color == WHITE) ? 0 : ~uint32_t(0);
+            rasterizers[i]->fillBinaryRows(data, wpl, pattern, top, bottom);
+        }
+    }
+}
+
 void
 PolygonRasterizer::fillExcept(
     BinaryImage& image, BWColor const color,
@@ -415,36 +462,60 @@ void
 PolygonRasterizer::Rasterizer::fillBinary(
     BinaryImage& image, BWColor const color) const
 {
-    std::vector<EdgeComponent> edges_for_line;
+    uint32_t const pattern = (color == WHITE) ? 0 : ~uint32_t(0);
+    fillBinaryRows(image.data(), image.wordsPerLine(), pattern, 0, image.height());
+}
+
+/**
+ * Fills rows [top, bottom) of the image, walking the edge components
+ * from top to bottom.  Components sharing the top also share the bottom,
+ * so the ones intersecting a horizontal line form a contiguous group,
+ * which stays the same until the line reaches their bottom.
+ */
+void
+PolygonRasterizer::Rasterizer::fillBinaryRows(
+    uint32_t* const data, int const wpl, uint32_t const pattern,
+    int const top, int const bottom) const
+{
     typedef std::vector<EdgeComponent>::const_iterator EdgeIter;
 
-    uint32_t* line = image.data();
-    int const wpl = image.wordsPerLine();
-    uint32_t const pattern = (color == WHITE) ? 0 : ~uint32_t(0);
+    int i = std::max(qRound(m_boundingBox.top()), top);
+    int const limit = std::min(qRound(m_boundingBox.bottom()), bottom);
+    if (i >= limit) {
+        return;
+    }
 
-    int i = qRound(m_boundingBox.top());
-    line += i * wpl;
-    int const limit = qRound(m_boundingBox.bottom());
-    for (; i < limit; ++i, line += wpl, edges_for_line.clear()) {
+    std::vector<EdgeComponent> edges_for_line;
+    EdgeIter group_begin(m_edgeComponents.begin());
+    double group_valid_until = -std::numeric_limits<double>::max();
+
+    uint32_t* line = data + i * wpl;
+    for (; i < limit; ++i, line += wpl) {
         double const y = i + 0.5;
 
-        // Get edges intersecting this horizontal line.
-        std::pair<EdgeIter, EdgeIter> const range(
-            std::equal_range(
-                m_edgeComponents.begin(), m_edgeComponents.end(),
-                y, EdgeOrderY()
-            )
-        );
+        bool const new_group = y >= group_valid_until;
+        if (new_group) {
+            // Get edges intersecting this horizontal line.
+            std::pair<EdgeIter, EdgeIter> const range(
+                std::equal_range(
+                    group_begin, m_edgeComponents.end(), y, EdgeOrderY()
+                )
+            );
+            group_begin = range.first;
+            if (range.first != range.second) {
+                group_valid_until = range.first->bottom();
+            } else if (range.second != m_edgeComponents.end()) {
+                group_valid_until = range.second->top();
+            } else {
+                group_valid_until = std::numeric_limits<double>::max();
+            }
+            edges_for_line.assign(range.first, range.second);
+        }
 
-        if (range.first == range.second) {
+        if (edges_for_line.empty()) {
             continue;
         }
 
-        std::copy(
-            range.first, range.second,
-            std::back_inserter(edges_for_line)
-        );
-
         // Calculate the intersection point of each edge with
         // the current horizontal line.
         for (EdgeComponent& ecomp : edges_for_line) {
@@ -452,10 +523,15 @@ PolygonRasterizer::Rasterizer::fillBinary(
         }
 
         // Sort edge components by the x value of the intersection point.
-        std::sort(
-            edges_for_line.begin(), edges_for_line.end(),
-            EdgeOrderX()
-        );
+        // Within a group, they are mostly sorted already from the previous line.
+        if (new_group) {
+            std::sort(
+                edges_for_line.begin(), edges_for_line.end(),
+                EdgeOrderX()
+            );
+        } else {
+            sortByX(edges_for_line);
+        }
 
         if (m_fillRule == Qt::OddEvenFill) {
             oddEvenLineBinary(
@@ -650,6 +726,31 @@ PolygonRasterizer::Rasterizer::windingLineGrayscale(
     }
 }
 
+/**
+ * An insertion sort, which is linear for nearly sorted input.
+ * Edges with the same x may end up in a different order than with
+ * std::sort(), which doesn't affect the result, as the segment between
+ * them is empty.
+ */
+void
+PolygonRasterizer::Rasterizer::sortByX(std::vector<EdgeComponent>& edges)
+{
+    size_t const num_edges = edges.size();
+    for (size_t i = 1; i < num_edges; ++i) {
+        if (!(edges[i].x() < edges[i - 1].x())) {
+            continue;
+        }
+
+        EdgeComponent const ecomp(edges[i]);
+        size_t j = i;
+        do {
+            edges[j] = edges[j - 1];
+            --j;
+        } while (j > 0 && ecomp.x() < edges[j - 1].x());
+        edges[j] = ecomp;
+    }
+}
+
 void
 PolygonRasterizer::Rasterizer::fillBinarySegment(
     int const x_from, int const x_to,
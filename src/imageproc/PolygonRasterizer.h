@@ -20,9 +20,10 @@
 #define IMAGEPROC_POLYGONRASTERIZER_H_
 
 #include "BWColor.h"
+#include <QPolygonF>
 #include <Qt>
+#include <vector>
 
-class QPolygonF;
 class QRectF;
 class QImage;
 
@@ -35,10 +36,33 @@ class GrayImage;
 class PolygonRasterizer
 {
 public:
+    /**
+     * \brief A polygon and the color to fill it with.
+     */
+    struct ColoredPolygon
+    {
+        QPolygonF poly;
+        BWColor color;
+
+        ColoredPolygon(QPolygonF const& poly, BWColor color)
+            : poly(poly), color(color) {}
+    };
+
     static void fill(
         BinaryImage& image, BWColor color,
         QPolygonF const& poly, Qt::FillRule fill_rule);
 
+    /**
+     * \brief Fills a number of polygons in a single pass over the image.
+     *
+     * The result is the same as filling the polygons one by one in the
+     * order given, so later polygons are painted over earlier ones.
+     * Horizontal bands of the image are processed in parallel.
+     */
+    static void fill(
+        BinaryImage& image, std::vector<ColoredPolygon> const& polys,
+        Qt::FillRule fill_rule);
+
     static void fillExcept(
         BinaryImage& image, BWColor color,
         QPolygonF const& poly, Qt::FillRule fill_rule);
@@ -28,15 +28,212 @@
 #include "MatrixCalc.h"
 #include <stdexcept>
 #include <algorithm>
+#include <vector>
+#include <memory>
 #include <math.h>
 #include <stdint.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace imageproc
 {
 
+namespace
+{
+
+/**
+ * The upper limit on the number of chunks prepareDataForLeastSquares()
+ * splits rows of strata into.
+ */
+int const MAX_CHUNKS = 64;
+
+/**
+ * \brief Accumulates A^T*A and A^T*b of the least squares problem.
+ *
+ * Samples are collected into batches, then the monomials are evaluated
+ * and their products summed a whole batch at a time.  Only the upper
+ * triangle of A^T*A is accumulated, as it's symmetric.
+ */
+class NormalEquations
+{
+public:
+    enum { BATCH_SIZE = 64 };
+
+    NormalEquations(int h_degree, int v_degree, bool weighted);
+
+    void add(double x, double y, double value, double weight = 1.0)
+    {
+        m_xs[m_count] = x;
+        m_ys[m_count] = y;
+        m_values[m_count] = value;
+        m_weights[m_count] = weight;
+        if (++m_count == BATCH_SIZE) {
+            flush();
+        }
+    }
+
+    void flush();
+
+    /**
+     * Adds the accumulated sums to \p AtA and \p Atb.
+     * Must be called after flush().
+     */
+    void addTo(MatT<double>& AtA, VecT<double>& Atb) const;
+private:
+    static double dot(double const* a, double const* b, int count);
+
+    int m_hDegree;
+    int m_vDegree;
+    int m_numTerms;
+    bool m_weighted;
+    int m_count;
+    AlignedArray<double, 2> m_xs;
+    AlignedArray<double, 2> m_ys;
+    AlignedArray<double, 2> m_values;
+    AlignedArray<double, 2> m_weights;
+    AlignedArray<double, 2> m_xPowers; // (h_degree + 1) rows of BATCH_SIZE.
+    AlignedArray<double, 2> m_yPowers; // (v_degree + 1) rows of BATCH_SIZE.
+    AlignedArray<double, 2> m_terms; // num_terms rows of BATCH_SIZE.
+    AlignedArray<double, 2> m_weightedTerms; // Same, multiplied by weights.
+    std::vector<double> m_AtA; // Upper triangle only.
+    std::vector<double> m_Atb;
+};
+
+NormalEquations::NormalEquations(int const h_degree, int const v_degree, bool const weighted)
+    :   m_hDegree(h_degree),
+        m_vDegree(v_degree),
+        m_numTerms((h_degree + 1) * (v_degree + 1)),
+        m_weighted(weighted),
+        m_count(0),
+        m_xs(BATCH_SIZE),
+        m_ys(BATCH_SIZE),
+        m_values(BATCH_SIZE),
+        m_weights(BATCH_SIZE),
+        m_xPowers((h_degree + 1) * BATCH_SIZE),
+        m_yPowers((v_degree + 1) * BATCH_SIZE),
+        m_terms(m_numTerms * BATCH_SIZE),
+        m_weightedTerms(weighted ? m_numTerms * BATCH_SIZE : 0),
+        m_AtA(m_numTerms * m_numTerms, 0.0),
+        m_Atb(m_numTerms, 0.0)
+{
+}
+
+void
+NormalEquations::flush()
+{
+    int const count = m_count;
+    if (count == 0) {
+        return;
+    }
+    m_count = 0;
+
+    // 1, x, x^2, x^3, ... laid out so that every power is contiguous
+    // across the batch.  Same for y.
+    double* const x_powers = m_xPowers.data();
+    double* const y_powers = m_yPowers.data();
+    for (int k = 0; k < count; ++k) {
+        x_powers[k] = 1.0;
+        y_powers[k] = 1.0;
+    }
+    for (int i = 1; i <= m_hDegree; ++i) {
+        double const* prev = x_powers + (i - 1) * BATCH_SIZE;
+        double* cur = x_powers + i * BATCH_SIZE;
+        for (int k = 0; k < count; ++k) {
+            cur[k] = prev[k] * m_xs[k];
+        }
+    }
+    for (int i = 1; i <= m_vDegree; ++i) {
+        double const* prev = y_powers + (i - 1) * BATCH_SIZE;
+        double* cur = y_powers + i * BATCH_SIZE;
+        for (int k = 0; k < count; ++k) {
+            cur[k] = prev[k] * m_ys[k];
+        }
+    }
+
+    double* const terms = m_terms.data();
+    double* term = terms;
+    for (int i = 0; i <= m_vDegree; ++i) {
+        double const* yp = y_powers + i * BATCH_SIZE;
+        for (int j = 0; j <= m_hDegree; ++j, term += BATCH_SIZE) {
+            double const* xp = x_powers + j * BATCH_SIZE;
+            for (int k = 0; k < count; ++k) {
+                term[k] = yp[k] * xp[k];
+            }
+        }
+    }
+
+    double const* right_terms = terms;
+    if (m_weighted) {
+        double* wterm = m_weightedTerms.data();
+        term = terms;
+        for (int i = 0; i < m_numTerms; ++i, term += BATCH_SIZE, wterm += BATCH_SIZE) {
+            for (int k = 0; k < count; ++k) {
+                wterm[k] = term[k] * m_weights[k];
+            }
+        }
+        right_terms = m_weightedTerms.data();
+    }
+
+    int const num_terms = m_numTerms;
+    double const* values = m_values.data();
+    for (int i = 0; i < num_terms; ++i) {
+        double const* i_terms = terms + i * BATCH_SIZE;
+        m_Atb[i] += dot(i_terms, values, count);
+
+        double* p_AtA = &m_AtA[i * num_terms];
+        for (int j = i; j < num_terms; ++j) {
+            p_AtA[j] += dot(i_terms, right_terms + j * BATCH_SIZE, count);
+        }
+    }
+}
+
+void
+NormalEquations::addTo(MatT<double>& AtA, VecT<double>& Atb) const
+{
+    assert(m_count == 0);
+
+    int const num_terms = m_numTerms;
+    for (int i = 0; i < num_terms; ++i) {
+        Atb[i] += m_Atb[i];
+        AtA(i, i) += m_AtA[i * num_terms + i];
+        for (int j = i + 1; j < num_terms; ++j) {
+            double const val = m_AtA[i * num_terms + j];
+            AtA(i, j) += val;
+            AtA(j, i) += val;
+        }
+    }
+}
+
+double
+NormalEquations::dot(double const* a, double const* b, int const count)
+{
+    int k = 0;
+    double sum = 0.0;
+#ifdef __SSE2__
+    // Both arrays are 16-byte aligned, as they start at a multiple
+    // of BATCH_SIZE within an AlignedArray<double, 2>.
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    for (; k + 4 <= count; k += 4) {
+        sum0 = _mm_add_pd(sum0, _mm_mul_pd(_mm_load_pd(a + k), _mm_load_pd(b + k)));
+        sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_load_pd(a + k + 2), _mm_load_pd(b + k + 2)));
+    }
+    sum0 = _mm_add_pd(sum0, sum1);
+    sum = _mm_cvtsd_f64(_mm_add_sd(sum0, _mm_unpackhi_pd(sum0, sum0)));
+#endif
+    for (; k < count; ++k) {
+        sum += a[k] * b[k];
+    }
+    return sum;
+}
+
+} // anonymous namespace
+
 PolynomialSurface::PolynomialSurface(
-    int const hor_degree, int const vert_degree, GrayImage const& src)
+    int const hor_degree, int const vert_degree,
+    GrayImage const& src, double const max_term_error)
     :   m_horDegree(hor_degree),
         m_vertDegree(vert_degree)
 {
@@ -58,28 +255,13 @@ PolynomialSurface::PolynomialSurface(
     }
 
     maybeReduceDegrees(num_data_points);
-
-    int const num_terms = calcNumTerms();
-    VecT<double>(num_terms, 0.0).swap(m_coeffs);
-
-    // The least squares equation is A^T*A*x = A^T*b
-    // We will be building A^T*A and A^T*b incrementally.
-    // This allows us not to build matrix A at all.
-    MatT<double> AtA(num_terms, num_terms);
-    VecT<double> Atb(num_terms);
-    prepareDataForLeastSquares(src, AtA, Atb, m_horDegree, m_vertDegree);
-
-    fixSquareMatrixRankDeficiency(AtA);
-
-    try {
-        DynamicMatrixCalc<double> mc;
-        mc(AtA).solve(mc(Atb)).write(m_coeffs.data());
-    } catch (std::runtime_error const&) {}
+    fit(src, 0, max_term_error);
 }
 
 PolynomialSurface::PolynomialSurface(
     int const hor_degree, int const vert_degree,
-    GrayImage const& src, BinaryImage const& mask)
+    GrayImage const& src, BinaryImage const& mask,
+    double const max_term_error)
     :   m_horDegree(hor_degree),
         m_vertDegree(vert_degree)
 {
@@ -104,23 +286,7 @@ PolynomialSurface::PolynomialSurface(
     }
 
     maybeReduceDegrees(num_data_points);
-
-    int const num_terms = calcNumTerms();
-    VecT<double>(num_terms, 0.0).swap(m_coeffs);
-
-    // The least squares equation is A^T*A*x = A^T*b
-    // We will be building A^T*A and A^T*b incrementally.
-    // This allows us not to build matrix A at all.
-    MatT<double> AtA(num_terms, num_terms);
-    VecT<double> Atb(num_terms);
-    prepareDataForLeastSquares(src, mask, AtA, Atb, m_horDegree, m_vertDegree);
-
-    fixSquareMatrixRankDeficiency(AtA);
-
-    try {
-        DynamicMatrixCalc<double> mc;
-        mc(AtA).solve(mc(Atb)).write(m_coeffs.data());
-    } catch (std::runtime_error const&) {}
+    fit(src, &mask, max_term_error);
 }
 
 GrayImage
@@ -218,96 +384,84 @@ PolynomialSurface::calcScale(int const dimension)
     }
 }
 
-void PolynomialSurface::prepareDataForLeastSquares(
-    GrayImage const& image, MatT<double>& AtA, VecT<double>& Atb,
-    int const h_degree, int const v_degree)
+QSize
+PolynomialSurface::calcStratumSize(
+    QSize const& image_size, double const max_term_error) const
 {
-    double* const AtA_data = AtA.data();
-    double* const Atb_data = Atb.data();
-
-    int const width = image.width();
-    int const height = image.height();
-    int const num_terms = Atb.size();
-
-    uint8_t const* line = image.data();
-    int const stride = image.stride();
-
-    // Pretend that both x and y positions of pixels
-    // lie in range of [0, 1].
-    double const xscale = calcScale(width);
-    double const yscale = calcScale(height);
-
-    // To force data samples into [0, 1] range.
-    double const data_scale = 1.0 / 255.0;
-
-    // 1, y, y^2, y^3, ...
-    VecT<double> y_powers(v_degree + 1); // Initialized to 0.
+    if (max_term_error <= 0.0) {
+        return QSize(1, 1);
+    }
 
-    // Same as y_powers, except y_powers correspond to a given y,
-    // while x_powers are computed for all possible x values.
-    MatT<double> x_powers(h_degree + 1, width); // Initialized to 0.
-    for (int x = 0; x < width; ++x) {
-        double const x_adjusted = xscale * x;
-        double x_power = 1.0;
-        for (int i = 0; i <= h_degree; ++i) {
-            x_powers(i, x) = x_power;
-            x_power *= x_adjusted;
+    // The derivative of x^j * y^i with respect to x doesn't exceed j
+    // while x and y stay within [0, 1].  Therefore, if neither of the
+    // normalized coordinates of a stratum centroid is further than
+    // max_term_error / (2 * degree) from the corresponding coordinate
+    // of any pixel in that stratum, no term is off by more than
+    // max_term_error.  A centroid can't leave its stratum, so the
+    // distance in question is bounded by the stratum size minus one.
+    int sizes[2];
+    int const dimensions[2] = { image_size.width(), image_size.height() };
+    int const degrees[2] = { m_horDegree, m_vertDegree };
+    for (int d = 0; d < 2; ++d) {
+        int const dim = dimensions[d];
+        int const degree = degrees[d];
+
+        // Keep at least two strata per degree of freedom in each direction,
+        // so that sparse sampling doesn't make the system rank deficient.
+        int size = std::max(1, dim / (2 * (degree + 1)));
+
+        double const scale = calcScale(dim);
+        if (degree > 0 && scale > 0.0) {
+            double const max_offset = max_term_error / (2.0 * degree * scale);
+            if (max_offset < size - 1) {
+                size = 1 + (int)max_offset;
+            }
         }
+        sizes[d] = size;
     }
 
-    VecT<double> full_powers(num_terms);
-
-    for (int y = 0; y < height; ++y, line += stride) {
-        double const y_adjusted = yscale * y;
-
-        double y_power = 1.0;
-        for (int i = 0; i <= v_degree; ++i) {
-            y_powers[i] = y_power;
-            y_power *= y_adjusted;
-        }
+    return QSize(sizes[0], sizes[1]);
+}
 
-        for (int x = 0; x < width; ++x) {
-            double const data_point = data_scale * line[x];
+void
+PolynomialSurface::fit(
+    GrayImage const& image, BinaryImage const* mask, double const max_term_error)
+{
+    int const num_terms = calcNumTerms();
+    VecT<double>(num_terms, 0.0).swap(m_coeffs);
 
-            int pos = 0;
-            for (int i = 0; i <= v_degree; ++i) {
-                for (int j = 0; j <= h_degree; ++j, ++pos) {
-                    full_powers[pos] = y_powers[i] * x_powers(j, x);
-                }
-            }
+    // The least squares equation is A^T*A*x = A^T*b
+    // We will be building A^T*A and A^T*b incrementally.
+    // This allows us not to build matrix A at all.
+    MatT<double> AtA(num_terms, num_terms);
+    VecT<double> Atb(num_terms);
+    prepareDataForLeastSquares(
+        image, mask, AtA, Atb, m_horDegree, m_vertDegree,
+        calcStratumSize(image.size(), max_term_error)
+    );
 
-            double* p_AtA = AtA_data;
-            for (int i = 0; i < num_terms; ++i) {
-                double const i_val = full_powers[i];
-                Atb_data[i] += i_val * data_point;
+    fixSquareMatrixRankDeficiency(AtA);
 
-                for (int j = 0; j < num_terms; ++j) {
-                    double const j_val = full_powers[j];
-                    *p_AtA += i_val * j_val;
-                    ++p_AtA;
-                }
-            }
-        }
-    }
+    try {
+        DynamicMatrixCalc<double> mc;
+        mc(AtA).solve(mc(Atb)).write(m_coeffs.data());
+    } catch (std::runtime_error const&) {}
 }
 
-void PolynomialSurface::prepareDataForLeastSquares(
-    GrayImage const& image, BinaryImage const& mask,
+void
+PolynomialSurface::prepareDataForLeastSquares(
+    GrayImage const& image, BinaryImage const* mask,
     MatT<double>& AtA, VecT<double>& Atb,
-    int const h_degree, int const v_degree)
+    int const h_degree, int const v_degree, QSize const& stratum_size)
 {
-    double* const AtA_data = AtA.data();
-    double* const Atb_data = Atb.data();
-
     int const width = image.width();
     int const height = image.height();
-    int const num_terms = Atb.size();
 
-    uint8_t const* image_line = image.data();
+    uint8_t const* const image_data = image.data();
     int const image_stride = image.stride();
 
-    uint32_t const* mask_line = mask.data();
-    int const mask_stride = mask.wordsPerLine();
+    uint32_t const* const mask_data = mask ? mask->data() : 0;
+    int const mask_stride = mask ? mask->wordsPerLine() : 0;
 
     // Pretend that both x and y positions of pixels
     // lie in range of [0, 1].
@@ -317,62 +471,76 @@ void PolynomialSurface::prepareDataForLeastSquares(
     // To force data samples into [0, 1] range.
     double const data_scale = 1.0 / 255.0;
 
-    // 1, y, y^2, y^3, ...
-    VecT<double> y_powers(v_degree + 1); // Initialized to 0.
-
-    // Same as y_powers, except y_powers correspond to a given y,
-    // while x_powers are computed for all possible x values.
-    MatT<double> x_powers(h_degree + 1, width); // Initialized to 0.
-    for (int x = 0; x < width; ++x) {
-        double const x_adjusted = xscale * x;
-        double x_power = 1.0;
-        for (int i = 0; i <= h_degree; ++i) {
-            x_powers(i, x) = x_power;
-            x_power *= x_adjusted;
-        }
-    }
-
-    VecT<double> full_powers(num_terms);
+    int const stratum_width = stratum_size.width();
+    int const stratum_height = stratum_size.height();
+    int const strata_cols = (width + stratum_width - 1) / stratum_width;
+    int const strata_rows = (height + stratum_height - 1) / stratum_height;
+    bool const weighted = stratum_width * stratum_height > 1;
 
     uint32_t const msb = uint32_t(1) << 31;
-    for (int y = 0; y < height; ++y) {
-        double const y_adjusted = yscale * y;
-
-        double y_power = 1.0;
-        for (int i = 0; i <= v_degree; ++i) {
-            y_powers[i] = y_power;
-            y_power *= y_adjusted;
-        }
-
-        for (int x = 0; x < width; ++x) {
-            if (!(mask_line[x >> 5] & (msb >> (x & 31)))) {
-                continue;
-            }
-
-            double const data_point = data_scale * image_line[x];
 
-            int pos = 0;
-            for (int i = 0; i <= v_degree; ++i) {
-                for (int j = 0; j <= h_degree; ++j, ++pos) {
-                    full_powers[pos] = y_powers[i] * x_powers(j, x);
+    // Rows of strata are split into chunks that only depend on the image
+    // size.  Every chunk gets its own sums, which are added up in chunk
+    // order, so the result doesn't depend on the number of threads.
+    int const rows_per_chunk = std::max(1, (strata_rows + MAX_CHUNKS - 1) / MAX_CHUNKS);
+    int const num_chunks = (strata_rows + rows_per_chunk - 1) / rows_per_chunk;
+    std::vector<std::unique_ptr<NormalEquations> > chunk_equations(num_chunks);
+
+    #pragma omp parallel
+    {
+        // Pixel count, sum of x, sum of y and sum of values for every
+        // stratum in a row of strata.
+        std::vector<double> sums(strata_cols * 4);
+
+        #pragma omp for schedule(dynamic)
+        for (int chunk = 0; chunk < num_chunks; ++chunk) {
+            NormalEquations* const equations = new NormalEquations(h_degree, v_degree, weighted);
+            chunk_equations[chunk].reset(equations);
+
+            int const sr_end = std::min(strata_rows, (chunk + 1) * rows_per_chunk);
+            for (int sr = chunk * rows_per_chunk; sr < sr_end; ++sr) {
+                std::fill(sums.begin(), sums.end(), 0.0);
+
+                int const y0 = sr * stratum_height;
+                int const y1 = std::min(y0 + stratum_height, height);
+                for (int y = y0; y < y1; ++y) {
+                    uint8_t const* image_line = image_data + y * image_stride;
+                    uint32_t const* mask_line = mask_data + y * mask_stride;
+                    double* sum = &sums[0];
+                    for (int x0 = 0; x0 < width; x0 += stratum_width, sum += 4) {
+                        int const x1 = std::min(x0 + stratum_width, width);
+                        for (int x = x0; x < x1; ++x) {
+                            if (mask_data && !(mask_line[x >> 5] & (msb >> (x & 31)))) {
+                                continue;
+                            }
+                            sum[0] += 1.0;
+                            sum[1] += x;
+                            sum[2] += y;
+                            sum[3] += image_line[x];
+                        }
+                    }
                 }
-            }
-
-            double* p_AtA = AtA_data;
-            for (int i = 0; i < num_terms; ++i) {
-                double const i_val = full_powers[i];
-                Atb_data[i] += i_val * data_point;
 
-                for (int j = 0; j < num_terms; ++j) {
-                    double const j_val = full_powers[j];
-                    *p_AtA += i_val * j_val;
-                    ++p_AtA;
+                double const* sum = &sums[0];
+                for (int sc = 0; sc < strata_cols; ++sc, sum += 4) {
+                    double const count = sum[0];
+                    if (count == 0.0) {
+                        continue;
+                    }
+                    double const r_count = 1.0 / count;
+                    equations->add(
+                        xscale * (sum[1] * r_count), yscale * (sum[2] * r_count),
+                        data_scale * sum[3], count
+                    );
                 }
             }
+
+            equations->flush();
         }
+    }
 
-        image_line += image_stride;
-        mask_line += mask_stride;
+    for (int chunk = 0; chunk < num_chunks; ++chunk) {
+        chunk_equations[chunk]->addTo(AtA, Atb);
     }
 }
 
@@ -47,6 +47,14 @@ public:
      *        Must not be negative.  A value of 3 or 4 should be enough
      *        to approximate page background.
      * \param src The image to approximate.  Must be grayscale and not null.
+     * \param max_term_error If positive, enables stratified subsampling.
+     *        The image is split into rectangular strata, each of which
+     *        contributes a single sample located at its centroid and
+     *        weighted by its pixel count.  The strata are sized so that
+     *        no polynomial term evaluated at a stratum centroid differs
+     *        by more than \p max_term_error from its value at any pixel
+     *        within that stratum, coordinates being normalized to [0, 1].
+     *        Zero (the default) means every pixel is a sample on its own.
      *
      * \note Building a polynomial surface for full size 300 DPI scans
      *       takes forever, so pass a downscaled version here. 300x300
@@ -54,7 +62,8 @@ public:
      *       may then be rendered in the original size, if necessary.
      */
     PolynomialSurface(
-        int hor_degree, int vert_degree, GrayImage const& src);
+        int hor_degree, int vert_degree,
+        GrayImage const& src, double max_term_error = 0.0);
 
     /**
      * \brief Calculate a polynomial that approximates portions of the given image.
@@ -69,6 +78,9 @@ public:
      * \param mask Specifies which areas of \p src to consider.
      *        A pixel in \p src is considered if the corresponding pixel
      *        in \p mask is black.
+     * \param max_term_error Enables stratified subsampling, see the
+     *        other constructor.  Only the masked pixels of a stratum
+     *        contribute to its centroid and weight.
      *
      * \note Building a polynomial surface for full size 300 DPI scans
      *       takes forever, so pass a downscaled version here. 300x300
@@ -77,7 +89,8 @@ public:
      */
     PolynomialSurface(
         int hor_degree, int vert_degree,
-        GrayImage const& src, BinaryImage const& mask);
+        GrayImage const& src, BinaryImage const& mask,
+        double max_term_error = 0.0);
 
     /**
      * \brief Visualizes the polynomial surface as a grayscale image.
@@ -85,6 +98,16 @@ public:
      * The surface will be stretched / shrunk to fit the new size.
      */
     GrayImage render(QSize const& size) const;
+
+    /**
+     * \brief The coefficients of x^j * y^i terms, with j changing faster.
+     *
+     * The degrees may be lower than requested, if there was not enough data.
+     */
+    VecT<double> const& coefficients() const
+    {
+        return m_coeffs;
+    }
 private:
     void maybeReduceDegrees(int num_data_points);
 
@@ -92,12 +115,14 @@ private:
 
     static double calcScale(int dimension);
 
-    static void prepareDataForLeastSquares(
-        GrayImage const& image, MatT<double>& AtA, VecT<double>& Atb, int h_degree, int v_degree);
+    QSize calcStratumSize(QSize const& image_size, double max_term_error) const;
+
+    void fit(GrayImage const& image, BinaryImage const* mask, double max_term_error);
 
     static void prepareDataForLeastSquares(
-        GrayImage const& image, BinaryImage const& mask,
-        MatT<double>& AtA, VecT<double>& Atb, int h_degree, int v_degree);
+        GrayImage const& image, BinaryImage const* mask,
+        MatT<double>& AtA, VecT<double>& Atb,
+        int h_degree, int v_degree, QSize const& stratum_size);
 
     static void fixSquareMatrixRankDeficiency(MatT<double>& mat);
 
@@ -20,6 +20,7 @@
 #define IMAGEPROC_RASTEROP_H_
 
 #include "BinaryImage.h"
+#include "CpuFeatures.h"
 #include <QPoint>
 #include <QRect>
 #include <QSize>
@@ -218,6 +219,81 @@ public:
 namespace detail
 {
 
+typedef void (*RopLineFunc)(
+    uint32_t const* src_span, uint32_t* dst_span, int words, int src_word1_shift);
+
+/*
+ * Transforms whole dst words, taking src words either as they are,
+ * if src_word1_shift is 0, or assembling each of them from two adjacent
+ * ones with a funnel shift.  Rop::transform() is a pure function, so
+ * the words may be processed in SIMD fashion, as long as src and dst
+ * don't overlap.  The same loops are also instantiated for wider
+ * instruction sets, to be picked at runtime.  With AVX2, that's 256 bits
+ * a step.
+ */
+
+template<typename Rop>
+IMAGEPROC_FORCE_INLINE
+void transformWordsImpl(
+    uint32_t const* src_span, uint32_t* dst_span, int const words, int const src_word1_shift)
+{
+    if (src_word1_shift == 0) {
+        #pragma omp simd
+        for (int i = 0; i < words; ++i) {
+            dst_span[i] = Rop::transform(src_span[i], dst_span[i]);
+        }
+    } else {
+        int const src_word2_shift = 32 - src_word1_shift;
+        #pragma omp simd
+        for (int i = 0; i < words; ++i) {
+            uint32_t const src_word = (src_span[i] << src_word1_shift)
+                                      | (src_span[i + 1] >> src_word2_shift);
+            dst_span[i] = Rop::transform(src_word, dst_span[i]);
+        }
+    }
+}
+
+template<typename Rop>
+void transformWords(
+    uint32_t const* src_span, uint32_t* dst_span, int const words, int const src_word1_shift)
+{
+    transformWordsImpl<Rop>(src_span, dst_span, words, src_word1_shift);
+}
+
+#if defined(IMAGEPROC_TARGET_DISPATCH)
+template<typename Rop>
+IMAGEPROC_TARGET_SSE42
+void transformWordsSse42(
+    uint32_t const* src_span, uint32_t* dst_span, int const words, int const src_word1_shift)
+{
+    transformWordsImpl<Rop>(src_span, dst_span, words, src_word1_shift);
+}
+
+template<typename Rop>
+IMAGEPROC_TARGET_AVX2
+void transformWordsAvx2(
+    uint32_t const* src_span, uint32_t* dst_span, int const words, int const src_word1_shift)
+{
+    transformWordsImpl<Rop>(src_span, dst_span, words, src_word1_shift);
+}
+#endif
+
+template<typename Rop>
+RopLineFunc selectTransformWords()
+{
+#if defined(IMAGEPROC_TARGET_DISPATCH)
+    switch (CpuFeatures::level()) {
+        case CpuFeatures::AVX2:
+            return &transformWordsAvx2<Rop>;
+        case CpuFeatures::SSE42:
+            return &transformWordsSse42<Rop>;
+        case CpuFeatures::BASELINE:
+            break;
+    }
+#endif
+    return &transformWords<Rop>;
+}
+
 template<typename Rop>
 void rasterOpInDirection(
     BinaryImage& dst, QRect const& dr,
@@ -292,8 +368,28 @@ void rasterOpInDirection(
                 uint32_t const new_dst_word = Rop::transform(src_word, dst_word);
                 dst_span[0] = (dst_word & ~mask) | (new_dst_word & mask);
             }
+        } else if (canBeParalleled) {
+            // Different images can't overlap, so the inner words
+            // of a line may go through the SIMD loop.
+            assert(dx == 1);
+            RopLineFunc const transform_words = selectTransformWords<Rop>();
+
+            #pragma omp parallel for
+            for (int i = 0; i < dr.height(); i++) {
+                uint32_t* dst_span_loc = dst_span + i * dst_span_delta;
+                uint32_t const* src_span_loc = src_span + i * src_span_delta;
+
+                uint32_t dst_word = dst_span_loc[0];
+                uint32_t new_dst_word = Rop::transform(src_span_loc[0], dst_word);
+                dst_span_loc[0] = (dst_word & ~first_dst_mask) | (new_dst_word & first_dst_mask);
+
+                transform_words(src_span_loc + 1, dst_span_loc + 1, last_dst_word - 1, 0);
+
+                dst_word = dst_span_loc[last_dst_word];
+                new_dst_word = Rop::transform(src_span_loc[last_dst_word], dst_word);
+                dst_span_loc[last_dst_word] = (dst_word & ~last_dst_mask) | (new_dst_word & last_dst_mask);
+            }
         } else {
-            #pragma omp parallel for if( canBeParalleled )
             for (int i = 0; i < dr.height(); i++) {
                 uint32_t* dst_span_loc = dst_span + i * dst_span_delta;
                 uint32_t const* src_span_loc = src_span + i * src_span_delta;
@@ -349,7 +445,44 @@ void rasterOpInDirection(
         uint32_t const can_last_word1 = (~uint32_t(0) << src_word1_shift) & last_dst_mask;
         uint32_t const can_last_word2 = (~uint32_t(0) >> src_word2_shift) & last_dst_mask;
 
-        #pragma omp parallel for if( canBeParalleled )
+        if (canBeParalleled) {
+            assert(dx == 1);
+            RopLineFunc const transform_words = selectTransformWords<Rop>();
+
+            #pragma omp parallel for
+            for (int i = 0; i < dr.height(); i++) {
+                uint32_t* dst_span_loc = dst_span + i * dst_span_delta;
+                uint32_t const* src_span_loc = src_span + i * src_span_delta;
+
+                // Handle the first (possibly incomplete) dst word in the line.
+                uint32_t src_word = 0;
+                if (can_first_word1) {
+                    src_word |= src_span_loc[0] << src_word1_shift;
+                }
+                if (can_first_word2) {
+                    src_word |= src_span_loc[1] >> src_word2_shift;
+                }
+                uint32_t dst_word = dst_span_loc[0];
+                uint32_t new_dst_word = Rop::transform(src_word, dst_word);
+                dst_span_loc[0] = (dst_word & ~first_dst_mask) | (new_dst_word & first_dst_mask);
+
+                transform_words(src_span_loc + 1, dst_span_loc + 1, last_dst_word - 1, src_word1_shift);
+
+                // Handle the last (possibly incomplete) dst word in the line.
+                src_word = 0;
+                if (can_last_word1) {
+                    src_word |= src_span_loc[last_dst_word] << src_word1_shift;
+                }
+                if (can_last_word2) {
+                    src_word |= src_span_loc[last_dst_word + 1] >> src_word2_shift;
+                }
+                dst_word = dst_span_loc[last_dst_word];
+                new_dst_word = Rop::transform(src_word, dst_word);
+                dst_span_loc[last_dst_word] = (dst_word & ~last_dst_mask) | (new_dst_word & last_dst_mask);
+            }
+            return;
+        }
+
         for (int i = 0; i < dr.height(); i++) {
             uint32_t* dst_span_loc = dst_span + i * dst_span_delta;
             uint32_t const* src_span_loc = src_span + i * src_span_delta;
@@ -22,6 +22,7 @@
 #include "foundation/IndexSequence.h"
 #include "foundation/GridAccessor.h"
 #include "BinaryImage.h"
+#include "CpuFeatures.h"
 #include <QSize>
 #include <stdint.h>
 #include <assert.h>
@@ -98,9 +99,80 @@ void rasterOpGeneric(BinaryImage const& image1, T2* data2, int stride2, Op opera
 
 /*======================== Implementation ==========================*/
 
+namespace rop_generic_impl
+{
+
+/*
+ * The operation may keep state between calls, so lines are processed
+ * in order and one pixel at a time.  Still, instantiating the loops for
+ * wider instruction sets lets the compiler use them where it can.
+ */
+
+template<typename T, typename Op>
+IMAGEPROC_FORCE_INLINE
+void rasterOpLines(T* data, int const stride, int const w, int const h, Op& operation)
+{
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            operation(data[x]);
+        }
+        data += stride;
+    }
+}
+
+template<typename T1, typename T2, typename Op>
+IMAGEPROC_FORCE_INLINE
+void rasterOpLines(T1* data1, int const stride1, T2* data2, int const stride2,
+                   int const w, int const h, Op& operation)
+{
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            operation(data1[x], data2[x]);
+        }
+        data1 += stride1;
+        data2 += stride2;
+    }
+}
+
+#if defined(IMAGEPROC_TARGET_DISPATCH)
+template<typename T, typename Op>
+IMAGEPROC_TARGET_SSE42
+void rasterOpLinesSse42(T* data, int const stride, int const w, int const h, Op& operation)
+{
+    rasterOpLines(data, stride, w, h, operation);
+}
+
+template<typename T, typename Op>
+IMAGEPROC_TARGET_AVX2
+void rasterOpLinesAvx2(T* data, int const stride, int const w, int const h, Op& operation)
+{
+    rasterOpLines(data, stride, w, h, operation);
+}
+
+template<typename T1, typename T2, typename Op>
+IMAGEPROC_TARGET_SSE42
+void rasterOpLinesSse42(T1* data1, int const stride1, T2* data2, int const stride2,
+                        int const w, int const h, Op& operation)
+{
+    rasterOpLines(data1, stride1, data2, stride2, w, h, operation);
+}
+
+template<typename T1, typename T2, typename Op>
+IMAGEPROC_TARGET_AVX2
+void rasterOpLinesAvx2(T1* data1, int const stride1, T2* data2, int const stride2,
+                       int const w, int const h, Op& operation)
+{
+    rasterOpLines(data1, stride1, data2, stride2, w, h, operation);
+}
+#endif
+
+} // namespace rop_generic_impl
+
 template<typename T, typename Op>
 void rasterOpGeneric(T* data, int stride, QSize size, Op operation)
 {
+    using namespace rop_generic_impl;
+
     if (size.isEmpty()) {
         return;
     }
@@ -108,18 +180,27 @@ void rasterOpGeneric(T* data, int stride, QSize size, Op operation)
     int const w = size.width();
     int const h = size.height();
 
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            operation(data[x]);
-        }
-        data += stride;
+#if defined(IMAGEPROC_TARGET_DISPATCH)
+    switch (CpuFeatures::level()) {
+        case CpuFeatures::AVX2:
+            rasterOpLinesAvx2(data, stride, w, h, operation);
+            return;
+        case CpuFeatures::SSE42:
+            rasterOpLinesSse42(data, stride, w, h, operation);
+            return;
+        case CpuFeatures::BASELINE:
+            break;
     }
+#endif
+    rasterOpLines(data, stride, w, h, operation);
 }
 
 template<typename T1, typename T2, typename Op>
 void rasterOpGeneric(T1* data1, int stride1, QSize size,
                      T2* data2, int stride2, Op operation)
 {
+    using namespace rop_generic_impl;
+
     if (size.isEmpty()) {
         return;
     }
@@ -127,13 +208,19 @@ void rasterOpGeneric(T1* data1, int stride1, QSize size,
     int const w = size.width();
     int const h = size.height();
 
-    for (int y = 0; y < h; ++y) {
-        for (int x = 0; x < w; ++x) {
-            operation(data1[x], data2[x]);
-        }
-        data1 += stride1;
-        data2 += stride2;
+#if defined(IMAGEPROC_TARGET_DISPATCH)
+    switch (CpuFeatures::level()) {
+        case CpuFeatures::AVX2:
+            rasterOpLinesAvx2(data1, stride1, data2, stride2, w, h, operation);
+            return;
+        case CpuFeatures::SSE42:
+            rasterOpLinesSse42(data1, stride1, data2, stride2, w, h, operation);
+            return;
+        case CpuFeatures::BASELINE:
+            break;
     }
+#endif
+    rasterOpLines(data1, stride1, data2, stride2, w, h, operation);
 }
 
 template<typename T2, typename Op>
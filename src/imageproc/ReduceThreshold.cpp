@@ -17,9 +17,12 @@
 */
 
 #include "ReduceThreshold.h"
+#include "SimdKernels.h"
+#include <algorithm>
 #include <stdexcept>
 #include <stdint.h>
 #include <assert.h>
+#include <stddef.h>
 
 namespace imageproc
 {
@@ -28,96 +31,21 @@ namespace
 {
 
 /**
- * This lookup table is filled like this:
- * \code
- * for (unsigned i = 0; i < 256; i += 2) {
- *  unsigned out =
- *      ((i & (1 << 1)) >> 1) |  // bit 1 becomes bit 0
- *      ((i & (1 << 3)) >> 2) |  // bit 3 becomes bit 1
- *      ((i & (1 << 5)) >> 3) |  // bit 5 becomes bit 2
- *      ((i & (1 << 7)) >> 4);   // bit 7 becomes bit 3
- *  compressBitsLut[i >> 1] = static_cast<uint8_t>(out);
- * }
- * \endcode
- * We take every other byte because bit 0 doesn't matter here.
+ * Does lines [dst_begin, dst_end) of a reduction of an image at least 2x2.
  */
-static uint8_t const compressBitsLut[128] = {
-    0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3,
-    0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3,
-    0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7,
-    0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7,
-    0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3,
-    0x0, 0x1, 0x0, 0x1, 0x2, 0x3, 0x2, 0x3,
-    0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7,
-    0x4, 0x5, 0x4, 0x5, 0x6, 0x7, 0x6, 0x7,
-    0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb,
-    0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb,
-    0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf,
-    0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf,
-    0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb,
-    0x8, 0x9, 0x8, 0x9, 0xa, 0xb, 0xa, 0xb,
-    0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf,
-    0xc, 0xd, 0xc, 0xd, 0xe, 0xf, 0xe, 0xf
-};
-
-/**
- * Throw away every other bit starting with bit 0 and
- * pack the remaining bits into the upper half of a word.
- */
-inline uint32_t compressBitsUpperHalf(uint32_t const bits)
-{
-    uint32_t r;
-    r = compressBitsLut[(bits >> 25) /*& 0x7F*/] << 28;
-    r |= compressBitsLut[(bits >> 17) & 0x7F] << 24;
-    r |= compressBitsLut[(bits >> 9) & 0x7F] << 20;
-    r |= compressBitsLut[(bits >> 1) & 0x7F] << 16;
-    return r;
-}
-
-/**
- * Throw away every other bit starting with bit 0 and
- * pack the remaining bits into the lower half of a word.
- */
-inline uint32_t compressBitsLowerHalf(uint32_t const bits)
-{
-    uint32_t r;
-    r = compressBitsLut[(bits >> 25) /*& 0x7F*/] << 12;
-    r |= compressBitsLut[(bits >> 17) & 0x7F] << 8;
-    r |= compressBitsLut[(bits >> 9) & 0x7F] << 4;
-    r |= compressBitsLut[(bits >> 1) & 0x7F];
-    return r;
-}
-
-inline uint32_t threshold1(uint32_t const top, uint32_t const bottom)
+void reduceLines(
+    uint32_t const* src_data, int const src_wpl,
+    uint32_t* dst_data, int const dst_wpl, int const steps_per_line,
+    int const dst_begin, int const dst_end, int const threshold)
 {
-    uint32_t word = top | bottom;
-    word |= word << 1;
-    return word;
-}
-
-inline uint32_t threshold2(uint32_t const top, uint32_t const bottom)
-{
-    uint32_t word1 = top & bottom;
-    word1 |= word1 << 1;
-    uint32_t word2 = top | bottom;
-    word2 &= word2 << 1;
-    return word1 | word2;
-}
-
-inline uint32_t threshold3(uint32_t const top, uint32_t const bottom)
-{
-    uint32_t word1 = top | bottom;
-    word1 &= word1 << 1;
-    uint32_t word2 = top & bottom;
-    word2 |= word2 << 1;
-    return word1 & word2;
-}
-
-inline uint32_t threshold4(uint32_t const top, uint32_t const bottom)
-{
-    uint32_t word = top & bottom;
-    word &= word << 1;
-    return word;
+    SimdKernels const& kernels = simdKernels();
+    uint32_t const* src_line = src_data + ptrdiff_t(dst_begin) * 2 * src_wpl;
+    uint32_t* dst_line = dst_data + ptrdiff_t(dst_begin) * dst_wpl;
+    for (int i = dst_end - dst_begin; i > 0; --i) {
+        kernels.reduceThresholdLine(src_line, src_line + src_wpl, dst_line, steps_per_line, threshold);
+        src_line += src_wpl * 2;
+        dst_line += dst_wpl;
+    }
 }
 
 } // anonymous namespace
@@ -130,96 +58,99 @@ ReduceThreshold::ReduceThreshold(BinaryImage const& image)
 ReduceThreshold&
 ReduceThreshold::reduce(int const threshold)
 {
-    if (threshold < 1 || threshold > 4) {
-        throw std::invalid_argument("ReduceThreshold: invalid threshold");
-    }
-
-    BinaryImage const& src = m_image;
+    std::vector<int> const thresholds(1, threshold);
+    m_image = pyramid(m_image, thresholds).back();
+    return *this;
+}
 
-    if (src.isNull()) {
-        return *this;
+std::vector<BinaryImage>
+ReduceThreshold::pyramid(BinaryImage const& image, std::vector<int> const& thresholds)
+{
+    for (int const threshold : thresholds) {
+        if (threshold < 1 || threshold > 4) {
+            throw std::invalid_argument("ReduceThreshold: invalid threshold");
+        }
     }
 
-    int const dst_w = src.width() / 2;
-    int const dst_h = src.height() / 2;
-
-    if (dst_h == 0) {
-        reduceHorLine(threshold);
-        return *this;
-    } else if (dst_w == 0) {
-        reduceVertLine(threshold);
-        return *this;
+    int const num_levels = thresholds.size();
+    std::vector<BinaryImage> levels(1, image);
+    if (image.isNull()) {
+        levels.resize(num_levels + 1);
+        return levels;
     }
 
-    BinaryImage dst(dst_w, dst_h);
-
-    int const dst_wpl = dst.wordsPerLine();
-    int const src_wpl = src.wordsPerLine();
-    int const steps_per_line = (dst_w * 2 + 31) / 32;
-    assert(steps_per_line <= src_wpl);
-    assert(steps_per_line / 2 <= dst_wpl);
-
-    uint32_t const* src_line = src.data();
-    uint32_t* dst_line = dst.data();
-
-    uint32_t word;
+    // Levels whose source is at least 2x2 are done by reduceLines().
+    // Further reductions of a 1 pixel thick line are done one by one.
+    int num_regular = 0;
+    while (num_regular < num_levels) {
+        BinaryImage const& src = levels[num_regular];
+        if (src.width() < 2 || src.height() < 2) {
+            break;
+        }
+        levels.push_back(BinaryImage(src.width() / 2, src.height() / 2));
+        ++num_regular;
+    }
 
-    if (threshold == 1) {
-        for (int i = dst_h; i > 0; --i) {
-            for (int j = 0; j < steps_per_line; j += 2) {
-                word = threshold1(src_line[j], src_line[j + src_wpl]);
-                dst_line[j / 2] = compressBitsUpperHalf(word);
-            }
-            for (int j = 1; j < steps_per_line; j += 2) {
-                word = threshold1(src_line[j], src_line[j + src_wpl]);
-                dst_line[j / 2] |= compressBitsLowerHalf(word);
-            }
-            src_line += src_wpl * 2;
-            dst_line += dst_wpl;
+    if (num_regular > 0) {
+        // Never call .data() inside omp.
+        std::vector<uint32_t const*> src_data(num_regular + 1);
+        std::vector<uint32_t*> dst_data(num_regular + 1);
+        std::vector<int> wpl(num_regular + 1);
+        std::vector<int> steps_per_line(num_regular + 1);
+        src_data[0] = image.data();
+        wpl[0] = image.wordsPerLine();
+        for (int k = 1; k <= num_regular; ++k) {
+            dst_data[k] = levels[k].data();
+            src_data[k] = dst_data[k];
+            wpl[k] = levels[k].wordsPerLine();
+            steps_per_line[k] = (levels[k].width() * 2 + 31) / 32;
+            assert(steps_per_line[k] <= wpl[k - 1]);
+            assert(steps_per_line[k] / 2 <= wpl[k]);
         }
-    } else if (threshold == 2) {
-        for (int i = dst_h; i > 0; --i) {
-            for (int j = 0; j < steps_per_line; j += 2) {
-                word = threshold2(src_line[j], src_line[j + src_wpl]);
-                dst_line[j / 2] = compressBitsUpperHalf(word);
-            }
-            for (int j = 1; j < steps_per_line; j += 2) {
-                word = threshold2(src_line[j], src_line[j + src_wpl]);
-                dst_line[j / 2] |= compressBitsLowerHalf(word);
+
+        // Lines of the last level are split into bands.  For each band,
+        // all levels are done before moving to the next one, while the
+        // source lines are still in cache.  A band of the last level
+        // corresponds to band << (num_regular - k) lines of level k.
+        int const last_h = levels[num_regular].height();
+        int const band = std::max(1, 64 >> num_regular);
+        int const num_bands = (last_h + band - 1) / band;
+
+        #pragma omp parallel for schedule(static)
+        for (int b = 0; b < num_bands; ++b) {
+            int const begin = b * band;
+            int const end = std::min(last_h, begin + band);
+            for (int k = 1; k <= num_regular; ++k) {
+                int const shift = num_regular - k;
+                reduceLines(
+                    src_data[k - 1], wpl[k - 1], dst_data[k], wpl[k], steps_per_line[k],
+                    begin << shift, end << shift, thresholds[k - 1]
+                );
             }
-            src_line += src_wpl * 2;
-            dst_line += dst_wpl;
         }
-    } else if (threshold == 3) {
-        for (int i = dst_h; i > 0; --i) {
-            for (int j = 0; j < steps_per_line; j += 2) {
-                word = threshold3(src_line[j], src_line[j + src_wpl]);
-                dst_line[j / 2] = compressBitsUpperHalf(word);
-            }
-            for (int j = 1; j < steps_per_line; j += 2) {
-                word = threshold3(src_line[j], src_line[j + src_wpl]);
-                dst_line[j / 2] |= compressBitsLowerHalf(word);
-            }
-            src_line += src_wpl * 2;
-            dst_line += dst_wpl;
+
+        // Lines of intermediate levels the last level doesn't depend on.
+        for (int k = 1; k < num_regular; ++k) {
+            reduceLines(
+                src_data[k - 1], wpl[k - 1], dst_data[k], wpl[k], steps_per_line[k],
+                last_h << (num_regular - k), levels[k].height(), thresholds[k - 1]
+            );
         }
-    } else if (threshold == 4) {
-        for (int i = dst_h; i > 0; --i) {
-            for (int j = 0; j < steps_per_line; j += 2) {
-                word = threshold4(src_line[j], src_line[j + src_wpl]);
-                dst_line[j / 2] = compressBitsUpperHalf(word);
-            }
-            for (int j = 1; j < steps_per_line; j += 2) {
-                word = threshold4(src_line[j], src_line[j + src_wpl]);
-                dst_line[j / 2] |= compressBitsLowerHalf(word);
+    }
+
+    if (num_regular < num_levels) {
+        ReduceThreshold reductor(levels.back());
+        for (int k = num_regular; k < num_levels; ++k) {
+            if (reductor.m_image.height() == 1) {
+                reductor.reduceHorLine(thresholds[k]);
+            } else {
+                reductor.reduceVertLine(thresholds[k]);
             }
-            src_line += src_wpl * 2;
-            dst_line += dst_wpl;
+            levels.push_back(reductor.m_image);
         }
     }
 
-    m_image = dst;
-    return *this;
+    return levels;
 }
 
 void
@@ -236,43 +167,15 @@ ReduceThreshold::reduceHorLine(int const threshold)
     BinaryImage dst(src.width() / 2, 1);
 
     int const steps_per_line = (dst.width() * 2 + 31) / 32;
-    uint32_t const* src_line = src.data();
-    uint32_t* dst_line = dst.data();
     assert(steps_per_line <= src.wordsPerLine());
     assert(steps_per_line / 2 <= dst.wordsPerLine());
 
-    uint32_t word;
-
-    switch (threshold) {
-    case 1:
-    case 2: {
-        for (int j = 0; j < steps_per_line; j += 2) {
-            word = src_line[j];
-            word |= word << 1;
-            dst_line[j / 2] = compressBitsUpperHalf(word);
-        }
-        for (int j = 1; j < steps_per_line; j += 2) {
-            word = src_line[j];
-            word |= word << 1;
-            dst_line[j / 2] |= compressBitsLowerHalf(word);
-        }
-        break;
-    }
-    case 3:
-    case 4: {
-        for (int j = 0; j < steps_per_line; j += 2) {
-            word = src_line[j];
-            word &= word << 1;
-            dst_line[j / 2] = compressBitsUpperHalf(word);
-        }
-        for (int j = 1; j < steps_per_line; j += 2) {
-            word = src_line[j];
-            word &= word << 1;
-            dst_line[j / 2] |= compressBitsLowerHalf(word);
-        }
-        break;
-    }
-    }
+    // As if the line was duplicated, thresholds 1 and 2 become
+    // "any of 2 pixels", while 3 and 4 become "both pixels".
+    uint32_t const* src_line = src.data();
+    simdKernels().reduceThresholdLine(
+        src_line, src_line, dst.data(), steps_per_line, threshold <= 2 ? 1 : 4
+    );
 
     m_image = dst;
 }
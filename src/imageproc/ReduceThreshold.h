@@ -20,6 +20,7 @@
 #define IMAGEPROC_REDUCETHRESHOLD_H_
 
 #include "BinaryImage.h"
+#include <vector>
 
 namespace imageproc
 {
@@ -48,6 +49,7 @@ namespace imageproc
  * \code
  * BinaryImage out = ReduceThreshold(input)(4)(4)(3);
  * \endcode
+ * When intermediate results are needed as well, pyramid() is faster.
  */
 class ReduceThreshold
 {
@@ -85,6 +87,17 @@ public:
     {
         return reduce(threshold);
     }
+
+    /**
+     * \brief Does a cascade of reductions, keeping all the results.
+     *
+     * Element 0 of the returned vector is \p image, element i is element
+     * i - 1 reduced with thresholds[i - 1].  The results are the same as
+     * with reduce(), but all levels are built in one pass over \p image,
+     * in bands of lines that stay in cache.
+     */
+    static std::vector<BinaryImage> pyramid(
+        BinaryImage const& image, std::vector<int> const& thresholds);
 private:
     void reduceHorLine(int threshold);
 
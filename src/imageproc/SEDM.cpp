@@ -25,6 +25,7 @@
 #include "Morphology.h"
 #include "SeedFill.h"
 #include "RasterOp.h"
+#include "foundation/ScratchArena.h"
 #include <algorithm>
 #include <string.h>
 #include <math.h>
@@ -417,12 +418,12 @@ SEDM::processRows(ConnectivityMap& cmap)
 BinaryImage
 SEDM::findPeakCandidatesNonPadded() const
 {
-    std::vector<uint32_t> maxed(m_data.size(), 0);
+    ScratchBuffer<uint32_t> maxed(m_data.size());
 
     // Every cell becomes the maximum of itself and its neighbors.
-    max3x3(&m_data[0], &maxed[0]);
+    max3x3(&m_data[0], maxed.data());
 
-    return buildEqualMapNonPadded(&m_data[0], &maxed[0]);
+    return buildEqualMapNonPadded(&m_data[0], maxed.data());
 }
 
 BinaryImage
@@ -457,9 +458,9 @@ SEDM::buildEqualMapNonPadded(uint32_t const* src1, uint32_t const* src2) const
 void
 SEDM::max3x3(uint32_t const* src, uint32_t* dst) const
 {
-    std::vector<uint32_t> tmp(m_data.size(), 0);
-    max3x1(src, &tmp[0]);
-    max1x3(&tmp[0], dst);
+    ScratchBuffer<uint32_t> tmp(m_data.size());
+    max3x1(src, tmp.data());
+    max1x3(tmp.data(), dst);
 }
 
 void
@@ -24,6 +24,9 @@
 #include <QSize>
 #include <QPoint>
 #include <QtGlobal>
+#include <algorithm>
+#include <memory>
+#include <vector>
 #include <stdexcept>
 #include <new>
 #include <stdint.h>
@@ -35,42 +38,96 @@ namespace imageproc
 namespace
 {
 
-int calcNumTerms(int const hor_degree, int const vert_degree)
+/**
+ * \brief One-dimensional kernels for every origin within a window.
+ *
+ * The polynomial terms of a two-dimensional window are products of powers
+ * of x and y, so its kernel is the product of a horizontal and a vertical
+ * one-dimensional kernel with the same origin.
+ */
+class Kernels1D
 {
-    return (hor_degree + 1) * (vert_degree + 1);
+public:
+    Kernels1D(int size, int degree);
+
+    int size() const
+    {
+        return m_size;
+    }
+
+    int degree() const
+    {
+        return m_degree;
+    }
+
+    float const* forOrigin(int origin) const
+    {
+        return &m_data[origin * m_size];
+    }
+private:
+    int m_size;
+    int m_degree;
+    std::vector<float> m_data;
+};
+
+Kernels1D::Kernels1D(int const size, int const degree)
+    :   m_size(size),
+        m_degree(degree),
+        m_data(size * size)
+{
+    SavGolKernel kernel(QSize(size, 1), QPoint(0, 0), degree, 0);
+    for (int origin = 0; origin < size; ++origin) {
+        kernel.recalcForOrigin(QPoint(origin, 0));
+        std::copy(kernel.data(), kernel.data() + size, &m_data[origin * size]);
+    }
 }
 
-class Kernel : public SavGolKernel
+/**
+ * \brief Kernels recently used by this thread.
+ *
+ * The same window is normally used for all the pages of a project,
+ * so there is no point recalculating the kernels for every page.
+ */
+class KernelCache
 {
 public:
-    Kernel(QSize const& size, QPoint const& origin,
-           int hor_degree, int vert_degree)
-        : SavGolKernel(size, origin, hor_degree, vert_degree) {}
+    std::shared_ptr<Kernels1D const> get(int size, int degree);
+private:
+    enum { MAX_ENTRIES = 8 };
 
-    void convolve(
-        uint8_t* dst, uint8_t const* src_top_left,
-        int src_bpl) const;
+    std::vector<std::shared_ptr<Kernels1D const> > m_entries;
 };
 
-inline void
-Kernel::convolve(uint8_t* dst, uint8_t const* src_top_left, int src_bpl) const
+std::shared_ptr<Kernels1D const>
+KernelCache::get(int const size, int const degree)
 {
-    uint8_t const* p_src = src_top_left;
-    float const* p_kernel = data();
-    float sum = 0.5; // For rounding purposes.
+    for (std::shared_ptr<Kernels1D const> const& entry : m_entries) {
+        if (entry->size() == size && entry->degree() == degree) {
+            return entry;
+        }
+    }
 
-    int const w = width();
-    int const h = height();
+    if (m_entries.size() >= MAX_ENTRIES) {
+        m_entries.erase(m_entries.begin());
+    }
+    m_entries.push_back(std::make_shared<Kernels1D const>(size, degree));
+    return m_entries.back();
+}
 
-    for (int y = 0; y < h; ++y, p_src += src_bpl) {
-        for (int x = 0; x < w; ++x) {
-            sum += p_src[x] * *p_kernel;
-            ++p_kernel;
-        }
+thread_local KernelCache kernel_cache;
+
+float dotProduct(float const* src, float const* kernel, int const size)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < size; ++i) {
+        sum += src[i] * kernel[i];
     }
+    return sum;
+}
 
-    int const val = static_cast<int>(sum);
-    *dst = static_cast<uint8_t>(qBound(0, val, 255));
+uint8_t toGrayLevel(float const val)
+{
+    return static_cast<uint8_t>(qBound(0, static_cast<int>(val), 255));
 }
 
 QImage savGolFilterGrayToGray(
@@ -97,27 +154,29 @@ QImage savGolFilterGrayToGray(
      * |x|x|B|x|x|
      */
 
-    // Co-ordinates of the central point (C) of the kernel.
-    QPoint const k_center(kw / 2, kh / 2);
-
-    // Origin is the current hot spot of the kernel.
-    // Normally it's at k_center, but sometimes we move
-    // it to other locations to avoid parts of the kernel
-    // from going outside of the image area.
-    QPoint k_origin;
-
     // Length of the top segment (T) of the kernel.
-    int const k_top = k_center.y();
+    int const k_top = kh / 2;
 
     // Length of the bottom segment (B) of the kernel.
     int const k_bottom = kh - k_top - 1;
 
     // Length of the left segment (L) of the kernel.
-    int const k_left = k_center.x();
+    int const k_left = kw / 2;
 
     // Length of the right segment (R) of the kernel.
     int const k_right = kw - k_left - 1;
 
+    // The central point (C) is the kernel's origin, except near the edges
+    // of the image, where the window is moved to stay within the image,
+    // and the origin is moved the other way.
+
+    std::shared_ptr<Kernels1D const> const hor_kernels(
+        kernel_cache.get(kw, hor_degree)
+    );
+    std::shared_ptr<Kernels1D const> const vert_kernels(
+        kernel_cache.get(kh, vert_degree)
+    );
+
     uint8_t const* const src_data = src.bits();
     int const src_bpl = src.bytesPerLine();
 
@@ -130,186 +189,90 @@ QImage savGolFilterGrayToGray(
     uint8_t* const dst_data = dst.bits();
     int const dst_bpl = dst.bytesPerLine();
 
-    // Top-left corner.
-    uint8_t const* src_line = src_data;
-    Kernel kernel(window_size, QPoint(0, 0), hor_degree, vert_degree);
-    #pragma omp parallel for schedule(static)
-    for (int y = 0; y < k_top; ++y) {
-        uint8_t* dst_line = dst_data + y * dst_bpl;
-        k_origin.setY(y);
-        for (int x = 0; x < k_left; ++x) {
-            k_origin.setX(x);
-            kernel.recalcForOrigin(k_origin);
-            kernel.convolve(dst_line + x, src_line, src_bpl);
-        }
-    }
-
-    // Top area between two corners.
-    k_origin.setX(k_center.x());
-    src_line = src_data - k_left;
-    #pragma omp parallel for schedule(static)
-    for (int y = 0; y < k_top; ++y) {
-        uint8_t* dst_line = dst_data + y * dst_bpl;
-        k_origin.setY(y);
-        kernel.recalcForOrigin(k_origin);
-        for (int x = k_left; x < width - k_right; ++x) {
-            kernel.convolve(dst_line + x, src_line + x, src_bpl);
-        }
-    }
-
-    // Top-right corner.
-    k_origin.setY(0);
-    src_line = src_data + width - kw;
-    #pragma omp parallel for schedule(static)
-    for (int y = 0; y < k_top; ++y) {
-        uint8_t* dst_line = dst_data + y * dst_bpl;
-        k_origin.setY(y);
-        k_origin.setX(k_center.x() + 1);
-        for (int x = width - k_right; x < width; ++x) {
-            kernel.recalcForOrigin(k_origin);
-            kernel.convolve(dst_line + x, src_line, src_bpl);
-            k_origin.rx() += 1;
-        }
-    }
-
-    // Central area.
-#if 0
-    // Simple but slow implementation.
-    kernel.recalcForOrigin(k_center);
-    src_line = src_data - k_left;
-    dst_line = dst_data + dst_bpl * k_top;
-    for (int y = k_top; y < height - k_bottom; ++y) {
-        for (int x = k_left; x < width - k_right; ++x) {
-            kernel.convolve(dst_line + x, src_line + x, src_bpl);
-        }
-        src_line += src_bpl;
-        dst_line += dst_bpl;
-    }
-#else
-    // Take advantage of Savitzky-Golay filter being separable.
-    SavGolKernel const hor_kernel(
-        QSize(window_size.width(), 1),
-        QPoint(k_center.x(), 0), hor_degree, 0
-    );
-    SavGolKernel const vert_kernel(
-        QSize(1, window_size.height()),
-        QPoint(0, k_center.y()), 0, vert_degree
-    );
-
-    int const shift = kw - 1;
-
     // Allocate a 16-byte aligned temporary storage.
     // That may help the compiler to emit efficient SSE code.
-    int const temp_stride = (width - shift + 3) & ~3;
+    int const temp_stride = (width + 3) & ~3;
     AlignedArray<float, 4> temp_array(temp_stride * height);
+    float* const temp_data = temp_array.data();
 
     // Horizontal pass.
-    src_line = src_data - shift;
-    float* temp_line = temp_array.data() - shift;
-    #pragma omp parallel for schedule(static) shared(temp_array, temp_line, src_line)
-    for (int y = 0; y < height; ++y) {
-        float* tmp_ = temp_line + y * temp_stride;
-        uint8_t const* src_ = src_line + y * src_bpl;
-        for (int i = shift; i < width; ++i) {
-            float sum = 0.0f;
-
-            uint8_t const* src = src_ + i;
-            for (int j = 0; j < kw; ++j) {
-                sum += src[j] * hor_kernel[j];
+    #pragma omp parallel
+    {
+        AlignedArray<float, 4> src_row(width);
+        float* const row = src_row.data();
+        float const* const center_kernel = hor_kernels->forOrigin(k_left);
+        int const center_end = width - k_right;
+
+        #pragma omp for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            uint8_t const* const src_line = src_data + y * src_bpl;
+            float* const temp_line = temp_data + y * temp_stride;
+
+            for (int x = 0; x < width; ++x) {
+                row[x] = src_line[x];
             }
-            tmp_[i] = sum;
-        }
-    }
 
-    // Vertical pass.
-    uint8_t* dst_line_base = dst_data + k_top * dst_bpl + k_left - shift;
-    temp_line = temp_array.data() - shift;
-    #pragma omp parallel for schedule(static) shared(temp_array, temp_line, dst_line_base)
-    for (int y = k_top; y < height - k_bottom; ++y) {
-        float* tmp_ = temp_line + (y - k_top) * temp_stride;
-        uint8_t* dst_ = dst_line_base + (y - k_top) * dst_bpl;
-        for (int i = shift; i < width; ++i) {
-            float sum = 0.0f;
-
-            float* tmp = tmp_ + i;
-            for (int j = 0; j < kh; ++j, tmp += temp_stride) {
-                sum += *tmp * vert_kernel[j];
+            for (int x = 0; x < k_left; ++x) {
+                temp_line[x] = dotProduct(row, hor_kernels->forOrigin(x), kw);
             }
-            int const val = static_cast<int>(sum);
-            dst_[i] = static_cast<uint8_t>(qBound(0, val, 255));
-        }
-    }
-#endif
-
-    // Left area between two corners.
-    k_origin.setY(k_center.y() + 1);
-    #pragma omp parallel for schedule(static)
-    for (int x = 0; x < k_left; ++x) {
-        k_origin.setX(x);
-        uint8_t const* src_line = src_data;
-        uint8_t* dst_line = dst_data + dst_bpl * k_top;
-
-        kernel.recalcForOrigin(k_origin);
-        for (int y = k_top; y < height - k_bottom; ++y) {
-            kernel.convolve(dst_line + x, src_line, src_bpl);
-            src_line += src_bpl;
-            dst_line += dst_bpl;
-        }
-    }
 
-    // Right area between two corners.
-    k_origin.setY(k_center.y());
-    #pragma omp parallel for schedule(static)
-    for (int x = width - k_right; x < width; ++x) {
-        k_origin.setX(k_center.x() + x - (width - k_right - 1));
-        uint8_t const* src_line = src_data + width - kw;
-        uint8_t* dst_line = dst_data + dst_bpl * k_top;
-
-        kernel.recalcForOrigin(k_origin);
-        for (int y = k_top; y < height - k_bottom; ++y) {
-            kernel.convolve(dst_line + x, src_line, src_bpl);
-            src_line += src_bpl;
-            dst_line += dst_bpl;
-        }
-    }
+            // Going tap by tap keeps the order of summation for every pixel,
+            // while letting the compiler vectorize the inner loop.
+            for (int x = k_left; x < center_end; ++x) {
+                temp_line[x] = 0.0f;
+            }
+            for (int j = 0; j < kw; ++j) {
+                float const k = center_kernel[j];
+                float const* const src = row + j - k_left;
+                for (int x = k_left; x < center_end; ++x) {
+                    temp_line[x] += src[x] * k;
+                }
+            }
 
-    // Bottom-left corner.
-//  k_origin.setY(k_center.y() + 1);
-    src_line = src_data + src_bpl * (height - kh);
-    #pragma omp parallel for schedule(static)
-    for (int y = height - k_bottom; y < height; ++y) {
-        k_origin.setY(k_center.y() + y - (height - k_bottom - 1));
-        uint8_t* dst_line = dst_data + dst_bpl * (height - k_bottom) + (y - height + k_bottom) * dst_bpl;
-        for (int x = 0; x < k_left; ++x) {
-            k_origin.setX(x);
-            kernel.recalcForOrigin(k_origin);
-            kernel.convolve(dst_line + x, src_line, src_bpl);
+            for (int x = center_end; x < width; ++x) {
+                temp_line[x] = dotProduct(
+                    row + width - kw, hor_kernels->forOrigin(x - (width - kw)), kw
+                );
+            }
         }
     }
 
-    // Bottom area between two corners.
-    k_origin.setX(k_center.x());
-    src_line = src_data + src_bpl * (height - kh) - k_left;
-    #pragma omp parallel for schedule(static)
-    for (int y = height - k_bottom; y < height; ++y) {
-        k_origin.setY(k_center.y() + y - (height - k_bottom - 1));
-        uint8_t* dst_line = dst_data + dst_bpl * (height - k_bottom) + (y - height + k_bottom) * dst_bpl;
-        kernel.recalcForOrigin(k_origin);
-        for (int x = k_left; x < width - k_right; ++x) {
-            kernel.convolve(dst_line + x, src_line + x, src_bpl);
-        }
-    }
+    // Vertical pass.
+    #pragma omp parallel
+    {
+        AlignedArray<float, 4> sum_row(width);
+        float* const sum = sum_row.data();
+
+        #pragma omp for schedule(static)
+        for (int y = 0; y < height; ++y) {
+            int const window_top = qBound(0, y - k_top, height - kh);
+            float const* const kernel = vert_kernels->forOrigin(y - window_top);
+
+            for (int x = 0; x < width; ++x) {
+                sum[x] = 0.0f;
+            }
+            for (int j = 0; j < kh; ++j) {
+                float const k = kernel[j];
+                float const* const temp_line = temp_data + (window_top + j) * temp_stride;
+                for (int x = 0; x < width; ++x) {
+                    sum[x] += temp_line[x] * k;
+                }
+            }
 
-    // Bottom-right corner.
-    src_line = src_data + src_bpl * (height - kh) + (width - kw);
-    #pragma omp parallel for schedule(static)
-    for (int y = height - k_bottom; y < height; ++y) {
-        k_origin.setY(k_center.y() + y - (height - k_bottom - 1));
-        uint8_t* dst_line = dst_data + dst_bpl * (height - k_bottom) + (y - height + k_bottom) * dst_bpl;
-        for (int x = width - k_right; x < width; ++x) {
-            k_origin.setX(k_center.x() + x - (width - k_right - 1));
-            kernel.recalcForOrigin(k_origin);
-            kernel.convolve(dst_line + x, src_line, src_bpl);
+            // Pixels near the edges are rounded, while the central area
+            // is truncated, as it always was.
+            uint8_t* const dst_line = dst_data + y * dst_bpl;
+            bool const edge_line = y < k_top || y >= height - k_bottom;
+            float const center_bias = edge_line ? 0.5f : 0.0f;
+            for (int x = 0; x < k_left; ++x) {
+                dst_line[x] = toGrayLevel(sum[x] + 0.5f);
+            }
+            for (int x = k_left; x < width - k_right; ++x) {
+                dst_line[x] = toGrayLevel(sum[x] + center_bias);
+            }
+            for (int x = width - k_right; x < width; ++x) {
+                dst_line[x] = toGrayLevel(sum[x] + 0.5f);
+            }
         }
     }
 
@@ -329,8 +292,8 @@ QImage savGolFilter(
         throw std::invalid_argument("savGolFilter: invalid window size");
     }
 
-    if (calcNumTerms(hor_degree, vert_degree)
-            > window_size.width() * window_size.height()) {
+    if (hor_degree >= window_size.width()
+            || vert_degree >= window_size.height()) {
         throw std::invalid_argument(
             "savGolFilter: order is too big for that window");
     }
@@ -42,9 +42,9 @@ namespace imageproc
  * \return The filtered grayscale image.
  *
  * \note The window size and degrees are not completely independent.
- *       The following inequality must be fulfilled:
+ *       The following inequalities must be fulfilled:
  * \code
- *       window_width * window_height >= (hor_degree + 1) * (vert_degree + 1)
+ *       window_width > hor_degree && window_height > vert_degree
  * \endcode
  * Good results for 300 dpi scans are achieved with 7x7 window and 4x4 degree.
  */
@@ -21,12 +21,103 @@
 #include <QImage>
 #include <QSize>
 #include <stdexcept>
+#include <vector>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace imageproc
 {
 
+/**
+ * Sums \p height lines of \p width pixels column-wise.
+ */
+static void sumColumns(
+    uint8_t const* src_line, int const src_stride,
+    int const width, int const height, unsigned* const sums)
+{
+    int x = 0;
+#ifdef __SSE2__
+    // 16-bit lanes are enough to sum up to 257 lines.
+    if (height <= 257) {
+        __m128i const zero = _mm_setzero_si128();
+        for (; x + 16 <= width; x += 16) {
+            __m128i sum_low = zero;
+            __m128i sum_high = zero;
+            uint8_t const* p = src_line + x;
+            for (int i = 0; i < height; ++i, p += src_stride) {
+                __m128i const pixels = _mm_loadu_si128((__m128i const*)p);
+                sum_low = _mm_add_epi16(sum_low, _mm_unpacklo_epi8(pixels, zero));
+                sum_high = _mm_add_epi16(sum_high, _mm_unpackhi_epi8(pixels, zero));
+            }
+            _mm_storeu_si128((__m128i*)(sums + x), _mm_unpacklo_epi16(sum_low, zero));
+            _mm_storeu_si128((__m128i*)(sums + x + 4), _mm_unpackhi_epi16(sum_low, zero));
+            _mm_storeu_si128((__m128i*)(sums + x + 8), _mm_unpacklo_epi16(sum_high, zero));
+            _mm_storeu_si128((__m128i*)(sums + x + 12), _mm_unpackhi_epi16(sum_high, zero));
+        }
+    }
+#endif
+    for (; x < width; ++x) {
+        unsigned sum = 0;
+        uint8_t const* p = src_line + x;
+        for (int i = 0; i < height; ++i, p += src_stride) {
+            sum += *p;
+        }
+        sums[x] = sum;
+    }
+}
+
+/**
+ * Averages 2x2 blocks of source pixels.  This is the most common case
+ * of integer downscaling, so it gets its own vectorized implementation.
+ */
+static GrayImage scaleDown2x2GrayToGray(GrayImage const& src, QSize const& dst_size)
+{
+    int const dw = dst_size.width();
+    int const dh = dst_size.height();
+
+    GrayImage dst(dst_size);
+
+    uint8_t const* const src_data = src.data();
+    uint8_t* const dst_data = dst.data();
+    int const src_stride = src.stride();
+    int const dst_stride = dst.stride();
+
+    #pragma omp parallel for schedule(static)
+    for (int dy = 0; dy < dh; ++dy) {
+        uint8_t const* const src_line1 = src_data + 2 * dy * src_stride;
+        uint8_t const* const src_line2 = src_line1 + src_stride;
+        uint8_t* const dst_line = dst_data + dy * dst_stride;
+
+        int dx = 0;
+#ifdef __SSE2__
+        __m128i const low_bytes = _mm_set1_epi16(0x00ff);
+        __m128i const rounding = _mm_set1_epi16(2);
+        for (; dx + 8 <= dw; dx += 8) {
+            __m128i const line1 = _mm_loadu_si128((__m128i const*)(src_line1 + 2 * dx));
+            __m128i const line2 = _mm_loadu_si128((__m128i const*)(src_line2 + 2 * dx));
+            __m128i sum = _mm_add_epi16(
+                              _mm_and_si128(line1, low_bytes), _mm_srli_epi16(line1, 8)
+                          );
+            sum = _mm_add_epi16(sum, _mm_and_si128(line2, low_bytes));
+            sum = _mm_add_epi16(sum, _mm_srli_epi16(line2, 8));
+            sum = _mm_srli_epi16(_mm_add_epi16(sum, rounding), 2);
+            _mm_storel_epi64((__m128i*)(dst_line + dx), _mm_packus_epi16(sum, sum));
+        }
+#endif
+        for (; dx < dw; ++dx) {
+            unsigned const sum = src_line1[2 * dx] + src_line1[2 * dx + 1]
+                                 + src_line2[2 * dx] + src_line2[2 * dx + 1];
+            dst_line[dx] = static_cast<uint8_t>((sum + 2) >> 2);
+        }
+    }
+
+    return dst;
+}
+
 /**
  * This is an optimized implementation for the case when every destination
  * pixel maps exactly to a M x N block of source pixels.
@@ -42,38 +133,52 @@ static GrayImage scaleDownIntGrayToGray(GrayImage const& src, QSize const& dst_s
     int const yscale = sh / dh;
     int const total_area = xscale * yscale;
 
+    if (xscale == 2 && yscale == 2) {
+        return scaleDown2x2GrayToGray(src, dst_size);
+    }
+
+    // Dividing by total_area is replaced by multiplying by its reciprocal
+    // in 32.32 fixed point.  That's exact as long as
+    // (255 * total_area) * total_area < 2^32, hence the limit.
+    bool const use_reciprocal = total_area < 4096;
+    uint64_t const reciprocal = ((UINT64_C(1) << 32) + total_area - 1) / total_area;
+
     GrayImage dst(dst_size);
 
-    uint8_t const* src_line = src.data();
-    uint8_t* dst_line = dst.data();
+    uint8_t const* const src_data = src.data();
+    uint8_t* const dst_data = dst.data();
     int const src_stride = src.stride();
-    int const src_stride_scaled = src_stride * yscale;
     int const dst_stride = dst.stride();
+    int const sum_width = dw * xscale;
 
-    int sy = 0;
-    int dy = 0;
-    for (; dy < dh; ++dy, sy += yscale) {
+    #pragma omp parallel
+    {
+        // Sums of yscale source pixels in every column.
+        std::vector<unsigned> column_sums(sum_width);
 
-        int sx = 0;
-        int dx = 0;
-        for (; dx < dw; ++dx, sx += xscale) {
+        #pragma omp for schedule(static)
+        for (int dy = 0; dy < dh; ++dy) {
+            uint8_t const* const src_line = src_data + dy * yscale * src_stride;
+            uint8_t* const dst_line = dst_data + dy * dst_stride;
+            unsigned* const sums = &column_sums[0];
 
-            unsigned gray_level = 0;
-            uint8_t const* psrc = src_line + sx;
+            sumColumns(src_line, src_stride, sum_width, yscale, sums);
 
-            for (int i = 0; i < yscale; ++i, psrc += src_stride) {
+            unsigned const* psum = sums;
+            for (int dx = 0; dx < dw; ++dx) {
+                unsigned gray_level = total_area >> 1;
                 for (int j = 0; j < xscale; ++j) {
-                    gray_level += psrc[j];
+                    gray_level += psum[j];
                 }
-            }
+                psum += xscale;
 
-            unsigned const pix_value = (gray_level + (total_area >> 1)) / total_area;
-            assert(pix_value < 256);
-            dst_line[dx] = static_cast<uint8_t>(pix_value);
+                unsigned const pix_value = use_reciprocal
+                                           ? unsigned((gray_level * reciprocal) >> 32)
+                                           : gray_level / total_area;
+                assert(pix_value < 256);
+                dst_line[dx] = static_cast<uint8_t>(pix_value);
+            }
         }
-
-        src_line += src_stride_scaled;
-        dst_line += dst_stride;
     }
 
     return dst;
@@ -95,29 +200,25 @@ static GrayImage scaleUpIntGrayToGray(GrayImage const& src, QSize const& dst_siz
 
     GrayImage dst(dst_size);
 
-    uint8_t const* src_line = src.data();
-    uint8_t* dst_line = dst.data();
+    uint8_t const* const src_data = src.data();
+    uint8_t* const dst_data = dst.data();
     int const src_stride = src.stride();
     int const dst_stride = dst.stride();
-    int const dst_stride_scaled = dst_stride * yscale;
-
-    int dy = 0;
-    for (; dy < dh; dy += xscale) {
-        int sx = 0;
-        int dx = 0;
 
-        for (; dx < dw; ++sx, dx += xscale) {
-            uint8_t* pdst = dst_line + dx;
+    #pragma omp parallel for schedule(static)
+    for (int sy = 0; sy < sh; ++sy) {
+        uint8_t const* const src_line = src_data + sy * src_stride;
+        uint8_t* const dst_line = dst_data + sy * yscale * dst_stride;
 
-            for (int i = 0; i < yscale; ++i, pdst += dst_stride) {
-                for (int j = 0; j < xscale; ++j) {
-                    pdst[j] = src_line[sx];
-                }
-            }
+        uint8_t* pdst = dst_line;
+        for (int sx = 0; sx < sw; ++sx, pdst += xscale) {
+            memset(pdst, src_line[sx], xscale);
         }
 
-        src_line += src_stride;
-        dst_line += dst_stride_scaled;
+        // The rest of the lines are copies of the first one.
+        for (int i = 1; i < yscale; ++i) {
+            memcpy(dst_line + i * dst_stride, dst_line, dw);
+        }
     }
 
     return dst;
@@ -160,44 +261,55 @@ static GrayImage scaleUpGrayToGray(GrayImage const& src, QSize const& dst_size)
     double const dx2sx32 = calc32xRatio1(dw, sw);
     double const dy2sy32 = calc32xRatio1(dh, sh);
 
+    // Horizontal positions are the same for every line.
+    std::vector<int> sxs(dw);
+    std::vector<unsigned> right_fractions(dw);
+    for (int dx = 0; dx < dw; ++dx) {
+        int const sx32 = (int)(dx * dx2sx32);
+        sxs[dx] = sx32 >> 5;
+        right_fractions[dx] = sx32 & 31;
+        assert(sxs[dx] + 1 < sw); // calc32xRatio1() ensures that.
+    }
+
     GrayImage dst(dst_size);
 
     uint8_t const* const src_data = src.data();
-    uint8_t* dst_line = dst.data();
+    uint8_t* const dst_data = dst.data();
     int const src_stride = src.stride();
     int const dst_stride = dst.stride();
 
-    for (int dy = 0; dy < dh; ++dy, dst_line += dst_stride) {
-        int const sy32 = (int)(dy * dy2sy32);
-        int const sy = sy32 >> 5;
-        unsigned const top_fraction = 32 - (sy32 & 31);
-        unsigned const bottom_fraction = sy32 & 31;
-        assert(sy + 1 < sh); // calc32xRatio1() ensures that.
-
-        uint8_t const* src_line = src_data + sy * src_stride;
-
-        for (int dx = 0; dx < dw; ++dx) {
-            int const sx32 = (int)(dx * dx2sx32);
-            int const sx = sx32 >> 5;
-            unsigned const left_fraction = 32 - (sx32 & 31);
-            unsigned const right_fraction = sx32 & 31;
-            assert(sx + 1 < sw); // calc32xRatio1() ensures that.
-
-            unsigned gray_level = 0;
-
-            uint8_t const* psrc = src_line + sx;
-            gray_level += *psrc * left_fraction * top_fraction;
-            ++psrc;
-            gray_level += *psrc * right_fraction * top_fraction;
-            psrc += src_stride;
-            gray_level += *psrc * right_fraction * bottom_fraction;
-            --psrc;
-            gray_level += *psrc * left_fraction * bottom_fraction;
-
-            unsigned const total_area = 32 * 32;
-            unsigned const pix_value = (gray_level + (total_area >> 1)) / total_area;
-            assert(pix_value < 256);
-            dst_line[dx] = static_cast<uint8_t>(pix_value);
+    #pragma omp parallel
+    {
+        // Source lines interpolated vertically, in 1/32 units.
+        std::vector<unsigned> vert_mix(sw);
+
+        #pragma omp for schedule(static)
+        for (int dy = 0; dy < dh; ++dy) {
+            int const sy32 = (int)(dy * dy2sy32);
+            int const sy = sy32 >> 5;
+            unsigned const top_fraction = 32 - (sy32 & 31);
+            unsigned const bottom_fraction = sy32 & 31;
+            assert(sy + 1 < sh); // calc32xRatio1() ensures that.
+
+            uint8_t const* const src_line1 = src_data + sy * src_stride;
+            uint8_t const* const src_line2 = src_line1 + src_stride;
+            unsigned* const mix = &vert_mix[0];
+            for (int sx = 0; sx < sw; ++sx) {
+                mix[sx] = src_line1[sx] * top_fraction + src_line2[sx] * bottom_fraction;
+            }
+
+            uint8_t* const dst_line = dst_data + dy * dst_stride;
+            for (int dx = 0; dx < dw; ++dx) {
+                int const sx = sxs[dx];
+                unsigned const right_fraction = right_fractions[dx];
+                unsigned const left_fraction = 32 - right_fraction;
+                unsigned const gray_level = mix[sx] * left_fraction + mix[sx + 1] * right_fraction;
+
+                unsigned const total_area = 32 * 32;
+                unsigned const pix_value = (gray_level + (total_area >> 1)) / total_area;
+                assert(pix_value < 256);
+                dst_line[dx] = static_cast<uint8_t>(pix_value);
+            }
         }
     }
 
@@ -228,6 +340,10 @@ static double calc32xRatio2(int const dst, int const src)
 
 /**
  * This is a generic implementation of the scaling algorithm.
+ *
+ * The weight of a source pixel in a destination pixel is a product of
+ * its horizontal and vertical coverage, so we first mix every source
+ * column vertically, and then mix the resulting line horizontally.
  */
 static GrayImage scaleGrayToGray(GrayImage const& src, QSize const& dst_size)
 {
@@ -250,129 +366,88 @@ static GrayImage scaleGrayToGray(GrayImage const& src, QSize const& dst_size)
     double const dx2sx32 = calc32xRatio2(dw, sw);
     double const dy2sy32 = calc32xRatio2(dh, sh);
 
+    // Horizontal spans are the same for every line.
+    std::vector<int> sx32lefts(dw + 1);
+    for (int dx = 0; dx <= dw; ++dx) {
+        sx32lefts[dx] = (int)(dx * dx2sx32);
+    }
+    assert(((sx32lefts[dw] - 1) >> 5) < sw); // calc32xRatio2() ensures that.
+
     GrayImage dst(dst_size);
 
     uint8_t const* const src_data = src.data();
-    uint8_t* dst_line = dst.data();
+    uint8_t* const dst_data = dst.data();
     int const src_stride = src.stride();
     int const dst_stride = dst.stride();
 
-    int sy32bottom = 0;
-    for (int dy1 = 1; dy1 <= dh; ++dy1, dst_line += dst_stride) {
-        int const sy32top = sy32bottom;
-        sy32bottom = (int)(dy1 * dy2sy32);
-        int const sytop = sy32top >> 5;
-        int const sybottom = (sy32bottom - 1) >> 5;
-        unsigned const top_fraction = 32 - (sy32top & 31);
-        unsigned const bottom_fraction = sy32bottom - (sybottom << 5);
-        assert(sybottom < sh); // calc32xRatio2() ensures that.
-
-        unsigned const top_area = top_fraction << 5;
-        unsigned const bottom_area = bottom_fraction << 5;
-
-        uint8_t const* const src_line_const = src_data + sytop * src_stride;
-
-        int sx32right = 0;
-        for (int dx = 0; dx < dw; ++dx) {
-            int const sx32left = sx32right;
-            sx32right = (int)((dx + 1) * dx2sx32);
-            int const sxleft = sx32left >> 5;
-            int const sxright = (sx32right - 1) >> 5;
-            unsigned const left_fraction = 32 - (sx32left & 31);
-            unsigned const right_fraction = sx32right - (sxright << 5);
-            assert(sxright < sw); // calc32xRatio2() ensures that.
-
-            uint8_t const* src_line = src_line_const;
-            unsigned gray_level = 0;
-
-            if (sytop == sybottom) {
-                if (sxleft == sxright) {
-                    // dst pixel maps to a single src pixel
-                    dst_line[dx] = src_line[sxleft];
-                    continue;
-                } else {
-                    // dst pixel maps to a horizontal line of src pixels
-                    unsigned const vert_fraction = sy32bottom - sy32top;
-                    unsigned const left_area = vert_fraction * left_fraction;
-                    unsigned const middle_area = vert_fraction << 5;
-                    unsigned const right_area = vert_fraction * right_fraction;
+    #pragma omp parallel
+    {
+        // Source columns mixed vertically.
+        std::vector<unsigned> vert_mix(sw);
 
-                    gray_level += src_line[sxleft] * left_area;
+        #pragma omp for schedule(static)
+        for (int dy = 0; dy < dh; ++dy) {
+            int const sy32top = (int)(dy * dy2sy32);
+            int const sy32bottom = (int)((dy + 1) * dy2sy32);
+            int const sytop = sy32top >> 5;
+            int const sybottom = (sy32bottom - 1) >> 5;
+            assert(sybottom < sh); // calc32xRatio2() ensures that.
 
-                    for (int sx = sxleft + 1; sx < sxright; ++sx) {
-                        gray_level += src_line[sx] * middle_area;
-                    }
+            unsigned* const mix = &vert_mix[0];
+            uint8_t const* src_line = src_data + sytop * src_stride;
 
-                    gray_level += src_line[sxright] * right_area;
+            if (sytop == sybottom) {
+                unsigned const vert_fraction = sy32bottom - sy32top;
+                for (int sx = 0; sx < sw; ++sx) {
+                    mix[sx] = src_line[sx] * vert_fraction;
                 }
-            } else if (sxleft == sxright) {
-                // dst pixel maps to a vertical line of src pixels
-                unsigned const hor_fraction = sx32right - sx32left;
-                unsigned const top_area = hor_fraction * top_fraction;
-                unsigned const middle_area = hor_fraction << 5;
-                unsigned const bottom_area =  hor_fraction * bottom_fraction;
-
-                gray_level += src_line[sxleft] * top_area;
+            } else {
+                unsigned const top_fraction = 32 - (sy32top & 31);
+                unsigned const bottom_fraction = sy32bottom - (sybottom << 5);
 
+                for (int sx = 0; sx < sw; ++sx) {
+                    mix[sx] = src_line[sx] * top_fraction;
+                }
                 src_line += src_stride;
 
                 for (int sy = sytop + 1; sy < sybottom; ++sy) {
-                    gray_level += src_line[sxleft] * middle_area;
+                    for (int sx = 0; sx < sw; ++sx) {
+                        mix[sx] += src_line[sx] << 5;
+                    }
                     src_line += src_stride;
                 }
 
-                gray_level += src_line[sxleft] * bottom_area;
-            } else {
-                // dst pixel maps to a block of src pixels
-                unsigned const left_area = left_fraction << 5;
-                unsigned const right_area = right_fraction << 5;
-                unsigned const topleft_area = top_fraction * left_fraction;
-                unsigned const topright_area = top_fraction * right_fraction;
-                unsigned const bottomleft_area = bottom_fraction * left_fraction;
-                unsigned const bottomright_area = bottom_fraction * right_fraction;
-
-                // process the top-left corner
-                gray_level += src_line[sxleft] * topleft_area;
-
-                // process the top line (without corners)
-                for (int sx = sxleft + 1; sx < sxright; ++sx) {
-                    gray_level += src_line[sx] * top_area;
+                for (int sx = 0; sx < sw; ++sx) {
+                    mix[sx] += src_line[sx] * bottom_fraction;
                 }
+            }
 
-                // process the top-right corner
-                gray_level += src_line[sxright] * topright_area;
+            uint8_t* const dst_line = dst_data + dy * dst_stride;
+            for (int dx = 0; dx < dw; ++dx) {
+                int const sx32left = sx32lefts[dx];
+                int const sx32right = sx32lefts[dx + 1];
+                int const sxleft = sx32left >> 5;
+                int const sxright = (sx32right - 1) >> 5;
 
-                src_line += src_stride;
-
-                // process middle lines
-                for (int sy = sytop + 1; sy < sybottom; ++sy) {
-                    gray_level += src_line[sxleft] * left_area;
+                unsigned gray_level;
+                if (sxleft == sxright) {
+                    gray_level = mix[sxleft] * (sx32right - sx32left);
+                } else {
+                    unsigned const left_fraction = 32 - (sx32left & 31);
+                    unsigned const right_fraction = sx32right - (sxright << 5);
 
+                    gray_level = mix[sxleft] * left_fraction;
                     for (int sx = sxleft + 1; sx < sxright; ++sx) {
-                        gray_level += src_line[sx] << (5 + 5);
+                        gray_level += mix[sx] << 5;
                     }
-
-                    gray_level += src_line[sxright] * right_area;
-
-                    src_line += src_stride;
+                    gray_level += mix[sxright] * right_fraction;
                 }
 
-                // process bottom-left corner
-                gray_level += src_line[sxleft] * bottomleft_area;
-
-                // process the bottom line (without corners)
-                for (int sx = sxleft + 1; sx < sxright; ++sx) {
-                    gray_level += src_line[sx] * bottom_area;
-                }
-
-                // process the bottom-right corner
-                gray_level += src_line[sxright] * bottomright_area;
+                unsigned const total_area = (sy32bottom - sy32top) * (sx32right - sx32left);
+                unsigned const pix_value = (gray_level + (total_area >> 1)) / total_area;
+                assert(pix_value < 256);
+                dst_line[dx] = static_cast<uint8_t>(pix_value);
             }
-
-            unsigned const total_area = (sy32bottom - sy32top) * (sx32right - sx32left);
-            unsigned const pix_value = (gray_level + (total_area >> 1)) / total_area;
-            assert(pix_value < 256);
-            dst_line[dx] = static_cast<uint8_t>(pix_value);
         }
     }
 
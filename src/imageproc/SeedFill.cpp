@@ -28,6 +28,9 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace imageproc
 {
@@ -35,20 +38,36 @@ namespace imageproc
 namespace
 {
 
+/**
+ * Spreads the bits of \p word over the whole runs of ones in \p mask
+ * they belong to.  \p word must be a subset of \p mask.
+ */
 inline uint32_t fillWordHorizontally(uint32_t word, uint32_t const mask)
 {
-    uint32_t prev_word;
-
-    do {
-        prev_word = word;
-        word |= (word << 1) | (word >> 1);
-        word &= mask;
-    } while (word != prev_word);
-
-    return word;
+    // Spread towards the least significant bit with Kogge-Stone
+    // style doubling steps.
+    uint32_t propagate = mask;
+    word |= propagate & (word >> 1);
+    propagate &= propagate >> 1;
+    word |= propagate & (word >> 2);
+    propagate &= propagate >> 2;
+    word |= propagate & (word >> 4);
+    propagate &= propagate >> 4;
+    word |= propagate & (word >> 8);
+    propagate &= propagate >> 8;
+    word |= propagate & (word >> 16);
+
+    // Now every seeded run has its least significant bit set.  Adding
+    // such a word to the mask makes a carry that travels from there
+    // to the most significant bit of the run, flipping everything
+    // on the way.
+    return mask & (((mask + word) ^ mask) | word);
 }
 
-void seedFill4Iteration(BinaryImage& seed, BinaryImage const& mask)
+/**
+ * \return true if \p seed was modified.
+ */
+bool seedFill4Iteration(BinaryImage& seed, BinaryImage const& mask)
 {
     int const w = seed.width();
     int const h = seed.height();
@@ -62,6 +81,8 @@ void seedFill4Iteration(BinaryImage& seed, BinaryImage const& mask)
     uint32_t const* mask_line = mask.data();
     uint32_t const* prev_line = seed_line;
 
+    uint32_t modified = 0;
+
     // Top to bottom.
     for (int y = 0; y < h; ++y) {
         uint32_t prev_word = 0;
@@ -69,22 +90,21 @@ void seedFill4Iteration(BinaryImage& seed, BinaryImage const& mask)
         // Make sure offscreen bits are 0.
         seed_line[last_word_idx] &= last_word_mask;
 
-        // Left to right (except the last word).
+        // Left to right.
         for (int i = 0; i <= last_word_idx; ++i) {
-            uint32_t const mask = mask_line[i];
+            uint32_t mask = mask_line[i];
+            if (i == last_word_idx) {
+                mask &= last_word_mask;
+            }
             uint32_t word = prev_word << 31;
             word |= seed_line[i] | prev_line[i];
             word &= mask;
             word = fillWordHorizontally(word, mask);
+            modified |= seed_line[i] ^ word;
             seed_line[i] = word;
             prev_word = word;
         }
 
-        // If we don't do this, prev_line[last_word_idx] on the next
-        // iteration may contain garbage in the off-screen area.
-        // That garbage can easily leak back.
-        seed_line[last_word_idx] &= last_word_mask;
-
         prev_line = seed_line;
         seed_line += seed_wpl;
         mask_line += mask_wpl;
@@ -103,29 +123,31 @@ void seedFill4Iteration(BinaryImage& seed, BinaryImage const& mask)
 
         // Right to left.
         for (int i = last_word_idx; i >= 0; --i) {
-            uint32_t const mask = mask_line[i];
+            uint32_t mask = mask_line[i];
+            if (i == last_word_idx) {
+                mask &= last_word_mask;
+            }
             uint32_t word = prev_word >> 31;
             word |= seed_line[i] | prev_line[i];
             word &= mask;
             word = fillWordHorizontally(word, mask);
+            modified |= seed_line[i] ^ word;
             seed_line[i] = word;
             prev_word = word;
         }
 
-        // If we don't do this, prev_line[last_word_idx] on the next
-        // iteration may contain garbage in the off-screen area.
-        // That garbage can easily leak back.
-        // Fortunately, garbage can't spread through prev_word,
-        // as only 1 bit is used from it, which can't be garbage.
-        seed_line[last_word_idx] &= last_word_mask;
-
         prev_line = seed_line;
         seed_line -= seed_wpl;
         mask_line -= mask_wpl;
     }
+
+    return modified != 0;
 }
 
-void seedFill8Iteration(BinaryImage& seed, BinaryImage const& mask)
+/**
+ * \return true if \p seed was modified.
+ */
+bool seedFill8Iteration(BinaryImage& seed, BinaryImage const& mask)
 {
     int const w = seed.width();
     int const h = seed.height();
@@ -148,9 +170,12 @@ void seedFill8Iteration(BinaryImage& seed, BinaryImage const& mask)
         seed_line[i] &= mask_line[i];
     }
 
+    uint32_t modified = 0;
+
     // Top to bottom.
     for (int y = 0; y < h; ++y) {
         uint32_t prev_word = 0;
+        uint32_t prev_word_above = 0;
 
         // Make sure offscreen bits area 0.
         seed_line[last_word_idx] &= last_word_mask;
@@ -163,9 +188,11 @@ void seedFill8Iteration(BinaryImage& seed, BinaryImage const& mask)
             word |= (word << 1) | (word >> 1);
             word |= seed_line[i];
             word |= prev_line[i + 1] >> 31;
-            word |= prev_word << 31;
+            word |= (prev_word | prev_word_above) << 31;
+            prev_word_above = prev_line[i];
             word &= mask;
             word = fillWordHorizontally(word, mask);
+            modified |= seed_line[i] ^ word;
             seed_line[i] = word;
             prev_word = word;
         }
@@ -175,9 +202,10 @@ void seedFill8Iteration(BinaryImage& seed, BinaryImage const& mask)
         uint32_t word = prev_line[i];
         word |= (word << 1) | (word >> 1);
         word |= seed_line[i];
-        word |= prev_word << 31;
+        word |= (prev_word | prev_word_above) << 31;
         word &= mask;
         word = fillWordHorizontally(word, mask);
+        modified |= seed_line[i] ^ word;
         seed_line[i] = word;
 
         prev_line = seed_line;
@@ -192,46 +220,51 @@ void seedFill8Iteration(BinaryImage& seed, BinaryImage const& mask)
     // Bottom to top.
     for (int y = h - 1; y >= 0; --y) {
         uint32_t prev_word = 0;
+        uint32_t prev_word_below = 0;
 
         // Make sure offscreen bits area 0.
         seed_line[last_word_idx] &= last_word_mask;
 
-        // Right to left (except the last word).
+        // Right to left (except the first word).
         int i = last_word_idx;
         for (; i > 0; --i) {
-            uint32_t const mask = mask_line[i];
+            uint32_t mask = mask_line[i];
+            if (i == last_word_idx) {
+                mask &= last_word_mask;
+            }
             uint32_t word = prev_line[i];
             word |= (word << 1) | (word >> 1);
             word |= seed_line[i];
             word |= prev_line[i - 1] << 31;
-            word |= prev_word >> 31;
+            word |= (prev_word | prev_word_below) >> 31;
+            prev_word_below = prev_line[i];
             word &= mask;
             word = fillWordHorizontally(word, mask);
+            modified |= seed_line[i] ^ word;
             seed_line[i] = word;
             prev_word = word;
         }
 
-        // Last word.
-        uint32_t const mask = mask_line[i];
+        // First word.
+        uint32_t mask = mask_line[i];
+        if (i == last_word_idx) {
+            mask &= last_word_mask;
+        }
         uint32_t word = prev_line[i];
         word |= (word << 1) | (word >> 1);
         word |= seed_line[i];
-        word |= prev_word >> 31;
+        word |= (prev_word | prev_word_below) >> 31;
         word &= mask;
         word = fillWordHorizontally(word, mask);
+        modified |= seed_line[i] ^ word;
         seed_line[i] = word;
 
-        // If we don't do this, prev_line[last_word_idx] on the next
-        // iteration may contain garbage in the off-screen area.
-        // That garbage can easily leak back.
-        // Fortunately, garbage can't spread through prev_word,
-        // as only 1 bit is used from it, which can't be garbage.
-        seed_line[last_word_idx] &= last_word_mask;
-
         prev_line = seed_line;
         seed_line -= seed_wpl;
         mask_line -= mask_wpl;
     }
+
+    return modified != 0;
 }
 
 inline uint8_t lightest(uint8_t lhs, uint8_t rhs)
@@ -244,6 +277,284 @@ inline uint8_t darkest(uint8_t lhs, uint8_t rhs)
     return lhs < rhs ? lhs : rhs;
 }
 
+/**
+ * Rows per band in seedFillGrayInPlace().  Bands are filled in parallel,
+ * and then reconciled along their seams.
+ */
+int const GRAY_FILL_BAND_HEIGHT = 128;
+
+typedef detail::seed_fill_generic::Position<uint8_t> GrayPosition;
+
+void clampToMask(uint8_t* seed, uint8_t const* mask, int const width)
+{
+    int x = 0;
+#ifdef __SSE2__
+    for (; x + 16 <= width; x += 16) {
+        __m128i const s = _mm_loadu_si128(reinterpret_cast<__m128i const*>(seed + x));
+        __m128i const m = _mm_loadu_si128(reinterpret_cast<__m128i const*>(mask + x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(seed + x), _mm_max_epu8(s, m));
+    }
+#endif
+    for (; x < width; ++x) {
+        seed[x] = lightest(seed[x], mask[x]);
+    }
+}
+
+/**
+ * The vertical part of a raster or anti-raster step: spreads values from
+ * an adjacent, already processed line of seed.
+ */
+void spreadFromLine4(
+    uint8_t* seed, uint8_t const* adj, uint8_t const* mask, int const width)
+{
+    int x = 0;
+#ifdef __SSE2__
+    for (; x + 16 <= width; x += 16) {
+        __m128i const s = _mm_loadu_si128(reinterpret_cast<__m128i const*>(seed + x));
+        __m128i const a = _mm_loadu_si128(reinterpret_cast<__m128i const*>(adj + x));
+        __m128i const m = _mm_loadu_si128(reinterpret_cast<__m128i const*>(mask + x));
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i*>(seed + x), _mm_max_epu8(m, _mm_min_epu8(s, a))
+        );
+    }
+#endif
+    for (; x < width; ++x) {
+        seed[x] = lightest(mask[x], darkest(seed[x], adj[x]));
+    }
+}
+
+/**
+ * Same as spreadFromLine4(), but diagonal neighbors are taken into account.
+ */
+void spreadFromLine8(
+    uint8_t* seed, uint8_t const* adj, uint8_t const* mask, int const width)
+{
+    if (width == 1) {
+        spreadFromLine4(seed, adj, mask, width);
+        return;
+    }
+
+    int const last = width - 1;
+
+    seed[0] = lightest(mask[0], darkest(seed[0], darkest(adj[0], adj[1])));
+
+    int x = 1;
+#ifdef __SSE2__
+    for (; x + 16 <= last; x += 16) {
+        __m128i const s = _mm_loadu_si128(reinterpret_cast<__m128i const*>(seed + x));
+        __m128i const m = _mm_loadu_si128(reinterpret_cast<__m128i const*>(mask + x));
+        __m128i a = _mm_loadu_si128(reinterpret_cast<__m128i const*>(adj + x - 1));
+        a = _mm_min_epu8(a, _mm_loadu_si128(reinterpret_cast<__m128i const*>(adj + x)));
+        a = _mm_min_epu8(a, _mm_loadu_si128(reinterpret_cast<__m128i const*>(adj + x + 1)));
+        _mm_storeu_si128(
+            reinterpret_cast<__m128i*>(seed + x), _mm_max_epu8(m, _mm_min_epu8(s, a))
+        );
+    }
+#endif
+    for (; x < last; ++x) {
+        seed[x] = lightest(
+                      mask[x],
+                      darkest(seed[x], darkest(darkest(adj[x - 1], adj[x]), adj[x + 1]))
+                  );
+    }
+
+    seed[last] = lightest(
+                     mask[last], darkest(seed[last], darkest(adj[last - 1], adj[last]))
+                 );
+}
+
+void spreadFromLine(
+    Connectivity const conn,
+    uint8_t* seed, uint8_t const* adj, uint8_t const* mask, int const width)
+{
+    if (conn == CONN4) {
+        spreadFromLine4(seed, adj, mask, width);
+    } else {
+        spreadFromLine8(seed, adj, mask, width);
+    }
+}
+
+/**
+ * Processes a neighbor of a pixel that has just become darker, and queues
+ * the neighbor if it becomes darker as well.
+ */
+inline void spreadToNeighbor(
+    FastQueue<GrayPosition>& queue, uint8_t const this_val,
+    uint8_t* seed, uint8_t const* mask, int const x, int const y)
+{
+    uint8_t const new_val = lightest(*mask, darkest(this_val, *seed));
+    if (new_val != *seed) {
+        *seed = new_val;
+        queue.push(GrayPosition(seed, mask, x, y));
+    }
+}
+
+/**
+ * Queues the neighbors that can be improved by the pixels of a line that
+ * have changed on the anti-raster pass.  Only eastern and southern neighbors
+ * are considered, as the others haven't been processed yet.
+ */
+void queueChangedPixels(
+    Connectivity const conn, FastQueue<GrayPosition>& queue,
+    uint8_t const* before, uint8_t* seed_line, int const seed_stride,
+    uint8_t const* mask_line, int const mask_stride,
+    int const width, int const y, bool const have_next_line)
+{
+    int x = 0;
+    while (x < width) {
+#ifdef __SSE2__
+        if (x + 16 <= width) {
+            __m128i const b = _mm_loadu_si128(reinterpret_cast<__m128i const*>(before + x));
+            __m128i const s = _mm_loadu_si128(reinterpret_cast<__m128i const*>(seed_line + x));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(b, s)) == 0xffff) {
+                x += 16;
+                continue;
+            }
+        }
+#endif
+        uint8_t const val = seed_line[x];
+        if (val != before[x]) {
+            if (x + 1 < width) {
+                spreadToNeighbor(queue, val, seed_line + x + 1, mask_line + x + 1, x + 1, y);
+            }
+            if (have_next_line) {
+                uint8_t* const south_seed = seed_line + seed_stride + x;
+                uint8_t const* const south_mask = mask_line + mask_stride + x;
+                spreadToNeighbor(queue, val, south_seed, south_mask, x, y + 1);
+                if (conn == CONN8) {
+                    if (x > 0) {
+                        spreadToNeighbor(queue, val, south_seed - 1, south_mask - 1, x - 1, y + 1);
+                    }
+                    if (x + 1 < width) {
+                        spreadToNeighbor(queue, val, south_seed + 1, south_mask + 1, x + 1, y + 1);
+                    }
+                }
+            }
+        }
+        ++x;
+    }
+}
+
+void spreadQueue(
+    Connectivity const conn, FastQueue<GrayPosition>& queue,
+    int const width, int const height, int const seed_stride, int const mask_stride)
+{
+    using namespace detail::seed_fill_generic;
+
+    std::vector<HTransition> h_transitions;
+    std::vector<VTransition> v_transitions;
+    initHorTransitions(h_transitions, width);
+    initVertTransitions(v_transitions, height);
+
+    if (conn == CONN4) {
+        spread4(
+            &darkest, &lightest, queue, &h_transitions[0],
+            &v_transitions[0], seed_stride, mask_stride
+        );
+    } else {
+        spread8(
+            &darkest, &lightest, queue, &h_transitions[0],
+            &v_transitions[0], seed_stride, mask_stride
+        );
+    }
+}
+
+/**
+ * Luc Vincent's hybrid grayscale reconstruction, restricted to a band of
+ * lines.  Raster and anti-raster passes are split into a vertical step
+ * that works on whole lines at once, and a horizontal recurrence.
+ * Only pixels that remain unstable after both passes go through the queue.
+ */
+void seedFillGrayBand(
+    Connectivity const conn,
+    uint8_t* const seed, int const seed_stride,
+    uint8_t const* const mask, int const mask_stride,
+    int const width, int const height)
+{
+    uint8_t* seed_line = seed;
+    uint8_t const* mask_line = mask;
+
+    // Top to bottom.
+    for (int y = 0; y < height; ++y) {
+        if (y == 0) {
+            clampToMask(seed_line, mask_line, width);
+        } else {
+            spreadFromLine(conn, seed_line, seed_line - seed_stride, mask_line, width);
+        }
+
+        // Left to right.
+        uint8_t prev = seed_line[0];
+        for (int x = 1; x < width; ++x) {
+            prev = lightest(mask_line[x], darkest(seed_line[x], prev));
+            seed_line[x] = prev;
+        }
+
+        seed_line += seed_stride;
+        mask_line += mask_stride;
+    }
+
+    seed_line -= seed_stride;
+    mask_line -= mask_stride;
+
+    FastQueue<GrayPosition> queue;
+    std::vector<uint8_t> before(width);
+
+    // Bottom to top.
+    for (int y = height - 1; y >= 0; --y) {
+        memcpy(&before[0], seed_line, width);
+
+        bool const have_next_line = y < height - 1;
+        if (have_next_line) {
+            spreadFromLine(conn, seed_line, seed_line + seed_stride, mask_line, width);
+        }
+
+        // Right to left.
+        uint8_t prev = seed_line[width - 1];
+        for (int x = width - 2; x >= 0; --x) {
+            prev = lightest(mask_line[x], darkest(seed_line[x], prev));
+            seed_line[x] = prev;
+        }
+
+        queueChangedPixels(
+            conn, queue, &before[0], seed_line, seed_stride,
+            mask_line, mask_stride, width, y, have_next_line
+        );
+
+        seed_line -= seed_stride;
+        mask_line -= mask_stride;
+    }
+
+    spreadQueue(conn, queue, width, height, seed_stride, mask_stride);
+}
+
+/**
+ * Spreads values from one line of seed to an adjacent one, which
+ * belongs to another band.  Pixels that change get queued.
+ */
+void spreadAcrossSeam(
+    Connectivity const conn, FastQueue<GrayPosition>& queue,
+    uint8_t const* from_line, uint8_t* to_line, uint8_t const* to_mask_line,
+    int const width, int const to_y)
+{
+    for (int x = 0; x < width; ++x) {
+        uint8_t val = from_line[x];
+        if (conn == CONN8) {
+            if (x > 0) {
+                val = darkest(val, from_line[x - 1]);
+            }
+            if (x + 1 < width) {
+                val = darkest(val, from_line[x + 1]);
+            }
+        }
+
+        uint8_t const new_val = lightest(to_mask_line[x], darkest(val, to_line[x]));
+        if (new_val != to_line[x]) {
+            to_line[x] = new_val;
+            queue.push(GrayPosition(to_line + x, to_mask_line + x, x, to_y));
+        }
+    }
+}
+
 void seedFillGrayHorLine(uint8_t* seed, uint8_t const* mask, int const line_len)
 {
     assert(line_len > 0);
@@ -499,17 +810,17 @@ BinaryImage seedFill(
         throw std::invalid_argument("seedFill: seed and mask have different sizes");
     }
 
-    BinaryImage prev;
     BinaryImage img(seed);
 
-    do {
-        prev = img;
-        if (connectivity == CONN4) {
-            seedFill4Iteration(img, mask);
-        } else {
-            seedFill8Iteration(img, mask);
+    if (connectivity == CONN4) {
+        while (seedFill4Iteration(img, mask)) {
+            // Continue until done.
+        }
+    } else {
+        while (seedFill8Iteration(img, mask)) {
+            // Continue until done.
         }
-    } while (img != prev);
+    }
 
     return img;
 }
@@ -533,11 +844,64 @@ void seedFillGrayInPlace(
         return;
     }
 
-    seedFillGenericInPlace(
-        &darkest, &lightest, connectivity,
-        seed.data(), seed.stride(), seed.size(),
-        mask.data(), mask.stride()
-    );
+    int const width = seed.width();
+    int const height = seed.height();
+    int const seed_stride = seed.stride();
+    int const mask_stride = mask.stride();
+    uint8_t* const seed_data = seed.data();
+    uint8_t const* const mask_data = mask.data();
+
+    int const num_bands = (height + GRAY_FILL_BAND_HEIGHT - 1) / GRAY_FILL_BAND_HEIGHT;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int band = 0; band < num_bands; ++band) {
+        int const y0 = band * GRAY_FILL_BAND_HEIGHT;
+        seedFillGrayBand(
+            connectivity,
+            seed_data + seed_stride * y0, seed_stride,
+            mask_data + mask_stride * y0, mask_stride,
+            width, std::min(GRAY_FILL_BAND_HEIGHT, height - y0)
+        );
+    }
+
+    // Each band is now filled on its own.  Spread values across the seams
+    // and propagate the changes inside the affected bands, until nothing
+    // changes anymore.
+    std::vector<FastQueue<GrayPosition> > queues(num_bands);
+    for (;;) {
+        bool changed = false;
+        for (int band = 1; band < num_bands; ++band) {
+            int const y = band * GRAY_FILL_BAND_HEIGHT;
+            uint8_t* const upper_seed = seed_data + seed_stride * (y - 1);
+            uint8_t* const lower_seed = upper_seed + seed_stride;
+            uint8_t const* const upper_mask = mask_data + mask_stride * (y - 1);
+            uint8_t const* const lower_mask = upper_mask + mask_stride;
+
+            spreadAcrossSeam(
+                connectivity, queues[band], upper_seed, lower_seed, lower_mask, width, 0
+            );
+            spreadAcrossSeam(
+                connectivity, queues[band - 1], lower_seed, upper_seed, upper_mask,
+                width, GRAY_FILL_BAND_HEIGHT - 1
+            );
+            changed |= !queues[band].empty() || !queues[band - 1].empty();
+        }
+
+        if (!changed) {
+            break;
+        }
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int band = 0; band < num_bands; ++band) {
+            if (!queues[band].empty()) {
+                int const y0 = band * GRAY_FILL_BAND_HEIGHT;
+                spreadQueue(
+                    connectivity, queues[band], width,
+                    std::min(GRAY_FILL_BAND_HEIGHT, height - y0), seed_stride, mask_stride
+                );
+            }
+        }
+    }
 }
 
 GrayImage seedFillGraySlow(
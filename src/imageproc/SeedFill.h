@@ -64,6 +64,9 @@ GrayImage seedFillGray(
 
 /**
  * \brief A faster, in-place version of seedFillGray().
+ *
+ * Horizontal bands of the image are filled in parallel, and then
+ * reconciled along their seams.
  */
 void seedFillGrayInPlace(
     GrayImage& seed, GrayImage const& mask, Connectivity connectivity);
@@ -17,18 +17,131 @@
 */
 
 #include "Shear.h"
-#include "RasterOp.h"
 #include "BinaryImage.h"
+#include "Constants.h"
 #include <QRect>
-#include <QPoint>
 #include <stdexcept>
+#include <algorithm>
+#include <vector>
 #include <math.h>
-#include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 
 namespace imageproc
 {
 
+namespace
+{
+
+/**
+ * \brief Calculates shift = floor(0.5 + shear * (i + 0.5 - origin))
+ *        for every line.
+ *
+ * The shift is accumulated line by line rather than calculated
+ * directly, as SkewFinder::process(RowProjections) relies on getting
+ * exactly the same shifts.
+ */
+std::vector<int> lineShifts(int const num_lines, double const shear, double const origin)
+{
+    std::vector<int> shifts(num_lines);
+    double shift = 0.5 + shear * (0.5 - origin);
+    for (int i = 0; i < num_lines; ++i) {
+        shifts[i] = (int)floor(shift);
+        shift += shear;
+    }
+    return shifts;
+}
+
+/**
+ * Returns true if every line would have a zero shift.
+ */
+bool noShift(int const num_lines, double const shear, double const origin)
+{
+    double const shift_begin = 0.5 + shear * (0.5 - origin);
+    double const shift_end = 0.5 + shear * (num_lines - 0.5 - origin);
+    if (floor(shift_begin) == floor(shift_end)) {
+        assert(floor(shift_begin) == 0);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * \brief Shifts a line of pixels to the right, or to the left
+ *        if shift is negative.
+ *
+ * Every destination word is assembled from two source words with
+ * a funnel shift.  Pixels coming from outside of the line take
+ * the background color.
+ */
+void shiftLine(
+    uint32_t const* const src, uint32_t* const dst, int const width,
+    int const shift, uint32_t const background)
+{
+    int const words = (width + 31) >> 5;
+    int const last_word = words - 1;
+
+    // Source bits past the width are replaced with the background.
+    uint32_t const last_word_mask = ~uint32_t(0) << (((words << 5) - width) & 31);
+    uint32_t const src_last_word = (src[last_word] & last_word_mask)
+                                   | (background & ~last_word_mask);
+
+    // Destination word i starts at source pixel 32 * (i + word_offset) + bit_offset.
+    int const src_x = -shift;
+    int const word_offset = src_x >= 0 ? src_x >> 5 : -((31 - src_x) >> 5);
+    int const bit_offset = src_x - word_offset * 32;
+
+    // Destination words in [begin, end) only read source words
+    // in [0, last_word), so don't need any checks.
+    int const begin = std::min(std::max(0, -word_offset), words);
+    int const end = std::max(std::min(words, last_word - 1 - word_offset), begin);
+
+    struct SrcWord
+    {
+        uint32_t const* src;
+        uint32_t last;
+        uint32_t background;
+        int last_word;
+
+        uint32_t operator()(int const idx) const
+        {
+            if (idx < 0 || idx > last_word) {
+                return background;
+            }
+            return idx == last_word ? last : src[idx];
+        }
+    };
+    SrcWord const src_word = { src, src_last_word, background, last_word };
+
+    if (bit_offset == 0) {
+        for (int i = 0; i < begin; ++i) {
+            dst[i] = src_word(i + word_offset);
+        }
+        for (int i = begin; i < end; ++i) {
+            dst[i] = src[i + word_offset];
+        }
+        for (int i = end; i < words; ++i) {
+            dst[i] = src_word(i + word_offset);
+        }
+    } else {
+        int const carry_shift = 32 - bit_offset;
+        for (int i = 0; i < begin; ++i) {
+            int const idx = i + word_offset;
+            dst[i] = (src_word(idx) << bit_offset) | (src_word(idx + 1) >> carry_shift);
+        }
+        uint32_t const* src_pos = src + begin + word_offset;
+        for (int i = begin; i < end; ++i, ++src_pos) {
+            dst[i] = (src_pos[0] << bit_offset) | (src_pos[1] >> carry_shift);
+        }
+        for (int i = end; i < words; ++i) {
+            int const idx = i + word_offset;
+            dst[i] = (src_word(idx) << bit_offset) | (src_word(idx + 1) >> carry_shift);
+        }
+    }
+}
+
+} // anonymous namespace
+
 void hShearFromTo(BinaryImage const& src, BinaryImage& dst, double const shear,
                   double const y_origin, BWColor const background_color)
 {
@@ -42,58 +155,29 @@ void hShearFromTo(BinaryImage const& src, BinaryImage& dst, double const shear,
     int const width = src.width();
     int const height = src.height();
 
-    // shift = floor(0.5 + shear * (y + 0.5 - y_origin));
-    double shift = 0.5 + shear * (0.5 - y_origin);
-    double const shift_end = 0.5 + shear * (height - 0.5 - y_origin);
-    int shift1 = (int)floor(shift);
-
-    if (shift1 == floor(shift_end)) {
-        assert(shift1 == 0);
+    if (noShift(height, shear, y_origin)) {
         dst = src;
         return;
     }
 
-    int shift2 = shift1;
-    int y1 = 0;
-    int y2 = 0;
-    for (;;) {
-        ++y2;
-        shift += shear;
-        shift2 = (int)floor(shift);
-        if (shift1 != shift2 || y2 == height) {
-            int const block_height = y2 - y1;
-            if (abs(shift1) >= width) {
-                // The shifted block would be completely off the image.
-                QRect const fr(0, y1, width, block_height);
-                dst.fill(fr, background_color);
-            } else if (shift1 < 0) {
-                // Shift to the left.
-                QRect const dr(0, y1, width + shift1, block_height);
-                QPoint const sp(-shift1, y1);
-                rasterOp<RopSrc>(dst, dr, src, sp);
-                QRect const fr(width + shift1, y1, -shift1, block_height);
-                dst.fill(fr, background_color);
-            } else if (shift1 > 0) {
-                // Shift to the right.
-                QRect const dr(shift1, y1, width - shift1, block_height);
-                QPoint const sp(0, y1);
-                rasterOp<RopSrc>(dst, dr, src, sp);
-                QRect const fr(0, y1, shift1, block_height);
-                dst.fill(fr, background_color);
-            } else {
-                // No shift, just copy.
-                QRect const dr(0, y1, width, block_height);
-                QPoint const sp(0, y1);
-                rasterOp<RopSrc>(dst, dr, src, sp);
-            }
+    if (&src == &dst) {
+        // shiftLine() doesn't work in place.
+        BinaryImage const src_copy(src);
+        hShearFromTo(src_copy, dst, shear, y_origin, background_color);
+        return;
+    }
 
-            if (y2 == height) {
-                break;
-            }
+    std::vector<int> const shifts(lineShifts(height, shear, y_origin));
+    uint32_t const background = background_color == BLACK ? ~uint32_t(0) : 0;
 
-            y1 = y2;
-            shift1 = shift2;
-        }
+    uint32_t* const dst_data = dst.data(); // never call dst.data() inside omp
+    uint32_t const* const src_data = src.data();
+    int const dst_wpl = dst.wordsPerLine();
+    int const src_wpl = src.wordsPerLine();
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; ++y) {
+        shiftLine(src_data + y * src_wpl, dst_data + y * dst_wpl, width, shifts[y], background);
     }
 }
 
@@ -110,57 +194,83 @@ void vShearFromTo(BinaryImage const& src, BinaryImage& dst, double const shear,
     int const width = src.width();
     int const height = src.height();
 
-    // shift = floor(0.5 + shear * (x + 0.5 - x_origin));
-    double shift = 0.5 + shear * (0.5 - x_origin);
-    double const shift_end = 0.5 + shear * (width - 0.5 - x_origin);
-    int shift1 = (int)floor(shift);
-
-    if (shift1 == floor(shift_end)) {
-        assert(shift1 == 0);
+    if (noShift(width, shear, x_origin)) {
         dst = src;
         return;
     }
 
-    int shift2 = shift1;
-    int x1 = 0;
-    int x2 = 0;
-    for (;;) {
-        ++x2;
-        shift += shear;
-        shift2 = (int)floor(shift);
-        if (shift1 != shift2 || x2 == width) {
-            int const block_width = x2 - x1;
-            if (abs(shift1) >= height) {
-                // The shifted block would be completely off the image.
-                QRect const fr(x1, 0, block_width, height);
-                dst.fill(fr, background_color);
-            } else if (shift1 < 0) {
-                // Shift upwards.
-                QRect const dr(x1, 0, block_width, height + shift1);
-                QPoint const sp(x1, -shift1);
-                rasterOp<RopSrc>(dst, dr, src, sp);
-                QRect const fr(x1, height + shift1, block_width, -shift1);
-                dst.fill(fr, background_color);
-            } else if (shift1 > 0) {
-                // Shift downwards.
-                QRect const dr(x1, shift1, block_width, height - shift1);
-                QPoint const sp(x1, 0);
-                rasterOp<RopSrc>(dst, dr, src, sp);
-                QRect const fr(x1, 0, block_width, shift1);
-                dst.fill(fr, background_color);
-            } else {
-                // No shift, just copy.
-                QRect const dr(x1, 0, block_width, height);
-                QPoint const sp(x1, 0);
-                rasterOp<RopSrc>(dst, dr, src, sp);
-            }
+    if (&src == &dst) {
+        // Columns are shifted vertically, so every line may read any other.
+        BinaryImage const src_copy(src);
+        vShearFromTo(src_copy, dst, shear, x_origin, background_color);
+        return;
+    }
 
-            if (x2 == width) {
-                break;
+    std::vector<int> const shifts(lineShifts(width, shear, x_origin));
+    uint32_t const background = background_color == BLACK ? ~uint32_t(0) : 0;
+
+    uint32_t* const dst_data = dst.data(); // never call dst.data() inside omp
+    uint32_t const* const src_data = src.data();
+    int const dst_wpl = dst.wordsPerLine();
+    int const src_wpl = src.wordsPerLine();
+
+    // Split every word into runs of columns having the same shift.
+    // With shears below 1/32, which is what deskewing deals with,
+    // a word has at most two runs.
+    struct ColumnRun
+    {
+        uint32_t mask;
+        int shift;
+        int offset; // Of the source word, relative to the destination line.
+    };
+    int const words = (width + 31) >> 5;
+    std::vector<ColumnRun> runs;
+    std::vector<int> first_run(words + 1);
+    for (int w = 0; w < words; ++w) {
+        first_run[w] = (int)runs.size();
+        int const x_end = std::min(width, (w + 1) << 5);
+        for (int x = w << 5; x < x_end;) {
+            int const shift = shifts[x];
+            uint32_t mask = 0;
+            for (; x < x_end && shifts[x] == shift; ++x) {
+                mask |= uint32_t(1) << (31 - (x & 31));
             }
+            ColumnRun const run = { mask, shift, w - shift * src_wpl };
+            runs.push_back(run);
+        }
+    }
+    first_run[words] = (int)runs.size();
 
-            x1 = x2;
-            shift1 = shift2;
+    // Lines in [safe_begin, safe_end) take all of their words from within the image.
+    int const min_shift = *std::min_element(shifts.begin(), shifts.end());
+    int const max_shift = *std::max_element(shifts.begin(), shifts.end());
+    int const safe_begin = std::max(0, max_shift);
+    int const safe_end = std::max(safe_begin, std::min(height, height + min_shift));
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; ++y) {
+        uint32_t* const dst_line = dst_data + y * dst_wpl;
+        if (y >= safe_begin && y < safe_end) {
+            uint32_t const* const src_line = src_data + y * src_wpl;
+            for (int w = 0; w < words; ++w) {
+                uint32_t word = 0;
+                for (int r = first_run[w]; r < first_run[w + 1]; ++r) {
+                    word |= src_line[runs[r].offset] & runs[r].mask;
+                }
+                dst_line[w] = word;
+            }
+        } else {
+            for (int w = 0; w < words; ++w) {
+                uint32_t word = 0;
+                for (int r = first_run[w]; r < first_run[w + 1]; ++r) {
+                    ColumnRun const& run = runs[r];
+                    int const src_y = y - run.shift;
+                    uint32_t const src_word = (src_y >= 0 && src_y < height)
+                                              ? src_data[src_y * src_wpl + w] : background;
+                    word |= src_word & run.mask;
+                }
+                dst_line[w] = word;
+            }
         }
     }
 }
@@ -197,4 +307,24 @@ void vShearInPlace(
     vShearFromTo(image, image, shear, x_origin, background_color);
 }
 
+BinaryImage rotateBinaryByShears(
+    BinaryImage const& src, double const angle_deg, BWColor const background_color)
+{
+    if (src.isNull()) {
+        throw std::invalid_argument("Can't rotate a null image");
+    }
+
+    // R = Sx(-tan(a / 2)) * Sy(sin(a)) * Sx(-tan(a / 2))
+    double const angle = angle_deg * constants::DEG2RAD;
+    double const h_shear = -tan(0.5 * angle);
+    double const v_shear = sin(angle);
+    double const x_center = 0.5 * src.width();
+    double const y_center = 0.5 * src.height();
+
+    BinaryImage dst(hShear(src, h_shear, y_center, background_color));
+    BinaryImage const tmp(vShear(dst, v_shear, x_center, background_color));
+    hShearFromTo(tmp, dst, h_shear, y_center, background_color);
+    return dst;
+}
+
 } // namespace imageproc
@@ -96,6 +96,24 @@ void vShearInPlace(
     BinaryImage& image, double shear,
     double x_origin, BWColor background_color);
 
+/**
+ * \brief Rotates an image around its center by three shears.
+ *
+ * The rotation is done as a horizontal, a vertical and another horizontal
+ * shear, with no interpolation, so the result stays bilevel.  Areas not
+ * represented in the source image get the background color.  The result
+ * has the same size as the source, so corners may get cut off.  This works
+ * best for small angles, like the ones deskewing deals with.
+ *
+ * \param src The source image.
+ * \param angle_deg The angle in degrees.  Positive angles rotate clockwise,
+ *        like QTransform::rotate() does with y pointing down.
+ * \param background_color The color used to fill areas not represented
+ *        in the source image.
+ */
+BinaryImage rotateBinaryByShears(
+    BinaryImage const& src, double angle_deg, BWColor background_color);
+
 } // namespace imageproc
 
 #endif
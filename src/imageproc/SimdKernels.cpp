@@ -0,0 +1,49 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C)  Joseph Artsimovich <joseph.artsimovich@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SimdKernels.h"
+#include "CpuFeatures.h"
+
+namespace imageproc
+{
+
+namespace
+{
+
+SimdKernels const& selectKernels(CpuFeatures::Level const level)
+{
+    switch (level) {
+        case CpuFeatures::AVX2:
+            return simd_avx2::kernels;
+        case CpuFeatures::SSE42:
+            return simd_sse42::kernels;
+        case CpuFeatures::BASELINE:
+            break;
+    }
+    return simd_baseline::kernels;
+}
+
+} // anonymous namespace
+
+SimdKernels const& simdKernels()
+{
+    static SimdKernels const& kernels = selectKernels(CpuFeatures::level());
+    return kernels;
+}
+
+} // namespace imageproc
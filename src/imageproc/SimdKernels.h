@@ -0,0 +1,89 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C)  Joseph Artsimovich <joseph.artsimovich@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGEPROC_SIMD_KERNELS_H_
+#define IMAGEPROC_SIMD_KERNELS_H_
+
+#include <stdint.h>
+
+namespace imageproc
+{
+
+/**
+ * \brief Line kernels built once per instruction set level.
+ *
+ * SimdKernelsImpl.h is compiled by SimdKernelsBaseline.cpp,
+ * SimdKernelsSse42.cpp and SimdKernelsAvx2.cpp with different compiler
+ * flags.  simdKernels() picks the best table for CpuFeatures::level().
+ * This is an internal interface of imageproc.
+ */
+struct SimdKernels
+{
+    /**
+     * The name of the level the kernels were built for.
+     */
+    char const* name;
+
+    /**
+     * Converts RGB32 / ARGB32 pixels to gray levels, the way qGray() does.
+     */
+    void (*rgb32ToGrayLine)(uint32_t const* src, uint8_t* dst, int width);
+
+    /**
+     * Same as rgb32ToGrayLine(), for RGB888 pixels, that is R, G, B bytes.
+     */
+    void (*rgb888ToGrayLine)(uint8_t const* src, uint8_t* dst, int width);
+
+    /**
+     * Does the 2x2 reduction of ReduceThreshold for one output line.
+     * steps is the number of source words to process, threshold is 1 to 4.
+     */
+    void (*reduceThresholdLine)(
+        uint32_t const* top, uint32_t const* bottom, uint32_t* dst,
+        int steps, int threshold);
+
+    /**
+     * Does what binarizeFromMap() does for one line.  Pixels are black if
+     * src < lower_bound || (src <= upper_bound && src < threshold + delta).
+     * Bits past width in the last word of dst are cleared.
+     */
+    void (*binarizeLine)(
+        uint8_t const* src, uint8_t const* threshold, uint32_t* dst, int width,
+        uint8_t lower_bound, uint8_t upper_bound, int delta);
+};
+
+SimdKernels const& simdKernels();
+
+namespace simd_baseline
+{
+extern SimdKernels const kernels;
+}
+
+namespace simd_sse42
+{
+extern SimdKernels const kernels;
+}
+
+namespace simd_avx2
+{
+extern SimdKernels const kernels;
+}
+
+} // namespace imageproc
+
+#endif
@@ -0,0 +1,494 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C)  Joseph Artsimovich <joseph.artsimovich@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * This file is deliberately not protected by an include guard.  It is
+ * included by SimdKernelsBaseline.cpp, SimdKernelsSse42.cpp and
+ * SimdKernelsAvx2.cpp, each defining SIMD_KERNELS_NAMESPACE.  The build
+ * compiles the last two with -msse4.2 and -mavx2 -mbmi2 where the compiler
+ * and the target allow it.  Without these flags they produce the portable
+ * code and say so in SimdKernels::name.
+ *
+ * Only headers with no inline functions of their own may be included here,
+ * as instruction set specific copies of those could get picked by the linker
+ * for use outside of these files.
+ */
+
+#include "SimdKernels.h"
+#include <stdint.h>
+#if defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+namespace imageproc
+{
+
+namespace SIMD_KERNELS_NAMESPACE
+{
+
+namespace
+{
+
+#if defined(__AVX2__) && defined(__BMI2__)
+char const kernelsName[] = "avx2";
+#elif defined(__SSE4_2__)
+char const kernelsName[] = "sse4.2";
+#else
+char const kernelsName[] = "baseline";
+#endif
+
+/*============================ Grayscale ============================*/
+
+inline uint8_t grayFromRgb(uint32_t const rgb)
+{
+    // Same as qGray().
+    uint32_t const r = (rgb >> 16) & 0xff;
+    uint32_t const g = (rgb >> 8) & 0xff;
+    uint32_t const b = rgb & 0xff;
+    return static_cast<uint8_t>((r * 11 + g * 16 + b * 5) >> 5);
+}
+
+void rgb32ToGrayLine(uint32_t const* src, uint8_t* dst, int const width)
+{
+    int x = 0;
+
+#if defined(__AVX2__)
+    {
+        // Pixel bytes are B, G, R, A in memory.  maddubs turns them into
+        // (B * 5 + G * 16, R * 11) pairs, hadd sums the pairs up.
+        __m256i const weights = _mm256_set1_epi32(0x000b1005);
+        // Undoes the lane interleaving of hadd and packus.
+        __m256i const order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        for (; x + 32 <= width; x += 32) {
+            __m256i const p0 = _mm256_maddubs_epi16(
+                _mm256_loadu_si256((__m256i const*)(src + x)), weights);
+            __m256i const p1 = _mm256_maddubs_epi16(
+                _mm256_loadu_si256((__m256i const*)(src + x + 8)), weights);
+            __m256i const p2 = _mm256_maddubs_epi16(
+                _mm256_loadu_si256((__m256i const*)(src + x + 16)), weights);
+            __m256i const p3 = _mm256_maddubs_epi16(
+                _mm256_loadu_si256((__m256i const*)(src + x + 24)), weights);
+            __m256i const g01 = _mm256_srli_epi16(_mm256_hadd_epi16(p0, p1), 5);
+            __m256i const g23 = _mm256_srli_epi16(_mm256_hadd_epi16(p2, p3), 5);
+            __m256i const gray = _mm256_permutevar8x32_epi32(
+                _mm256_packus_epi16(g01, g23), order);
+            _mm256_storeu_si256((__m256i*)(dst + x), gray);
+        }
+    }
+#endif
+
+#if defined(__SSE4_2__)
+    {
+        __m128i const weights = _mm_set1_epi32(0x000b1005);
+        for (; x + 16 <= width; x += 16) {
+            __m128i const p0 = _mm_maddubs_epi16(
+                _mm_loadu_si128((__m128i const*)(src + x)), weights);
+            __m128i const p1 = _mm_maddubs_epi16(
+                _mm_loadu_si128((__m128i const*)(src + x + 4)), weights);
+            __m128i const p2 = _mm_maddubs_epi16(
+                _mm_loadu_si128((__m128i const*)(src + x + 8)), weights);
+            __m128i const p3 = _mm_maddubs_epi16(
+                _mm_loadu_si128((__m128i const*)(src + x + 12)), weights);
+            __m128i const g01 = _mm_srli_epi16(_mm_hadd_epi16(p0, p1), 5);
+            __m128i const g23 = _mm_srli_epi16(_mm_hadd_epi16(p2, p3), 5);
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(g01, g23));
+        }
+    }
+#endif
+
+    for (; x < width; ++x) {
+        dst[x] = grayFromRgb(src[x]);
+    }
+}
+
+void rgb888ToGrayLine(uint8_t const* src, uint8_t* dst, int const width)
+{
+    int x = 0;
+
+#if defined(__SSE4_2__)
+    // Spreads 4 pixels of 3 bytes over 4 dwords: R, G, B, 0.
+    __m128i const spread = _mm_setr_epi8(
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    __m128i const weights = _mm_set1_epi32(0x0005100b);
+#endif
+
+#if defined(__AVX2__)
+    {
+        __m256i const spread2 = _mm256_broadcastsi128_si256(spread);
+        __m256i const weights2 = _mm256_broadcastsi128_si256(weights);
+        __m256i const order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        // Each 16 byte load uses 12 bytes.  The last one reads 4 bytes
+        // past the 32 pixels, which must still be within the line.
+        for (; x + 34 <= width; x += 32) {
+            uint8_t const* const p = src + x * 3;
+            __m256i const p0 = _mm256_maddubs_epi16(_mm256_shuffle_epi8(
+                _mm256_inserti128_si256(_mm256_castsi128_si256(
+                    _mm_loadu_si128((__m128i const*)p)),
+                    _mm_loadu_si128((__m128i const*)(p + 12)), 1), spread2), weights2);
+            __m256i const p1 = _mm256_maddubs_epi16(_mm256_shuffle_epi8(
+                _mm256_inserti128_si256(_mm256_castsi128_si256(
+                    _mm_loadu_si128((__m128i const*)(p + 24))),
+                    _mm_loadu_si128((__m128i const*)(p + 36)), 1), spread2), weights2);
+            __m256i const p2 = _mm256_maddubs_epi16(_mm256_shuffle_epi8(
+                _mm256_inserti128_si256(_mm256_castsi128_si256(
+                    _mm_loadu_si128((__m128i const*)(p + 48))),
+                    _mm_loadu_si128((__m128i const*)(p + 60)), 1), spread2), weights2);
+            __m256i const p3 = _mm256_maddubs_epi16(_mm256_shuffle_epi8(
+                _mm256_inserti128_si256(_mm256_castsi128_si256(
+                    _mm_loadu_si128((__m128i const*)(p + 72))),
+                    _mm_loadu_si128((__m128i const*)(p + 84)), 1), spread2), weights2);
+            __m256i const g01 = _mm256_srli_epi16(_mm256_hadd_epi16(p0, p1), 5);
+            __m256i const g23 = _mm256_srli_epi16(_mm256_hadd_epi16(p2, p3), 5);
+            __m256i const gray = _mm256_permutevar8x32_epi32(
+                _mm256_packus_epi16(g01, g23), order);
+            _mm256_storeu_si256((__m256i*)(dst + x), gray);
+        }
+    }
+#endif
+
+#if defined(__SSE4_2__)
+    for (; x + 18 <= width; x += 16) {
+        uint8_t const* const p = src + x * 3;
+        __m128i const p0 = _mm_maddubs_epi16(
+            _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)p), spread), weights);
+        __m128i const p1 = _mm_maddubs_epi16(
+            _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(p + 12)), spread), weights);
+        __m128i const p2 = _mm_maddubs_epi16(
+            _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(p + 24)), spread), weights);
+        __m128i const p3 = _mm_maddubs_epi16(
+            _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(p + 36)), spread), weights);
+        __m128i const g01 = _mm_srli_epi16(_mm_hadd_epi16(p0, p1), 5);
+        __m128i const g23 = _mm_srli_epi16(_mm_hadd_epi16(p2, p3), 5);
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(g01, g23));
+    }
+#endif
+
+    for (; x < width; ++x) {
+        uint8_t const* const p = src + x * 3;
+        dst[x] = static_cast<uint8_t>((p[0] * 11 + p[1] * 16 + p[2] * 5) >> 5);
+    }
+}
+
+/*========================= ReduceThreshold =========================*/
+
+/**
+ * Takes bits 1, 3, 5, ..., 31 and packs them into the lower half of a word.
+ */
+inline uint32_t compressOddBits(uint32_t bits)
+{
+#if defined(__BMI2__)
+    return _pext_u32(bits, 0xAAAAAAAAu);
+#else
+    bits = (bits >> 1) & 0x55555555u;
+    bits = (bits | (bits >> 1)) & 0x33333333u;
+    bits = (bits | (bits >> 2)) & 0x0F0F0F0Fu;
+    bits = (bits | (bits >> 4)) & 0x00FF00FFu;
+    bits = (bits | (bits >> 8)) & 0x0000FFFFu;
+    return bits;
+#endif
+}
+
+#if defined(__SSE4_2__)
+inline __m128i compressOddBits(__m128i bits)
+{
+    bits = _mm_and_si128(_mm_srli_epi32(bits, 1), _mm_set1_epi32(0x55555555));
+    bits = _mm_and_si128(_mm_or_si128(bits, _mm_srli_epi32(bits, 1)), _mm_set1_epi32(0x33333333));
+    bits = _mm_and_si128(_mm_or_si128(bits, _mm_srli_epi32(bits, 2)), _mm_set1_epi32(0x0F0F0F0F));
+    bits = _mm_and_si128(_mm_or_si128(bits, _mm_srli_epi32(bits, 4)), _mm_set1_epi32(0x00FF00FF));
+    bits = _mm_and_si128(_mm_or_si128(bits, _mm_srli_epi32(bits, 8)), _mm_set1_epi32(0x0000FFFF));
+    return bits;
+}
+
+/**
+ * Given compressed words c0 .. c7, produces (c0 << 16) | c1, (c2 << 16) | c3 ...
+ */
+inline __m128i joinHalves(__m128i const c0123, __m128i const c4567)
+{
+    __m128i const packed = _mm_packus_epi32(c0123, c4567);
+    return _mm_or_si128(_mm_slli_epi32(packed, 16), _mm_srli_epi32(packed, 16));
+}
+#endif
+
+#if defined(__AVX2__)
+inline __m256i compressOddBits(__m256i bits)
+{
+    bits = _mm256_and_si256(_mm256_srli_epi32(bits, 1), _mm256_set1_epi32(0x55555555));
+    bits = _mm256_and_si256(_mm256_or_si256(bits, _mm256_srli_epi32(bits, 1)), _mm256_set1_epi32(0x33333333));
+    bits = _mm256_and_si256(_mm256_or_si256(bits, _mm256_srli_epi32(bits, 2)), _mm256_set1_epi32(0x0F0F0F0F));
+    bits = _mm256_and_si256(_mm256_or_si256(bits, _mm256_srli_epi32(bits, 4)), _mm256_set1_epi32(0x00FF00FF));
+    bits = _mm256_and_si256(_mm256_or_si256(bits, _mm256_srli_epi32(bits, 8)), _mm256_set1_epi32(0x0000FFFF));
+    return bits;
+}
+
+inline __m256i joinHalves(__m256i const c0to7, __m256i const c8to15)
+{
+    __m256i const packed = _mm256_permute4x64_epi64(
+        _mm256_packus_epi32(c0to7, c8to15), 0xD8 /* 0, 2, 1, 3 */);
+    return _mm256_or_si256(_mm256_slli_epi32(packed, 16), _mm256_srli_epi32(packed, 16));
+}
+#endif
+
+inline uint32_t bitOr(uint32_t const a, uint32_t const b) { return a | b; }
+inline uint32_t bitAnd(uint32_t const a, uint32_t const b) { return a & b; }
+inline uint32_t shiftLeft1(uint32_t const a) { return a << 1; }
+
+#if defined(__SSE4_2__)
+inline __m128i bitOr(__m128i const a, __m128i const b) { return _mm_or_si128(a, b); }
+inline __m128i bitAnd(__m128i const a, __m128i const b) { return _mm_and_si128(a, b); }
+inline __m128i shiftLeft1(__m128i const a) { return _mm_slli_epi32(a, 1); }
+#endif
+
+#if defined(__AVX2__)
+inline __m256i bitOr(__m256i const a, __m256i const b) { return _mm256_or_si256(a, b); }
+inline __m256i bitAnd(__m256i const a, __m256i const b) { return _mm256_and_si256(a, b); }
+inline __m256i shiftLeft1(__m256i const a) { return _mm256_slli_epi32(a, 1); }
+#endif
+
+/*
+ * Each ThresholdN class combines words from a pair of lines, leaving the
+ * result for each 2x2 block in the odd bit of a pair.  The block becomes
+ * black if it has at least N black pixels.
+ */
+
+struct Threshold1
+{
+    template<typename Word>
+    static Word apply(Word const top, Word const bottom)
+    {
+        Word const word = bitOr(top, bottom);
+        return bitOr(word, shiftLeft1(word));
+    }
+};
+
+struct Threshold2
+{
+    template<typename Word>
+    static Word apply(Word const top, Word const bottom)
+    {
+        Word const word1 = bitAnd(top, bottom);
+        Word const word2 = bitOr(top, bottom);
+        return bitOr(bitOr(word1, shiftLeft1(word1)), bitAnd(word2, shiftLeft1(word2)));
+    }
+};
+
+struct Threshold3
+{
+    template<typename Word>
+    static Word apply(Word const top, Word const bottom)
+    {
+        Word const word1 = bitOr(top, bottom);
+        Word const word2 = bitAnd(top, bottom);
+        return bitAnd(bitAnd(word1, shiftLeft1(word1)), bitOr(word2, shiftLeft1(word2)));
+    }
+};
+
+struct Threshold4
+{
+    template<typename Word>
+    static Word apply(Word const top, Word const bottom)
+    {
+        Word const word = bitAnd(top, bottom);
+        return bitAnd(word, shiftLeft1(word));
+    }
+};
+
+template<typename Op>
+void reduceLine(uint32_t const* top, uint32_t const* bottom, uint32_t* dst, int const steps)
+{
+    int j = 0;
+
+#if defined(__AVX2__)
+    for (; j + 16 <= steps; j += 16) {
+        __m256i const c0 = compressOddBits(Op::apply(
+            _mm256_loadu_si256((__m256i const*)(top + j)),
+            _mm256_loadu_si256((__m256i const*)(bottom + j))));
+        __m256i const c1 = compressOddBits(Op::apply(
+            _mm256_loadu_si256((__m256i const*)(top + j + 8)),
+            _mm256_loadu_si256((__m256i const*)(bottom + j + 8))));
+        _mm256_storeu_si256((__m256i*)(dst + (j >> 1)), joinHalves(c0, c1));
+    }
+#endif
+
+#if defined(__SSE4_2__)
+    for (; j + 8 <= steps; j += 8) {
+        __m128i const c0 = compressOddBits(Op::apply(
+            _mm_loadu_si128((__m128i const*)(top + j)),
+            _mm_loadu_si128((__m128i const*)(bottom + j))));
+        __m128i const c1 = compressOddBits(Op::apply(
+            _mm_loadu_si128((__m128i const*)(top + j + 4)),
+            _mm_loadu_si128((__m128i const*)(bottom + j + 4))));
+        _mm_storeu_si128((__m128i*)(dst + (j >> 1)), joinHalves(c0, c1));
+    }
+#endif
+
+    for (; j < steps; j += 2) {
+        uint32_t word = compressOddBits(Op::apply(top[j], bottom[j])) << 16;
+        if (j + 1 < steps) {
+            word |= compressOddBits(Op::apply(top[j + 1], bottom[j + 1]));
+        }
+        dst[j >> 1] = word;
+    }
+}
+
+void reduceThresholdLine(
+    uint32_t const* top, uint32_t const* bottom, uint32_t* dst,
+    int const steps, int const threshold)
+{
+    switch (threshold) {
+        case 1:
+            reduceLine<Threshold1>(top, bottom, dst, steps);
+            break;
+        case 2:
+            reduceLine<Threshold2>(top, bottom, dst, steps);
+            break;
+        case 3:
+            reduceLine<Threshold3>(top, bottom, dst, steps);
+            break;
+        default:
+            reduceLine<Threshold4>(top, bottom, dst, steps);
+            break;
+    }
+}
+
+/*============================ Binarize =============================*/
+
+#if defined(__SSE4_2__)
+/**
+ * Computes black pixel masks for 8 pixels in 16 bit lanes.
+ */
+inline __m128i blackMask(
+    __m128i const src, __m128i const threshold, __m128i const lower,
+    __m128i const upper, __m128i const delta)
+{
+    __m128i const below_lower = _mm_cmplt_epi16(src, lower);
+    __m128i const above_upper = _mm_cmpgt_epi16(src, upper);
+    __m128i const below_threshold = _mm_cmplt_epi16(src, _mm_add_epi16(threshold, delta));
+    return _mm_or_si128(below_lower, _mm_andnot_si128(above_upper, below_threshold));
+}
+#endif
+
+#if defined(__AVX2__)
+inline __m256i blackMask(
+    __m256i const src, __m256i const threshold, __m256i const lower,
+    __m256i const upper, __m256i const delta)
+{
+    __m256i const below_lower = _mm256_cmpgt_epi16(lower, src);
+    __m256i const above_upper = _mm256_cmpgt_epi16(src, upper);
+    __m256i const below_threshold = _mm256_cmpgt_epi16(_mm256_add_epi16(threshold, delta), src);
+    return _mm256_or_si256(below_lower, _mm256_andnot_si256(above_upper, below_threshold));
+}
+#endif
+
+void binarizeLine(
+    uint8_t const* src, uint8_t const* threshold, uint32_t* dst, int const width,
+    uint8_t const lower_bound, uint8_t const upper_bound, int delta)
+{
+    // Beyond these limits, the outcome of src < threshold + delta
+    // doesn't depend on src and threshold anymore.  Limiting delta
+    // lets the vector code do the sum in 16 bits.
+    if (delta > 256) {
+        delta = 256;
+    } else if (delta < -256) {
+        delta = -256;
+    }
+
+    int x = 0;
+
+#if defined(__AVX2__)
+    {
+        __m256i const lower = _mm256_set1_epi16(lower_bound);
+        __m256i const upper = _mm256_set1_epi16(upper_bound);
+        __m256i const delta16 = _mm256_set1_epi16(static_cast<short>(delta));
+        __m256i const reverse = _mm256_setr_epi8(
+            15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+            15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+        for (; x + 32 <= width; x += 32) {
+            __m256i const s = _mm256_loadu_si256((__m256i const*)(src + x));
+            __m256i const t = _mm256_loadu_si256((__m256i const*)(threshold + x));
+            __m256i const black0 = blackMask(
+                _mm256_cvtepu8_epi16(_mm256_castsi256_si128(s)),
+                _mm256_cvtepu8_epi16(_mm256_castsi256_si128(t)), lower, upper, delta16);
+            __m256i const black1 = blackMask(
+                _mm256_cvtepu8_epi16(_mm256_extracti128_si256(s, 1)),
+                _mm256_cvtepu8_epi16(_mm256_extracti128_si256(t, 1)), lower, upper, delta16);
+            // Bytes in pixel order, then reversed within each half,
+            // as the first pixel goes to the most significant bit.
+            __m256i const bytes = _mm256_shuffle_epi8(
+                _mm256_permute4x64_epi64(
+                    _mm256_packs_epi16(black0, black1), 0xD8 /* 0, 2, 1, 3 */), reverse);
+            uint32_t const bits = static_cast<uint32_t>(_mm256_movemask_epi8(bytes));
+            dst[x >> 5] = (bits << 16) | (bits >> 16);
+        }
+    }
+#endif
+
+#if defined(__SSE4_2__)
+    {
+        __m128i const lower = _mm_set1_epi16(lower_bound);
+        __m128i const upper = _mm_set1_epi16(upper_bound);
+        __m128i const delta16 = _mm_set1_epi16(static_cast<short>(delta));
+        __m128i const reverse = _mm_setr_epi8(
+            15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+        __m128i const zero = _mm_setzero_si128();
+        for (; x + 32 <= width; x += 32) {
+            uint32_t word = 0;
+            for (int half = 0; half < 2; ++half) {
+                __m128i const s = _mm_loadu_si128((__m128i const*)(src + x + half * 16));
+                __m128i const t = _mm_loadu_si128((__m128i const*)(threshold + x + half * 16));
+                __m128i const black0 = blackMask(
+                    _mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(t, zero),
+                    lower, upper, delta16);
+                __m128i const black1 = blackMask(
+                    _mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(t, zero),
+                    lower, upper, delta16);
+                __m128i const bytes = _mm_shuffle_epi8(_mm_packs_epi16(black0, black1), reverse);
+                word = (word << 16) | static_cast<uint32_t>(_mm_movemask_epi8(bytes));
+            }
+            dst[x >> 5] = word;
+        }
+    }
+#endif
+
+    int const lower = lower_bound;
+    int const upper = upper_bound;
+    for (; x < width; x += 32) {
+        int const end = (width - x < 32) ? width - x : 32;
+        uint32_t word = 0;
+        for (int i = 0; i < end; ++i) {
+            int const s = src[x + i];
+            if (s < lower || (s <= upper && s < int(threshold[x + i]) + delta)) {
+                word |= uint32_t(0x80000000) >> i;
+            }
+        }
+        dst[x >> 5] = word;
+    }
+}
+
+} // anonymous namespace
+
+extern SimdKernels const kernels = {
+    kernelsName,
+    &rgb32ToGrayLine,
+    &rgb888ToGrayLine,
+    &reduceThresholdLine,
+    &binarizeLine
+};
+
+} // namespace SIMD_KERNELS_NAMESPACE
+
+} // namespace imageproc
@@ -25,8 +25,12 @@
 #include "Constants.h"
 #include <QDebug>
 #include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <memory>
 #include <stdint.h>
 #include <math.h>
+#include <assert.h>
 
 namespace imageproc
 {
@@ -43,12 +47,96 @@ int const SkewFinder::DEFAULT_FINE_REDUCTION = 1;
 
 double const SkewFinder::LOW_SCORE = 1000.0;
 
+/**
+ * Per-row black pixel counts of an image, indexed by word, so that
+ * the number of black pixels in any horizontal span can be found
+ * in constant time.  This is all that's needed to build row
+ * projections of a vertically sheared image.
+ */
+class SkewFinder::RowProjections
+{
+public:
+    explicit RowProjections(BinaryImage const& image);
+
+    int width() const
+    {
+        return m_width;
+    }
+
+    int height() const
+    {
+        return m_height;
+    }
+
+    /**
+     * Returns the number of black pixels in [x1, x2) on line y.
+     */
+    int countBlackPixels(int y, int x1, int x2) const;
+private:
+    int m_width;
+    int m_height;
+    int m_wpl;
+    std::vector<uint32_t> m_words; // With padding bits cleared.
+    std::vector<int> m_prefixCounts; // m_wpl + 1 per line.
+};
+
+SkewFinder::RowProjections::RowProjections(BinaryImage const& image)
+    :   m_width(image.width()),
+        m_height(image.height()),
+        m_wpl(image.wordsPerLine()),
+        m_words(m_wpl * m_height),
+        m_prefixCounts((m_wpl + 1) * m_height)
+{
+    int const last_word_idx = (m_width - 1) >> 5;
+    uint32_t const last_word_mask = ~uint32_t(0) << (31 - ((m_width - 1) & 31));
+    uint32_t const* src_line = image.data();
+    int const src_wpl = image.wordsPerLine();
+
+    for (int y = 0; y < m_height; ++y, src_line += src_wpl) {
+        uint32_t* const line = &m_words[y * m_wpl];
+        int* const counts = &m_prefixCounts[y * (m_wpl + 1)];
+        int count = 0;
+        counts[0] = 0;
+        for (int i = 0; i < m_wpl; ++i) {
+            uint32_t word = 0;
+            if (i < last_word_idx) {
+                word = src_line[i];
+            } else if (i == last_word_idx) {
+                word = src_line[i] & last_word_mask;
+            }
+            line[i] = word;
+            count += countNonZeroBits(word);
+            counts[i + 1] = count;
+        }
+    }
+}
+
+inline int
+SkewFinder::RowProjections::countBlackPixels(int const y, int const x1, int const x2) const
+{
+    uint32_t const* const line = &m_words[y * m_wpl];
+    int const* const counts = &m_prefixCounts[y * (m_wpl + 1)];
+    int const first_word = x1 >> 5;
+    int const last_word = (x2 - 1) >> 5;
+
+    int count = counts[last_word + 1] - counts[first_word];
+
+    // Exclude pixels to the left of x1 and at or to the right of x2.
+    uint32_t const left_mask = ~(~uint32_t(0) >> (x1 & 31));
+    uint32_t const right_mask = ~uint32_t(0) >> 1 >> ((x2 - 1) & 31);
+    count -= countNonZeroBits(line[first_word] & left_mask);
+    count -= countNonZeroBits(line[last_word] & right_mask);
+
+    return count;
+}
+
 SkewFinder::SkewFinder()
     :   m_maxAngle(DEFAULT_MAX_ANGLE),
         m_accuracy(DEFAULT_ACCURACY),
         m_resolutionRatio(1.0),
         m_coarseReduction(DEFAULT_COARSE_REDUCTION),
-        m_fineReduction(DEFAULT_FINE_REDUCTION)
+        m_fineReduction(DEFAULT_FINE_REDUCTION),
+        m_projectionOnly(true)
 {
 }
 
@@ -94,6 +182,12 @@ SkewFinder::setResolutionRatio(double const ratio)
     m_resolutionRatio = ratio;
 }
 
+void
+SkewFinder::setProjectionOnly(bool const projection_only)
+{
+    m_projectionOnly = projection_only;
+}
+
 Skew
 SkewFinder::findSkew(BinaryImage const& image) const
 {
@@ -101,32 +195,45 @@ SkewFinder::findSkew(BinaryImage const& image) const
         throw std::invalid_argument("SkewFinder: null image was provided");
     }
 
-    ReduceThreshold coarse_reduced(image);
-    int const min_reduction = std::min(m_coarseReduction, m_fineReduction);
-    for (int i = 0; i < min_reduction; ++i) {
-        coarse_reduced.reduce(i == 0 ? 1 : 2);
+    // Both searches use levels of the same 1, 2, 2, ... reduction cascade.
+    std::vector<int> thresholds(std::max(m_coarseReduction, m_fineReduction), 2);
+    if (!thresholds.empty()) {
+        thresholds[0] = 1;
     }
+    std::vector<BinaryImage> const reduced(ReduceThreshold::pyramid(image, thresholds));
+    BinaryImage const& coarse_image = reduced[m_coarseReduction];
 
-    ReduceThreshold fine_reduced(coarse_reduced.image());
+    double const coarse_step = 1.0; // degrees
 
-    for (int i = min_reduction; i < m_coarseReduction; ++i) {
-        coarse_reduced.reduce(i == 0 ? 1 : 2);
+    std::vector<double> coarse_angles;
+    for (double angle = -m_maxAngle; angle <= m_maxAngle; angle += coarse_step) {
+        coarse_angles.push_back(angle);
     }
+    int const num_coarse_angles = coarse_angles.size();
 
-    BinaryImage skewed(coarse_reduced.image().size());
-    double const coarse_step = 1.0; // degrees
+    std::unique_ptr<RowProjections> projections;
+    if (m_projectionOnly) {
+        projections.reset(new RowProjections(coarse_image));
+    }
+
+    // Coarse linear search.  Angles are evaluated concurrently,
+    // while scores are accumulated in the same order as before.
+    std::vector<double> coarse_scores(num_coarse_angles);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < num_coarse_angles; ++i) {
+        coarse_scores[i] = evaluate(coarse_image, projections.get(), coarse_angles[i]);
+    }
 
-    // Coarse linear search.
     int num_coarse_scores = 0;
     double sum_coarse_scores = 0.0;
     double best_coarse_score = 0.0;
     double best_coarse_angle = -m_maxAngle;
-    for (double angle = -m_maxAngle; angle <= m_maxAngle; angle += coarse_step) {
-        double const score = process(coarse_reduced, skewed, angle);
+    for (int i = 0; i < num_coarse_angles; ++i) {
+        double const score = coarse_scores[i];
         sum_coarse_scores += score;
         ++num_coarse_scores;
         if (score > best_coarse_score) {
-            best_coarse_angle = angle;
+            best_coarse_angle = coarse_angles[i];
             best_coarse_score = score;
         }
     }
@@ -140,28 +247,27 @@ SkewFinder::findSkew(BinaryImage const& image) const
         return Skew(-best_coarse_angle, confidence - 1.0);
     }
 
-    for (int i = min_reduction; i < m_fineReduction; ++i) {
-        fine_reduced.reduce(i == 0 ? 1 : 2);
-    }
-
-    if (m_coarseReduction != m_fineReduction) {
-        skewed = BinaryImage(fine_reduced.image().size());
+    BinaryImage const& fine_image = reduced[m_fineReduction];
+    if (m_projectionOnly) {
+        if (m_coarseReduction != m_fineReduction) {
+            projections.reset(new RowProjections(fine_image));
+        }
     }
 
     // Fine binary search.
     double angle_plus = best_coarse_angle + 0.5 * coarse_step;
     double angle_minus = best_coarse_angle - 0.5 * coarse_step;
-    double score_plus = process(fine_reduced, skewed, angle_plus);
-    double score_minus = process(fine_reduced, skewed, angle_minus);
+    double score_plus = evaluate(fine_image, projections.get(), angle_plus);
+    double score_minus = evaluate(fine_image, projections.get(), angle_minus);
     double const fine_score1 = score_plus;
     double const fine_score2 = score_minus;
     while (angle_plus - angle_minus > m_accuracy) {
         if (score_plus > score_minus) {
             angle_minus = 0.5 * (angle_plus + angle_minus);
-            score_minus = process(fine_reduced, skewed, angle_minus);
+            score_minus = evaluate(fine_image, projections.get(), angle_minus);
         } else if (score_plus < score_minus) {
             angle_plus = 0.5 * (angle_plus + angle_minus);
-            score_plus = process(fine_reduced, skewed, angle_plus);
+            score_plus = evaluate(fine_image, projections.get(), angle_plus);
         } else {
             // This protects us from unreasonably low m_accuracy.
             break;
@@ -205,6 +311,75 @@ SkewFinder::process(BinaryImage const& src, BinaryImage& dst, double const angle
     return calcScore(dst);
 }
 
+double
+SkewFinder::process(RowProjections const& src, double const angle) const
+{
+    double const tg = tan(angle * constants::DEG2RAD);
+    double const shear = tg / m_resolutionRatio;
+    int const width = src.width();
+    int const height = src.height();
+    double const x_origin = 0.5 * width;
+
+    std::vector<int> black_pixels(height, 0);
+
+    // The column blocks and their shifts are calculated exactly
+    // like vShearFromTo() does.
+
+    // shift = floor(0.5 + shear * (x + 0.5 - x_origin));
+    double shift = 0.5 + shear * (0.5 - x_origin);
+    double const shift_end = 0.5 + shear * (width - 0.5 - x_origin);
+    int shift1 = (int)floor(shift);
+    bool const no_shift = (shift1 == floor(shift_end));
+    int shift2 = shift1;
+    int x1 = 0;
+    int x2 = 0;
+    for (;;) {
+        ++x2;
+        shift += shear;
+        shift2 = (int)floor(shift);
+        if (no_shift) {
+            assert(shift1 == 0);
+            x2 = width;
+        }
+        if (shift1 != shift2 || x2 == width) {
+            // Line y of the sheared image comes from line (y - shift1)
+            // of the source image, if it exists.  Otherwise it's white.
+            int const y_begin = std::max(0, shift1);
+            int const y_end = std::min(height, height + shift1);
+            for (int y = y_begin; y < y_end; ++y) {
+                black_pixels[y] += src.countBlackPixels(y - shift1, x1, x2);
+            }
+
+            if (x2 == width) {
+                break;
+            }
+
+            x1 = x2;
+            shift1 = shift2;
+        }
+    }
+
+    double score = 0.0;
+    for (int y = 1; y < height; ++y) {
+        double const diff = black_pixels[y] - black_pixels[y - 1];
+        score += diff * diff;
+    }
+
+    return score;
+}
+
+double
+SkewFinder::evaluate(
+    BinaryImage const& src, RowProjections const* projections, double const angle) const
+{
+    if (projections) {
+        return process(*projections, angle);
+    }
+
+    BinaryImage skewed(src.size());
+    return process(src, skewed, angle);
+}
+
 double
 SkewFinder::calcScore(BinaryImage const& image)
 {
@@ -137,6 +137,16 @@ public:
      */
     void setResolutionRatio(double ratio);
 
+    /**
+     * \brief Choose between shearing images and shearing projections.
+     *
+     * In projection-only mode (the default) row histograms of sheared
+     * images are computed from per-row pixel counts of the unsheared one,
+     * without materializing sheared images.  The results are the same
+     * either way.
+     */
+    void setProjectionOnly(bool projection_only = true);
+
     /**
      * \brief Process the image and determine its skew.
      * \note If the image contains text columns at (slightly) different
@@ -144,10 +154,19 @@ public:
      */
     Skew findSkew(BinaryImage const& image) const;
 private:
+    class RowProjections;
+
     static double const LOW_SCORE;
 
     double process(BinaryImage const& src, BinaryImage& dst, double angle) const;
 
+    double process(RowProjections const& src, double angle) const;
+
+    /**
+     * Uses \p projections if provided, or shears \p src into a scratch image.
+     */
+    double evaluate(BinaryImage const& src, RowProjections const* projections, double angle) const;
+
     static double calcScore(BinaryImage const& image);
 
     double m_maxAngle;
@@ -155,6 +174,7 @@ private:
     double m_resolutionRatio;
     int m_coarseReduction;
     int m_fineReduction;
+    bool m_projectionOnly;
 };
 
 } // namespace imageproc
@@ -30,6 +30,7 @@
 #include <QDebug>
 #include <stdexcept>
 #include <algorithm>
+#include <vector>
 #include <stdint.h>
 #include <math.h>
 #include <assert.h>
@@ -74,72 +75,88 @@ private:
     unsigned m_grayLevel;
 };
 
+/**
+ * Moves bits 0-7 and 16-23 of a pixel into separate 32-bit halves of
+ * a 64-bit integer, so that a pair of channels can be weighted and
+ * accumulated with a single multiplication and a single addition.
+ */
+inline uint64_t spreadChannels(uint32_t const pixel)
+{
+    uint64_t const channels = pixel & 0x00FF00FF;
+    return (channels | (channels << 16)) & UINT64_C(0x000000FF000000FF);
+}
+
+/**
+ * Divides both 32-bit halves of an accumulator, rounding to nearest,
+ * and packs the results back into bits 0-7 and 16-23.
+ */
+inline uint32_t packChannels(uint64_t const channels, unsigned const total_area)
+{
+    unsigned const half_area = total_area >> 1;
+    uint32_t const low = (uint32_t(channels) + half_area) / total_area;
+    uint32_t const high = (uint32_t(channels >> 32) + half_area) / total_area;
+    return low | (high << 16);
+}
+
 class RGB32
 {
 public:
-    RGB32() : m_red(0), m_green(0), m_blue(0) {}
+    RGB32() : m_redBlue(0), m_green(0) {}
 
-    inline void add(uint32_t rgb, unsigned const area)
+    inline void add(uint32_t const rgb, unsigned const area)
     {
-        m_blue += (rgb & 0xFF) * area;
-        rgb >>= 8;
-        m_green += (rgb & 0xFF) * area;
-        rgb >>= 8;
-        m_red += (rgb & 0xFF) * area;
+        m_redBlue += spreadChannels(rgb) * area;
+        m_green += ((rgb >> 8) & 0xFF) * area;
     }
 
     inline uint32_t result(unsigned const total_area) const
     {
         unsigned const half_area = total_area >> 1;
-        uint32_t rgb = 0x0000FF00;
-        rgb |= (m_red + half_area) / total_area;
-        rgb <<= 8;
-        rgb |= (m_green + half_area) / total_area;
-        rgb <<= 8;
-        rgb |= (m_blue + half_area) / total_area;
-        return rgb;
+        uint32_t const green = (m_green + half_area) / total_area;
+        return 0xFF000000 | packChannels(m_redBlue, total_area) | (green << 8);
     }
 private:
-    unsigned m_red;
+    uint64_t m_redBlue;
     unsigned m_green;
-    unsigned m_blue;
 };
 
 class ARGB32
 {
 public:
-    ARGB32() : m_alpha(0), m_red(0), m_green(0), m_blue(0) {}
+    ARGB32() : m_redBlue(0), m_alphaGreen(0) {}
 
-    inline void add(uint32_t argb, unsigned const area)
+    inline void add(uint32_t const argb, unsigned const area)
     {
-        m_blue += (argb & 0xFF) * area;
-        argb >>= 8;
-        m_green += (argb & 0xFF) * area;
-        argb >>= 8;
-        m_red += (argb & 0xFF) * area;
-        argb >>= 8;
-        m_alpha += argb * area;
+        m_redBlue += spreadChannels(argb) * area;
+        m_alphaGreen += spreadChannels(argb >> 8) * area;
     }
 
     inline uint32_t result(unsigned const total_area) const
     {
-        unsigned const half_area = total_area >> 1;
-        uint32_t argb = (m_alpha + half_area) / total_area;
-        argb <<= 8;
-        argb |= (m_red + half_area) / total_area;
-        argb <<= 8;
-        argb |= (m_green + half_area) / total_area;
-        argb <<= 8;
-        argb |= (m_blue + half_area) / total_area;
-        return argb;
+        return packChannels(m_redBlue, total_area)
+               | (packChannels(m_alphaGreen, total_area) << 8);
     }
 private:
-    unsigned m_alpha;
-    unsigned m_red;
-    unsigned m_green;
-    unsigned m_blue;
+    uint64_t m_redBlue;
+    uint64_t m_alphaGreen;
 };
 
+/**
+ * Destination images are processed in tiles of this size, so that
+ * the source pixels a tile maps to stay in cache while it's processed.
+ */
+int const TILE_WIDTH = 256;
+int const TILE_HEIGHT = 32;
+
+/**
+ * Converts to 32.32 fixed point, for stepping source coordinates
+ * along a line in transformBilinear().
+ */
+inline int64_t toFixed(double const val)
+{
+    return static_cast<int64_t>(floor(val * 4294967296.0 + 0.5));
+}
+
 static QSizeF calcSrcUnitSize(QTransform const& xform, QSizeF const& min)
 {
     // Imagine a rectangle of (0, 0, 1, 1), except we take
@@ -163,6 +180,225 @@ static QSizeF calcSrcUnitSize(QTransform const& xform, QSizeF const& min)
            );
 }
 
+/**
+ * Computes a span of destination pixels on a single line.  Each of them
+ * maps to a rectangle in the source image given in 1/32 pixel units.
+ * Its center is computed in floating point for every pixel, as stepping
+ * it along the line would round differently for most transformations.
+ */
+template<typename StorageUnit, typename Mixer>
+static void areaMapLine(
+    StorageUnit const* const src_data, int const src_stride,
+    int const sw, int const sh, StorageUnit* const dst_line,
+    int const dx_begin, int const dx_end,
+    double const f_sx32_base, double const f_sy32_base,
+    double const m11, double const m12,
+    int const src32_unit_w, int const src32_unit_h,
+    StorageUnit const outside_color, int const outside_flags)
+{
+    for (int dx = dx_begin; dx < dx_end; ++dx) {
+        double const f_dx_center = dx + 0.5;
+        double const f_sx32_center = f_sx32_base + f_dx_center * m11;
+        double const f_sy32_center = f_sy32_base + f_dx_center * m12;
+        int src32_left = (int)f_sx32_center - (src32_unit_w >> 1);
+        int src32_top = (int)f_sy32_center - (src32_unit_h >> 1);
+        int src32_right = src32_left + src32_unit_w;
+        int src32_bottom = src32_top + src32_unit_h;
+        int src_left = src32_left >> 5;
+        int src_right = (src32_right - 1) >> 5; // inclusive
+        int src_top = src32_top >> 5;
+        int src_bottom = (src32_bottom - 1) >> 5; // inclusive
+        assert(src_bottom >= src_top);
+        assert(src_right >= src_left);
+
+        if (src_bottom < 0 || src_right < 0 || src_left >= sw || src_top >= sh) {
+            // Completely outside of src image.
+            if (outside_flags & OutsidePixels::COLOR) {
+                dst_line[dx] = outside_color;
+            } else {
+                int const src_x = qBound<int>(0, (src_left + src_right) >> 1, sw - 1);
+                int const src_y = qBound<int>(0, (src_top + src_bottom) >> 1, sh - 1);
+                dst_line[dx] = src_data[src_y * src_stride + src_x];
+            }
+            continue;
+        }
+
+        /*
+         * Note that (intval / 32) is not the same as (intval >> 5).
+         * The former rounds towards zero, while the latter rounds towards
+         * negative infinity.
+         * Likewise, (intval % 32) is not the same as (intval & 31).
+         * The following expression:
+         * top_fraction = 32 - (src32_top & 31);
+         * works correctly with both positive and negative src32_top.
+         */
+
+        unsigned background_area = 0;
+
+        if (src_top < 0) {
+            unsigned const top_fraction = 32 - (src32_top & 31);
+            unsigned const hor_fraction = src32_right - src32_left;
+            background_area += top_fraction * hor_fraction;
+            unsigned const full_pixels_ver = -1 - src_top;
+            background_area += hor_fraction * (full_pixels_ver << 5);
+            src_top = 0;
+            src32_top = 0;
+        }
+        if (src_bottom >= sh) {
+            unsigned const bottom_fraction = src32_bottom - (src_bottom << 5);
+            unsigned const hor_fraction = src32_right - src32_left;
+            background_area += bottom_fraction * hor_fraction;
+            unsigned const full_pixels_ver = src_bottom - sh;
+            background_area += hor_fraction * (full_pixels_ver << 5);
+            src_bottom = sh - 1; // inclusive
+            src32_bottom = sh << 5; // exclusive
+        }
+        if (src_left < 0) {
+            unsigned const left_fraction = 32 - (src32_left & 31);
+            unsigned const vert_fraction = src32_bottom - src32_top;
+            background_area += left_fraction * vert_fraction;
+            unsigned const full_pixels_hor = -1 - src_left;
+            background_area += vert_fraction * (full_pixels_hor << 5);
+            src_left = 0;
+            src32_left = 0;
+        }
+        if (src_right >= sw) {
+            unsigned const right_fraction = src32_right - (src_right << 5);
+            unsigned const vert_fraction = src32_bottom - src32_top;
+            background_area += right_fraction * vert_fraction;
+            unsigned const full_pixels_hor = src_right - sw;
+            background_area += vert_fraction * (full_pixels_hor << 5);
+            src_right = sw - 1; // inclusive
+            src32_right = sw << 5; // exclusive
+        }
+        assert(src_bottom >= src_top);
+        assert(src_right >= src_left);
+
+        Mixer mixer;
+        if (outside_flags & OutsidePixels::WEAK) {
+            background_area = 0;
+        } else {
+            mixer.add(outside_color, background_area);
+        }
+
+        unsigned const left_fraction = 32 - (src32_left & 31);
+        unsigned const top_fraction = 32 - (src32_top & 31);
+        unsigned const right_fraction = src32_right - (src_right << 5);
+        unsigned const bottom_fraction = src32_bottom - (src_bottom << 5);
+
+        assert(left_fraction + right_fraction + (src_right - src_left - 1) * 32 == static_cast<unsigned>(src32_right - src32_left));
+        assert(top_fraction + bottom_fraction + (src_bottom - src_top - 1) * 32 == static_cast<unsigned>(src32_bottom - src32_top));
+
+        unsigned const src_area = (src32_bottom - src32_top) * (src32_right - src32_left);
+        if (src_area == 0) {
+            if ((outside_flags & OutsidePixels::COLOR)) {
+                dst_line[dx] = outside_color;
+            } else {
+                int const src_x = qBound<int>(0, (src_left + src_right) >> 1, sw - 1);
+                int const src_y = qBound<int>(0, (src_top + src_bottom) >> 1, sh - 1);
+                dst_line[dx] = src_data[src_y * src_stride + src_x];
+            }
+            continue;
+        }
+
+        StorageUnit const* src_line = &src_data[src_top * src_stride];
+
+        if (src_top == src_bottom) {
+            if (src_left == src_right) {
+                // dst pixel maps to a single src pixel
+                StorageUnit const c = src_line[src_left];
+                if (background_area == 0) {
+                    // common case optimization
+                    dst_line[dx] = c;
+                    continue;
+                }
+                mixer.add(c, src_area);
+            } else {
+                // dst pixel maps to a horizontal line of src pixels
+                unsigned const vert_fraction = src32_bottom - src32_top;
+                unsigned const left_area = vert_fraction * left_fraction;
+                unsigned const middle_area = vert_fraction << 5;
+                unsigned const right_area = vert_fraction * right_fraction;
+
+                mixer.add(src_line[src_left], left_area);
+
+                for (int sx = src_left + 1; sx < src_right; ++sx) {
+                    mixer.add(src_line[sx], middle_area);
+                }
+
+                mixer.add(src_line[src_right], right_area);
+            }
+        } else if (src_left == src_right) {
+            // dst pixel maps to a vertical line of src pixels
+            unsigned const hor_fraction = src32_right - src32_left;
+            unsigned const top_area = hor_fraction * top_fraction;
+            unsigned const middle_area = hor_fraction << 5;
+            unsigned const bottom_area =  hor_fraction * bottom_fraction;
+
+            src_line += src_left;
+            mixer.add(*src_line, top_area);
+
+            src_line += src_stride;
+
+            for (int sy = src_top + 1; sy < src_bottom; ++sy) {
+                mixer.add(*src_line, middle_area);
+                src_line += src_stride;
+            }
+
+            mixer.add(*src_line, bottom_area);
+        } else {
+            // dst pixel maps to a block of src pixels
+            unsigned const top_area = top_fraction << 5;
+            unsigned const bottom_area = bottom_fraction << 5;
+            unsigned const left_area = left_fraction << 5;
+            unsigned const right_area = right_fraction << 5;
+            unsigned const topleft_area = top_fraction * left_fraction;
+            unsigned const topright_area = top_fraction * right_fraction;
+            unsigned const bottomleft_area = bottom_fraction * left_fraction;
+            unsigned const bottomright_area = bottom_fraction * right_fraction;
+
+            // process the top-left corner
+            mixer.add(src_line[src_left], topleft_area);
+
+            // process the top line (without corners)
+            for (int sx = src_left + 1; sx < src_right; ++sx) {
+                mixer.add(src_line[sx], top_area);
+            }
+
+            // process the top-right corner
+            mixer.add(src_line[src_right], topright_area);
+
+            src_line += src_stride;
+
+            // process middle lines
+            for (int sy = src_top + 1; sy < src_bottom; ++sy) {
+                mixer.add(src_line[src_left], left_area);
+
+                for (int sx = src_left + 1; sx < src_right; ++sx) {
+                    mixer.add(src_line[sx], 32 * 32);
+                }
+
+                mixer.add(src_line[src_right], right_area);
+
+                src_line += src_stride;
+            }
+
+            // process bottom-left corner
+            mixer.add(src_line[src_left], bottomleft_area);
+
+            // process the bottom line (without corners)
+            for (int sx = src_left + 1; sx < src_right; ++sx) {
+                mixer.add(src_line[sx], bottom_area);
+            }
+
+            // process the bottom-right corner
+            mixer.add(src_line[src_right], bottomright_area);
+        }
+
+        dst_line[dx] = mixer.result(src_area + background_area);
+    }
+}
+
 template<typename StorageUnit, typename Mixer>
 static void transformGeneric(
     StorageUnit const* const src_data, int const src_stride, QSize const src_size,
@@ -187,214 +423,224 @@ static void transformGeneric(
     int const src32_unit_w = std::max<int>(1, qRound(src32_unit_size.width()));
     int const src32_unit_h = std::max<int>(1, qRound(src32_unit_size.height()));
 
-    #pragma omp parallel for schedule(static) shared(inv_xform)
+    double const m11 = inv_xform.m11();
+    double const m12 = inv_xform.m12();
+    double const m21 = inv_xform.m21();
+    double const m22 = inv_xform.m22();
+    double const tx = inv_xform.dx();
+    double const ty = inv_xform.dy();
+
+    int const tiles_x = (dw + TILE_WIDTH - 1) / TILE_WIDTH;
+    int const tiles_y = (dh + TILE_HEIGHT - 1) / TILE_HEIGHT;
+    int const num_tiles = tiles_x * tiles_y;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < num_tiles; ++tile) {
+        int const tile_dx0 = (tile % tiles_x) * TILE_WIDTH;
+        int const tile_dy0 = (tile / tiles_x) * TILE_HEIGHT;
+        int const tile_dx1 = std::min(tile_dx0 + TILE_WIDTH, dw);
+        int const tile_dy1 = std::min(tile_dy0 + TILE_HEIGHT, dh);
+
+        for (int dy = tile_dy0; dy < tile_dy1; ++dy) {
+            StorageUnit* const dst_line = dst_data + dy * dst_stride;
+            double const f_dy_center = dy + 0.5;
+            double const f_sx32_base = f_dy_center * m21 + tx;
+            double const f_sy32_base = f_dy_center * m22 + ty;
+
+            areaMapLine<StorageUnit, Mixer>(
+                src_data, src_stride, sw, sh, dst_line, tile_dx0, tile_dx1,
+                f_sx32_base, f_sy32_base, m11, m12,
+                src32_unit_w, src32_unit_h, outside_color, outside_flags
+            );
+        }
+    }
+}
+
+/**
+ * Averages blocks of factor x factor pixels.  Blocks at the right and
+ * bottom edges may be incomplete.
+ */
+template<typename StorageUnit, typename Mixer>
+static void boxReduceGeneric(
+    StorageUnit const* const src_data, int const src_stride, QSize const src_size,
+    StorageUnit* const dst_data, int const dst_stride, int const factor)
+{
+    int const sw = src_size.width();
+    int const sh = src_size.height();
+    int const dw = (sw + factor - 1) / factor;
+    int const dh = (sh + factor - 1) / factor;
+
+    #pragma omp parallel for schedule(static)
     for (int dy = 0; dy < dh; ++dy) {
-        StorageUnit* dst_line = dst_data + dy * dst_stride;
-        double const f_dy_center = dy + 0.5;
-        double const f_sx32_base = f_dy_center * inv_xform.m21() + inv_xform.dx();
-        double const f_sy32_base = f_dy_center * inv_xform.m22() + inv_xform.dy();
+        int const sy0 = dy * factor;
+        int const sy1 = std::min(sy0 + factor, sh);
+        StorageUnit* const dst_line = dst_data + dy * dst_stride;
 
         for (int dx = 0; dx < dw; ++dx) {
-            double const f_dx_center = dx + 0.5;
-            double const f_sx32_center = f_sx32_base + f_dx_center * inv_xform.m11();
-            double const f_sy32_center = f_sy32_base + f_dx_center * inv_xform.m12();
-            int src32_left = (int)f_sx32_center - (src32_unit_w >> 1);
-            int src32_top = (int)f_sy32_center - (src32_unit_h >> 1);
-            int src32_right = src32_left + src32_unit_w;
-            int src32_bottom = src32_top + src32_unit_h;
-            int src_left = src32_left >> 5;
-            int src_right = (src32_right - 1) >> 5; // inclusive
-            int src_top = src32_top >> 5;
-            int src_bottom = (src32_bottom - 1) >> 5; // inclusive
-            assert(src_bottom >= src_top);
-            assert(src_right >= src_left);
-
-            if (src_bottom < 0 || src_right < 0 || src_left >= sw || src_top >= sh) {
-                // Completely outside of src image.
-                if (outside_flags & OutsidePixels::COLOR) {
-                    dst_line[dx] = outside_color;
-                } else {
-                    int const src_x = qBound<int>(0, (src_left + src_right) >> 1, sw - 1);
-                    int const src_y = qBound<int>(0, (src_top + src_bottom) >> 1, sh - 1);
-                    dst_line[dx] = src_data[src_y * src_stride + src_x];
-                }
-                continue;
-            }
-
-            /*
-             * Note that (intval / 32) is not the same as (intval >> 5).
-             * The former rounds towards zero, while the latter rounds towards
-             * negative infinity.
-             * Likewise, (intval % 32) is not the same as (intval & 31).
-             * The following expression:
-             * top_fraction = 32 - (src32_top & 31);
-             * works correctly with both positive and negative src32_top.
-             */
-
-            unsigned background_area = 0;
-
-            if (src_top < 0) {
-                unsigned const top_fraction = 32 - (src32_top & 31);
-                unsigned const hor_fraction = src32_right - src32_left;
-                background_area += top_fraction * hor_fraction;
-                unsigned const full_pixels_ver = -1 - src_top;
-                background_area += hor_fraction * (full_pixels_ver << 5);
-                src_top = 0;
-                src32_top = 0;
-            }
-            if (src_bottom >= sh) {
-                unsigned const bottom_fraction = src32_bottom - (src_bottom << 5);
-                unsigned const hor_fraction = src32_right - src32_left;
-                background_area += bottom_fraction * hor_fraction;
-                unsigned const full_pixels_ver = src_bottom - sh;
-                background_area += hor_fraction * (full_pixels_ver << 5);
-                src_bottom = sh - 1; // inclusive
-                src32_bottom = sh << 5; // exclusive
-            }
-            if (src_left < 0) {
-                unsigned const left_fraction = 32 - (src32_left & 31);
-                unsigned const vert_fraction = src32_bottom - src32_top;
-                background_area += left_fraction * vert_fraction;
-                unsigned const full_pixels_hor = -1 - src_left;
-                background_area += vert_fraction * (full_pixels_hor << 5);
-                src_left = 0;
-                src32_left = 0;
-            }
-            if (src_right >= sw) {
-                unsigned const right_fraction = src32_right - (src_right << 5);
-                unsigned const vert_fraction = src32_bottom - src32_top;
-                background_area += right_fraction * vert_fraction;
-                unsigned const full_pixels_hor = src_right - sw;
-                background_area += vert_fraction * (full_pixels_hor << 5);
-                src_right = sw - 1; // inclusive
-                src32_right = sw << 5; // exclusive
-            }
-            assert(src_bottom >= src_top);
-            assert(src_right >= src_left);
+            int const sx0 = dx * factor;
+            int const sx1 = std::min(sx0 + factor, sw);
 
             Mixer mixer;
-            if (outside_flags & OutsidePixels::WEAK) {
-                background_area = 0;
-            } else {
-                mixer.add(outside_color, background_area);
+            StorageUnit const* src_line = src_data + sy0 * src_stride;
+            for (int sy = sy0; sy < sy1; ++sy, src_line += src_stride) {
+                for (int sx = sx0; sx < sx1; ++sx) {
+                    mixer.add(src_line[sx], 1);
+                }
             }
+            dst_line[dx] = mixer.result((sy1 - sy0) * (sx1 - sx0));
+        }
+    }
+}
 
-            unsigned const left_fraction = 32 - (src32_left & 31);
-            unsigned const top_fraction = 32 - (src32_top & 31);
-            unsigned const right_fraction = src32_right - (src_right << 5);
-            unsigned const bottom_fraction = src32_bottom - (src_bottom << 5);
+/**
+ * Bilinear interpolation with 8-bit fixed point weights.
+ */
+template<typename StorageUnit, typename Mixer>
+static void transformBilinear(
+    StorageUnit const* const src_data, int const src_stride, QSize const src_size,
+    StorageUnit* const dst_data, int const dst_stride, QTransform const& inv_xform,
+    int const dw, int const dh, StorageUnit const outside_color, int const outside_flags)
+{
+    int const sw = src_size.width();
+    int const sh = src_size.height();
+    bool const weak = (outside_flags & OutsidePixels::WEAK) != 0;
+    bool const use_color = (outside_flags & OutsidePixels::COLOR) != 0;
 
-            assert(left_fraction + right_fraction + (src_right - src_left - 1) * 32 == static_cast<unsigned>(src32_right - src32_left));
-            assert(top_fraction + bottom_fraction + (src_bottom - src_top - 1) * 32 == static_cast<unsigned>(src32_bottom - src32_top));
+    // Source pixel centers are at (x + 0.5, y + 0.5), so we shift by half
+    // a pixel to make them integer, and then scale by 256.
+    int64_t const sx_step = toFixed(inv_xform.m11() * 256.0);
+    int64_t const sy_step = toFixed(inv_xform.m12() * 256.0);
 
-            unsigned const src_area = (src32_bottom - src32_top) * (src32_right - src32_left);
-            if (src_area == 0) {
-                if ((outside_flags & OutsidePixels::COLOR)) {
+    #pragma omp parallel for schedule(static)
+    for (int dy = 0; dy < dh; ++dy) {
+        StorageUnit* const dst_line = dst_data + dy * dst_stride;
+        double const f_dy_center = dy + 0.5;
+        int64_t sx256 = toFixed(
+                            (f_dy_center * inv_xform.m21() + 0.5 * inv_xform.m11()
+                             + inv_xform.dx() - 0.5) * 256.0
+                        );
+        int64_t sy256 = toFixed(
+                            (f_dy_center * inv_xform.m22() + 0.5 * inv_xform.m12()
+                             + inv_xform.dy() - 0.5) * 256.0
+                        );
+
+        for (int dx = 0; dx < dw; ++dx, sx256 += sx_step, sy256 += sy_step) {
+            // Arithmetic shifts round towards negative infinity, which is what we need here.
+            int const isx256 = static_cast<int>(sx256 >> 32);
+            int const isy256 = static_cast<int>(sy256 >> 32);
+            int const sx0 = isx256 >> 8;
+            int const sy0 = isy256 >> 8;
+            unsigned const fx = isx256 & 0xff;
+            unsigned const fy = isy256 & 0xff;
+
+            if (sx0 >= 0 && sy0 >= 0 && sx0 + 1 < sw && sy0 + 1 < sh) {
+                // The common case: all of the 4 pixels are inside.
+                StorageUnit const* const p = src_data + sy0 * src_stride + sx0;
+                Mixer mixer;
+                mixer.add(p[0], (256 - fx) * (256 - fy));
+                mixer.add(p[1], fx * (256 - fy));
+                mixer.add(p[src_stride], (256 - fx) * fy);
+                mixer.add(p[src_stride + 1], fx * fy);
+                dst_line[dx] = mixer.result(256 * 256);
+                continue;
+            }
+
+            if (sx0 + 1 < 0 || sy0 + 1 < 0 || sx0 >= sw || sy0 >= sh) {
+                // Completely outside of src image.
+                if (use_color) {
                     dst_line[dx] = outside_color;
                 } else {
-                    int const src_x = qBound<int>(0, (src_left + src_right) >> 1, sw - 1);
-                    int const src_y = qBound<int>(0, (src_top + src_bottom) >> 1, sh - 1);
+                    int const src_x = qBound<int>(0, sx0, sw - 1);
+                    int const src_y = qBound<int>(0, sy0, sh - 1);
                     dst_line[dx] = src_data[src_y * src_stride + src_x];
                 }
                 continue;
             }
 
-            StorageUnit const* src_line = &src_data[src_top * src_stride];
-
-            if (src_top == src_bottom) {
-                if (src_left == src_right) {
-                    // dst pixel maps to a single src pixel
-                    StorageUnit const c = src_line[src_left];
-                    if (background_area == 0) {
-                        // common case optimization
-                        dst_line[dx] = c;
-                        continue;
-                    }
-                    mixer.add(c, src_area);
+            Mixer mixer;
+            unsigned const weights[4] = {
+                (256 - fx) * (256 - fy), fx * (256 - fy), (256 - fx) * fy, fx * fy
+            };
+            for (int i = 0; i < 4; ++i) {
+                int const sx = sx0 + (i & 1);
+                int const sy = sy0 + (i >> 1);
+                if (sx >= 0 && sy >= 0 && sx < sw && sy < sh) {
+                    mixer.add(src_data[sy * src_stride + sx], weights[i]);
+                } else if (weak || !use_color) {
+                    int const src_x = qBound<int>(0, sx, sw - 1);
+                    int const src_y = qBound<int>(0, sy, sh - 1);
+                    mixer.add(src_data[src_y * src_stride + src_x], weights[i]);
                 } else {
-                    // dst pixel maps to a horizontal line of src pixels
-                    unsigned const vert_fraction = src32_bottom - src32_top;
-                    unsigned const left_area = vert_fraction * left_fraction;
-                    unsigned const middle_area = vert_fraction << 5;
-                    unsigned const right_area = vert_fraction * right_fraction;
-
-                    mixer.add(src_line[src_left], left_area);
-
-                    for (int sx = src_left + 1; sx < src_right; ++sx) {
-                        mixer.add(src_line[sx], middle_area);
-                    }
-
-                    mixer.add(src_line[src_right], right_area);
+                    mixer.add(outside_color, weights[i]);
                 }
-            } else if (src_left == src_right) {
-                // dst pixel maps to a vertical line of src pixels
-                unsigned const hor_fraction = src32_right - src32_left;
-                unsigned const top_area = hor_fraction * top_fraction;
-                unsigned const middle_area = hor_fraction << 5;
-                unsigned const bottom_area =  hor_fraction * bottom_fraction;
-
-                src_line += src_left;
-                mixer.add(*src_line, top_area);
-
-                src_line += src_stride;
-
-                for (int sy = src_top + 1; sy < src_bottom; ++sy) {
-                    mixer.add(*src_line, middle_area);
-                    src_line += src_stride;
-                }
-
-                mixer.add(*src_line, bottom_area);
-            } else {
-                // dst pixel maps to a block of src pixels
-                unsigned const top_area = top_fraction << 5;
-                unsigned const bottom_area = bottom_fraction << 5;
-                unsigned const left_area = left_fraction << 5;
-                unsigned const right_area = right_fraction << 5;
-                unsigned const topleft_area = top_fraction * left_fraction;
-                unsigned const topright_area = top_fraction * right_fraction;
-                unsigned const bottomleft_area = bottom_fraction * left_fraction;
-                unsigned const bottomright_area = bottom_fraction * right_fraction;
-
-                // process the top-left corner
-                mixer.add(src_line[src_left], topleft_area);
-
-                // process the top line (without corners)
-                for (int sx = src_left + 1; sx < src_right; ++sx) {
-                    mixer.add(src_line[sx], top_area);
-                }
-
-                // process the top-right corner
-                mixer.add(src_line[src_right], topright_area);
-
-                src_line += src_stride;
-
-                // process middle lines
-                for (int sy = src_top + 1; sy < src_bottom; ++sy) {
-                    mixer.add(src_line[src_left], left_area);
-
-                    for (int sx = src_left + 1; sx < src_right; ++sx) {
-                        mixer.add(src_line[sx], 32 * 32);
-                    }
+            }
+            dst_line[dx] = mixer.result(256 * 256);
+        }
+    }
+}
 
-                    mixer.add(src_line[src_right], right_area);
+/**
+ * A fast approximation of transformGeneric().  When downscaling,
+ * the source image is first reduced by an integer factor with a box
+ * filter, and then bilinear interpolation is used.
+ */
+template<typename StorageUnit, typename Mixer>
+static void transformPreview(
+    StorageUnit const* const src_data, int const src_stride, QSize const src_size,
+    StorageUnit* const dst_data, int const dst_stride, QTransform const& xform,
+    QRect const& dst_rect, StorageUnit const outside_color, int const outside_flags)
+{
+    QTransform inv_xform;
+    inv_xform.translate(dst_rect.x(), dst_rect.y());
+    inv_xform *= xform.inverted();
 
-                    src_line += src_stride;
-                }
+    QSizeF const src_unit_size(calcSrcUnitSize(inv_xform, QSizeF(0.0, 0.0)));
+    int const factor = std::max<int>(
+                           1, static_cast<int>(std::min(src_unit_size.width(), src_unit_size.height()))
+                       );
 
-                // process bottom-left corner
-                mixer.add(src_line[src_left], bottomleft_area);
+    if (factor == 1) {
+        transformBilinear<StorageUnit, Mixer>(
+            src_data, src_stride, src_size, dst_data, dst_stride,
+            inv_xform, dst_rect.width(), dst_rect.height(), outside_color, outside_flags
+        );
+        return;
+    }
 
-                // process the bottom line (without corners)
-                for (int sx = src_left + 1; sx < src_right; ++sx) {
-                    mixer.add(src_line[sx], bottom_area);
-                }
+    QSize const reduced_size(
+        (src_size.width() + factor - 1) / factor,
+        (src_size.height() + factor - 1) / factor
+    );
+    int const reduced_stride = reduced_size.width();
+    std::vector<StorageUnit> reduced(reduced_stride * reduced_size.height());
+    boxReduceGeneric<StorageUnit, Mixer>(
+        src_data, src_stride, src_size, &reduced[0], reduced_stride, factor
+    );
 
-                // process the bottom-right corner
-                mixer.add(src_line[src_right], bottomright_area);
-            }
+    inv_xform *= QTransform().scale(1.0 / factor, 1.0 / factor);
+    transformBilinear<StorageUnit, Mixer>(
+        &reduced[0], reduced_stride, reduced_size, dst_data, dst_stride,
+        inv_xform, dst_rect.width(), dst_rect.height(), outside_color, outside_flags
+    );
+}
 
-            dst_line[dx] = mixer.result(src_area + background_area);
-        }
+template<typename StorageUnit, typename Mixer>
+static void transformImpl(
+    StorageUnit const* const src_data, int const src_stride, QSize const src_size,
+    StorageUnit* const dst_data, int const dst_stride, QTransform const& xform,
+    QRect const& dst_rect, StorageUnit const outside_color, int const outside_flags,
+    QSizeF const& min_mapping_area, TransformQuality const quality)
+{
+    if (quality == PREVIEW_QUALITY) {
+        transformPreview<StorageUnit, Mixer>(
+            src_data, src_stride, src_size, dst_data, dst_stride,
+            xform, dst_rect, outside_color, outside_flags
+        );
+    } else {
+        transformGeneric<StorageUnit, Mixer>(
+            src_data, src_stride, src_size, dst_data, dst_stride,
+            xform, dst_rect, outside_color, outside_flags, min_mapping_area
+        );
     }
 }
 
@@ -403,7 +649,7 @@ static void transformGeneric(
 QImage transform(
     QImage const& src, QTransform const& xform,
     QRect const& dst_rect, OutsidePixels const outside_pixels,
-    QSizeF const& min_mapping_area)
+    QSizeF const& min_mapping_area, TransformQuality const quality)
 {
     if (src.isNull() || dst_rect.isEmpty()) {
         return QImage();
@@ -422,30 +668,30 @@ QImage transform(
         // which is guaranteed to have a standard palette.
         GrayImage gray_src(src);
         GrayImage gray_dst(dst_rect.size());
-        transformGeneric<uint8_t, Gray>(
+        transformImpl<uint8_t, Gray>(
             gray_src.data(), gray_src.stride(), src.size(),
             gray_dst.data(), gray_dst.stride(), xform, dst_rect,
             outside_pixels.grayLevel(), outside_pixels.flags(),
-            min_mapping_area
+            min_mapping_area, quality
         );
         return gray_dst;
     } else {
         if (src.hasAlphaChannel() || qAlpha(outside_pixels.rgba()) != 0xff) {
             QImage const src_argb32(src.convertToFormat(QImage::Format_ARGB32));
             QImage dst(dst_rect.size(), QImage::Format_ARGB32);
-            transformGeneric<uint32_t, ARGB32>(
+            transformImpl<uint32_t, ARGB32>(
                 (uint32_t const*)src_argb32.bits(), src_argb32.bytesPerLine() / 4, src_argb32.size(),
                 (uint32_t*)dst.bits(), dst.bytesPerLine() / 4, xform, dst_rect,
-                outside_pixels.rgba(), outside_pixels.flags(), min_mapping_area
+                outside_pixels.rgba(), outside_pixels.flags(), min_mapping_area, quality
             );
             return dst;
         } else {
             QImage const src_rgb32(src.convertToFormat(QImage::Format_RGB32));
             QImage dst(dst_rect.size(), QImage::Format_RGB32);
-            transformGeneric<uint32_t, RGB32>(
+            transformImpl<uint32_t, RGB32>(
                 (uint32_t const*)src_rgb32.bits(), src_rgb32.bytesPerLine() / 4, src_rgb32.size(),
                 (uint32_t*)dst.bits(), dst.bytesPerLine() / 4, xform, dst_rect,
-                outside_pixels.rgb(), outside_pixels.flags(), min_mapping_area
+                outside_pixels.rgb(), outside_pixels.flags(), min_mapping_area, quality
             );
             return dst;
         }
@@ -455,7 +701,7 @@ QImage transform(
 GrayImage transformToGray(
     QImage const& src, QTransform const& xform,
     QRect const& dst_rect, OutsidePixels const outside_pixels,
-    QSizeF const& min_mapping_area)
+    QSizeF const& min_mapping_area, TransformQuality const quality)
 {
     if (src.isNull() || dst_rect.isEmpty()) {
         return GrayImage();
@@ -472,11 +718,11 @@ GrayImage transformToGray(
     GrayImage const gray_src(src);
     GrayImage dst(dst_rect.size());
 
-    transformGeneric<uint8_t, Gray>(
+    transformImpl<uint8_t, Gray>(
         gray_src.data(), gray_src.stride(), gray_src.size(),
         dst.data(), dst.stride(), xform, dst_rect,
         outside_pixels.grayLevel(), outside_pixels.flags(),
-        min_mapping_area
+        min_mapping_area, quality
     );
 
     return dst;
@@ -98,6 +98,21 @@ private:
     QRgb m_rgba;
 };
 
+enum TransformQuality {
+    /**
+     * Every destination pixel is computed from the exact area of the source
+     * image it maps to.  This is what should be used for output.
+     */
+    EXACT_QUALITY,
+
+    /**
+     * Bilinear interpolation, preceded by box filtering when downscaling
+     * by a factor of 2 or more.  Much faster, but only suitable for display.
+     * The min_mapping_area argument is ignored in this mode.
+     */
+    PREVIEW_QUALITY
+};
+
 /**
  * \brief Apply an affine transformation to the image.
  *
@@ -117,6 +132,7 @@ private:
  * \param min_mapping_area Defines the minimum rectangle in the source image
  *        that maps to a destination pixel.  This can be used to control
  *        smoothing.
+ * \param quality Exact area mapping or a faster approximation.
  * \return The transformed image.  It's format may differ from the
  *         source image format, for example Format_Indexed8 may
  *         be transformed to Format_RGB32, if the source image
@@ -125,7 +141,8 @@ private:
 QImage transform(
     QImage const& src, QTransform const& xform,
     QRect const& dst_rect, OutsidePixels outside_pixels,
-    QSizeF const& min_mapping_area = QSizeF(0.9, 0.9));
+    QSizeF const& min_mapping_area = QSizeF(0.9, 0.9),
+    TransformQuality quality = EXACT_QUALITY);
 
 /**
  * \brief Apply an affine transformation to the image.
@@ -136,7 +153,8 @@ QImage transform(
 GrayImage transformToGray(
     QImage const& src, QTransform const& xform,
     QRect const& dst_rect, OutsidePixels outside_pixels,
-    QSizeF const& min_mapping_area = QSizeF(0.9, 0.9));
+    QSizeF const& min_mapping_area = QSizeF(0.9, 0.9),
+    TransformQuality quality = EXACT_QUALITY);
 
 } // namespace imageproc
 
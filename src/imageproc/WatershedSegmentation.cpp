@@ -19,10 +19,8 @@
 #include "WatershedSegmentation.h"
 #include "GrayImage.h"
 #include "ColorForId.h"
-#include "FastQueue.h"
 #include <QImage>
 #include <QPoint>
-#include <QRect>
 #include <algorithm>
 #include <vector>
 #include <assert.h>
@@ -78,10 +76,22 @@ WatershedSegmentation::WatershedSegmentation(
     QPoint const* offsets = conn == CONN4 ? offsets4 : offsets8;
     int const num_neighbours = conn == CONN4 ? 4 : 8;
 
-    QRect const rect(image.rect());
+    // Neighbour offsets in image and grid units.
+    int image_offsets[8];
+    int grid_offsets[8];
+    for (int i = 0; i < num_neighbours; ++i)
+    {
+        image_offsets[i] = offsets[i].y() * image_stride + offsets[i].x();
+        grid_offsets[i] = offsets[i].y() * grid_stride + offsets[i].x();
+    }
+
+    uint32_t* const grid_data = m_grid.data();
 
     std::vector<uint32_t> remapping_table(1, 0); // Reserve space for label 0.
-    FastQueue<QPoint> queue;
+
+    // Pixels of the current plateau, in the order of discovery.
+    // It's reused for every plateau, as most of them are tiny.
+    std::vector<QPoint> queue;
     uint32_t this_label = 0;
 
     for (int y = 0; y < height; ++y)
@@ -97,51 +107,57 @@ WatershedSegmentation::WatershedSegmentation(
                 QPoint next_pos;
 
                 assert(queue.empty());
-                queue.push(QPoint(x, y));
+                queue.push_back(QPoint(x, y));
                 grid_line[x] = this_label;
 
                 for (;;)
                 {
-                    while (!queue.empty())
+                    for (size_t head = 0; head < queue.size(); ++head)
                     {
-                        QPoint const pos(queue.front());
-                        queue.pop();
-
+                        QPoint const pos(queue[head]);
+                        uint8_t const* const image_px = image_data + image_stride * pos.y() + pos.x();
+                        uint32_t* const grid_px = grid_data + grid_stride * pos.y() + pos.x();
+                        bool const interior = pos.x() > 0 && pos.x() < width - 1
+                                              && pos.y() > 0 && pos.y() < height - 1;
+
+                        // The last of the lower neighbours is where the water goes.
+                        int lower = -1;
                         for (int i = 0; i < num_neighbours; ++i)
                         {
-                            QPoint const new_pos(pos + offsets[i]);
-                            if (!rect.contains(new_pos))
+                            if (!interior)
                             {
-                                continue;
+                                int const new_x = pos.x() + offsets[i].x();
+                                int const new_y = pos.y() + offsets[i].y();
+                                if (unsigned(new_x) >= unsigned(width) || unsigned(new_y) >= unsigned(height))
+                                {
+                                    continue;
+                                }
                             }
 
-                            uint8_t const px = image_data[image_stride * new_pos.y() + new_pos.x()];
-
-                            if (px > last_altitude)
+                            uint8_t const px = image_px[image_offsets[i]];
+                            if (px == last_altitude)
                             {
-                                continue;
-                            }
-                            else if (px == last_altitude)
-                            {
-                                uint32_t& label = m_grid(new_pos.x(), new_pos.y());
+                                uint32_t& label = grid_px[grid_offsets[i]];
                                 if (!label)
                                 {
-                                    queue.push(new_pos);
-                                    m_grid(new_pos.x(), new_pos.y()) = this_label;
+                                    queue.push_back(pos + offsets[i]);
+                                    label = this_label;
                                 }
                                 else
                                 {
                                     assert(label == this_label);
                                 }
                             }
-                            else
-                            {
-                                assert(px < last_altitude);
-                                next_altitude = px;
-                                next_pos = new_pos;
-                            }
+                            lower = px < last_altitude ? i : lower;
+                        }
+
+                        if (lower >= 0)
+                        {
+                            next_altitude = image_px[image_offsets[lower]];
+                            next_pos = pos + offsets[lower];
                         }
                     }
+                    queue.clear();
 
                     if (next_altitude >= last_altitude)
                     {
@@ -151,7 +167,7 @@ WatershedSegmentation::WatershedSegmentation(
                         break;
                     }
 
-                    uint32_t& next_label = m_grid(next_pos.x(), next_pos.y());
+                    uint32_t& next_label = grid_data[grid_stride * next_pos.y() + next_pos.x()];
                     if (next_label)
                     {
                         // Merging with another stream.
@@ -160,8 +176,7 @@ WatershedSegmentation::WatershedSegmentation(
                     }
 
                     // Continuing downstream.
-                    assert(queue.empty());
-                    queue.push(next_pos);
+                    queue.push_back(next_pos);
                     next_label = this_label;
                     last_altitude = next_altitude;
                 }
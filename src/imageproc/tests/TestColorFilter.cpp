@@ -0,0 +1,409 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C) 2007-2008  Joseph Artsimovich <joseph_a@mail.ru>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ColorFilter.h"
+#include "BinaryImage.h"
+#include "BWColor.h"
+#include "GrayImage.h"
+#include <QImage>
+#include <QRect>
+#include <QSet>
+#include <QVector>
+#include <QtGlobal>
+#ifndef Q_MOC_RUN
+#include <boost/test/unit_test.hpp>
+#endif
+#include <algorithm>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace imageproc
+{
+
+namespace tests
+{
+
+namespace
+{
+
+/**
+ * White paper with black text-like runs, blocks of four noisy colors
+ * and a few pixels of arbitrary colors.
+ */
+QImage colorPage(int const width, int const height)
+{
+    static QRgb const block_colors[] = {
+        qRgb(200, 40, 30), qRgb(40, 160, 60), qRgb(30, 60, 190), qRgb(230, 200, 40)
+    };
+
+    QImage img(width, height, QImage::Format_RGB32);
+    img.fill(qRgb(255, 255, 255));
+    for (int y = 0; y < height; ++y) {
+        QRgb* line = (QRgb*) img.scanLine(y);
+        for (int x = 0; x < width; ++x) {
+            int const block = (y / 20) % 5;
+            if (block < 4 && (x / 25) % 3 == 1) {
+                QRgb const color = block_colors[block];
+                line[x] = qRgb(
+                    qBound(0, qRed(color) + rand() % 17 - 8, 255),
+                    qBound(0, qGreen(color) + rand() % 17 - 8, 255),
+                    qBound(0, qBlue(color) + rand() % 17 - 8, 255)
+                );
+            } else if (block == 4 && (x / 4) % 3 == 0) {
+                line[x] = qRgb(0, 0, 0);
+            } else if (rand() % 50 == 0) {
+                line[x] = qRgb(rand() % 256, rand() % 256, rand() % 256);
+            }
+        }
+    }
+    return img;
+}
+
+/**
+ * A gradient with noise and a few sharp edges.
+ */
+GrayImage noisyGrayImage(int const width, int const height)
+{
+    GrayImage img(QSize(width, height));
+    uint8_t* line = img.data();
+    for (int y = 0; y < height; ++y, line += img.stride()) {
+        for (int x = 0; x < width; ++x) {
+            int const level = (x * 255 / width + ((y / 16) % 2) * 96) % 256;
+            line[x] = (uint8_t) qBound(0, level + rand() % 41 - 20, 255);
+        }
+    }
+    return img;
+}
+
+QImage noisyColorImage(int const width, int const height)
+{
+    GrayImage const red(noisyGrayImage(width, height));
+    GrayImage const green(noisyGrayImage(width, height));
+    GrayImage const blue(noisyGrayImage(width, height));
+    QImage img(width, height, QImage::Format_RGB32);
+    for (int y = 0; y < height; ++y) {
+        QRgb* line = (QRgb*) img.scanLine(y);
+        for (int x = 0; x < width; ++x) {
+            line[x] = qRgb(
+                red.data()[y * red.stride() + x],
+                green.data()[y * green.stride() + width - 1 - x],
+                blue.data()[(height - 1 - y) * blue.stride() + x]
+            );
+        }
+    }
+    return img;
+}
+
+/**
+ * The sum of pixels over [left, right) x [top, bottom) and
+ * the sum of their squares.
+ */
+void windowSums(
+    GrayImage const& img, int const left, int const top, int const right, int const bottom,
+    uint32_t& sum, uint64_t& sqsum)
+{
+    sum = 0;
+    sqsum = 0;
+    for (int y = top; y < bottom; ++y) {
+        uint8_t const* line = img.data() + y * img.stride();
+        for (int x = left; x < right; ++x) {
+            sum += line[x];
+            sqsum += uint32_t(line[x]) * line[x];
+        }
+    }
+}
+
+/**
+ * wienerFilterInPlace() as it was before it worked row by row,
+ * with window sums done pixel by pixel.
+ */
+GrayImage referenceWiener(GrayImage const& image, QSize const& window_size, float const noise_sigma)
+{
+    int const w = image.width();
+    int const h = image.height();
+    float const noise_variance = noise_sigma * noise_sigma;
+    int const window_lower_half = window_size.height() >> 1;
+    int const window_upper_half = window_size.height() - window_lower_half;
+    int const window_left_half = window_size.width() >> 1;
+    int const window_right_half = window_size.width() - window_left_half;
+
+    GrayImage dst(image.size());
+    for (int y = 0; y < h; ++y) {
+        int const top = std::max(0, y - window_lower_half);
+        int const bottom = std::min(h, y + window_upper_half);
+        for (int x = 0; x < w; ++x) {
+            int const left = std::max(0, x - window_left_half);
+            int const right = std::min(w, x + window_right_half);
+            uint32_t sum;
+            uint64_t sqsum;
+            windowSums(image, left, top, right, bottom, sum, sqsum);
+
+            float const window_sum = sum;
+            float const window_sqsum = sqsum;
+            float const r_area = 1.0f / ((bottom - top) * (right - left));
+            float const mean = window_sum * r_area;
+            float const sqmean = window_sqsum * r_area;
+            float const variance = sqmean - mean * mean;
+
+            float const src_pixel = image.data()[y * image.stride() + x];
+            float const delta_variance = variance - noise_variance;
+            float dst_pixel = mean;
+            if (delta_variance > 0.0f) {
+                dst_pixel += (src_pixel - mean) * delta_variance / variance;
+            }
+            dst.data()[y * dst.stride() + x] = (uint8_t) (dst_pixel + 0.5f);
+        }
+    }
+    return dst;
+}
+
+/**
+ * knnDenoiserFilterInPlace() as it was before it worked row by row,
+ * calling expf() for every radius at every pixel.
+ */
+QImage referenceKnnDenoiser(QImage const& src, int const radius, float const coef)
+{
+    float const threshold_weight = 0.02f;
+    float const threshold_lerp = 0.66f;
+    float const noise_lerpc = 0.16f;
+
+    QImage image(src);
+    int const w = image.width();
+    int const h = image.height();
+    int const image_bpl = image.bytesPerLine();
+    unsigned int const cnum = image_bpl / w;
+    GrayImage const gray(image);
+
+    float const noise_area_inv = 1.0f / (float) ((2 * radius + 1) * (2 * radius + 1));
+    float const noise_weight = 1.0f / (coef * coef);
+    float const pixel_weight = 1.0f / 255.0f;
+
+    for (int y = 0; y < h; ++y) {
+        uint8_t* image_line = image.scanLine(y);
+        for (int x = 0; x < w; ++x) {
+            float const origin = gray.data()[y * gray.stride() + x];
+            float f_count = noise_area_inv;
+            float sum_weights = 1.0f;
+            float color = origin;
+
+            for (int r = 1; r <= radius; r++) {
+                int const top = std::max(0, y - r);
+                int const bottom = std::min(h, y + r);
+                int const left = std::max(0, x - r);
+                int const right = std::min(w, x + r);
+                uint32_t sum;
+                uint64_t sqsum;
+                windowSums(gray, left, top, right, bottom, sum, sqsum);
+                float const window_sum = sum;
+                float const mean = window_sum * (1.0f / ((bottom - top) * (right - left)));
+                float const delta = (origin - mean) * pixel_weight * r;
+                float const deltasq = delta * delta;
+
+                float const r2 = r * r;
+                float const weight_f = expf(-(r2 * noise_area_inv + deltasq * noise_weight));
+                float const weight_r = (r << 3);
+                float const weight_fr = weight_f * weight_r;
+                color += mean * weight_fr;
+                sum_weights += weight_fr;
+                f_count += (weight_f > threshold_weight) ? (noise_area_inv * weight_r) : 0.0f;
+            }
+
+            color *= (sum_weights > 0.0f) ? (1.0f / sum_weights) : 1.0f;
+            float const lerp_q = (f_count > threshold_lerp) ? noise_lerpc : (1.0f - noise_lerpc);
+            color = color + (origin - color) * lerp_q;
+            color = (color < 0.0f) ? 0.0f : ((color < 255.0f) ? color : 255.0f);
+
+            float const colscale = (color + 1.0f) / (origin + 1.0f);
+            float const coldelta = color - origin * colscale;
+            for (unsigned int c = 0; c < cnum; ++c) {
+                float val = image_line[x * cnum + c] * colscale + coldelta;
+                val = (val < 0.0f) ? 0.0f : (val < 255.0f) ? val : 255.0f;
+                image_line[x * cnum + c] = (uint8_t) (val + 0.5f);
+            }
+        }
+    }
+    return image;
+}
+
+/**
+ * The largest difference between bytes of two images of the same format.
+ */
+int maxDifference(QImage const& img1, QImage const& img2)
+{
+    int const width_bytes = img1.bytesPerLine() / img1.width() * img1.width();
+    int max_diff = 0;
+    for (int y = 0; y < img1.height(); ++y) {
+        uint8_t const* line1 = img1.constScanLine(y);
+        uint8_t const* line2 = img2.constScanLine(y);
+        for (int i = 0; i < width_bytes; ++i) {
+            max_diff = std::max(max_diff, abs(int(line1[i]) - int(line2[i])));
+        }
+    }
+    return max_diff;
+}
+
+#ifdef _OPENMP
+QImage quantizeWithThreads(QImage const& image, int const ncount, int const num_threads)
+{
+    int const max_threads = omp_get_max_threads();
+    omp_set_num_threads(num_threads);
+    QImage const result(colorQuantize(image, ncount));
+    omp_set_num_threads(max_threads);
+    return result;
+}
+#endif
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(ColorFilterTestSuite);
+
+BOOST_AUTO_TEST_CASE(test_wiener_matches_reference)
+{
+    GrayImage const img(noisyGrayImage(97, 61));
+    QSize const windows[] = { QSize(5, 5), QSize(4, 7), QSize(1, 3), QSize(150, 9) };
+    float const sigmas[] = { 0.0f, 25.5f, 76.5f };
+    for (QSize const& window : windows) {
+        for (float const sigma : sigmas) {
+            GrayImage const filtered(wienerFilter(img, window, sigma));
+            GrayImage const ref(referenceWiener(img, window, sigma));
+            BOOST_CHECK_LE(maxDifference(filtered.toQImage(), ref.toQImage()), 1);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_knn_denoiser_matches_reference)
+{
+    QImage const images[] = { noisyColorImage(97, 61), noisyGrayImage(83, 45).toQImage() };
+    int const radii[] = { 1, 2, 3, 5 };
+    float const coefs[] = { 0.1f, 0.3f, 1.0f };
+    for (QImage const& img : images) {
+        for (int const radius : radii) {
+            for (float const coef : coefs) {
+                QImage const denoised(knnDenoiserFilter(img, radius, coef));
+                QImage const ref(referenceKnnDenoiser(img, radius, coef));
+                BOOST_CHECK_LE(maxDifference(denoised, ref), 1);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_quantize_palette)
+{
+    QImage const img(colorPage(203, 157));
+    QRgb const white = qRgb(255, 255, 255);
+    QRgb const black = qRgb(0, 0, 0);
+
+    // The palette sizes output may be reduced to.
+    for (int ncount = 4; ncount <= 16; ++ncount) {
+        QImage const quantized(colorQuantize(img, ncount));
+        BOOST_REQUIRE(quantized.format() == QImage::Format_Indexed8);
+        BOOST_REQUIRE(quantized.size() == img.size());
+        BOOST_REQUIRE_EQUAL(quantized.colorCount(), ncount + 2);
+        BOOST_CHECK(quantized.color(0) == white);
+        BOOST_CHECK(quantized.color(ncount + 1) == black);
+
+        bool ok = true;
+        for (int y = 0; y < img.height(); ++y) {
+            QRgb const* line = (QRgb const*) img.constScanLine(y);
+            uint8_t const* quantized_line = quantized.constScanLine(y);
+            for (int x = 0; x < img.width(); ++x) {
+                QRgb const color = line[x] | 0xff000000;
+                int const idx = quantized_line[x];
+                if (color == white) {
+                    ok = ok && (idx == 0);
+                } else if (color == black) {
+                    ok = ok && (idx == ncount + 1);
+                } else {
+                    ok = ok && (idx >= 1) && (idx <= ncount);
+                }
+            }
+        }
+        BOOST_CHECK(ok);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_quantize_out_of_range)
+{
+    QImage const img(colorPage(64, 48));
+    BOOST_CHECK(colorQuantize(img, 0) == img);
+    BOOST_CHECK(colorQuantize(img, 255) == img);
+    BOOST_CHECK(colorQuantize(QImage(), 8).isNull());
+}
+
+BOOST_AUTO_TEST_CASE(test_quantize_is_deterministic)
+{
+    QImage const img(colorPage(311, 257));
+    QImage const quantized(colorQuantize(img, 8));
+    BOOST_CHECK(colorQuantize(img, 8) == quantized);
+#ifdef _OPENMP
+    BOOST_CHECK(quantizeWithThreads(img, 8, 1) == quantized);
+    BOOST_CHECK(quantizeWithThreads(img, 8, 3) == quantized);
+#endif
+}
+
+BOOST_AUTO_TEST_CASE(test_kmeans_outside_of_mask)
+{
+    QImage const img(colorPage(203, 157));
+    BinaryImage mask(img.width(), img.height(), WHITE);
+    mask.fill(QRect(20, 10, 120, 100), BLACK);
+
+    // Something other than the image, to tell where pixels come from.
+    QImage background(img.size(), QImage::Format_RGB32);
+    background.fill(qRgb(255, 255, 255));
+    for (int y = 0; y < background.height(); ++y) {
+        QRgb* line = (QRgb*) background.scanLine(y);
+        for (int x = 150; x < background.width(); ++x) {
+            line[x] = qRgb(10, 20, 30);
+        }
+    }
+
+    int const ncount = 5;
+    QImage dst(background);
+    hsvKMeansInPlace(dst, img, mask, ncount);
+    BOOST_REQUIRE(dst.size() == img.size());
+
+    QSet<QRgb> mask_colors;
+    bool ok = true;
+    for (int y = 0; y < img.height(); ++y) {
+        for (int x = 0; x < img.width(); ++x) {
+            if (QRect(20, 10, 120, 100).contains(x, y)) {
+                mask_colors.insert(dst.pixel(x, y));
+            } else {
+                // White background stays white with coef_bg = 0,
+                // anything else is taken from dst.
+                ok = ok && (dst.pixel(x, y) == background.pixel(x, y));
+            }
+        }
+    }
+    BOOST_CHECK(ok);
+    BOOST_CHECK(mask_colors.size() <= ncount);
+
+    QImage again(background);
+    hsvKMeansInPlace(again, img, mask, ncount);
+    BOOST_CHECK(again == dst);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace tests
+
+} // namespace imageproc
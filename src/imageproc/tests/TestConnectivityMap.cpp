@@ -0,0 +1,240 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C) 2007-2008  Joseph Artsimovich <joseph_a@mail.ru>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ConnectivityMap.h"
+#include "Connectivity.h"
+#include "BinaryImage.h"
+#include "BWColor.h"
+#include "Utils.h"
+#include <QRect>
+#include <vector>
+#include <stdlib.h>
+#include <stdint.h>
+#ifndef Q_MOC_RUN
+#include <boost/test/unit_test.hpp>
+#endif
+
+namespace imageproc
+{
+
+namespace tests
+{
+
+using namespace utils;
+
+namespace
+{
+
+bool isBlack(BinaryImage const& img, int x, int y)
+{
+    uint32_t const word = img.data()[y * img.wordsPerLine() + x / 32];
+    return (word >> (31 - x % 32)) & 1;
+}
+
+/**
+ * Labels components by flood filling them one by one, in the raster
+ * order of their first pixels.  White pixels are labelled 0.
+ */
+std::vector<uint32_t> referenceLabels(BinaryImage const& img, Connectivity const conn)
+{
+    int const width = img.width();
+    int const height = img.height();
+    std::vector<uint32_t> labels(width * height, 0);
+
+    // East, south, west, north, then the diagonals.
+    int const dxs[] = { 1, 0, -1, 0, 1, 1, -1, -1 };
+    int const dys[] = { 0, 1, 0, -1, -1, 1, 1, -1 };
+    int const num_neighbours = conn == CONN4 ? 4 : 8;
+
+    uint32_t next_label = 1;
+    std::vector<int> stack;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            if (labels[y * width + x] != 0 || !isBlack(img, x, y)) {
+                continue;
+            }
+
+            labels[y * width + x] = next_label;
+            stack.push_back(y * width + x);
+            while (!stack.empty()) {
+                int const offset = stack.back();
+                stack.pop_back();
+                for (int i = 0; i < num_neighbours; ++i) {
+                    int const nx = offset % width + dxs[i];
+                    int const ny = offset / width + dys[i];
+                    if (nx < 0 || nx >= width || ny < 0 || ny >= height) {
+                        continue;
+                    }
+                    int const noffset = ny * width + nx;
+                    if (labels[noffset] == 0 && isBlack(img, nx, ny)) {
+                        labels[noffset] = next_label;
+                        stack.push_back(noffset);
+                    }
+                }
+            }
+            ++next_label;
+        }
+    }
+
+    return labels;
+}
+
+bool matchesReference(BinaryImage const& img, Connectivity const conn)
+{
+    ConnectivityMap const cmap(img, conn);
+    std::vector<uint32_t> const ref(referenceLabels(img, conn));
+
+    uint32_t max_label = 0;
+    for (int y = 0; y < img.height(); ++y) {
+        for (int x = 0; x < img.width(); ++x) {
+            uint32_t const label = ref[y * img.width() + x];
+            if (cmap(x, y) != label) {
+                return false;
+            }
+            if (label > max_label) {
+                max_label = label;
+            }
+        }
+    }
+
+    return cmap.maxLabel() == max_label;
+}
+
+/**
+ * Makes a picture that's hard on labelling in strips:
+ * \li A vertical snake going through all the strips.  Its first pixel
+ *     is at the top, but its turns join it with components that start
+ *     further down.
+ * \li Diagonal lines, which are single components with CONN8 only,
+ *     crossing strip seams and word boundaries.
+ * \li A U shape whose arms only meet at the bottom of the image.
+ */
+BinaryImage seamCrossingImage(int const width, int const height)
+{
+    BinaryImage img(width, height, WHITE);
+
+    for (int x = 2; x < width - 2; x += 8) {
+        img.fill(QRect(x, 0, 2, height - 2), BLACK);
+        if ((x / 8) % 2 == 0) {
+            img.fill(QRect(x, height - 3, 10, 1), BLACK);
+        } else {
+            img.fill(QRect(x, 0, 10, 1), BLACK);
+        }
+    }
+
+    for (int y0 = -width; y0 < height; y0 += 37) {
+        for (int x = 0; x < width; ++x) {
+            int const y = y0 + x;
+            if (y >= 0 && y < height) {
+                img.setPixel(x, y, BLACK);
+            }
+        }
+    }
+
+    int const arm_width = width / 4;
+    img.fill(QRect(width - arm_width, 5, 1, height - 5), BLACK);
+    img.fill(QRect(width - 2 * arm_width, 70, 1, height - 70), BLACK);
+    img.fill(QRect(width - 2 * arm_width, height - 1, arm_width, 1), BLACK);
+
+    return img;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(ConnectivityMapTestSuite);
+
+BOOST_AUTO_TEST_CASE(test_empty_and_full)
+{
+    BinaryImage const white(67, 200, WHITE);
+    BOOST_CHECK(matchesReference(white, CONN4));
+    BOOST_CHECK(matchesReference(white, CONN8));
+
+    BinaryImage const black(67, 200, BLACK);
+    BOOST_CHECK(matchesReference(black, CONN4));
+    BOOST_CHECK(matchesReference(black, CONN8));
+}
+
+BOOST_AUTO_TEST_CASE(test_random_images)
+{
+    // Heights span several strips, including a partial last one.
+    // Widths are around and past word boundaries.
+    static int const sizes[][2] = { { 1, 300 }, { 31, 129 }, { 32, 200 }, { 33, 257 }, { 150, 333 } };
+    for (auto const& size : sizes) {
+        for (int i = 0; i < 3; ++i) {
+            BinaryImage const img(randomBinaryImage(size[0], size[1]));
+            BOOST_REQUIRE(matchesReference(img, CONN4));
+            BOOST_REQUIRE(matchesReference(img, CONN8));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_components_across_seams)
+{
+    static int const sizes[][2] = { { 97, 300 }, { 160, 450 } };
+    for (auto const& size : sizes) {
+        BinaryImage const img(seamCrossingImage(size[0], size[1]));
+        BOOST_REQUIRE(matchesReference(img, CONN4));
+        BOOST_REQUIRE(matchesReference(img, CONN8));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_compact_labels)
+{
+    BinaryImage const img(randomBinaryImage(150, 333));
+    ConnectivityMap const cmap(img, CONN8);
+    BOOST_REQUIRE(cmap.maxLabel() <= 0xffff);
+
+    ConnectivityMap compact(cmap);
+    BOOST_REQUIRE(compact.compactLabels());
+    BOOST_CHECK(compact.hasCompactLabels());
+    BOOST_CHECK(!compact.data());
+    BOOST_CHECK_EQUAL(compact.maxLabel(), cmap.maxLabel());
+
+    // Copies stay compact.  Padding is compared as well.
+    ConnectivityMap const copy(compact);
+    BOOST_REQUIRE(copy.hasCompactLabels());
+    uint32_t const* line = cmap.paddedData();
+    uint16_t const* compact_line = copy.compactData() - copy.stride() - 1;
+    for (int y = 0; y < cmap.size().height() + 2; ++y) {
+        for (int x = 0; x < cmap.stride(); ++x) {
+            BOOST_REQUIRE_EQUAL(compact_line[x], line[x]);
+        }
+        line += cmap.stride();
+        compact_line += copy.stride();
+    }
+
+    // Isolated pixels make more components than 16 bits can hold.
+    BinaryImage dots(600, 600, WHITE);
+    for (int y = 0; y < 600; y += 2) {
+        for (int x = 0; x < 600; x += 2) {
+            dots.setPixel(x, y, BLACK);
+        }
+    }
+    ConnectivityMap many(dots, CONN8);
+    BOOST_REQUIRE_EQUAL(many.maxLabel(), uint32_t(300 * 300));
+    BOOST_CHECK(!many.compactLabels());
+    BOOST_CHECK(!many.hasCompactLabels());
+    BOOST_CHECK(!many.compactData());
+    BOOST_CHECK_EQUAL(many(598, 598), uint32_t(300 * 300));
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace tests
+
+} // namespace imageproc
@@ -0,0 +1,251 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C) 2007-2008  Joseph Artsimovich <joseph_a@mail.ru>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "GaussBlur.h"
+#include <QSize>
+#ifndef Q_MOC_RUN
+#include <boost/test/unit_test.hpp>
+#endif
+#include <algorithm>
+#include <vector>
+#include <stdlib.h>
+#include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace imageproc
+{
+
+namespace tests
+{
+
+namespace
+{
+
+/**
+ * The one column or row at a time version of gaussBlurGeneric(),
+ * for float grids.
+ */
+void referenceGaussBlur(
+    QSize const size, float const h_sigma, float const v_sigma,
+    float const* const input, int const input_stride,
+    float* const output, int const output_stride)
+{
+    int const width = size.width();
+    int const height = size.height();
+
+    std::vector<float> val_p(std::max(width, height));
+    std::vector<float> val_m(std::max(width, height));
+    std::vector<float> intermediate_image(width * height);
+
+    float n_p[5], n_m[5], d_p[5], d_m[5], bd_p[5], bd_m[5];
+
+    // Vertical pass.
+    gauss_blur_impl::find_iir_constants(n_p, n_m, d_p, d_m, bd_p, bd_m, v_sigma);
+    for (int x = 0; x < width; ++x) {
+        std::fill(val_p.begin(), val_p.end(), 0.0f);
+        std::fill(val_m.begin(), val_m.end(), 0.0f);
+
+        float const* sp_p = input + x;
+        float const* sp_m = sp_p + (height - 1) * input_stride;
+        float* vp = &val_p[0];
+        float* vm = &val_m[0] + height - 1;
+        float const initial_p = sp_p[0];
+        float const initial_m = sp_m[0];
+
+        for (int y = 0; y < height; ++y) {
+            int const terms = y < 4 ? y : 4;
+            int i = 0;
+            for (; i <= terms; ++i) {
+                *vp += n_p[i] * sp_p[-i * input_stride] - d_p[i] * vp[-i];
+                *vm += n_m[i] * sp_m[i * input_stride] - d_m[i] * vm[i];
+            }
+            for (; i <= 4; ++i) {
+                *vp += (n_p[i] - bd_p[i]) * initial_p;
+                *vm += (n_m[i] - bd_m[i]) * initial_m;
+            }
+            sp_p += input_stride;
+            sp_m -= input_stride;
+            ++vp;
+            --vm;
+        }
+
+        for (int y = 0; y < height; ++y) {
+            intermediate_image[y * width + x] = val_p[y] + val_m[y];
+        }
+    }
+
+    // Horizontal pass.
+    gauss_blur_impl::find_iir_constants(n_p, n_m, d_p, d_m, bd_p, bd_m, h_sigma);
+    for (int y = 0; y < height; ++y) {
+        std::fill(val_p.begin(), val_p.end(), 0.0f);
+        std::fill(val_m.begin(), val_m.end(), 0.0f);
+
+        float const* sp_p = &intermediate_image[y * width];
+        float const* sp_m = sp_p + width - 1;
+        float* vp = &val_p[0];
+        float* vm = &val_m[0] + width - 1;
+        float const initial_p = sp_p[0];
+        float const initial_m = sp_m[0];
+
+        for (int x = 0; x < width; ++x) {
+            int const terms = x < 4 ? x : 4;
+            int i = 0;
+            for (; i <= terms; ++i) {
+                *vp += n_p[i] * sp_p[-i] - d_p[i] * vp[-i];
+                *vm += n_m[i] * sp_m[i] - d_m[i] * vm[i];
+            }
+            for (; i <= 4; ++i) {
+                *vp += (n_p[i] - bd_p[i]) * initial_p;
+                *vm += (n_m[i] - bd_m[i]) * initial_m;
+            }
+            ++sp_p;
+            --sp_m;
+            ++vp;
+            --vm;
+        }
+
+        for (int x = 0; x < width; ++x) {
+            output[y * output_stride + x] = val_p[x] + val_m[x];
+        }
+    }
+}
+
+void blurWithThreads(
+    QSize const size, float const h_sigma, float const v_sigma,
+    float const* const input, int const input_stride,
+    float* const output, int const output_stride, int const num_threads)
+{
+#ifdef _OPENMP
+    int const max_threads = omp_get_max_threads();
+    omp_set_num_threads(num_threads);
+#endif
+    gaussBlurGeneric(
+        size, h_sigma, v_sigma,
+        input, input_stride, [](float val) {
+            return val;
+        },
+        output, output_stride, [](float& dst, float val) {
+            dst = val;
+        }
+    );
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
+}
+
+float maxDifference(std::vector<float> const& v1, std::vector<float> const& v2)
+{
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < v1.size(); ++i) {
+        max_diff = std::max(max_diff, fabsf(v1[i] - v2[i]));
+    }
+    return max_diff;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(GaussBlurTestSuite);
+
+BOOST_AUTO_TEST_CASE(test_matches_scalar_reference)
+{
+    // Widths below, at and above multiples of COLUMN_LANES.
+    static int const sizes[][2] = {
+        { 1, 1 }, { 5, 9 }, { 8, 8 }, { 13, 29 }, { 61, 17 }, { 100, 3 }
+    };
+    static float const sigmas[][2] = { { 0.5f, 0.5f }, { 2.0f, 3.5f }, { 9.0f, 0.7f } };
+    static int const thread_counts[] = { 1, 3 };
+
+    for (auto const& wh : sizes) {
+        QSize const size(wh[0], wh[1]);
+        int const stride = size.width() + 3;
+
+        std::vector<float> input(stride * size.height(), 0.0f);
+        for (int y = 0; y < size.height(); ++y) {
+            for (int x = 0; x < size.width(); ++x) {
+                input[y * stride + x] = float(rand() % 256);
+            }
+        }
+
+        for (auto const& sigma : sigmas) {
+            std::vector<float> reference(input.size(), 0.0f);
+            referenceGaussBlur(
+                size, sigma[0], sigma[1], &input[0], stride, &reference[0], stride
+            );
+
+            for (int const num_threads : thread_counts) {
+                std::vector<float> output(input.size(), 0.0f);
+                blurWithThreads(
+                    size, sigma[0], sigma[1], &input[0], stride,
+                    &output[0], stride, num_threads
+                );
+                BOOST_CHECK_LE(maxDifference(output, reference), 1e-3f);
+            }
+
+            // Output may be the same memory as input.
+            std::vector<float> in_place(input);
+            blurWithThreads(
+                size, sigma[0], sigma[1], &in_place[0], stride,
+                &in_place[0], stride, 3
+            );
+            BOOST_CHECK_LE(maxDifference(in_place, reference), 1e-3f);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_padding_layers)
+{
+    int const width = 13;
+    int const height = 6;
+    int const stride = width + 4 + 3;
+    float const garbage = -1.0f;
+
+    std::vector<float> padded(stride * (height + 4), garbage);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            padded[(y + 2) * stride + x + 2] = float(y * width + x);
+        }
+    }
+
+    gauss_blur_impl::initPaddingLayers(&padded[0], width, height, stride);
+
+    for (int y = 0; y < height + 4; ++y) {
+        for (int x = 0; x < stride; ++x) {
+            float expected = garbage;
+            if (y == 0 || y == height + 3) {
+                // Outer padding rows are cleared over the whole stride.
+                expected = 0.0f;
+            } else if (x == 0 || x == width + 3) {
+                expected = 0.0f;
+            } else if (x <= width + 2) {
+                // Inner padding repeats the nearest image pixel.
+                int const src_x = std::min(std::max(x - 2, 0), width - 1);
+                int const src_y = std::min(std::max(y - 2, 0), height - 1);
+                expected = float(src_y * width + src_x);
+            }
+            BOOST_REQUIRE_EQUAL(padded[y * stride + x], expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace tests
+
+} // namespace imageproc
@@ -81,6 +81,52 @@ BOOST_AUTO_TEST_CASE(test_argb32_to_grayscale)
     BOOST_CHECK(toGrayscale(argb32) == gray);
 }
 
+BOOST_AUTO_TEST_CASE(test_rgb888_to_grayscale)
+{
+    int const w = 77;
+    int const h = 31;
+    QImage rgb888(w, h, QImage::Format_RGB888);
+    QImage gray(w, h, QImage::Format_Indexed8);
+    gray.setColorTable(createGrayscalePalette());
+
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            QRgb const color = qRgb(rand() & 0xff, rand() & 0xff, rand() & 0xff);
+            rgb888.setPixel(x, y, color);
+            gray.setPixel(x, y, qGray(color));
+        }
+    }
+
+    BOOST_CHECK(toGrayscale(rgb888) == gray);
+}
+
+BOOST_AUTO_TEST_CASE(test_histogram_with_conversion)
+{
+    int const w = 61;
+    int const h = 45;
+    QImage rgb32(w, h, QImage::Format_RGB32);
+    int expected[256] = { 0 };
+
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            QRgb const color = qRgb(rand() & 0xff, rand() & 0xff, rand() & 0xff);
+            rgb32.setPixel(x, y, color);
+            ++expected[qGray(color)];
+        }
+    }
+
+    GrayscaleHistogram hist;
+    QImage const gray(toGrayscale(rgb32, hist));
+    GrayscaleHistogram const direct(rgb32);
+    GrayscaleHistogram const from_gray(gray);
+
+    for (int i = 0; i < 256; ++i) {
+        BOOST_REQUIRE_EQUAL(hist[i], expected[i]);
+        BOOST_REQUIRE_EQUAL(direct[i], expected[i]);
+        BOOST_REQUIRE_EQUAL(from_gray[i], expected[i]);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 } // namespace tests
@@ -0,0 +1,159 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C) 2007-2008  Joseph Artsimovich <joseph_a@mail.ru>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "HoughLineDetector.h"
+#include "GrayImage.h"
+#include <QImage>
+#include <QPointF>
+#include <QRect>
+#include <QSize>
+#ifndef Q_MOC_RUN
+#include <boost/test/unit_test.hpp>
+#endif
+#include <vector>
+#include <limits>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+namespace imageproc
+{
+
+namespace tests
+{
+
+namespace
+{
+
+/**
+ * Two dark lines and random specks on white.
+ */
+GrayImage linesImage(int const width, int const height)
+{
+    GrayImage img(QSize(width, height));
+    uint8_t* line = img.data();
+    for (int y = 0; y < height; ++y, line += img.stride()) {
+        memset(line, 0xff, width);
+        for (int x = 0; x < width; ++x) {
+            if (rand() % 40 == 0) {
+                line[x] = (uint8_t) (rand() % 256);
+            }
+        }
+        int const x1 = 30 + y / 8;
+        if (x1 < width) {
+            line[x1] = 100;
+        }
+    }
+
+    line = img.data();
+    for (int x = 0; x < width; ++x) {
+        int const y = 60 + x / 13;
+        if (y < height) {
+            line[y * img.stride() + x] = 100;
+        }
+    }
+
+    return img;
+}
+
+void processPixels(
+    HoughLineDetector& detector, GrayImage const& image,
+    QRect const& area, unsigned const weight_table[256])
+{
+    QRect const rect(area.intersected(image.rect()));
+    for (int y = rect.top(); y <= rect.bottom(); ++y) {
+        uint8_t const* line = image.data() + y * image.stride();
+        for (int x = rect.left(); x <= rect.right(); ++x) {
+            if (weight_table[line[x]]) {
+                detector.process(x, y, weight_table[line[x]]);
+            }
+        }
+    }
+}
+
+bool sameLines(std::vector<HoughLine> const& lines1, std::vector<HoughLine> const& lines2)
+{
+    if (lines1.size() != lines2.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < lines1.size(); ++i) {
+        if (lines1[i].normUnitVector() != lines2[i].normUnitVector()
+                || lines1[i].distance() != lines2[i].distance()
+                || lines1[i].quality() != lines2[i].quality()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(HoughLineDetectorTestSuite);
+
+BOOST_AUTO_TEST_CASE(test_bulk_matches_per_pixel)
+{
+    GrayImage const img(linesImage(157, 113));
+
+    unsigned weights[256];
+    for (int i = 0; i < 256; ++i) {
+        weights[i] = (i < 64) ? 2 : (i < 128) ? 1 : 0;
+    }
+
+    QRect const areas[] = { img.rect(), QRect(13, 7, 101, 88), QRect(-5, 50, 300, 200) };
+
+    // An odd and an even number of angles.
+    struct {
+        double distanceResolution;
+        double startAngle;
+        double angleDelta;
+        int numAngles;
+    } const configs[] = { { 2.0, -10.0, 0.5, 41 }, { 3.0, 80.0, 0.25, 80 } };
+
+    // Without peaks drawn over it, the visualization is the histogram
+    // scaled to [0, 255].
+    unsigned const no_peaks = std::numeric_limits<unsigned>::max();
+
+    for (QRect const& area : areas) {
+        for (auto const& config : configs) {
+            HoughLineDetector per_pixel(
+                img.size(), config.distanceResolution,
+                config.startAngle, config.angleDelta, config.numAngles
+            );
+            HoughLineDetector bulk(
+                img.size(), config.distanceResolution,
+                config.startAngle, config.angleDelta, config.numAngles
+            );
+            processPixels(per_pixel, img, area, weights);
+            bulk.process(img, area, weights);
+
+            std::vector<HoughLine> const lines(per_pixel.findLines(10));
+            BOOST_REQUIRE(!lines.empty());
+
+            // Scaling to [0, 255] keeps bins apart if none exceeds 255.
+            BOOST_REQUIRE(lines.front().quality() <= 255);
+            BOOST_CHECK(per_pixel.visualizeHoughSpace(no_peaks) == bulk.visualizeHoughSpace(no_peaks));
+            BOOST_CHECK(sameLines(lines, bulk.findLines(10)));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace tests
+
+} // namespace imageproc
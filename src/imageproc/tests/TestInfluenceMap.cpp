@@ -0,0 +1,186 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C) 2007-2008  Joseph Artsimovich <joseph_a@mail.ru>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "InfluenceMap.h"
+#include "ConnectivityMap.h"
+#include "Connectivity.h"
+#include "BinaryImage.h"
+#include "BWColor.h"
+#include "FastQueue.h"
+#include <QRect>
+#include <vector>
+#include <stdlib.h>
+#include <stdint.h>
+#ifndef Q_MOC_RUN
+#include <boost/test/unit_test.hpp>
+#endif
+
+namespace imageproc
+{
+
+namespace tests
+{
+
+namespace
+{
+
+bool isBlack(BinaryImage const& img, int x, int y)
+{
+    uint32_t const word = img.data()[y * img.wordsPerLine() + x / 32];
+    return (word >> (31 - x % 32)) & 1;
+}
+
+/**
+ * Labels and squared distances of a padded influence map,
+ * computed by a plain breadth-first search.
+ */
+struct ReferenceMap {
+    std::vector<uint32_t> labels;
+    std::vector<uint32_t> distSq;
+};
+
+ReferenceMap referenceInfluence(ConnectivityMap const& cmap, BinaryImage const* mask)
+{
+    int const width = cmap.size().width() + 2;
+    int const height = cmap.size().height() + 2;
+    std::vector<InfluenceMap::Vector> vec(width * height);
+
+    ReferenceMap ref;
+    ref.labels.assign(cmap.paddedData(), cmap.paddedData() + width * height);
+    ref.distSq.assign(width * height, 0);
+
+    FastQueue<int> queue;
+    for (int y = 1; y < height - 1; ++y) {
+        for (int x = 1; x < width - 1; ++x) {
+            int const offset = y * width + x;
+            if (ref.labels[offset] != 0) {
+                queue.push(offset);
+            } else if (!mask || isBlack(*mask, x - 1, y - 1)) {
+                ref.distSq[offset] = ~uint32_t(0);
+            }
+        }
+    }
+
+    // North-west, north, north-east, east, south-east, south, south-west, west.
+    int const dxs[] = { -1, 0, 1, 1, 1, 0, -1, -1 };
+    int const dys[] = { -1, -1, -1, 0, 1, 1, 1, 0 };
+
+    while (!queue.empty()) {
+        int const offset = queue.front();
+        queue.pop();
+
+        for (int i = 0; i < 8; ++i) {
+            int const nbh = offset + dys[i] * width + dxs[i];
+            int const vx = vec[offset].x - dxs[i];
+            int const vy = vec[offset].y - dys[i];
+            uint32_t const dist_sq = vx * vx + vy * vy;
+            if (dist_sq < ref.distSq[nbh]) {
+                ref.labels[nbh] = ref.labels[offset];
+                ref.distSq[nbh] = dist_sq;
+                vec[nbh].x = vx;
+                vec[nbh].y = vy;
+                queue.push(nbh);
+            }
+        }
+    }
+
+    return ref;
+}
+
+bool matchesReference(InfluenceMap const& imap, ReferenceMap const& ref)
+{
+    int const size = imap.stride() * (imap.size().height() + 2);
+    InfluenceMap::Cell const* cells = imap.paddedData();
+    for (int i = 0; i < size; ++i) {
+        if (cells[i].label != ref.labels[i] || cells[i].distSq != ref.distSq[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * A page with lines of glyph-like boxes and random specks.
+ */
+BinaryImage makePage(int const width, int const height)
+{
+    BinaryImage page(width, height, WHITE);
+    for (int y = 20; y < height - 20; y += 16) {
+        for (int x = 10; x < width - 20;) {
+            int const w = 2 + rand() % 6;
+            int const h = 4 + rand() % 6;
+            page.fill(QRect(x, y + 10 - h, w, h), BLACK);
+            x += w + 1 + (rand() % 6 == 0 ? 5 : 0);
+        }
+    }
+    for (int i = width * height / 500; i > 0; --i) {
+        page.fill(QRect(rand() % (width - 2), rand() % (height - 2), 1 + rand() % 2, 1), BLACK);
+    }
+    return page;
+}
+
+/**
+ * Blobs of different sizes, both isolated and touching each other.
+ */
+BinaryImage makeMask(int const width, int const height)
+{
+    BinaryImage mask(width, height, WHITE);
+    for (int i = width * height / 800; i > 0; --i) {
+        int const size = 5 + rand() % 40;
+        mask.fill(QRect(rand() % width, rand() % height, size, size), BLACK);
+    }
+    return mask;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(InfluenceMapTestSuite);
+
+BOOST_AUTO_TEST_CASE(test_empty)
+{
+    InfluenceMap const imap(ConnectivityMap(BinaryImage(20, 10, WHITE), CONN8));
+    BOOST_CHECK_EQUAL(imap.maxLabel(), 0u);
+    BOOST_CHECK(imap.data()[5 * imap.stride() + 5].label == 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_pages_without_mask)
+{
+    srand(1);
+    for (int i = 0; i < 4; ++i) {
+        BinaryImage const page(makePage(300 + 37 * i, 400 + 23 * i));
+        ConnectivityMap const cmap(page, i % 2 ? CONN4 : CONN8);
+        BOOST_CHECK(matchesReference(InfluenceMap(cmap), referenceInfluence(cmap, 0)));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_pages_with_mask)
+{
+    srand(2);
+    for (int i = 0; i < 6; ++i) {
+        BinaryImage const page(makePage(300 + 41 * i, 400 + 19 * i));
+        BinaryImage const mask(makeMask(page.width(), page.height()));
+        ConnectivityMap const cmap(page, CONN8);
+        BOOST_CHECK(matchesReference(InfluenceMap(cmap, mask), referenceInfluence(cmap, &mask)));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace tests
+
+} // namespace imageproc
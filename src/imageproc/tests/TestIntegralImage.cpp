@@ -0,0 +1,129 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C) 2007-2008  Joseph Artsimovich <joseph_a@mail.ru>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "IntegralImage.h"
+#include "GrayImage.h"
+#include "Utils.h"
+#include <QRect>
+#include <stdlib.h>
+#include <stdint.h>
+#ifndef Q_MOC_RUN
+#include <boost/test/unit_test.hpp>
+#endif
+
+namespace imageproc
+{
+
+namespace tests
+{
+
+using namespace utils;
+
+namespace
+{
+
+/**
+ * Builds the integral image pixel by pixel, with push().
+ */
+template<typename T>
+void pushPixels(IntegralImage<T>& integral_image, GrayImage const& image)
+{
+    uint8_t const* line = image.data();
+    for (int y = 0; y < image.height(); ++y) {
+        integral_image.beginRow();
+        for (int x = 0; x < image.width(); ++x) {
+            integral_image.push(T(line[x]));
+        }
+        line += image.stride();
+    }
+}
+
+QRect randomRect(GrayImage const& image)
+{
+    int const left = rand() % image.width();
+    int const top = rand() % image.height();
+    int const width = 1 + rand() % (image.width() - left);
+    int const height = 1 + rand() % (image.height() - top);
+    return QRect(left, top, width, height);
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(IntegralImageTestSuite);
+
+BOOST_AUTO_TEST_CASE(test_bulk_matches_push)
+{
+    srand(5);
+    for (int i = 0; i < 4; ++i) {
+        GrayImage const image(randomGrayImage(300 + 97 * i, 200 + 31 * i));
+
+        IntegralImage<uint32_t> pushed(image.size());
+        pushPixels(pushed, image);
+        IntegralImage<uint32_t> const bulk(image);
+
+        IntegralImage<double> pushed_double(image.size());
+        pushPixels(pushed_double, image);
+        IntegralImage<double> const bulk_double(image);
+
+        for (int j = 0; j < 200; ++j) {
+            QRect const rect(randomRect(image));
+            BOOST_REQUIRE_EQUAL(bulk.sum(rect), pushed.sum(rect));
+            BOOST_REQUIRE_EQUAL(bulk_double.sum(rect), pushed_double.sum(rect));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_sum_and_square)
+{
+    srand(6);
+    GrayImage const image(randomGrayImage(257, 129));
+    IntegralImage<GraySumAndSquare<uint64_t> > const integral_image(image);
+
+    for (int i = 0; i < 100; ++i) {
+        QRect const rect(randomRect(image));
+        uint64_t sum = 0;
+        uint64_t sqsum = 0;
+        for (int y = rect.top(); y <= rect.bottom(); ++y) {
+            for (int x = rect.left(); x <= rect.right(); ++x) {
+                uint64_t const level = image.data()[y * image.stride() + x];
+                sum += level;
+                sqsum += level * level;
+            }
+        }
+        GraySumAndSquare<uint64_t> const window(integral_image.sum(rect));
+        BOOST_REQUIRE_EQUAL(window.sum, sum);
+        BOOST_REQUIRE_EQUAL(window.sqsum, sqsum);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_no_overflow)
+{
+    // 255 * 255 * 1500 * 1500 doesn't fit 32 bits.
+    GrayImage image(QSize(1500, 1500));
+    image.fill(255);
+    IntegralImage<GraySumAndSquare<uint64_t> > const integral_image(image);
+    GraySumAndSquare<uint64_t> const window(integral_image.sum(image.rect()));
+    BOOST_CHECK_EQUAL(window.sum, uint64_t(255) * 1500 * 1500);
+    BOOST_CHECK_EQUAL(window.sqsum, uint64_t(255 * 255) * 1500 * 1500);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace tests
+
+} // namespace imageproc
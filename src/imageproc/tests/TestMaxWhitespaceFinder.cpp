@@ -0,0 +1,133 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C) 2007-2008  Joseph Artsimovich <joseph_a@mail.ru>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "MaxWhitespaceFinder.h"
+#include "BinaryImage.h"
+#include "BWColor.h"
+#include <QRect>
+#include <QSize>
+#include <vector>
+#include <stdlib.h>
+#ifndef Q_MOC_RUN
+#include <boost/test/unit_test.hpp>
+#endif
+
+namespace imageproc
+{
+
+namespace tests
+{
+
+namespace
+{
+
+/**
+ * A page with lines of glyph-like boxes, some gaps and random specks.
+ */
+BinaryImage makePage(int const width, int const height)
+{
+    BinaryImage page(width, height, WHITE);
+    for (int y = 10; y < height - 10; y += 12) {
+        for (int x = 5; x < width - 10;) {
+            if (rand() % 5 == 0) {
+                x += 20;
+                continue;
+            }
+            int const w = 2 + rand() % 5;
+            int const h = 3 + rand() % 6;
+            page.fill(QRect(x, y, w, h), BLACK);
+            x += w + 1 + (rand() % 5 == 0 ? 4 : 0);
+        }
+    }
+    for (int i = width * height / 2000; i > 0; --i) {
+        page.fill(QRect(rand() % width, rand() % height, 1, 1), BLACK);
+    }
+    return page;
+}
+
+bool isWhite(BinaryImage const& img, QRect const& rect)
+{
+    BinaryImage area(img.size(), WHITE);
+    area.fill(rect, BLACK);
+    for (int i = img.wordsPerLine() * img.height() - 1; i >= 0; --i) {
+        if (img.data()[i] & area.data()[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(MaxWhitespaceFinderTestSuite);
+
+BOOST_AUTO_TEST_CASE(test_white_image)
+{
+    BinaryImage const img(40, 30, WHITE);
+    MaxWhitespaceFinder finder(img);
+    BOOST_CHECK(finder.next() == img.rect());
+    BOOST_CHECK(finder.next().isNull());
+}
+
+BOOST_AUTO_TEST_CASE(test_largest_first)
+{
+    srand(4);
+    BinaryImage const page(makePage(300, 400));
+    MaxWhitespaceFinder finder(page, QSize(2, 2));
+
+    int prev_area = page.width() * page.height();
+    for (int i = 0; i < 100; ++i) {
+        QRect const ws(finder.next());
+        if (ws.isNull()) {
+            break;
+        }
+        int const area = ws.width() * ws.height();
+        BOOST_REQUIRE(area <= prev_area);
+        BOOST_REQUIRE(isWhite(page, ws));
+        prev_area = area;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_next_many)
+{
+    srand(5);
+    for (int i = 0; i < 4; ++i) {
+        BinaryImage const page(makePage(250 + 43 * i, 350 + 29 * i));
+        int const min_area = 200 + 300 * i;
+
+        std::vector<QRect> expected;
+        MaxWhitespaceFinder finder1(page, QSize(4, 4));
+        for (int j = 0; j < 30; ++j) {
+            QRect const ws(finder1.next());
+            if (ws.isNull() || ws.width() * ws.height() < min_area) {
+                break;
+            }
+            expected.push_back(ws);
+        }
+
+        MaxWhitespaceFinder finder2(page, QSize(4, 4));
+        std::vector<QRect> const found(finder2.nextMany(30, min_area));
+        BOOST_CHECK(found == expected);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace tests
+
+} // namespace imageproc
@@ -21,6 +21,10 @@
 #include "Utils.h"
 #include <QImage>
 #include <QRect>
+#include <QPoint>
+#include <QColor>
+#include <stdlib.h>
+#include <stdint.h>
 #ifndef Q_MOC_RUN
 #include <boost/test/unit_test.hpp>
 #endif
@@ -35,6 +39,67 @@ using namespace utils;
 
 BOOST_AUTO_TEST_SUITE(OrthogonalRotationTestSuite);
 
+/**
+ * Maps a pixel of the rotated image to the source image.
+ */
+static QPoint srcPixel(QRect const& src_rect, int const degrees, int const x, int const y)
+{
+    switch ((degrees % 360 + 360) % 360) {
+    case 90:
+        return QPoint(src_rect.left() + y, src_rect.bottom() - x);
+    case 180:
+        return QPoint(src_rect.right() - x, src_rect.bottom() - y);
+    case 270:
+        return QPoint(src_rect.right() - y, src_rect.top() + x);
+    default:
+        return QPoint(src_rect.left() + x, src_rect.top() + y);
+    }
+}
+
+static bool isBlack(BinaryImage const& img, int const x, int const y)
+{
+    uint32_t const word = img.data()[y * img.wordsPerLine() + x / 32];
+    return (word >> (31 - x % 32)) & 1;
+}
+
+static bool checkRotated(
+    BinaryImage const& src, QRect const& src_rect, int const degrees)
+{
+    BinaryImage const dst(orthogonalRotation(src, src_rect, degrees));
+    QSize const size(degrees % 180 ? src_rect.size().transposed() : src_rect.size());
+    if (dst.size() != size) {
+        return false;
+    }
+    for (int y = 0; y < dst.height(); ++y) {
+        for (int x = 0; x < dst.width(); ++x) {
+            QPoint const src_pt(srcPixel(src_rect, degrees, x, y));
+            if (isBlack(dst, x, y) != isBlack(src, src_pt.x(), src_pt.y())) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool checkRotated(
+    QImage const& src, QRect const& src_rect, int const degrees)
+{
+    QImage const dst(orthogonalRotation(src, src_rect, degrees));
+    QSize const size(degrees % 180 ? src_rect.size().transposed() : src_rect.size());
+    if (dst.size() != size || dst.format() != src.format()) {
+        return false;
+    }
+    for (int y = 0; y < dst.height(); ++y) {
+        for (int x = 0; x < dst.width(); ++x) {
+            QPoint const src_pt(srcPixel(src_rect, degrees, x, y));
+            if (dst.pixel(x, y) != src.pixel(src_pt)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 BOOST_AUTO_TEST_CASE(test_null_image)
 {
     BinaryImage const null_img;
@@ -177,6 +242,41 @@ BOOST_AUTO_TEST_CASE(test_sub_image)
     BOOST_REQUIRE(orthogonalRotation(img, rect, -90) == out4_img);
 }
 
+BOOST_AUTO_TEST_CASE(test_large_binary_image)
+{
+    // Large enough to span several 32x32 blocks, with partial blocks
+    // on every side of the sub-image.
+    BinaryImage const img(randomBinaryImage(331, 275));
+    QRect const rects[] = { img.rect(), QRect(5, 37, 300, 201), QRect(64, 0, 33, 275) };
+    int const angles[] = { 0, 90, 180, 270, -90 };
+
+    for (QRect const& rect : rects) {
+        for (int const angle : angles) {
+            BOOST_CHECK(checkRotated(img, rect, angle));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_8_and_32_bit_images)
+{
+    QImage rgb(151, 133, QImage::Format_RGB32);
+    for (int y = 0; y < rgb.height(); ++y) {
+        for (int x = 0; x < rgb.width(); ++x) {
+            rgb.setPixel(x, y, qRgb(rand() & 0xff, rand() & 0xff, rand() & 0xff));
+        }
+    }
+    QImage const gray(randomGrayImage(151, 133));
+    QRect const rects[] = { rgb.rect(), QRect(3, 70, 97, 63) };
+    int const angles[] = { 0, 90, 180, 270, -90 };
+
+    for (QRect const& rect : rects) {
+        for (int const angle : angles) {
+            BOOST_CHECK(checkRotated(rgb, rect, angle));
+            BOOST_CHECK(checkRotated(gray, rect, angle));
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 } // namespace tests
@@ -33,6 +33,7 @@
 #include <QColor>
 #include <Qt>
 #include <memory>
+#include <vector>
 #include <math.h>
 #ifndef Q_MOC_RUN
 #include <boost/test/unit_test.hpp>
@@ -193,6 +194,32 @@ BOOST_AUTO_TEST_CASE(regression_test_1)
     BOOST_CHECK(testFillExceptShape(QSize(938, 1299), shape, Qt::WindingFill));
 }
 
+BOOST_AUTO_TEST_CASE(test_many_polygons)
+{
+    // A tall image, so that it's split into several bands.
+    QSize const image_size(300, 700);
+
+    std::vector<PolygonRasterizer::ColoredPolygon> polys;
+    for (int i = 0; i < 12; ++i) {
+        QPolygonF shape(createShape(QSize(100 + 17 * i, 150 + 41 * i), 40 + 13 * i));
+        shape.translate(7 * i, 11 * i);
+        polys.push_back(PolygonRasterizer::ColoredPolygon(shape, i % 3 ? BLACK : WHITE));
+    }
+
+    Qt::FillRule const fill_rules[] = { Qt::OddEvenFill, Qt::WindingFill };
+    for (Qt::FillRule const fill_rule : fill_rules) {
+        BinaryImage one_by_one(image_size, WHITE);
+        for (PolygonRasterizer::ColoredPolygon const& cp : polys) {
+            PolygonRasterizer::fill(one_by_one, cp.color, cp.poly, fill_rule);
+        }
+
+        BinaryImage batch(image_size, WHITE);
+        PolygonRasterizer::fill(batch, polys, fill_rule);
+
+        BOOST_CHECK(batch == one_by_one);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 } // namespace tests
@@ -0,0 +1,149 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C)  Joseph Artsimovich <joseph.artsimovich@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "PolynomialSurface.h"
+#include "GrayImage.h"
+#include "BinaryImage.h"
+#include <QSize>
+#ifndef Q_MOC_RUN
+#include <boost/test/unit_test.hpp>
+#endif
+#include <stdint.h>
+#include <stdlib.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace imageproc
+{
+
+namespace tests
+{
+
+BOOST_AUTO_TEST_SUITE(PolynomialSurfaceTestSuite);
+
+static GrayImage smoothImage(int const width, int const height, int const noise)
+{
+    GrayImage img(QSize(width, height));
+    uint8_t* line = img.data();
+    int const stride = img.stride();
+    for (int y = 0; y < height; ++y, line += stride) {
+        double const fy = double(y) / (height - 1);
+        for (int x = 0; x < width; ++x) {
+            double const fx = double(x) / (width - 1);
+            double const val = 60.0 + 120.0 * fx * fx - 80.0 * fx * fy + 90.0 * fy * fy * fx;
+            line[x] = static_cast<uint8_t>(val + 0.5) + (noise ? rand() % noise : 0);
+        }
+    }
+    return img;
+}
+
+static int maxDifference(GrayImage const& img1, GrayImage const& img2)
+{
+    BOOST_REQUIRE(img1.size() == img2.size());
+
+    int max_diff = 0;
+    for (int y = 0; y < img1.height(); ++y) {
+        uint8_t const* line1 = img1.data() + y * img1.stride();
+        uint8_t const* line2 = img2.data() + y * img2.stride();
+        for (int x = 0; x < img1.width(); ++x) {
+            int const diff = abs(int(line1[x]) - int(line2[x]));
+            if (diff > max_diff) {
+                max_diff = diff;
+            }
+        }
+    }
+    return max_diff;
+}
+
+BOOST_AUTO_TEST_CASE(test_exact_polynomial)
+{
+    GrayImage const img(smoothImage(203, 151, 0));
+    GrayImage const rendered(PolynomialSurface(3, 2, img).render(img.size()));
+    BOOST_CHECK(maxDifference(img, rendered) <= 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_stratified_sampling)
+{
+    srand(1);
+    GrayImage const img(smoothImage(300, 200, 16));
+    QSize const size(img.size());
+
+    GrayImage const full(PolynomialSurface(4, 4, img).render(size));
+    GrayImage const sampled(PolynomialSurface(4, 4, img, 0.05).render(size));
+    BOOST_CHECK(maxDifference(full, sampled) <= 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_stratified_sampling_with_mask)
+{
+    srand(2);
+    GrayImage const img(smoothImage(300, 200, 16));
+    QSize const size(img.size());
+
+    BinaryImage mask(size, WHITE);
+    for (int y = 0; y < size.height(); ++y) {
+        for (int x = 0; x < size.width(); ++x) {
+            if (rand() % 3 != 0) {
+                mask.setPixel(x, y, BLACK);
+            }
+        }
+    }
+
+    GrayImage const full(PolynomialSurface(4, 4, img, mask).render(size));
+    GrayImage const sampled(PolynomialSurface(4, 4, img, mask, 0.05).render(size));
+    BOOST_CHECK(maxDifference(full, sampled) <= 2);
+}
+
+#ifdef _OPENMP
+static VecT<double> fitWithThreads(
+    GrayImage const& img, BinaryImage const& mask,
+    double const max_term_error, int const num_threads)
+{
+    int const max_threads = omp_get_max_threads();
+    omp_set_num_threads(num_threads);
+    VecT<double> const coeffs(PolynomialSurface(5, 5, img, mask, max_term_error).coefficients());
+    omp_set_num_threads(max_threads);
+    return coeffs;
+}
+
+BOOST_AUTO_TEST_CASE(test_same_coefficients_for_any_thread_count)
+{
+    srand(3);
+    GrayImage const img(smoothImage(301, 707, 16));
+    BinaryImage mask(img.size(), BLACK);
+    for (int i = 0; i < 5000; ++i) {
+        mask.setPixel(rand() % img.width(), rand() % img.height(), WHITE);
+    }
+
+    double const max_term_errors[] = { 0.0, 0.05 };
+    for (double const max_term_error : max_term_errors) {
+        VecT<double> const coeffs1(fitWithThreads(img, mask, max_term_error, 1));
+        VecT<double> const coeffs3(fitWithThreads(img, mask, max_term_error, 3));
+        BOOST_REQUIRE_EQUAL(coeffs1.size(), coeffs3.size());
+        for (size_t i = 0; i < coeffs1.size(); ++i) {
+            BOOST_CHECK_EQUAL(coeffs1[i], coeffs3[i]);
+        }
+    }
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace tests
+
+} // namespace imageproc
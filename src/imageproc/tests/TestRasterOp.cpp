@@ -18,8 +18,11 @@
 
 #include "RasterOp.h"
 #include "BinaryImage.h"
+#include "BWColor.h"
+#include "CpuFeatures.h"
 #include "Utils.h"
 #include <QImage>
+#include <QElapsedTimer>
 #ifndef Q_MOC_RUN
 #include <boost/test/unit_test.hpp>
 #endif
@@ -221,6 +224,92 @@ BOOST_AUTO_TEST_CASE(test_move_blocks)
     BOOST_REQUIRE(tester.testBlockMove(QRect(51, 35, 199, 200), 1, 1));
 }
 
+namespace
+{
+
+bool isBlack(BinaryImage const& img, int x, int y)
+{
+    uint32_t const word = img.data()[y * img.wordsPerLine() + x / 32];
+    return (word >> (31 - x % 32)) & 1;
+}
+
+/**
+ * Applies RopSubtract<RopDst, RopSrc> pixel by pixel.
+ */
+BinaryImage referenceSubtract(
+    BinaryImage const& dst, QRect const& dr, BinaryImage const& src, QPoint const& sp)
+{
+    BinaryImage res(dst);
+    for (int y = 0; y < dr.height(); ++y) {
+        for (int x = 0; x < dr.width(); ++x) {
+            if (isBlack(src, sp.x() + x, sp.y() + y)) {
+                res.fill(QRect(dr.x() + x, dr.y() + y, 1, 1), WHITE);
+            }
+        }
+    }
+    return res;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(test_random_offsets)
+{
+    // All combinations of dst and src bit offsets, with spans
+    // both narrower and much wider than a SIMD register.
+    srand(7);
+    BinaryImage const src(randomBinaryImage(700, 20));
+    BinaryImage const dst(randomBinaryImage(650, 30));
+    for (int i = 0; i < 300; ++i) {
+        int const width = 1 + rand() % 600;
+        int const height = 1 + rand() % 20;
+        QRect const dr(
+            rand() % (dst.width() - width + 1), rand() % (dst.height() - height + 1),
+            width, height
+        );
+        QPoint const sp(
+            rand() % (src.width() - width + 1), rand() % (src.height() - height + 1)
+        );
+
+        BinaryImage res(dst);
+        rasterOp<RopSubtract<RopDst, RopSrc> >(res, dr, src, sp);
+        BOOST_REQUIRE(res == referenceSubtract(dst, dr, src, sp));
+    }
+}
+
+/**
+ * Only runs when the SCANTAILOR_BENCHMARK environment variable is set.
+ * SCANTAILOR_SIMD may be used to compare instruction set levels.
+ */
+BOOST_AUTO_TEST_CASE(benchmark_rops)
+{
+    if (!getenv("SCANTAILOR_BENCHMARK")) {
+        return;
+    }
+
+    // A letter-sized page at 600 dpi.
+    BinaryImage const src(randomBinaryImage(5100, 6600));
+    BinaryImage dst(randomBinaryImage(5100, 6600));
+    QRect const dr(dst.rect().adjusted(5, 0, -50, 0));
+    int const iterations = 20;
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < iterations; ++i) {
+        rasterOp<RopXor<RopDst, RopSrc> >(dst, src);
+    }
+    qint64 const aligned = timer.restart();
+    for (int i = 0; i < iterations; ++i) {
+        rasterOp<RopOr<RopDst, RopSrc> >(dst, dr, src, QPoint(40, 0));
+    }
+    qint64 const unaligned = timer.elapsed();
+
+    BOOST_TEST_MESSAGE(
+        "rasterOp at " << CpuFeatures::levelName(CpuFeatures::level()) << ": aligned "
+        << double(aligned) / iterations << " ms, unaligned "
+        << double(unaligned) / iterations << " ms"
+    );
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 } // namespace tests
@@ -20,6 +20,7 @@
 #include "BinaryImage.h"
 #include "Utils.h"
 #include <QImage>
+#include <vector>
 #ifndef Q_MOC_RUN
 #include <boost/test/unit_test.hpp>
 #endif
@@ -120,6 +121,25 @@ BOOST_AUTO_TEST_CASE(test_lines)
     BOOST_CHECK(makeBinaryImage(out4, 1, 4) == ReduceThreshold(img)(4));
 }
 
+BOOST_AUTO_TEST_CASE(test_pyramid)
+{
+    BinaryImage const img(randomBinaryImage(1003, 517));
+
+    std::vector<int> thresholds;
+    for (int i = 0; i < 10; ++i) {
+        thresholds.push_back(i % 4 + 1);
+    }
+    std::vector<BinaryImage> const levels(ReduceThreshold::pyramid(img, thresholds));
+    BOOST_REQUIRE(levels.size() == thresholds.size() + 1);
+    BOOST_CHECK(levels[0] == img);
+
+    ReduceThreshold reductor(img);
+    for (size_t i = 0; i < thresholds.size(); ++i) {
+        reductor.reduce(thresholds[i]);
+        BOOST_CHECK(levels[i + 1] == reductor.image());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 } // namespace tests
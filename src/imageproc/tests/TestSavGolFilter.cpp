@@ -0,0 +1,125 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C) 2007-2008  Joseph Artsimovich <joseph_a@mail.ru>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SavGolFilter.h"
+#include "SavGolKernel.h"
+#include "Grayscale.h"
+#include <QImage>
+#include <QSize>
+#include <QPoint>
+#include <algorithm>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#ifndef Q_MOC_RUN
+#include <boost/test/unit_test.hpp>
+#endif
+
+namespace imageproc
+{
+
+namespace tests
+{
+
+namespace
+{
+
+/**
+ * A smooth gradient with some noise on top.
+ */
+QImage makeNoisyImage(int const width, int const height)
+{
+    QImage img(width, height, QImage::Format_Indexed8);
+    img.setColorTable(createGrayscalePalette());
+    for (int y = 0; y < height; ++y) {
+        uint8_t* line = img.scanLine(y);
+        for (int x = 0; x < width; ++x) {
+            line[x] = static_cast<uint8_t>(128 + 100 * sin(x * 0.1 + y * 0.05) + rand() % 20);
+        }
+    }
+    return img;
+}
+
+/**
+ * Applies a full two-dimensional kernel to every pixel.  Near the edges,
+ * the window is moved inside the image and its origin is moved the
+ * other way.  The difference from savGolFilter() is at most one
+ * gray level.
+ */
+int maxDifferenceFromReference(
+    QImage const& src, QImage const& res, QSize const& window_size,
+    int const hor_degree, int const vert_degree)
+{
+    int const width = src.width();
+    int const height = src.height();
+    int const kw = window_size.width();
+    int const kh = window_size.height();
+
+    SavGolKernel kernel(window_size, QPoint(0, 0), hor_degree, vert_degree);
+
+    int max_diff = 0;
+    for (int y = 0; y < height; ++y) {
+        int const top = std::min(std::max(y - kh / 2, 0), height - kh);
+        for (int x = 0; x < width; ++x) {
+            int const left = std::min(std::max(x - kw / 2, 0), width - kw);
+            kernel.recalcForOrigin(QPoint(x - left, y - top));
+
+            double sum = 0.5;
+            for (int j = 0; j < kh; ++j) {
+                uint8_t const* line = src.scanLine(top + j) + left;
+                for (int i = 0; i < kw; ++i) {
+                    sum += line[i] * kernel[j * kw + i];
+                }
+            }
+            int const expected = std::min(std::max(static_cast<int>(sum), 0), 255);
+            max_diff = std::max(max_diff, abs(expected - res.scanLine(y)[x]));
+        }
+    }
+
+    return max_diff;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(SavGolFilterTestSuite);
+
+BOOST_AUTO_TEST_CASE(test_against_2d_kernel)
+{
+    srand(6);
+    int const windows[] = { 3, 5, 7, 11 };
+    int const degrees[] = { 1, 3, 4, 4 };
+    for (int i = 0; i < 4; ++i) {
+        QSize const window_size(windows[i], windows[i]);
+        QImage const src(makeNoisyImage(60 + 13 * i, 45 + 7 * i));
+        QImage const res(savGolFilter(src, window_size, degrees[i], degrees[i]));
+        BOOST_CHECK(maxDifferenceFromReference(src, res, window_size, degrees[i], degrees[i]) <= 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_window_bigger_than_image)
+{
+    QImage const src(makeNoisyImage(5, 20));
+    QImage const res(savGolFilter(src, QSize(7, 7), 4, 4));
+    BOOST_CHECK(res == src);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace tests
+
+} // namespace imageproc
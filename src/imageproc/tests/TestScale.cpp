@@ -100,6 +100,68 @@ BOOST_AUTO_TEST_CASE(test_random_image)
     //BOOST_CHECK(checkScale(img, QSize(145, 55)));
 }
 
+static bool checkIntScaleDown(GrayImage const& img, int const xscale, int const yscale)
+{
+    QSize const new_size(img.width() / xscale, img.height() / yscale);
+    GrayImage const scaled(scaleToGray(img, new_size));
+    int const area = xscale * yscale;
+
+    for (int y = 0; y < new_size.height(); ++y) {
+        for (int x = 0; x < new_size.width(); ++x) {
+            unsigned sum = 0;
+            for (int i = 0; i < yscale; ++i) {
+                uint8_t const* line = img.data() + (y * yscale + i) * img.stride();
+                for (int j = 0; j < xscale; ++j) {
+                    sum += line[x * xscale + j];
+                }
+            }
+            if (scaled.data()[y * scaled.stride() + x] != (sum + area / 2) / area) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool checkIntScaleUp(GrayImage const& img, int const xscale, int const yscale)
+{
+    QSize const new_size(img.width() * xscale, img.height() * yscale);
+    GrayImage const scaled(scaleToGray(img, new_size));
+
+    for (int y = 0; y < new_size.height(); ++y) {
+        for (int x = 0; x < new_size.width(); ++x) {
+            uint8_t const expected = img.data()[(y / yscale) * img.stride() + x / xscale];
+            if (scaled.data()[y * scaled.stride() + x] != expected) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(test_integer_ratios)
+{
+    GrayImage img(QSize(96, 72));
+    uint8_t* line = img.data();
+    for (int y = 0; y < img.height(); ++y) {
+        for (int x = 0; x < img.width(); ++x) {
+            line[x] = rand() % 256;
+        }
+        line += img.stride();
+    }
+
+    BOOST_CHECK(checkIntScaleDown(img, 2, 2));
+    BOOST_CHECK(checkIntScaleDown(img, 3, 3));
+    BOOST_CHECK(checkIntScaleDown(img, 4, 4));
+    BOOST_CHECK(checkIntScaleDown(img, 3, 2));
+    BOOST_CHECK(checkIntScaleDown(img, 32, 24));
+    BOOST_CHECK(checkIntScaleUp(img, 2, 2));
+    BOOST_CHECK(checkIntScaleUp(img, 2, 3));
+    BOOST_CHECK(checkIntScaleUp(img, 3, 1));
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 } // namespace tests
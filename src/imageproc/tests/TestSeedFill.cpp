@@ -140,6 +140,28 @@ BOOST_AUTO_TEST_CASE(test_regression_4)
     BOOST_REQUIRE(seedFill(seed, mask, CONN4) == fill);
 }
 
+BOOST_AUTO_TEST_CASE(test_regression_5)
+{
+    // A diagonal link going from north-west to south-east across a word boundary.
+    int seed_data[70 * 2] = { 0 };
+    int mask_data[70 * 2] = { 0 };
+
+    seed_data[31] = 1;
+
+    mask_data[31] = 1;
+    mask_data[70 + 32] = 1;
+
+    BinaryImage const seed(makeBinaryImage(seed_data, 70, 2));
+    BinaryImage const mask(makeBinaryImage(mask_data, 70, 2));
+    BOOST_CHECK(seedFill(seed, mask, CONN8) == mask);
+
+    // Same link, spreading in the opposite direction.
+    int seed2_data[70 * 2] = { 0 };
+    seed2_data[70 + 32] = 1;
+    BinaryImage const seed2(makeBinaryImage(seed2_data, 70, 2));
+    BOOST_CHECK(seedFill(seed2, mask, CONN8) == mask);
+}
+
 BOOST_AUTO_TEST_CASE(test_gray4_random)
 {
     for (int i = 0; i < 200; ++i) {
@@ -176,6 +198,22 @@ BOOST_AUTO_TEST_CASE(test_gray8_random)
     }
 }
 
+BOOST_AUTO_TEST_CASE(test_gray_random_multiband)
+{
+    // Tall enough for seedFillGray() to split the image into several bands.
+    for (int i = 0; i < 10; ++i) {
+        GrayImage const seed(randomGrayImage(37, 300));
+        GrayImage const mask(randomGrayImage(37, 300));
+        Connectivity const conn = (i & 1) ? CONN8 : CONN4;
+        GrayImage const fill_new(seedFillGray(seed, mask, conn));
+        GrayImage const fill_old(seedFillGraySlow(seed, mask, conn));
+        if (fill_new != fill_old) {
+            BOOST_ERROR("fill_new != fill_old at iteration " << i);
+            break;
+        }
+    }
+}
+
 BOOST_AUTO_TEST_CASE(test_gray_vs_binary)
 {
     for (int i = 0; i < 200; ++i) {
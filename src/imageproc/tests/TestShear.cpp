@@ -21,6 +21,10 @@
 #include "BWColor.h"
 #include "Utils.h"
 #include <QImage>
+#include <QRect>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
 #ifndef Q_MOC_RUN
 #include <boost/test/unit_test.hpp>
 #endif
@@ -33,6 +37,41 @@ namespace tests
 
 using namespace utils;
 
+namespace
+{
+
+bool isBlack(BinaryImage const& img, int x, int y)
+{
+    uint32_t const word = img.data()[y * img.wordsPerLine() + x / 32];
+    return (word >> (31 - x % 32)) & 1;
+}
+
+/**
+ * Shears pixel by pixel.  Shears are expected to be exact in binary,
+ * so that shift = floor(0.5 + shear * (i + 0.5 - origin)) comes out
+ * the same no matter how it's calculated.
+ */
+BinaryImage referenceShear(
+    BinaryImage const& src, double const shear, double const origin,
+    BWColor const background_color, bool const horizontal)
+{
+    BinaryImage dst(src.size(), background_color);
+    for (int y = 0; y < src.height(); ++y) {
+        for (int x = 0; x < src.width(); ++x) {
+            double const along = horizontal ? y : x;
+            int const shift = (int)floor(0.5 + shear * (along + 0.5 - origin));
+            int const dst_x = horizontal ? x + shift : x;
+            int const dst_y = horizontal ? y : y + shift;
+            if (dst.rect().contains(dst_x, dst_y)) {
+                dst.fill(QRect(dst_x, dst_y, 1, 1), isBlack(src, x, y) ? BLACK : WHITE);
+            }
+        }
+    }
+    return dst;
+}
+
+} // anonymous namespace
+
 BOOST_AUTO_TEST_SUITE(ShearTestSuite);
 
 BOOST_AUTO_TEST_CASE(test_small_image)
@@ -92,6 +131,60 @@ BOOST_AUTO_TEST_CASE(test_small_image)
     BOOST_REQUIRE(v_shear_inplace == v_out_img);
 }
 
+BOOST_AUTO_TEST_CASE(test_random_images)
+{
+    double const shears[] = { 0.015625, -0.0234375, 0.25, -0.75, 1.5, -40.0 };
+    int const sizes[][2] = { { 3, 5 }, { 31, 40 }, { 64, 33 }, { 97, 61 }, { 200, 150 } };
+    BWColor const colors[] = { WHITE, BLACK };
+
+    for (auto const& size : sizes) {
+        BinaryImage const img(randomBinaryImage(size[0], size[1]));
+        for (double const shear : shears) {
+            for (BWColor const color : colors) {
+                double const y_origin = 0.25 * img.height();
+                double const x_origin = 0.75 * img.width();
+
+                BinaryImage const h_ref(referenceShear(img, shear, y_origin, color, true));
+                BOOST_CHECK(hShear(img, shear, y_origin, color) == h_ref);
+
+                BinaryImage const v_ref(referenceShear(img, shear, x_origin, color, false));
+                BOOST_CHECK(vShear(img, shear, x_origin, color) == v_ref);
+
+                BinaryImage inplace(img);
+                vShearInPlace(inplace, shear, x_origin, color);
+                BOOST_CHECK(inplace == v_ref);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_rotation)
+{
+    // A small square 100 pixels to the right of the center.
+    BinaryImage img(401, 401, WHITE);
+    img.fill(QRect(298, 198, 5, 5), BLACK);
+
+    BinaryImage const rotated(rotateBinaryByShears(img, 30.0, WHITE));
+    BOOST_REQUIRE_EQUAL(rotated.countBlackPixels(), 25);
+
+    // It's expected to move clockwise, to (200 + 100 * cos(30), 200 + 100 * sin(30)).
+    int sum_x = 0;
+    int sum_y = 0;
+    for (int y = 0; y < rotated.height(); ++y) {
+        for (int x = 0; x < rotated.width(); ++x) {
+            if (isBlack(rotated, x, y)) {
+                sum_x += x;
+                sum_y += y;
+            }
+        }
+    }
+    BOOST_CHECK(fabs(sum_x / 25.0 - 286.6) < 1.0);
+    BOOST_CHECK(fabs(sum_y / 25.0 - 250.0) < 1.0);
+
+    BinaryImage const back(rotateBinaryByShears(rotated, -30.0, WHITE));
+    BOOST_CHECK(back.countBlackPixels(QRect(296, 196, 9, 9)) == 25);
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 } // namespace tests
@@ -0,0 +1,167 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C) 2007-2008  Joseph Artsimovich <joseph_a@mail.ru>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SimdKernels.h"
+#include "CpuFeatures.h"
+#include <QColor>
+#include <vector>
+#include <stdlib.h>
+#include <stdint.h>
+#ifndef Q_MOC_RUN
+#include <boost/test/unit_test.hpp>
+#endif
+
+namespace imageproc
+{
+
+namespace tests
+{
+
+BOOST_AUTO_TEST_SUITE(SimdKernelsTestSuite);
+
+namespace
+{
+
+/**
+ * The kernel tables the current CPU is able to run, including the baseline.
+ */
+std::vector<SimdKernels const*> runnableKernels()
+{
+    std::vector<SimdKernels const*> kernels;
+    kernels.push_back(&simd_baseline::kernels);
+    if (CpuFeatures::detectedLevel() >= CpuFeatures::SSE42) {
+        kernels.push_back(&simd_sse42::kernels);
+    }
+    if (CpuFeatures::detectedLevel() >= CpuFeatures::AVX2) {
+        kernels.push_back(&simd_avx2::kernels);
+    }
+    return kernels;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_CASE(test_rgb32_to_gray)
+{
+    std::vector<SimdKernels const*> const kernels(runnableKernels());
+    for (int width = 0; width < 100; ++width) {
+        std::vector<uint32_t> src(width);
+        for (int x = 0; x < width; ++x) {
+            src[x] = (uint32_t(rand() & 0xffff) << 16) | uint32_t(rand() & 0xffff);
+        }
+
+        std::vector<uint8_t> expected(width + 1, 0);
+        simd_baseline::kernels.rgb32ToGrayLine(src.data(), expected.data(), width);
+        for (int x = 0; x < width; ++x) {
+            BOOST_REQUIRE_EQUAL(int(expected[x]), qGray(src[x]));
+        }
+
+        for (SimdKernels const* k : kernels) {
+            std::vector<uint8_t> actual(width + 1, 0);
+            k->rgb32ToGrayLine(src.data(), actual.data(), width);
+            BOOST_CHECK_MESSAGE(actual == expected, k->name << " width " << width);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_rgb888_to_gray)
+{
+    std::vector<SimdKernels const*> const kernels(runnableKernels());
+    for (int width = 0; width < 100; ++width) {
+        std::vector<uint8_t> src(width * 3);
+        for (size_t i = 0; i < src.size(); ++i) {
+            src[i] = static_cast<uint8_t>(rand());
+        }
+
+        std::vector<uint8_t> expected(width + 1, 0);
+        simd_baseline::kernels.rgb888ToGrayLine(src.data(), expected.data(), width);
+        for (int x = 0; x < width; ++x) {
+            QRgb const rgb = qRgb(src[x * 3], src[x * 3 + 1], src[x * 3 + 2]);
+            BOOST_REQUIRE_EQUAL(int(expected[x]), qGray(rgb));
+        }
+
+        for (SimdKernels const* k : kernels) {
+            std::vector<uint8_t> actual(width + 1, 0);
+            k->rgb888ToGrayLine(src.data(), actual.data(), width);
+            BOOST_CHECK_MESSAGE(actual == expected, k->name << " width " << width);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_reduce_threshold_line)
+{
+    std::vector<SimdKernels const*> const kernels(runnableKernels());
+    for (int steps = 1; steps < 70; ++steps) {
+        std::vector<uint32_t> top(steps);
+        std::vector<uint32_t> bottom(steps);
+        for (int i = 0; i < steps; ++i) {
+            top[i] = (uint32_t(rand() & 0xffff) << 16) | uint32_t(rand() & 0xffff);
+            bottom[i] = (uint32_t(rand() & 0xffff) << 16) | uint32_t(rand() & 0xffff);
+        }
+
+        for (int threshold = 1; threshold <= 4; ++threshold) {
+            std::vector<uint32_t> expected((steps + 1) / 2);
+            simd_baseline::kernels.reduceThresholdLine(
+                top.data(), bottom.data(), expected.data(), steps, threshold
+            );
+            for (SimdKernels const* k : kernels) {
+                std::vector<uint32_t> actual((steps + 1) / 2);
+                k->reduceThresholdLine(top.data(), bottom.data(), actual.data(), steps, threshold);
+                BOOST_CHECK_MESSAGE(
+                    actual == expected,
+                    k->name << " steps " << steps << " threshold " << threshold
+                );
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_binarize_line)
+{
+    int const deltas[] = { -300, -40, 0, 25, 300 };
+    std::vector<SimdKernels const*> const kernels(runnableKernels());
+    for (int width = 1; width < 100; ++width) {
+        std::vector<uint8_t> src(width);
+        std::vector<uint8_t> threshold(width);
+        for (int x = 0; x < width; ++x) {
+            src[x] = static_cast<uint8_t>(rand());
+            threshold[x] = static_cast<uint8_t>(rand());
+        }
+
+        for (int delta : deltas) {
+            int const words = (width + 31) / 32;
+            std::vector<uint32_t> expected(words, 0);
+            for (int x = 0; x < width; ++x) {
+                if (src[x] < 50 || (src[x] <= 200 && src[x] < threshold[x] + delta)) {
+                    expected[x >> 5] |= uint32_t(0x80000000) >> (x & 31);
+                }
+            }
+
+            for (SimdKernels const* k : kernels) {
+                std::vector<uint32_t> actual(words, ~uint32_t(0));
+                k->binarizeLine(src.data(), threshold.data(), actual.data(), width, 50, 200, delta);
+                BOOST_CHECK_MESSAGE(actual == expected, k->name << " width " << width << " delta " << delta);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace tests
+
+} // namespace imageproc
@@ -18,6 +18,9 @@
 
 #include "SkewFinder.h"
 #include "BinaryImage.h"
+#include "BWColor.h"
+#include "Constants.h"
+#include "Utils.h"
 #include <QApplication>
 #include <QImage>
 #include <QPainter>
@@ -36,6 +39,59 @@ namespace imageproc
 namespace tests
 {
 
+using namespace utils;
+
+namespace
+{
+
+/**
+ * Draws groups of parallel lines going down by \p slope pixels per pixel,
+ * leaving random gaps in them, the way lines of text would look.
+ */
+BinaryImage skewedLinesImage(int const width, int const height, double const slope)
+{
+    BinaryImage image(width, height, WHITE);
+    for (int y0 = -height; y0 < 2 * height; y0 += 23) {
+        for (int dy = 0; dy < 9; ++dy) {
+            for (int x = width / 10; x < width - width / 10; ++x) {
+                int const y = y0 + dy + (int)floor(0.5 + x * slope);
+                if (y >= 0 && y < height && rand() % 4 != 0) {
+                    image.setPixel(x, y, BLACK);
+                }
+            }
+        }
+    }
+    return image;
+}
+
+bool projectionOnlyMatches(
+    BinaryImage const& image, double const resolution_ratio,
+    int const reduction, double const max_angle)
+{
+    SkewFinder finders[2];
+    for (int i = 0; i < 2; ++i) {
+        finders[i].setProjectionOnly(i == 0);
+        finders[i].setResolutionRatio(resolution_ratio);
+        finders[i].setCoarseReduction(reduction);
+        finders[i].setFineReduction(reduction);
+        finders[i].setMaxAngle(max_angle);
+    }
+
+    Skew const projected(finders[0].findSkew(image));
+    Skew const sheared(finders[1].findSkew(image));
+    if (projected.angle() != sheared.angle()
+            || projected.confidence() != sheared.confidence()) {
+        BOOST_TEST_MESSAGE(
+            "projections: " << projected.angle() << " / " << projected.confidence()
+            << ", shearing: " << sheared.angle() << " / " << sheared.confidence()
+        );
+        return false;
+    }
+    return true;
+}
+
+} // anonymous namespace
+
 BOOST_AUTO_TEST_SUITE(SkewFinderTestSuite);
 
 BOOST_AUTO_TEST_CASE(test_positive_detection)
@@ -94,6 +150,36 @@ BOOST_AUTO_TEST_CASE(test_negative_detection)
     BOOST_CHECK(skew.confidence() < Skew::GOOD_CONFIDENCE);
 }
 
+BOOST_AUTO_TEST_CASE(test_projection_only_matches_shearing)
+{
+    for (int i = 0; i < 20; ++i) {
+        int const width = 1 + rand() % 400;
+        int const height = 1 + rand() % 400;
+        BinaryImage const image(randomBinaryImage(width, height));
+        BOOST_REQUIRE(projectionOnlyMatches(image, 1.0, rand() % 3, 5.0));
+    }
+
+    static double const slopes[] = { -0.07, -0.013, 0.0, 0.004, 0.035, 0.11 };
+    for (double const slope : slopes) {
+        int const width = 300 + rand() % 500;
+        int const height = 300 + rand() % 500;
+        BinaryImage const image(skewedLinesImage(width, height, slope));
+        BOOST_REQUIRE(projectionOnlyMatches(image, 1.0, 0, 10.0));
+        BOOST_REQUIRE(projectionOnlyMatches(image, 0.7, 1, 10.0));
+    }
+
+    // At one degree, these ratios make the shear exactly 1/2 and 1.
+    // Every other column of the odd width then has its shift exactly
+    // at the .5 rounding point, and with the shear of 1 every column does.
+    double const tg = tan(constants::DEG2RAD);
+    static int const widths[] = { 301, 302 };
+    for (int const width : widths) {
+        BinaryImage const image(skewedLinesImage(width, 257, 0.02));
+        BOOST_REQUIRE(projectionOnlyMatches(image, 2.0 * tg, 0, 3.0));
+        BOOST_REQUIRE(projectionOnlyMatches(image, tg, 0, 3.0));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 } // namespace tests
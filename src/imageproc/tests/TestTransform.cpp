@@ -21,9 +21,15 @@
 #include "Utils.h"
 #include <QImage>
 #include <QSize>
+#include <QSizeF>
+#include <QRect>
+#include <QRectF>
+#include <QPolygonF>
+#include <QTransform>
 #ifndef Q_MOC_RUN
 #include <boost/test/unit_test.hpp>
 #endif
+#include <algorithm>
 #include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
@@ -36,6 +42,78 @@ namespace tests
 
 using namespace utils;
 
+namespace
+{
+
+/**
+ * A straightforward version of exact area mapping, with destination
+ * pixels done one by one, and every source pixel weighted by its overlap
+ * with the destination pixel in 1/32 pixel units.
+ */
+GrayImage referenceTransform(
+    GrayImage const& src, QTransform const& xform, QRect const& dst_rect,
+    uint8_t const outside_color, QSizeF const& min_mapping_area)
+{
+    int const sw = src.width();
+    int const sh = src.height();
+    uint8_t const* const src_data = src.data();
+    int const src_stride = src.stride();
+
+    QTransform inv_xform;
+    inv_xform.translate(dst_rect.x(), dst_rect.y());
+    inv_xform *= xform.inverted();
+    inv_xform *= QTransform().scale(32.0, 32.0);
+
+    QPolygonF unit_poly;
+    unit_poly << QPointF(0.5, 0.0) << QPointF(1.0, 0.5)
+              << QPointF(0.5, 1.0) << QPointF(0.0, 0.5);
+    QRectF const unit_bounds(inv_xform.map(unit_poly).boundingRect());
+    int const unit_w = std::max<int>(
+        1, qRound(std::max<double>(min_mapping_area.width() * 32.0, unit_bounds.width()))
+    );
+    int const unit_h = std::max<int>(
+        1, qRound(std::max<double>(min_mapping_area.height() * 32.0, unit_bounds.height()))
+    );
+
+    GrayImage dst(dst_rect.size());
+    uint8_t* dst_line = dst.data();
+    for (int dy = 0; dy < dst.height(); ++dy, dst_line += dst.stride()) {
+        for (int dx = 0; dx < dst.width(); ++dx) {
+            double const f_sx32 = (dy + 0.5) * inv_xform.m21() + inv_xform.dx()
+                                  + (dx + 0.5) * inv_xform.m11();
+            double const f_sy32 = (dy + 0.5) * inv_xform.m22() + inv_xform.dy()
+                                  + (dx + 0.5) * inv_xform.m12();
+            int const left = (int)f_sx32 - (unit_w >> 1);
+            int const top = (int)f_sy32 - (unit_h >> 1);
+            int const right = left + unit_w;
+            int const bottom = top + unit_h;
+
+            if (right <= 0 || bottom <= 0 || left >= sw * 32 || top >= sh * 32) {
+                dst_line[dx] = outside_color;
+                continue;
+            }
+
+            unsigned const total_area = unit_w * unit_h;
+            unsigned src_area = 0;
+            unsigned sum = 0;
+            for (int sy = std::max(0, top >> 5); sy <= std::min(sh - 1, (bottom - 1) >> 5); ++sy) {
+                int const h = std::min(bottom, (sy + 1) * 32) - std::max(top, sy * 32);
+                for (int sx = std::max(0, left >> 5); sx <= std::min(sw - 1, (right - 1) >> 5); ++sx) {
+                    int const w = std::min(right, (sx + 1) * 32) - std::max(left, sx * 32);
+                    src_area += w * h;
+                    sum += src_data[sy * src_stride + sx] * unsigned(w * h);
+                }
+            }
+            sum += outside_color * (total_area - src_area);
+            dst_line[dx] = static_cast<uint8_t>((sum + (total_area >> 1)) / total_area);
+        }
+    }
+
+    return dst;
+}
+
+} // anonymous namespace
+
 BOOST_AUTO_TEST_SUITE(TransformTestSuite);
 
 BOOST_AUTO_TEST_CASE(test_null_image)
@@ -66,6 +144,59 @@ BOOST_AUTO_TEST_CASE(test_random_image)
     BOOST_CHECK(transformToGray(img, null_xform, img.rect(), outside_pixels) == img);
 }
 
+BOOST_AUTO_TEST_CASE(test_preview_random_image)
+{
+    GrayImage img(QSize(100, 100));
+    uint8_t* line = img.data();
+    for (int y = 0; y < img.height(); ++y) {
+        for (int x = 0; x < img.width(); ++x) {
+            line[x] = rand() % 256;
+        }
+        line += img.stride();
+    }
+
+    QColor const bgcolor(0xff, 0xff, 0xff);
+    OutsidePixels const outside_pixels(OutsidePixels::assumeColor(bgcolor));
+
+    QTransform const null_xform;
+    BOOST_CHECK(
+        transformToGray(
+            img, null_xform, img.rect(), outside_pixels,
+            QSizeF(0.0, 0.0), PREVIEW_QUALITY
+        ) == img
+    );
+}
+
+BOOST_AUTO_TEST_CASE(test_rotated_scaled_matches_reference)
+{
+    GrayImage const src(randomGrayImage(211, 157));
+    QColor const bgcolor(0xff, 0xff, 0xff);
+    OutsidePixels const outside_pixels(OutsidePixels::assumeColor(bgcolor));
+    QSizeF const min_mapping_area(0.9, 0.9);
+
+    // Upscaling, so that destination lines span several tiles,
+    // and downscaling, so that every pixel mixes several source ones.
+    static double const scales[][2] = { { 2.37, 1.63 }, { 0.71, 0.43 } };
+    static double const angles[] = { 7.3, -31.9 };
+    for (auto const& scale : scales) {
+        for (double const angle : angles) {
+            QTransform xform;
+            xform.scale(scale[0], scale[1]);
+            xform *= QTransform().rotate(angle);
+            QRect const dst_rect(
+                xform.mapRect(QRectF(src.rect())).toAlignedRect().adjusted(-3, -5, 7, 2)
+            );
+
+            GrayImage const dst(
+                transformToGray(src.toQImage(), xform, dst_rect, outside_pixels, min_mapping_area)
+            );
+            BOOST_CHECK(
+                dst == referenceTransform(src, xform, dst_rect, 0xff, min_mapping_area)
+            );
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END();
 
 } // namespace tests
@@ -0,0 +1,236 @@
+/*
+    Scan Tailor - Interactive post-processing tool for scanned pages.
+    Copyright (C) 2007-2008  Joseph Artsimovich <joseph_a@mail.ru>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "WatershedSegmentation.h"
+#include "GrayImage.h"
+#include "BinaryImage.h"
+#include "BWColor.h"
+#include "Connectivity.h"
+#include "FastQueue.h"
+#include "Utils.h"
+#include <QImage>
+#include <QPoint>
+#include <QRect>
+#include <vector>
+#include <stdlib.h>
+#include <stdint.h>
+#ifndef Q_MOC_RUN
+#include <boost/test/unit_test.hpp>
+#endif
+
+namespace imageproc
+{
+
+namespace tests
+{
+
+using namespace utils;
+
+namespace
+{
+
+/**
+ * Labels pixels by following the water downstream, one plateau
+ * at a time, the straightforward way.
+ */
+std::vector<uint32_t> referenceWatershed(GrayImage const& image, Connectivity const conn)
+{
+    int const width = image.width();
+    int const height = image.height();
+    std::vector<uint32_t> labels(width * height, 0);
+
+    QPoint const offsets4[] = {
+        QPoint(0, -1), QPoint(-1, 0), QPoint(1, 0), QPoint(0, 1)
+    };
+    QPoint const offsets8[] = {
+        QPoint(-1, -1), QPoint(0, -1), QPoint(1, -1), QPoint(-1, 0),
+        QPoint(1, 0), QPoint(-1, 1), QPoint(0, 1), QPoint(1, 1)
+    };
+    QPoint const* offsets = conn == CONN4 ? offsets4 : offsets8;
+    int const num_neighbours = conn == CONN4 ? 4 : 8;
+
+    QRect const rect(image.rect());
+    uint8_t const* const data = image.data();
+    int const stride = image.stride();
+
+    std::vector<uint32_t> remapping_table(1, 0);
+    FastQueue<QPoint> queue;
+    uint32_t this_label = 0;
+
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            if (labels[y * width + x]) {
+                continue;
+            }
+
+            ++this_label;
+            uint8_t last_altitude = data[y * stride + x];
+            uint8_t next_altitude = last_altitude;
+            QPoint next_pos;
+
+            queue.push(QPoint(x, y));
+            labels[y * width + x] = this_label;
+
+            for (;;) {
+                while (!queue.empty()) {
+                    QPoint const pos(queue.front());
+                    queue.pop();
+
+                    for (int i = 0; i < num_neighbours; ++i) {
+                        QPoint const new_pos(pos + offsets[i]);
+                        if (!rect.contains(new_pos)) {
+                            continue;
+                        }
+
+                        uint8_t const px = data[new_pos.y() * stride + new_pos.x()];
+                        if (px == last_altitude) {
+                            uint32_t& label = labels[new_pos.y() * width + new_pos.x()];
+                            if (!label) {
+                                queue.push(new_pos);
+                                label = this_label;
+                            }
+                        } else if (px < last_altitude) {
+                            next_altitude = px;
+                            next_pos = new_pos;
+                        }
+                    }
+                }
+
+                if (next_altitude >= last_altitude) {
+                    remapping_table.push_back(this_label);
+                    break;
+                }
+
+                uint32_t& next_label = labels[next_pos.y() * width + next_pos.x()];
+                if (next_label) {
+                    remapping_table.push_back(remapping_table[next_label]);
+                    break;
+                }
+
+                queue.push(next_pos);
+                next_label = this_label;
+                last_altitude = next_altitude;
+            }
+        }
+    }
+
+    std::vector<uint32_t> remapping_table2(remapping_table.size(), 0);
+    uint32_t max_label = 0;
+    for (uint32_t label = 1; label < remapping_table.size(); ++label) {
+        if (remapping_table[label] == label) {
+            remapping_table2[label] = ++max_label;
+        }
+    }
+    for (uint32_t& label : labels) {
+        label = remapping_table2[remapping_table[label]];
+    }
+
+    return labels;
+}
+
+bool matchesReference(WatershedSegmentation const& segmentation, std::vector<uint32_t> const& ref)
+{
+    int const width = segmentation.size().width();
+    int const height = segmentation.size().height();
+    uint32_t const* line = segmentation.data();
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            if (line[x] != ref[y * width + x]) {
+                return false;
+            }
+        }
+        line += segmentation.stride();
+    }
+    return true;
+}
+
+/**
+ * A gray image with valleys along the glyphs of a synthetic page:
+ * every pixel is darkened by the black pixels around it.
+ */
+GrayImage makeValleys(int const width, int const height)
+{
+    BinaryImage page(width, height, WHITE);
+    for (int y = 10; y < height - 10; y += 14) {
+        for (int x = 5; x < width - 10;) {
+            int const w = 2 + rand() % 5;
+            int const h = 3 + rand() % 6;
+            page.fill(QRect(x, y + 8 - h, w, h), BLACK);
+            x += w + 1 + (rand() % 5 == 0 ? 4 : 0);
+        }
+    }
+
+    uint32_t const* const page_data = page.data();
+    int const page_stride = page.wordsPerLine();
+
+    GrayImage image(QSize(width, height));
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int dark = 0;
+            for (int dy = -2; dy <= 2; ++dy) {
+                for (int dx = -2; dx <= 2; ++dx) {
+                    int const xx = x + dx;
+                    int const yy = y + dy;
+                    if (xx >= 0 && yy >= 0 && xx < width && yy < height) {
+                        dark += (page_data[yy * page_stride + (xx >> 5)] >> (31 - (xx & 31))) & 1;
+                    }
+                }
+            }
+            image.data()[y * image.stride() + x] = uint8_t(250 - dark * 8 - rand() % 3);
+        }
+    }
+
+    return image;
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(WatershedSegmentationTestSuite);
+
+BOOST_AUTO_TEST_CASE(test_flat_image)
+{
+    GrayImage image(QSize(50, 40));
+    image.fill(100);
+    WatershedSegmentation const segmentation(image, CONN8);
+    BOOST_CHECK_EQUAL(segmentation.maxLabel(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_valleys)
+{
+    srand(3);
+    for (int i = 0; i < 4; ++i) {
+        GrayImage const image(makeValleys(200 + 31 * i, 150 + 17 * i));
+        Connectivity const conn = i % 2 ? CONN4 : CONN8;
+        BOOST_CHECK(matchesReference(WatershedSegmentation(image, conn), referenceWatershed(image, conn)));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_random_images)
+{
+    for (int i = 0; i < 4; ++i) {
+        GrayImage const image(randomGrayImage(100 + 13 * i, 80 + 7 * i));
+        Connectivity const conn = i % 2 ? CONN4 : CONN8;
+        BOOST_CHECK(matchesReference(WatershedSegmentation(image, conn), referenceWatershed(image, conn)));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END();
+
+} // namespace tests
+
+} // namespace imageproc